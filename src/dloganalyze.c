@@ -0,0 +1,630 @@
+/**
+* @file dloganalyze.c
+*
+* Offline analyzer for libdlog logs. Each log file is mapped into
+* memory and split into one chunk per thread at line boundaries; the
+* threads parse their chunks with dlogParseRecord() into private
+* totals, which are merged at the end. Compressed logs (.gz, .bz2, .xz,
+* .zst, e.g. rotated ones) and standard input ("-") are read through a
+* pipe in large blocks, each of which is analyzed the same way.
+*
+* The results are CSV files for gnuplot or a spreadsheet: log-linear
+* histograms of transfer size, duration and throughput, totals per
+* application, user and host, and a time series of transfers per
+* interval. A summary with percentiles goes to stdout.
+*/
+
+#define _GNU_SOURCE  // for memrchr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "dlogparse.h"
+
+#define MAXTHREADS   64          //!< Most analysis threads
+#define PIPEBLOCK    (64<<20)    //!< Block read from a decompressor
+#define MINCHUNK     (1<<20)     //!< Smallest chunk worth a thread
+
+/** Transfer totals of one key */
+struct totals
+{
+   unsigned long transfers;
+   unsigned long bytes;
+   unsigned long failures;
+   double duration;              // milliseconds
+};
+
+/**
+* An entry of a key table; hosts have totals as source (t[0]) and as
+* target (t[1]), other keys only use t[0]
+*/
+struct keyEntry
+{
+   char *key;
+   unsigned int len;
+   unsigned long hash;
+   struct totals t[2];
+};
+
+/** Open addressing hash table of keys, one per thread and kind */
+struct keyTable
+{
+   struct keyEntry *entries;
+   unsigned long size;
+   unsigned long count;
+};
+
+/** Kinds of key tables */
+enum { BY_APP, BY_USER, BY_HOST, BY_TIME, TABLES };
+
+static const char *tableNames[TABLES] = {"apps", "users", "hosts", "time"};
+static const char *histNames[DLOG_HIST_METRICS] =
+   {"size", "duration", "throughput"};
+static const char *histUnits[DLOG_HIST_METRICS] =
+   {"bytes", "microseconds", "bytes_per_second"};
+
+/** What one thread has found */
+struct analysis
+{
+   struct dlogHistogram hist[DLOG_HIST_METRICS];
+   struct keyTable tables[TABLES];
+   unsigned long records;        // transfer records (lines)
+   unsigned long transfers;      // transfers, with sampling weights
+   unsigned long other;          // SUMMARY, DROPPED, ... lines
+   unsigned long bad;            // lines that are not libdlog records
+   unsigned long firstTime;
+   unsigned long lastTime;
+};
+
+/** A chunk of log text for one thread */
+struct chunk
+{
+   const char *start;
+   const char *end;
+   struct analysis *result;
+};
+
+static unsigned long interval = 3600;   // time series step, seconds
+static int numThreads = 1;
+static struct analysis results[MAXTHREADS];
+
+/**
+* FNV-1a hash of a key
+*/
+static unsigned long hashKey(const char *key, unsigned int len)
+{
+   unsigned long hash = 14695981039346656037UL;
+   unsigned int i;
+   for (i=0; i < len; i++)
+      hash = (hash ^ (unsigned char) key[i]) * 1099511628211UL;
+   return hash;
+}
+
+/**
+* Find a key in a table, adding it if it is new
+* @param table is the table
+* @param key is the key, not terminated
+* @param len is its length
+* @return the entry, or NULL if out of memory
+*/
+static struct keyEntry *findKey(struct keyTable *table, const char *key,
+                                unsigned int len)
+{
+   unsigned long hash = hashKey(key, len), i, n;
+   struct keyEntry *entry, *old;
+
+   if (table->count*2 >= table->size)
+   {
+      old = table->entries;
+      n = table->size;
+      table->size = n ? n*2 : 1024;
+      table->entries = (struct keyEntry *)
+                       calloc(table->size, sizeof(struct keyEntry));
+      if (!table->entries)
+         return NULL;
+      for (i=0; i < n; i++)
+      {
+         if (!old[i].key)
+            continue;
+         entry = &table->entries[old[i].hash & (table->size-1)];
+         while (entry->key)
+            if (++entry == table->entries + table->size)
+               entry = table->entries;
+         *entry = old[i];
+      }
+      free(old);
+   }
+   entry = &table->entries[hash & (table->size-1)];
+   while (entry->key)
+   {
+      if (entry->hash == hash && entry->len == len &&
+          memcmp(entry->key, key, len) == 0)
+         return entry;
+      if (++entry == table->entries + table->size)
+         entry = table->entries;
+   }
+   if (!(entry->key = (char *) malloc(len+1)))
+      return NULL;
+   memcpy(entry->key, key, len);
+   entry->key[len] = '\0';
+   entry->len = len;
+   entry->hash = hash;
+   table->count++;
+   return entry;
+}
+
+/**
+* Add a record to the totals of a key
+* @param table is the key table
+* @param key is the key text
+* @param len is its length
+* @param which is 0, or 1 for a host as the target
+* @param rec is the record
+* @return nothing
+*/
+static void addTotals(struct keyTable *table, const char *key,
+                      unsigned int len, int which,
+                      struct dlogParsedRecord *rec)
+{
+   struct keyEntry *entry;
+   struct totals *t;
+
+   if (!(entry = findKey(table, key, len)))
+      return;
+   t = &entry->t[which];
+   t->transfers += rec->weight;
+   t->bytes += rec->size * rec->weight;
+   t->duration += rec->duration * rec->weight;
+   if (!rec->success)
+      t->failures += rec->weight;
+}
+
+/**
+* Add one transfer record to a thread's analysis
+* @param a is the analysis
+* @param rec is the parsed record
+* @return nothing
+*/
+static void addRecord(struct analysis *a, struct dlogParsedRecord *rec)
+{
+   unsigned long duration = (rec->duration > 0) ?
+                            (unsigned long) (rec->duration * 1.0e3) : 0;
+   unsigned long step;
+
+   a->records++;
+   a->transfers += rec->weight;
+   dlogHistAdd(&a->hist[DLOG_HIST_SIZE], rec->size, rec->weight);
+   dlogHistAdd(&a->hist[DLOG_HIST_DURATION], duration, rec->weight);
+   if (duration > 0)
+      dlogHistAdd(&a->hist[DLOG_HIST_THROUGHPUT], (unsigned long)
+                  (rec->size * 1.0e6 / duration), rec->weight);
+   addTotals(&a->tables[BY_APP], rec->text[DLOGP_APP].str,
+             rec->text[DLOGP_APP].len, 0, rec);
+   addTotals(&a->tables[BY_USER], rec->text[DLOGP_USER].str,
+             rec->text[DLOGP_USER].len, 0, rec);
+   addTotals(&a->tables[BY_HOST], rec->text[DLOGP_SOURCEIP].str,
+             rec->text[DLOGP_SOURCEIP].len, 0, rec);
+   addTotals(&a->tables[BY_HOST], rec->text[DLOGP_TARGETIP].str,
+             rec->text[DLOGP_TARGETIP].len, 1, rec);
+   step = rec->startTime - rec->startTime % interval;
+   addTotals(&a->tables[BY_TIME], (char *) &step, sizeof(step), 0, rec);
+   if (a->firstTime == 0 || rec->startTime < a->firstTime)
+      a->firstTime = rec->startTime;
+   if (rec->startTime > a->lastTime)
+      a->lastTime = rec->startTime;
+}
+
+/**
+* Thread function: analyze the lines of a chunk
+*/
+static void *analyzeChunk(void *arg)
+{
+   struct chunk *c = (struct chunk *) arg;
+   struct dlogParsedRecord rec;
+   const char *pos, *next;
+   unsigned int len;
+
+   for (pos = c->start; pos < c->end; pos = next)
+   {
+      next = dlogNextLine(pos, c->end);
+      len = next - pos;
+      if (len > 0 && pos[len-1] == '\n')
+         len--;
+      if (len == 0)
+         continue;
+      switch (dlogParseRecord(pos, len, &rec))
+      {
+         case DLOGPARSE_RECORD: addRecord(c->result, &rec); break;
+         case DLOGPARSE_OTHER: c->result->other++; break;
+         default: c->result->bad++; break;
+      }
+   }
+   return NULL;
+}
+
+/**
+* Analyze a buffer of whole lines, in parallel chunks
+* @param buf is the text
+* @param len is its length
+* @return nothing
+*/
+static void analyzeBuffer(const char *buf, size_t len)
+{
+   struct chunk chunks[MAXTHREADS];
+   pthread_t threads[MAXTHREADS];
+   const char *pos = buf, *end = buf + len, *stop;
+   int n, i;
+
+   n = (len / MINCHUNK < (size_t) numThreads) ? len / MINCHUNK + 1 :
+                                                numThreads;
+   for (i=0; i < n; i++)
+   {
+      stop = (i == n-1) ? end : buf + len / n * (i+1);
+      if (stop < pos)
+         stop = pos;
+      if (stop < end && stop > buf && stop[-1] != '\n')
+         stop = dlogNextLine(stop, end);
+      chunks[i].start = pos;
+      chunks[i].end = stop;
+      chunks[i].result = &results[i];
+      pos = stop;
+   }
+   for (i=1; i < n; i++)
+      pthread_create(&threads[i], NULL, analyzeChunk, &chunks[i]);
+   analyzeChunk(&chunks[0]);
+   for (i=1; i < n; i++)
+      pthread_join(threads[i], NULL);
+}
+
+/**
+* Analyze a log file by mapping it into memory
+* @return 0 on success, 1 if it cannot be read
+*/
+static int analyzeMapped(const char *filename)
+{
+   struct stat st;
+   char *buf;
+   int fd;
+
+   if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+   {
+      if (fd >= 0)
+         close(fd);
+      return 1;
+   }
+   if (st.st_size == 0)
+   {
+      close(fd);
+      return 0;
+   }
+   buf = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (buf == MAP_FAILED)
+      return 1;
+   madvise(buf, st.st_size, MADV_WILLNEED);
+   analyzeBuffer(buf, st.st_size);
+   munmap(buf, st.st_size);
+   return 0;
+}
+
+/**
+* Analyze a log read from a file descriptor, block by block; a partial
+* last line is carried over to the next block
+* @return 0 on success, 1 if out of memory
+*/
+static int analyzeStream(int fd)
+{
+   char *buf = (char *) malloc(PIPEBLOCK), *last;
+   size_t used = 0;
+   ssize_t n;
+
+   if (!buf)
+      return 1;
+   for (;;)
+   {
+      n = read(fd, buf + used, PIPEBLOCK - used);
+      if (n < 0)
+         break;
+      used += n;
+      if (n == 0 || used == PIPEBLOCK)
+      {
+         // analyze up to the last newline; at EOF, everything
+         last = memrchr(buf, '\n', used);
+         if (n == 0 || !last)
+            last = buf + used - 1;
+         analyzeBuffer(buf, last+1 - buf);
+         used = buf + used - (last+1);
+         memmove(buf, last+1, used);
+         if (n == 0)
+            break;
+      }
+   }
+   free(buf);
+   return 0;
+}
+
+/**
+* Analyze a compressed log through its decompressor
+* @param filename is the log
+* @param tool is the decompressor, run as tool -dc filename
+* @return 0 on success, 1 if the decompressor cannot be run or fails
+*/
+static int analyzeCompressed(const char *filename, const char *tool)
+{
+   int fds[2], status;
+   pid_t pid;
+
+   if (pipe(fds) != 0)
+      return 1;
+   if ((pid = fork()) == 0)
+   {
+      dup2(fds[1], 1);
+      close(fds[0]);
+      close(fds[1]);
+      execlp(tool, tool, "-dc", filename, (char *) 0);
+      _exit(127);
+   }
+   close(fds[1]);
+   if (pid < 0)
+   {
+      close(fds[0]);
+      return 1;
+   }
+   analyzeStream(fds[0]);
+   close(fds[0]);
+   waitpid(pid, &status, 0);
+   return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/**
+* Merge the key tables of all threads into the first one
+* @return nothing
+*/
+static void mergeTables()
+{
+   struct keyEntry *from, *into;
+   unsigned long i;
+   int t, k, w;
+
+   for (t=1; t < numThreads; t++)
+   {
+      for (k=0; k < TABLES; k++)
+      {
+         for (i=0; i < results[t].tables[k].size; i++)
+         {
+            from = &results[t].tables[k].entries[i];
+            if (!from->key ||
+                !(into = findKey(&results[0].tables[k], from->key,
+                                 from->len)))
+               continue;
+            for (w=0; w < 2; w++)
+            {
+               into->t[w].transfers += from->t[w].transfers;
+               into->t[w].bytes += from->t[w].bytes;
+               into->t[w].failures += from->t[w].failures;
+               into->t[w].duration += from->t[w].duration;
+            }
+            free(from->key);
+         }
+         free(results[t].tables[k].entries);
+      }
+      for (k=0; k < DLOG_HIST_METRICS; k++)
+         dlogHistMerge(&results[0].hist[k], &results[t].hist[k]);
+      results[0].records += results[t].records;
+      results[0].transfers += results[t].transfers;
+      results[0].other += results[t].other;
+      results[0].bad += results[t].bad;
+      if (results[t].firstTime && (results[0].firstTime == 0 ||
+          results[t].firstTime < results[0].firstTime))
+         results[0].firstTime = results[t].firstTime;
+      if (results[t].lastTime > results[0].lastTime)
+         results[0].lastTime = results[t].lastTime;
+   }
+}
+
+static int compareTime(const void *a, const void *b)
+{
+   unsigned long x, y;
+   memcpy(&x, ((const struct keyEntry *) a)->key, sizeof(x));
+   memcpy(&y, ((const struct keyEntry *) b)->key, sizeof(y));
+   return (x > y) - (x < y);
+}
+
+static int compareBytes(const void *a, const void *b)
+{
+   unsigned long x = ((const struct keyEntry *) a)->t[0].bytes +
+                     ((const struct keyEntry *) a)->t[1].bytes;
+   unsigned long y = ((const struct keyEntry *) b)->t[0].bytes +
+                     ((const struct keyEntry *) b)->t[1].bytes;
+   return (x < y) - (x > y);
+}
+
+/**
+* Open an output file named prefix-name.csv
+*/
+static FILE *openOutput(const char *prefix, const char *name)
+{
+   char filename[1024];
+   FILE *out;
+   snprintf(filename, sizeof(filename), "%s-%s.csv", prefix, name);
+   if (!(out = fopen(filename, "w")))
+      fprintf(stderr, "Error: cannot write %s\n", filename);
+   return out;
+}
+
+/**
+* Write the CSV files
+* @return 0 on success, 1 if a file could not be written
+*/
+static int writeOutputs(const char *prefix)
+{
+   struct analysis *a = &results[0];
+   struct keyTable *table;
+   struct keyEntry *e;
+   unsigned long i, n, step;
+   unsigned int b;
+   FILE *out;
+   int k;
+
+   for (k=0; k < DLOG_HIST_METRICS; k++)
+   {
+      if (!(out = openOutput(prefix, histNames[k])))
+         return 1;
+      fprintf(out, "%s,transfers\n", histUnits[k]);
+      for (b=0; b < DLOG_HIST_BUCKETS; b++)
+         if (a->hist[k].buckets[b])
+            fprintf(out, "%lu,%lu\n", dlogHistBucketStart(b),
+                    a->hist[k].buckets[b]);
+      fclose(out);
+   }
+   for (k=0; k < TABLES; k++)
+   {
+      table = &a->tables[k];
+      // compact the entries, then sort by time or by bytes
+      for (i=0, n=0; i < table->size; i++)
+         if (table->entries[i].key)
+            table->entries[n++] = table->entries[i];
+      qsort(table->entries, n, sizeof(struct keyEntry),
+            (k == BY_TIME) ? compareTime : compareBytes);
+      if (!(out = openOutput(prefix, tableNames[k])))
+         return 1;
+      if (k == BY_HOST)
+         fprintf(out, "host,transfers_as_source,bytes_as_source,"
+                 "failures_as_source,transfers_as_target,bytes_as_target,"
+                 "failures_as_target\n");
+      else
+         fprintf(out, "%s,transfers,bytes,failures,mean_duration_ms,"
+                 "mean_throughput\n", (k == BY_TIME) ? "time" :
+                 (k == BY_APP) ? "app" : "user");
+      for (i=0; i < n; i++)
+      {
+         e = &table->entries[i];
+         if (k == BY_HOST)
+            fprintf(out, "\"%s\",%lu,%lu,%lu,%lu,%lu,%lu\n", e->key,
+                    e->t[0].transfers, e->t[0].bytes, e->t[0].failures,
+                    e->t[1].transfers, e->t[1].bytes, e->t[1].failures);
+         else
+         {
+            if (k == BY_TIME)
+            {
+               memcpy(&step, e->key, sizeof(step));
+               fprintf(out, "%lu,", step);
+            } else
+               fprintf(out, "\"%s\",", e->key);
+            fprintf(out, "%lu,%lu,%lu,%.3f,%.0f\n", e->t[0].transfers,
+                    e->t[0].bytes, e->t[0].failures,
+                    e->t[0].duration / e->t[0].transfers,
+                    (e->t[0].duration > 0) ?
+                    e->t[0].bytes * 1.0e3 / e->t[0].duration : 0.0);
+         }
+      }
+      fclose(out);
+   }
+   return 0;
+}
+
+/**
+* Print the summary to stdout
+*/
+static void printSummary()
+{
+   struct analysis *a = &results[0];
+   struct dlogHistogram *h;
+   int k;
+
+   printf("records %lu (transfers %lu), other lines %lu, "
+          "unparsed lines %lu\n", a->records, a->transfers, a->other,
+          a->bad);
+   printf("start times %lu - %lu, %lu apps, %lu users, %lu hosts\n",
+          a->firstTime, a->lastTime, a->tables[BY_APP].count,
+          a->tables[BY_USER].count, a->tables[BY_HOST].count);
+   printf("%-24s %12s %12s %12s %12s %12s %12s\n", "metric", "min", "mean",
+          "p50", "p90", "p99", "max");
+   for (k=0; k < DLOG_HIST_METRICS; k++)
+   {
+      h = &a->hist[k];
+      if (h->count == 0)
+         continue;
+      printf("%-24s %12lu %12lu %12lu %12lu %12lu %12lu\n", histUnits[k],
+             h->min, h->sum / h->count, dlogHistValueAt(h, 50.0),
+             dlogHistValueAt(h, 90.0), dlogHistValueAt(h, 99.0), h->max);
+   }
+}
+
+/**
+* Find the decompressor for a file name, if it is compressed
+*/
+static const char *decompressor(const char *filename)
+{
+   static const char *tools[][2] = {{".gz", "gzip"}, {".bz2", "bzip2"},
+                                    {".xz", "xz"}, {".zst", "zstd"},
+                                    {0, 0}};
+   size_t len = strlen(filename), n;
+   int i;
+   for (i=0; tools[i][0]; i++)
+   {
+      n = strlen(tools[i][0]);
+      if (len > n && strcmp(filename + len - n, tools[i][0]) == 0)
+         return tools[i][1];
+   }
+   return NULL;
+}
+
+//
+// Main: analyze every log given and write the results
+//
+int main(int argc, char* argv[])
+{
+   const char *prefix = "dlog", *tool;
+   int opt, stat = 0, k;
+
+   numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+   while ((opt = getopt(argc, argv, "o:t:i:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'o': prefix = optarg; break;
+         case 't': numThreads = atoi(optarg); break;
+         case 'i': interval = strtoul(optarg, 0, 10); break;
+         default: optind = argc+1; break;
+      }
+   }
+   if (optind >= argc)
+   {
+      fprintf(stderr,"Usage: %s [-o output-prefix] [-t threads] "
+              "[-i interval-seconds] <logfile|->...\n", argv[0]);
+      return 1;
+   }
+   if (numThreads < 1)
+      numThreads = 1;
+   if (numThreads > MAXTHREADS)
+      numThreads = MAXTHREADS;
+   if (interval == 0)
+      interval = 3600;
+
+   for (; optind < argc; optind++)
+   {
+      if (strcmp(argv[optind], "-") == 0)
+         k = analyzeStream(0);
+      else if ((tool = decompressor(argv[optind])) != NULL)
+         k = analyzeCompressed(argv[optind], tool);
+      else
+         k = analyzeMapped(argv[optind]);
+      if (k != 0)
+      {
+         fprintf(stderr, "Error: cannot read %s\n", argv[optind]);
+         stat = 2;
+      }
+   }
+   mergeTables();
+   printSummary();
+   if (writeOutputs(prefix) != 0)
+      return 3;
+   return stat;
+}
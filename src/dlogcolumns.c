@@ -0,0 +1,586 @@
+/**
+* @file dlogcolumns.c
+*
+* Writer and reader helpers of the columnar record format, described
+* in doc/columnar-format.txt. A row group is built in memory, one array
+* per column: strings go into a per-column dictionary and the rows keep
+* only the dictionary index, numbers are kept as they are. When the
+* group is written, each column is encoded on its own (dictionary,
+* LEB128 varints, or zigzag deltas for the slowly changing start time
+* and session) behind a header that has the offset, size and min/max of
+* every column, so readers can skip groups and columns they do not need.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "dlogcolumns.h"
+
+#define MINDICT   64     //!< Initial dictionary table size, power of two
+
+const char *dlogColumnNames[DLOGCOL_COLUMNS] =
+{
+   "app", "name", "fileExt", "sourceDir", "targetDir", "user",
+   "sourceIP", "targetIP", "note", "type", "size", "session",
+   "startTime", "duration", "success", "weight"
+};
+
+/** Encoding of each numeric column */
+static const unsigned char numberEncodings[DLOGCOL_COLUMNS -
+                                           DLOGCOL_STRINGS] =
+{
+   DLOGCOL_VARINT, DLOGCOL_VARINT, DLOGCOL_DELTA, DLOGCOL_DELTA,
+   DLOGCOL_VARINT, DLOGCOL_VARINT, DLOGCOL_VARINT
+};
+
+/** A dictionary entry: its text in the column's arena */
+struct dictEntry
+{
+   unsigned long offset;
+   unsigned int len;
+   unsigned int hash;
+};
+
+/** A string column being built */
+struct stringColumn
+{
+   char *arena;                  // text of the entries
+   unsigned long arenaUsed, arenaSize;
+   struct dictEntry *entries;    // in order of first use
+   unsigned int count;
+   unsigned int *table;          // open addressing: entry index + 1
+   unsigned int tableSize;
+   unsigned int *rows;           // entry index of each row
+};
+
+struct dlogColumnWriter
+{
+   unsigned int groupRows;
+   unsigned int rows;
+   struct stringColumn strings[DLOGCOL_STRINGS];
+   unsigned long *numbers[DLOGCOL_COLUMNS - DLOGCOL_STRINGS];
+};
+
+/**
+* Create a row group writer
+* @param groupRows is the most rows a group can hold
+* @return the writer, or null if out of memory
+*/
+struct dlogColumnWriter *dlogColumnCreate(unsigned int groupRows)
+{
+   struct dlogColumnWriter *w;
+   int c;
+
+   if (groupRows == 0 ||
+       !(w = (struct dlogColumnWriter *) calloc(1, sizeof(*w))))
+      return 0;
+   w->groupRows = groupRows;
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+      if (!(w->strings[c].rows = (unsigned int *)
+            malloc(groupRows * sizeof(unsigned int))))
+      {
+         dlogColumnFree(w);
+         return 0;
+      }
+   for (c=0; c < DLOGCOL_COLUMNS - DLOGCOL_STRINGS; c++)
+      if (!(w->numbers[c] = (unsigned long *)
+            malloc(groupRows * sizeof(unsigned long))))
+      {
+         dlogColumnFree(w);
+         return 0;
+      }
+   return w;
+}
+
+/**
+* Free a writer and any rows not written
+* @param w is the writer
+* @return nothing
+*/
+void dlogColumnFree(struct dlogColumnWriter *w)
+{
+   int c;
+
+   if (!w)
+      return;
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+   {
+      free(w->strings[c].arena);
+      free(w->strings[c].entries);
+      free(w->strings[c].table);
+      free(w->strings[c].rows);
+   }
+   for (c=0; c < DLOGCOL_COLUMNS - DLOGCOL_STRINGS; c++)
+      free(w->numbers[c]);
+   free(w);
+}
+
+/**
+* Double a dictionary's table and rehash its entries
+* @param col is the column
+* @return 0 on success, 1 if out of memory
+*/
+static int growDictionary(struct stringColumn *col)
+{
+   unsigned int size = col->tableSize ? col->tableSize * 2 : MINDICT;
+   unsigned int i, slot, *table;
+   struct dictEntry *entries;
+
+   table = (unsigned int *) calloc(size, sizeof(unsigned int));
+   entries = (struct dictEntry *)
+             realloc(col->entries, size / 2 * sizeof(struct dictEntry));
+   if (!table || !entries)
+   {
+      free(table);
+      if (entries)
+         col->entries = entries;
+      return 1;
+   }
+   col->entries = entries;
+   for (i=0; i < col->count; i++)
+   {
+      for (slot = entries[i].hash & (size-1); table[slot];
+           slot = (slot+1) & (size-1))
+         ;
+      table[slot] = i+1;
+   }
+   free(col->table);
+   col->table = table;
+   col->tableSize = size;
+   return 0;
+}
+
+/**
+* Find a string in a column's dictionary, adding it if new
+* @param col is the column
+* @param str is the string, not terminated
+* @param len is its length
+* @return the entry index, or -1 if out of memory
+*/
+static long dictionaryIndex(struct stringColumn *col, const char *str,
+                            unsigned int len)
+{
+   unsigned int hash = 2166136261u, i, slot;
+   struct dictEntry *e;
+   unsigned long size;
+   char *arena;
+
+   for (i=0; i < len; i++)
+      hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+   if ((col->count+1) * 2 > col->tableSize && growDictionary(col) != 0)
+      return -1;
+   for (slot = hash & (col->tableSize-1); col->table[slot];
+        slot = (slot+1) & (col->tableSize-1))
+   {
+      e = &col->entries[col->table[slot]-1];
+      if (e->hash == hash && e->len == len &&
+          memcmp(col->arena + e->offset, str, len) == 0)
+         return col->table[slot]-1;
+   }
+   if (col->arenaUsed + len > col->arenaSize)
+   {
+      size = col->arenaSize ? col->arenaSize * 2 : 4096;
+      while (size < col->arenaUsed + len)
+         size *= 2;
+      if (!(arena = (char *) realloc(col->arena, size)))
+         return -1;
+      col->arena = arena;
+      col->arenaSize = size;
+   }
+   memcpy(col->arena + col->arenaUsed, str, len);
+   e = &col->entries[col->count];
+   e->offset = col->arenaUsed;
+   e->len = len;
+   e->hash = hash;
+   col->arenaUsed += len;
+   col->table[slot] = ++col->count;
+   return col->count-1;
+}
+
+/**
+* Add a record to the row group
+* @param w is the writer
+* @param row is the record
+* @return the rows now in the group, or 0 if out of memory or the
+*         group is full
+*/
+unsigned int dlogColumnAdd(struct dlogColumnWriter *w,
+                           struct dlogColumnRow *row)
+{
+   long index[DLOGCOL_STRINGS];
+   int c;
+
+   if (w->rows >= w->groupRows)
+      return 0;
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+      if ((index[c] = dictionaryIndex(&w->strings[c], row->str[c],
+                                      row->len[c])) < 0)
+         return 0; // entries added so far are just unused
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+      w->strings[c].rows[w->rows] = index[c];
+   for (c=0; c < DLOGCOL_COLUMNS - DLOGCOL_STRINGS; c++)
+      w->numbers[c][w->rows] = row->num[c];
+   return ++w->rows;
+}
+
+/**
+* Get the number of rows in the row group
+* @param w is the writer
+* @return the number of rows
+*/
+unsigned int dlogColumnRows(struct dlogColumnWriter *w)
+{
+   return w->rows;
+}
+
+/**
+* Get the memory a writer has allocated: its row arrays, which are
+* fixed, and the dictionaries, which grow with the distinct strings
+* @param w is the writer
+* @return the bytes
+*/
+unsigned long dlogColumnMemory(struct dlogColumnWriter *w)
+{
+   unsigned long bytes;
+   int c;
+
+   bytes = sizeof(*w) + w->groupRows * (DLOGCOL_STRINGS * sizeof(unsigned int)
+           + (DLOGCOL_COLUMNS - DLOGCOL_STRINGS) * sizeof(unsigned long));
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+      bytes += w->strings[c].arenaSize +
+               w->strings[c].tableSize * sizeof(unsigned int) +
+               w->strings[c].tableSize / 2 * sizeof(struct dictEntry);
+   return bytes;
+}
+
+/**
+* Store a number as LEB128
+* @param pos is where to store it
+* @param value is the number
+* @return the position after it
+*/
+static unsigned char *putVarint(unsigned char *pos, unsigned long value)
+{
+   while (value >= 0x80)
+   {
+      *pos++ = (unsigned char) (value | 0x80);
+      value >>= 7;
+   }
+   *pos++ = (unsigned char) value;
+   return pos;
+}
+
+/**
+* Store a little-endian number of the given size
+* @param pos is where to store it
+* @param value is the number
+* @param bytes is its size
+* @return nothing
+*/
+static void putLE(unsigned char *pos, unsigned long value, int bytes)
+{
+   int i;
+   for (i=0; i < bytes; i++, value >>= 8)
+      pos[i] = (unsigned char) value;
+}
+
+/**
+* Read a little-endian number of the given size
+* @param pos is where it is stored
+* @param bytes is its size
+* @return the number
+*/
+static unsigned long getLE(const unsigned char *pos, int bytes)
+{
+   unsigned long value = 0;
+   int i;
+   for (i=bytes-1; i >= 0; i--)
+      value = (value << 8) | pos[i];
+   return value;
+}
+
+/**
+* Encode a string column: its dictionary, then the row indexes
+* @param col is the column
+* @param rows is the number of rows
+* @param pos is where to put the data
+* @return the position after the data
+*/
+static unsigned char *encodeStrings(struct stringColumn *col,
+                                    unsigned int rows, unsigned char *pos)
+{
+   unsigned int i;
+
+   pos = putVarint(pos, col->count);
+   for (i=0; i < col->count; i++)
+   {
+      pos = putVarint(pos, col->entries[i].len);
+      memcpy(pos, col->arena + col->entries[i].offset, col->entries[i].len);
+      pos += col->entries[i].len;
+   }
+   for (i=0; i < rows; i++)
+      pos = putVarint(pos, col->rows[i]);
+   return pos;
+}
+
+/**
+* Encode a numeric column and find its min and max
+* @param values are the column's values
+* @param rows is the number of rows
+* @param encoding is DLOGCOL_VARINT or DLOGCOL_DELTA
+* @param pos is where to put the data
+* @param desc is the column descriptor, to store min and max in
+* @return the position after the data
+*/
+static unsigned char *encodeNumbers(unsigned long *values, unsigned int rows,
+                                    int encoding, unsigned char *pos,
+                                    unsigned char *desc)
+{
+   unsigned long min = values[0], max = values[0], prev = 0;
+   long delta;
+   unsigned int i;
+
+   for (i=0; i < rows; i++)
+   {
+      if (values[i] < min)
+         min = values[i];
+      if (values[i] > max)
+         max = values[i];
+      if (encoding == DLOGCOL_DELTA)
+      {
+         delta = (long) (values[i] - prev);
+         pos = putVarint(pos, ((unsigned long) delta << 1) ^
+                              (unsigned long) (delta >> 63));
+         prev = values[i];
+      } else
+         pos = putVarint(pos, values[i]);
+   }
+   putLE(desc+8, min, 8);
+   putLE(desc+16, max, 8);
+   return pos;
+}
+
+/**
+* Clear the row group, keeping the allocated space
+* @param w is the writer
+* @return nothing
+*/
+static void resetGroup(struct dlogColumnWriter *w)
+{
+   int c;
+
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+   {
+      w->strings[c].count = 0;
+      w->strings[c].arenaUsed = 0;
+      if (w->strings[c].table)
+         memset(w->strings[c].table, 0,
+                w->strings[c].tableSize * sizeof(unsigned int));
+   }
+   w->rows = 0;
+}
+
+/**
+* Encode the row group and write it, then start a new one
+* @param w is the writer
+* @param fd is the file to write to
+* @return 0 on success or if the group is empty, 1 if out of memory,
+*         2 if the write failed
+*/
+int dlogColumnWrite(struct dlogColumnWriter *w, int fd)
+{
+   unsigned char *buff, *pos, *desc;
+   unsigned long bound, done;
+   ssize_t n;
+   int c, stat = 0;
+
+   if (w->rows == 0)
+      return 0;
+   bound = DLOGCOL_HEADER + DLOGCOL_COLUMNS * DLOGCOL_DESCRIPTOR +
+           (DLOGCOL_COLUMNS - DLOGCOL_STRINGS) * 10UL * w->rows;
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+      bound += 10 + w->strings[c].count * 5UL + w->strings[c].arenaUsed +
+               w->rows * 5UL;
+   if (!(buff = (unsigned char *) calloc(1, bound)))
+   {
+      resetGroup(w);
+      return 1;
+   }
+   pos = buff + DLOGCOL_HEADER + DLOGCOL_COLUMNS * DLOGCOL_DESCRIPTOR;
+   for (c=0; c < DLOGCOL_COLUMNS; c++)
+   {
+      desc = buff + DLOGCOL_HEADER + c * DLOGCOL_DESCRIPTOR;
+      desc[0] = c;
+      done = pos - buff;
+      if (c < DLOGCOL_STRINGS)
+      {
+         desc[1] = DLOGCOL_DICT;
+         pos = encodeStrings(&w->strings[c], w->rows, pos);
+      } else
+      {
+         desc[1] = numberEncodings[c - DLOGCOL_STRINGS];
+         pos = encodeNumbers(w->numbers[c - DLOGCOL_STRINGS], w->rows,
+                             desc[1], pos, desc);
+      }
+      putLE(desc+4, pos - buff - done, 4);
+   }
+   memcpy(buff, DLOGCOL_MAGIC, 4);
+   putLE(buff+4, DLOGCOL_VERSION, 2);
+   putLE(buff+6, DLOGCOL_COLUMNS, 2);
+   putLE(buff+8, w->rows, 4);
+   putLE(buff+12, DLOGCOL_HEADER + DLOGCOL_COLUMNS * DLOGCOL_DESCRIPTOR, 4);
+   putLE(buff+16, pos - buff, 8);
+
+   for (done = 0; done < (unsigned long) (pos - buff); done += n)
+   {
+      n = write(fd, buff + done, (pos - buff) - done);
+      if (n < 0 && errno == EINTR)
+         n = 0;
+      else if (n <= 0)
+      {
+         stat = 2;
+         break;
+      }
+   }
+   free(buff);
+   resetGroup(w);
+   return stat;
+}
+
+/**
+* Read a LEB128 number
+* @param pos is where it starts
+* @param end is the end of the data
+* @param value is set to the number
+* @return the position after it, or null if it runs past end
+*/
+const unsigned char *dlogColumnGetVarint(const unsigned char *pos,
+                                         const unsigned char *end,
+                                         unsigned long *value)
+{
+   unsigned long v = 0;
+   int shift;
+
+   for (shift = 0; pos < end && shift < 64; shift += 7)
+   {
+      v |= (unsigned long) (*pos & 0x7f) << shift;
+      if (!(*pos++ & 0x80))
+      {
+         *value = v;
+         return pos;
+      }
+   }
+   return 0;
+}
+
+/**
+* Read the header of a row group
+* @param data is the start of the group
+* @param avail is the number of bytes available at data
+* @param group is filled in with the header
+* @return 0 on success, 1 if it is not a valid row group
+*/
+int dlogColumnReadGroup(const unsigned char *data, unsigned long avail,
+                        struct dlogColumnGroup *group)
+{
+   const unsigned char *desc;
+   unsigned long offset, bytes;
+   unsigned int columns, headerBytes, c, id;
+
+   memset(group, 0, sizeof(*group));
+   if (avail < DLOGCOL_HEADER || memcmp(data, DLOGCOL_MAGIC, 4) != 0 ||
+       getLE(data+4, 2) != DLOGCOL_VERSION)
+      return 1;
+   columns = getLE(data+6, 2);
+   group->rows = getLE(data+8, 4);
+   headerBytes = getLE(data+12, 4);
+   group->bytes = getLE(data+16, 8);
+   if (headerBytes < DLOGCOL_HEADER + columns * DLOGCOL_DESCRIPTOR ||
+       group->bytes < headerBytes || group->bytes > avail)
+      return 1;
+   for (c=0, offset = headerBytes; c < columns; c++)
+   {
+      desc = data + DLOGCOL_HEADER + c * DLOGCOL_DESCRIPTOR;
+      bytes = getLE(desc+4, 4);
+      if (offset + bytes > group->bytes)
+         return 1;
+      id = desc[0];
+      if (id < DLOGCOL_COLUMNS) // else a column added in a later version
+      {
+         group->col[id].encoding = desc[1];
+         group->col[id].offset = offset;
+         group->col[id].bytes = bytes;
+         group->col[id].min = getLE(desc+8, 8);
+         group->col[id].max = getLE(desc+16, 8);
+      }
+      offset += bytes;
+   }
+   return 0;
+}
+
+/**
+* Decode a column of a row group
+* @param data is the start of the group
+* @param group is its header
+* @param c is the column
+* @param col is filled in; free it with dlogColumnDataFree()
+* @return 0 on success, 1 if the column is missing or damaged
+*/
+int dlogColumnDecode(const unsigned char *data, struct dlogColumnGroup *group,
+                     int c, struct dlogColumnData *col)
+{
+   const unsigned char *pos = data + group->col[c].offset;
+   const unsigned char *end = pos + group->col[c].bytes;
+   unsigned long i, count = 0, len, prev = 0;
+
+   col->dict = 0;
+   if (!(col->values = (unsigned long *)
+         malloc((group->rows+1) * sizeof(unsigned long))) ||
+       group->col[c].encoding == 0)
+      return 1;
+   if (group->col[c].encoding == DLOGCOL_DICT)
+   {
+      if (!(pos = dlogColumnGetVarint(pos, end, &count)) ||
+          count > group->col[c].bytes ||
+          !(col->dict = (struct dlogColumnString *)
+            malloc((count+1) * sizeof(struct dlogColumnString))))
+         return 1;
+      for (i=0; i < count; i++)
+      {
+         if (!(pos = dlogColumnGetVarint(pos, end, &len)) ||
+             len > (unsigned long) (end - pos))
+            return 1;
+         col->dict[i].str = (const char *) pos;
+         col->dict[i].len = len;
+         pos += len;
+      }
+   }
+   for (i=0; i < group->rows; i++)
+   {
+      if (!(pos = dlogColumnGetVarint(pos, end, &col->values[i])))
+         return 1;
+      if (group->col[c].encoding == DLOGCOL_DELTA)
+      {
+         // zigzag-encoded difference from the previous row
+         prev += (col->values[i] >> 1) ^ -(col->values[i] & 1);
+         col->values[i] = prev;
+      } else if (group->col[c].encoding == DLOGCOL_DICT &&
+                 col->values[i] >= count)
+         return 1;
+   }
+   return 0;
+}
+
+/**
+* Free the arrays of a decoded column
+* @param col is the column
+* @return nothing
+*/
+void dlogColumnDataFree(struct dlogColumnData *col)
+{
+   free(col->dict);
+   free(col->values);
+   col->dict = 0;
+   col->values = 0;
+}
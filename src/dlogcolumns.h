@@ -0,0 +1,135 @@
+/**
+* @file  dlogcolumns.h
+* Columnar record format (see doc/columnar-format.txt), written by the
+* libdlog column sink and by dlogexport
+*/
+
+#ifndef DLOGCOLUMNS_H
+#define DLOGCOLUMNS_H
+
+#define DLOGCOL_MAGIC "DLRG"     /* starts every row group */
+#define DLOGCOL_VERSION 1
+#define DLOGCOL_HEADER 24        /* bytes of a row group header */
+#define DLOGCOL_DESCRIPTOR 24    /* bytes of a column descriptor */
+
+/* Columns, in the order they are stored: the strings first */
+#define DLOGCOL_APP 0
+#define DLOGCOL_NAME 1
+#define DLOGCOL_FILEEXT 2
+#define DLOGCOL_SOURCEDIR 3
+#define DLOGCOL_TARGETDIR 4
+#define DLOGCOL_USER 5
+#define DLOGCOL_SOURCEIP 6
+#define DLOGCOL_TARGETIP 7
+#define DLOGCOL_NOTE 8
+#define DLOGCOL_STRINGS 9
+#define DLOGCOL_TYPE 9           /* DLOG_SEND or DLOG_RECEIVE */
+#define DLOGCOL_SIZE 10          /* bytes */
+#define DLOGCOL_SESSION 11
+#define DLOGCOL_STARTTIME 12     /* seconds since the epoch */
+#define DLOGCOL_DURATION 13      /* microseconds */
+#define DLOGCOL_SUCCESS 14       /* 1 if the transfer succeeded */
+#define DLOGCOL_WEIGHT 15        /* transfers the record stands for */
+#define DLOGCOL_COLUMNS 16
+
+/* Column encodings */
+#define DLOGCOL_VARINT 1         /* LEB128 per row */
+#define DLOGCOL_DELTA 2          /* zigzag LEB128 difference per row */
+#define DLOGCOL_DICT 3           /* dictionary, then LEB128 index per row */
+
+/* One record to add: strings point to their text, which need not be
+* terminated, and num holds columns DLOGCOL_TYPE and up
+*/
+struct dlogColumnRow
+{
+   const char *str[DLOGCOL_STRINGS];
+   unsigned int len[DLOGCOL_STRINGS];
+   unsigned long num[DLOGCOL_COLUMNS - DLOGCOL_STRINGS];
+};
+
+/* Row group being built; opaque */
+struct dlogColumnWriter;
+
+/* create a writer for row groups of at most groupRows rows; null if
+* out of memory
+*/
+struct dlogColumnWriter *dlogColumnCreate(unsigned int groupRows);
+
+/* add a record to the row group; returns the number of rows in the
+* group, or 0 if out of memory (the record is not added)
+*/
+unsigned int dlogColumnAdd(struct dlogColumnWriter *writer,
+                           struct dlogColumnRow *row);
+
+/* number of rows in the row group */
+unsigned int dlogColumnRows(struct dlogColumnWriter *writer);
+
+/* bytes of memory the writer has allocated */
+unsigned long dlogColumnMemory(struct dlogColumnWriter *writer);
+
+/* encode the row group, write it to fd with one write() if possible,
+* and start a new one; returns 0 on success (also if the group is
+* empty), nonzero if it cannot be written (the rows are discarded)
+*/
+int dlogColumnWrite(struct dlogColumnWriter *writer, int fd);
+
+void dlogColumnFree(struct dlogColumnWriter *writer);
+
+/* Location and statistics of a column in a row group */
+struct dlogColumnInfo
+{
+   unsigned int encoding;
+   unsigned long offset;         /* of the data, from the group start */
+   unsigned long bytes;
+   unsigned long min;            /* 0 for dictionary columns */
+   unsigned long max;
+};
+
+/* Header of a row group, as read */
+struct dlogColumnGroup
+{
+   unsigned long rows;
+   unsigned long bytes;          /* of the whole group */
+   struct dlogColumnInfo col[DLOGCOL_COLUMNS];
+};
+
+/* column names, as in the text log format */
+extern const char *dlogColumnNames[DLOGCOL_COLUMNS];
+
+/* read the header of the row group at data, of which avail bytes are
+* available; returns 0 on success, 1 if it is not a valid row group
+*/
+int dlogColumnReadGroup(const unsigned char *data, unsigned long avail,
+                        struct dlogColumnGroup *group);
+
+/* A decoded column: numbers, or dictionary indexes and the dictionary
+* of a string column; the strings point into the row group
+*/
+struct dlogColumnString
+{
+   const char *str;
+   unsigned int len;
+};
+
+struct dlogColumnData
+{
+   struct dlogColumnString *dict;
+   unsigned long *values;
+};
+
+/* decode a column of the row group at data; returns 0 on success, 1
+* if the column is damaged; free the arrays with dlogColumnDataFree()
+* either way
+*/
+int dlogColumnDecode(const unsigned char *data, struct dlogColumnGroup *group,
+                     int column, struct dlogColumnData *col);
+void dlogColumnDataFree(struct dlogColumnData *col);
+
+/* read a LEB128 number; returns the position after it, or null if it
+* runs past end
+*/
+const unsigned char *dlogColumnGetVarint(const unsigned char *pos,
+                                         const unsigned char *end,
+                                         unsigned long *value);
+
+#endif        //  #ifndef DLOGCOLUMNS_H
@@ -0,0 +1,43 @@
+/**
+* @file dlogd.c
+*
+* The dlogd daemon: applications configured with LoggingLocation =
+* daemon send their log records to it in batches over a Unix socket,
+* so that one process, instead of every application process, appends
+* to the log. It reads its own config file, whose LoggingLocation must
+* be file or syslog, and runs in the foreground until SIGTERM/SIGINT;
+* SIGHUP reloads the config.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libdlog.h>
+
+//
+// Main: Init from the given config file and serve clients
+//
+int main(int argc, char* argv[])
+{
+   unsigned int stat;
+
+   if (argc != 2) {
+      fprintf(stderr,"Usage: %s <libdlog-config-file>\n",argv[0]);
+      return 1;
+   }
+   setenv("DLOG_CONFIG",argv[1],1);
+   if ((stat=dlogInit("dlogd")) != 0)
+   {
+      fprintf(stderr,"Error %u in dlogInit()\n", stat);
+      return 2;
+   }
+   if ((stat=dlogRunDaemon()) != 0)
+   {
+      if (stat == 2)
+         fprintf(stderr,"Error: dlogd must log to file or syslog\n");
+      else
+         fprintf(stderr,"Error %u starting the daemon\n", stat);
+      return 3;
+   }
+   dlogFinalize();
+   return 0;
+}
@@ -0,0 +1,281 @@
+/**
+* @file dlogexport.c
+*
+* Convert libdlog logs to the columnar format of doc/columnar-format.txt,
+* or dump a columnar file as CSV. Converting parses each line with
+* dlogParseRecord() and adds the transfer records to row groups;
+* other lines (SUMMARY, STATS, ...) are left out. Compressed logs can be
+* converted through a pipe, e.g. zcat x.log.gz | dlogexport -o x.dlc -.
+*
+* Dumping reads only the columns asked for, and skips row groups whose
+* start time range is outside the one asked for without decoding them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "dlogparse.h"
+#include "dlogcolumns.h"
+
+/**
+* Convert one log, adding its records to the writer and writing each
+* row group as it fills up
+* @param in is the log
+* @param w is the writer
+* @param fd is the output file
+* @param groupRows is the size of a full row group
+* @return 0 on success, 1 if a row group could not be written
+*/
+static int convertLog(FILE *in, struct dlogColumnWriter *w, int fd,
+                      unsigned int groupRows)
+{
+   struct dlogParsedRecord rec;
+   struct dlogColumnRow row;
+   char *line = 0;
+   size_t size = 0;
+   ssize_t len;
+   int c;
+
+   while ((len = getline(&line, &size, in)) > 0)
+   {
+      if (line[len-1] == '\n')
+         len--;
+      if (dlogParseRecord(line, len, &rec) != DLOGPARSE_RECORD)
+         continue;
+      for (c=0; c < DLOGCOL_STRINGS; c++)
+      {
+         // the string columns are in the parser's order
+         row.str[c] = rec.text[c].str;
+         row.len[c] = rec.text[c].len;
+      }
+      row.num[DLOGCOL_TYPE - DLOGCOL_STRINGS] = rec.type;
+      row.num[DLOGCOL_SIZE - DLOGCOL_STRINGS] = rec.size;
+      row.num[DLOGCOL_SESSION - DLOGCOL_STRINGS] = rec.session;
+      row.num[DLOGCOL_STARTTIME - DLOGCOL_STRINGS] = rec.startTime;
+      row.num[DLOGCOL_DURATION - DLOGCOL_STRINGS] = (rec.duration > 0) ?
+         (unsigned long) (rec.duration * 1.0e3 + 0.5) : 0;
+      row.num[DLOGCOL_SUCCESS - DLOGCOL_STRINGS] = rec.success;
+      row.num[DLOGCOL_WEIGHT - DLOGCOL_STRINGS] = rec.weight;
+      if (dlogColumnAdd(w, &row) == groupRows &&
+          dlogColumnWrite(w, fd) != 0)
+      {
+         free(line);
+         return 1;
+      }
+   }
+   free(line);
+   return 0;
+}
+
+/**
+* Print a string as a CSV field, quoted if needed
+* @param str is the string
+* @param len is its length
+* @return nothing
+*/
+static void printCSVString(const char *str, unsigned int len)
+{
+   unsigned int i;
+
+   if (!memchr(str, ',', len) && !memchr(str, '"', len) &&
+       !memchr(str, '\n', len))
+   {
+      fwrite(str, len, 1, stdout);
+      return;
+   }
+   putchar('"');
+   for (i=0; i < len; i++)
+   {
+      if (str[i] == '"')
+         putchar('"');
+      putchar(str[i]);
+   }
+   putchar('"');
+}
+
+/**
+* Dump the selected columns of a columnar file as CSV
+* @param filename is the file
+* @param columns are the columns to print, in order
+* @param ncols is the number of columns
+* @param after and before limit the start times, 0 if not limited
+* @return 0 on success, 1 if the file cannot be read, 2 if it is
+*         damaged
+*/
+static int dumpFile(const char *filename, int *columns, int ncols,
+                    unsigned long after, unsigned long before)
+{
+   struct dlogColumnData col[DLOGCOL_COLUMNS];
+   struct dlogColumnGroup group;
+   unsigned long pos = 0, r, groups = 0, read = 0, value;
+   struct stat st;
+   unsigned char *data;
+   int fd, i, c, stat = 0;
+
+   if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+      return 1;
+   data = (st.st_size > 0) ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0) : 0;
+   close(fd);
+   if (data == MAP_FAILED)
+      return 1;
+   for (i=0; i < ncols; i++)
+      printf("%s%s", i ? "," : "", dlogColumnNames[columns[i]]);
+   putchar('\n');
+   for (; pos < (unsigned long) st.st_size; pos += group.bytes)
+   {
+      if (dlogColumnReadGroup(data + pos, st.st_size - pos, &group) != 0)
+      {
+         stat = 2;
+         break;
+      }
+      groups++;
+      if ((after && group.col[DLOGCOL_STARTTIME].max < after) ||
+          (before && group.col[DLOGCOL_STARTTIME].min >= before))
+         continue; // no row of this group is in the time range
+      read++;
+      memset(col, 0, sizeof(col));
+      for (i=0; i < ncols && stat == 0; i++)
+         if (!col[columns[i]].values &&
+             dlogColumnDecode(data + pos, &group, columns[i],
+                              &col[columns[i]]) != 0)
+            stat = 2;
+      if ((after || before) && stat == 0 && !col[DLOGCOL_STARTTIME].values &&
+          dlogColumnDecode(data + pos, &group, DLOGCOL_STARTTIME,
+                           &col[DLOGCOL_STARTTIME]) != 0)
+         stat = 2;
+      for (r=0; r < group.rows && stat == 0; r++)
+      {
+         value = col[DLOGCOL_STARTTIME].values ?
+                 col[DLOGCOL_STARTTIME].values[r] : 0;
+         if ((after && value < after) || (before && value >= before))
+            continue;
+         for (i=0; i < ncols; i++)
+         {
+            c = columns[i];
+            if (i)
+               putchar(',');
+            if (col[c].dict)
+               printCSVString(col[c].dict[col[c].values[r]].str,
+                              col[c].dict[col[c].values[r]].len);
+            else if (c == DLOGCOL_TYPE)
+               fputs(col[c].values[r] == DLOG_RECEIVE ? "RECEIVE" : "SEND",
+                     stdout);
+            else
+               printf("%lu", col[c].values[r]);
+         }
+         putchar('\n');
+      }
+      for (c=0; c < DLOGCOL_COLUMNS; c++)
+         dlogColumnDataFree(&col[c]);
+      if (stat != 0)
+         break;
+   }
+   if (data)
+      munmap(data, st.st_size);
+   fprintf(stderr, "%s: read %lu of %lu row groups\n", filename, read,
+           groups);
+   return stat;
+}
+
+/**
+* Parse a comma-separated list of column names
+* @param list is the list
+* @param columns is filled in with the columns
+* @return the number of columns, 0 if a name is unknown
+*/
+static int parseColumns(char *list, int *columns)
+{
+   char *name, *save;
+   int n = 0, c;
+
+   for (name = strtok_r(list, ",", &save); name && n < DLOGCOL_COLUMNS;
+        name = strtok_r(0, ",", &save))
+   {
+      for (c=0; c < DLOGCOL_COLUMNS; c++)
+         if (strcmp(name, dlogColumnNames[c]) == 0)
+            break;
+      if (c == DLOGCOL_COLUMNS)
+         return 0;
+      columns[n++] = c;
+   }
+   return n;
+}
+
+//
+// Main: convert logs to a columnar file, or dump one
+//
+int main(int argc, char* argv[])
+{
+   struct dlogColumnWriter *w;
+   int columns[DLOGCOL_COLUMNS], ncols, opt, fd, stat = 0, dump = 0;
+   unsigned long after = 0, before = 0;
+   unsigned int groupRows = 65536;
+   const char *output = 0;
+   FILE *in;
+
+   for (ncols = 0; ncols < DLOGCOL_COLUMNS; ncols++)
+      columns[ncols] = ncols;
+   while ((opt = getopt(argc, argv, "o:r:dc:a:b:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'o': output = optarg; break;
+         case 'r': groupRows = atoi(optarg); break;
+         case 'd': dump = 1; break;
+         case 'c': ncols = parseColumns(optarg, columns); break;
+         case 'a': after = strtoul(optarg, 0, 10); break;
+         case 'b': before = strtoul(optarg, 0, 10); break;
+         default: optind = argc+1; break;
+      }
+   }
+   if (optind >= argc || groupRows < 1 || ncols == 0 ||
+       (!dump && !output))
+   {
+      fprintf(stderr,"Usage: %s [-r rows-per-group] -o output <logfile|->..."
+              "\n       %s -d [-c column,...] [-a after-time] "
+              "[-b before-time] <columnfile>...\n", argv[0], argv[0]);
+      return 1;
+   }
+
+   if (dump)
+   {
+      for (; optind < argc; optind++)
+         if (dumpFile(argv[optind], columns, ncols, after, before) != 0)
+         {
+            fprintf(stderr, "Error: cannot read %s\n", argv[optind]);
+            stat = 2;
+         }
+      return stat;
+   }
+
+   if ((fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+       !(w = dlogColumnCreate(groupRows)))
+   {
+      fprintf(stderr, "Error: cannot create %s\n", output);
+      return 3;
+   }
+   for (; optind < argc; optind++)
+   {
+      in = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+      if (!in || convertLog(in, w, fd, groupRows) != 0)
+      {
+         fprintf(stderr, "Error: cannot convert %s\n", argv[optind]);
+         stat = 2;
+      }
+      if (in && in != stdin)
+         fclose(in);
+   }
+   if (dlogColumnWrite(w, fd) != 0 || close(fd) != 0)
+   {
+      fprintf(stderr, "Error: cannot write %s\n", output);
+      stat = 3;
+   }
+   dlogColumnFree(w);
+   return stat;
+}
@@ -0,0 +1,234 @@
+/**
+* @file dlogindex.c
+*
+* Build the sidecar index (logfile.idx) that dlogquery uses to read
+* only the parts of a log that can hold the records it looks for. The
+* log is cut into blocks of consecutive lines; for each block the index
+* keeps its offset and length, the range of record start times, and a
+* Bloom filter of the users, sessions, source and target IPs and file
+* names of its records. Logs are only appended to, so running dlogindex
+* again indexes just the new part; if the log was rotated or replaced,
+* the index is rebuilt. Compressed logs cannot be indexed, since blocks
+* are read at their offsets.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "dlogparse.h"
+
+#define BLOOMBITS   10     //!< Bloom filter bits per key, ~1% false hits
+#define MINBLOOM    64     //!< Smallest Bloom filter, bytes
+
+static unsigned int blockRecords = 4096;  // records per block
+
+/**
+* Add the Bloom keys of a record to a block's list of key hashes
+* @param hashes is the list, with room for DLOGKEY_KINDS more
+* @param rec is the record
+* @return the number of hashes added
+*/
+static unsigned int recordKeys(unsigned long *hashes,
+                               struct dlogParsedRecord *rec)
+{
+   hashes[0] = dlogKeyHash(DLOGKEY_USER, rec->text[DLOGP_USER].str,
+                           rec->text[DLOGP_USER].len);
+   hashes[1] = dlogKeyHash(DLOGKEY_SESSION, (char *) &rec->session,
+                           sizeof(rec->session));
+   hashes[2] = dlogKeyHash(DLOGKEY_SOURCEIP, rec->text[DLOGP_SOURCEIP].str,
+                           rec->text[DLOGP_SOURCEIP].len);
+   hashes[3] = dlogKeyHash(DLOGKEY_TARGETIP, rec->text[DLOGP_TARGETIP].str,
+                           rec->text[DLOGP_TARGETIP].len);
+   hashes[4] = dlogKeyHash(DLOGKEY_NAME, rec->text[DLOGP_NAME].str,
+                           rec->text[DLOGP_NAME].len);
+   return DLOGKEY_KINDS;
+}
+
+/**
+* Write one block entry and its Bloom filter
+* @param idx is the index file
+* @param block is the block entry, with bloomBytes not yet set
+* @param hashes are the key hashes of the block's records
+* @param count is the number of hashes
+* @return 0 on success, 1 on a write error
+*/
+static int writeBlock(FILE *idx, struct dlogIndexBlock *block,
+                      unsigned long *hashes, unsigned int count)
+{
+   unsigned char *bloom;
+   unsigned int i;
+   int stat;
+
+   block->bloomBytes = (count * BLOOMBITS + 7) / 8;
+   if (block->bloomBytes < MINBLOOM)
+      block->bloomBytes = MINBLOOM;
+   if (!(bloom = (unsigned char *) calloc(1, block->bloomBytes)))
+      return 1;
+   for (i=0; i < count; i++)
+      dlogBloomAdd(bloom, block->bloomBytes, hashes[i]);
+   stat = fwrite(block, sizeof(*block), 1, idx) != 1 ||
+          fwrite(bloom, block->bloomBytes, 1, idx) != 1;
+   free(bloom);
+   return stat;
+}
+
+/**
+* Index the part of a log from a given offset, appending the blocks
+* to the index file
+* @param idx is the index file, positioned at its end
+* @param log is the mapped log
+* @param from is where to start (the end of a line)
+* @param size is the log size
+* @param header is updated with the new blocks and indexed size
+* @return 0 on success, 1 on a write error
+*/
+static int indexLog(FILE *idx, const char *log, unsigned long from,
+                    unsigned long size, struct dlogIndexHeader *header)
+{
+   struct dlogParsedRecord rec;
+   struct dlogIndexBlock block;
+   unsigned long *hashes;
+   unsigned int count = 0, len;
+   int stat = 0;
+   const char *pos, *next, *end = log + size;
+
+   hashes = (unsigned long *)
+            malloc(blockRecords * DLOGKEY_KINDS * sizeof(unsigned long));
+   if (!hashes)
+      return 1;
+   memset(&block, 0, sizeof(block));
+   block.offset = from;
+   for (pos = log + from; pos < end; pos = next)
+   {
+      next = dlogNextLine(pos, end);
+      if (next[-1] != '\n')
+         break; // a line still being written; indexed next time
+      len = next - pos - 1;
+      if (len > 0 && dlogParseRecord(pos, len, &rec) == DLOGPARSE_RECORD)
+      {
+         count += recordKeys(hashes + count, &rec);
+         if (block.records == 0 || rec.startTime < block.minTime)
+            block.minTime = rec.startTime;
+         if (rec.startTime > block.maxTime)
+            block.maxTime = rec.startTime;
+         block.records++;
+      }
+      block.length = next - (log + block.offset);
+      if (block.records == blockRecords)
+      {
+         if ((stat = writeBlock(idx, &block, hashes, count)) != 0)
+            break;
+         header->blockCount++;
+         memset(&block, 0, sizeof(block));
+         block.offset = next - log;
+         count = 0;
+      }
+   }
+   if (stat == 0 && block.length > 0 &&
+       (stat = writeBlock(idx, &block, hashes, count)) == 0)
+      header->blockCount++;
+   header->logSize = (stat == 0) ? block.offset + block.length :
+                                   block.offset;
+   free(hashes);
+   return stat;
+}
+
+/**
+* Create or extend the index of one log file
+* @param filename is the log
+* @return 0 on success, nonzero on error
+*/
+static int indexFile(const char *filename)
+{
+   struct dlogIndexHeader header;
+   char idxname[1024];
+   struct stat st;
+   FILE *idx = 0;
+   char *log;
+   int fd, stat;
+
+   snprintf(idxname, sizeof(idxname), "%s.idx", filename);
+   if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+      return 1;
+   log = (st.st_size > 0) ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE,
+                                 fd, 0) : 0;
+   close(fd);
+   if (log == MAP_FAILED)
+      return 1;
+
+   // keep an existing index if it is of this log, else start over
+   if ((idx = fopen(idxname, "r+")) != NULL &&
+       (fread(&header, sizeof(header), 1, idx) != 1 ||
+        memcmp(header.magic, DLOGINDEX_MAGIC, 8) != 0 ||
+        header.logSize > (unsigned long) st.st_size ||
+        header.logHead != dlogLogHeadHash(log, header.logSize)))
+   {
+      fclose(idx);
+      idx = 0;
+   }
+   if (!idx)
+   {
+      if (!(idx = fopen(idxname, "w+")))
+      {
+         if (log)
+            munmap(log, st.st_size);
+         return 2;
+      }
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, DLOGINDEX_MAGIC, 8);
+      fwrite(&header, sizeof(header), 1, idx);
+   }
+   fseek(idx, 0, SEEK_END);
+   stat = indexLog(idx, log, header.logSize, st.st_size, &header);
+   header.logHead = dlogLogHeadHash(log, header.logSize);
+   rewind(idx);
+   if (fwrite(&header, sizeof(header), 1, idx) != 1)
+      stat = 3;
+   if (fclose(idx) != 0)
+      stat = 3;
+   if (log)
+      munmap(log, st.st_size);
+   if (stat != 0)
+   {
+      unlink(idxname); // rebuilt next time
+      return stat;
+   }
+   printf("%s: %lu bytes in %lu blocks\n", idxname, header.logSize,
+          header.blockCount);
+   return stat;
+}
+
+//
+// Main: index every log given
+//
+int main(int argc, char* argv[])
+{
+   int opt, stat = 0;
+
+   while ((opt = getopt(argc, argv, "b:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'b': blockRecords = atoi(optarg); break;
+         default: optind = argc+1; break;
+      }
+   }
+   if (optind >= argc || blockRecords < 1)
+   {
+      fprintf(stderr,"Usage: %s [-b records-per-block] <logfile>...\n",
+              argv[0]);
+      return 1;
+   }
+   for (; optind < argc; optind++)
+      if (indexFile(argv[optind]) != 0)
+      {
+         fprintf(stderr, "Error: cannot index %s\n", argv[optind]);
+         stat = 2;
+      }
+   return stat;
+}
@@ -0,0 +1,487 @@
+/**
+* @file dlogparse.c
+*
+* Parser for the records libdlog writes, for the offline log tools.
+* Lines are scanned with memchr(), which the C library implements with
+* vector instructions, to jump from one delimiter to the next rather
+* than looking at every character; values are not copied, they point
+* into the log text. The text, JSON and RFC 5424 syslog formats of
+* formatRecord() are understood, as is the old text format with
+* srcDir, srcIP, xferDuration=sec,usec and xferSuccess.
+*/
+
+#define _GNU_SOURCE  // for memmem()
+#include <string.h>
+#include <limits.h>
+#include "dlogparse.h"
+
+/** Structured data ID of the native syslog sink */
+#define SYSLOGSDID   "[dlog@32473 "
+
+/**
+* Find the start of the next line
+* @param pos is a position in the current line
+* @param end is the end of the text
+* @return the character after the newline, or end
+*/
+const char *dlogNextLine(const char *pos, const char *end)
+{
+   const char *nl = memchr(pos, '\n', end - pos);
+   return nl ? nl+1 : end;
+}
+
+/**
+* Convert a decimal number
+* @param str is the digits, not terminated
+* @param len is the number of characters
+* @return the value; conversion stops at the first non-digit
+*/
+static unsigned long parseNumber(const char *str, unsigned int len)
+{
+   unsigned long value = 0;
+   unsigned int i;
+   for (i=0; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+      value = value*10 + (str[i] - '0');
+   return value;
+}
+
+/**
+* Convert a decimal number with an optional sign and fraction, e.g.
+* 12.345; durations are negative if the clock was set back
+* @param str is the number, not terminated
+* @param len is the number of characters
+* @return the value
+*/
+static double parseDecimal(const char *str, unsigned int len)
+{
+   double value = 0, scale = 0.1;
+   unsigned int i = 0;
+   if (len > 0 && str[0] == '-')
+      return -parseDecimal(str+1, len-1);
+   for (; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+      value = value*10 + (str[i] - '0');
+   if (i < len && str[i] == '.')
+      for (i++; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+      {
+         value += (str[i] - '0') * scale;
+         scale /= 10;
+      }
+   return value;
+}
+
+/**
+* Check whether a value is the given constant
+*/
+static int textIs(const char *str, unsigned int len, const char *word)
+{
+   return len == strlen(word) && memcmp(str, word, len) == 0;
+}
+
+/**
+* Store one key/value pair in the record; unknown keys (custom
+* fields, progress rates) are ignored
+* @param rec is the record
+* @param key is the key, not terminated
+* @param keyLen is its length
+* @param val is the value, without quotes
+* @param valLen is its length
+* @return 1 if the key was the transfer size, else 0
+*/
+static int setField(struct dlogParsedRecord *rec, const char *key,
+                    unsigned int keyLen, const char *val,
+                    unsigned int valLen)
+{
+   static const struct { const char *key; int field; } strings[] =
+   {
+      {"app", DLOGP_APP}, {"name", DLOGP_NAME},
+      {"fileExt", DLOGP_FILEEXT}, {"sourceDir", DLOGP_SOURCEDIR},
+      {"srcDir", DLOGP_SOURCEDIR}, {"targetDir", DLOGP_TARGETDIR},
+      {"user", DLOGP_USER}, {"sourceIP", DLOGP_SOURCEIP},
+      {"srcIP", DLOGP_SOURCEIP}, {"targetIP", DLOGP_TARGETIP},
+      {"note", DLOGP_NOTE}, {0, 0}
+   };
+   const char *comma;
+   int i;
+
+   for (i=0; strings[i].key; i++)
+      if (textIs(key, keyLen, strings[i].key))
+      {
+         rec->text[strings[i].field].str = val;
+         rec->text[strings[i].field].len = valLen;
+         return 0;
+      }
+   if (textIs(key, keyLen, "size"))
+   {
+      rec->size = parseNumber(val, valLen);
+      return 1;
+   }
+   if (textIs(key, keyLen, "session"))
+      rec->session = parseNumber(val, valLen);
+   else if (textIs(key, keyLen, "startTime"))
+      rec->startTime = parseNumber(val, valLen);
+   else if (textIs(key, keyLen, "duration"))
+      rec->duration = parseDecimal(val, valLen);
+   else if (textIs(key, keyLen, "success") ||
+            textIs(key, keyLen, "xferSuccess"))
+      rec->success = textIs(val, valLen, "yes") ||
+                     textIs(val, valLen, "true");
+   else if (textIs(key, keyLen, "weight"))
+      rec->weight = parseNumber(val, valLen) ? parseNumber(val, valLen) : 1;
+   else if (textIs(key, keyLen, "xferDuration") &&
+            (comma = memchr(val, ',', valLen)) != NULL)
+      rec->duration = parseNumber(val, comma - val) * 1.0e3 +
+                      parseNumber(comma+1, valLen - (comma+1 - val)) / 1.0e3;
+   return 0;
+}
+
+/**
+* Set the transfer type from its name
+* @return DLOGPARSE_RECORD for SEND and RECEIVE, else DLOGPARSE_OTHER
+*/
+static int setType(struct dlogParsedRecord *rec, const char *str,
+                   unsigned int len)
+{
+   if (textIs(str, len, "SEND"))
+      rec->type = DLOG_SEND;
+   else if (textIs(str, len, "RECEIVE"))
+      rec->type = DLOG_RECEIVE;
+   else
+      return DLOGPARSE_OTHER;
+   return DLOGPARSE_RECORD;
+}
+
+/**
+* Find the closing quote of a quoted value, skipping backslash escapes
+* if the format has them
+* @return the closing quote, or NULL if the line ends first
+*/
+static const char *closingQuote(const char *pos, const char *end,
+                                char quote, int escapes)
+{
+   const char *q;
+   while ((q = memchr(pos, quote, end - pos)) != NULL)
+   {
+      const char *b = q;
+      if (!escapes)
+         return q;
+      while (b > pos && b[-1] == '\\')
+         b--;
+      if ((q - b) % 2 == 0)
+         return q; // not escaped
+      pos = q+1;
+   }
+   return NULL;
+}
+
+/**
+* Parse key='value', key="value" and key=number pairs, as in the text
+* and syslog formats
+* @param rec is the record
+* @param pos is the first pair
+* @param end is the end of the pairs
+* @param escapes is 1 if values have backslash escapes (syslog)
+* @return 1 if the size was seen, else 0
+*/
+static int parsePairs(struct dlogParsedRecord *rec, const char *pos,
+                      const char *end, int escapes)
+{
+   const char *key, *eq, *val, *stop;
+   int haveSize = 0;
+
+   while (pos < end)
+   {
+      while (pos < end && *pos == ' ')
+         pos++;
+      key = pos;
+      if (!(eq = memchr(pos, '=', end - pos)))
+         break;
+      val = eq+1;
+      if (val < end && (*val == '\'' || *val == '"'))
+      {
+         if (!(stop = closingQuote(val+1, end, *val, escapes)))
+            break;
+         haveSize |= setField(rec, key, eq - key, val+1, stop - val - 1);
+         pos = stop+1;
+      } else {
+         if (!(stop = memchr(val, ' ', end - val)))
+            stop = end;
+         haveSize |= setField(rec, key, eq - key, val, stop - val);
+         pos = stop;
+      }
+   }
+   return haveSize;
+}
+
+/**
+* Parse a JSON record: an object of string, number and boolean values
+* @return one of DLOGPARSE_*
+*/
+static int parseJSON(struct dlogParsedRecord *rec, const char *pos,
+                     const char *end)
+{
+   const char *key, *keyEnd, *val, *stop;
+   int haveSize = 0, result = DLOGPARSE_BAD;
+
+   while (end > pos && end[-1] != '}')
+      end--;
+   if (end == pos)
+      return DLOGPARSE_BAD;
+   end--; // the closing brace
+   pos++; // the opening brace
+   while (pos < end)
+   {
+      if (!(key = memchr(pos, '"', end - pos)))
+         break;
+      key++;
+      if (!(keyEnd = closingQuote(key, end, '"', 1)) ||
+          !(val = memchr(keyEnd, ':', end - keyEnd)))
+         break;
+      for (val++; val < end && *val == ' '; val++)
+         ;
+      if (val < end && *val == '"')
+      {
+         if (!(stop = closingQuote(val+1, end, '"', 1)))
+            break;
+         if (textIs(key, keyEnd - key, "type"))
+            result = setType(rec, val+1, stop - val - 1);
+         else
+            haveSize |= setField(rec, key, keyEnd - key, val+1,
+                                 stop - val - 1);
+         pos = stop+1;
+      } else {
+         for (stop = val; stop < end && *stop != ',' && *stop != '}';
+              stop++)
+            ;
+         haveSize |= setField(rec, key, keyEnd - key, val, stop - val);
+         pos = stop;
+      }
+   }
+   if (result == DLOGPARSE_RECORD && !haveSize)
+      return DLOGPARSE_BAD;
+   return result;
+}
+
+/**
+* Parse one line of a libdlog log
+* @param line is the start of the line
+* @param len is its length, without the newline
+* @param rec is filled in with the record
+* @return DLOGPARSE_RECORD for a transfer record, DLOGPARSE_OTHER for
+*         the other lines libdlog writes, DLOGPARSE_BAD otherwise
+*/
+int dlogParseRecord(const char *line, unsigned int len,
+                    struct dlogParsedRecord *rec)
+{
+   const char *end = line + len, *app, *type, *typeEnd, *sd;
+   int result;
+
+   memset(rec, 0, sizeof(struct dlogParsedRecord));
+   rec->weight = 1;
+   if (len > 0 && line[len-1] == '\r')
+      end--;
+   if (len == 0)
+      return DLOGPARSE_BAD;
+   if (line[0] == '{')
+      return parseJSON(rec, line, end);
+   if (line[0] == '<')
+   {
+      // RFC 5424: <pri>1 time host ident pid MSGID [dlog@32473 ...] msg
+      if (!(sd = memmem(line, len, SYSLOGSDID, sizeof(SYSLOGSDID)-1)))
+         return DLOGPARSE_BAD;
+      for (type = sd-1; type > line && type[-1] != ' '; type--)
+         ;
+      if ((result = setType(rec, type, sd-1 - type)) != DLOGPARSE_RECORD)
+         return result;
+      sd += sizeof(SYSLOGSDID)-1;
+      if (!(end = closingQuote(sd, end, ']', 1)))
+         return DLOGPARSE_BAD;
+      return parsePairs(rec, sd, end, 1) ? DLOGPARSE_RECORD : DLOGPARSE_BAD;
+   }
+   // text: app TYPE key='value' ...
+   app = line;
+   if (!(type = memchr(line, ' ', end - line)))
+      return DLOGPARSE_BAD;
+   rec->text[DLOGP_APP].str = app;
+   rec->text[DLOGP_APP].len = type - app;
+   type++;
+   if (!(typeEnd = memchr(type, ' ', end - type)))
+      typeEnd = end;
+   if ((result = setType(rec, type, typeEnd - type)) != DLOGPARSE_RECORD)
+      return result;
+   return parsePairs(rec, typeEnd, end, 0) ? DLOGPARSE_RECORD :
+                                             DLOGPARSE_BAD;
+}
+
+/**
+* Find the histogram bucket of a value: values below 16 have their own
+* bucket, above that each power-of-two range has 8 buckets, as in
+* libdlog's histogramBucket()
+* @param value is the value to place
+* @return the bucket index, < DLOG_HIST_BUCKETS
+*/
+unsigned int dlogHistBucket(unsigned long value)
+{
+   unsigned int exponent;
+   if (value < 16)
+      return (unsigned int) value;
+   exponent = 8*sizeof(unsigned long) - 1 - __builtin_clzl(value);
+   return (exponent - 3) * 8 + (unsigned int) (value >> (exponent - 3));
+}
+
+/**
+* Find the smallest value that falls into a histogram bucket
+* @param bucket is the bucket index
+* @return the lower bound of the bucket
+*/
+unsigned long dlogHistBucketStart(unsigned int bucket)
+{
+   unsigned int exponent;
+   if (bucket < 16)
+      return bucket;
+   exponent = bucket / 8 + 2;
+   return (unsigned long) (bucket % 8 + 8) << (exponent - 3);
+}
+
+/**
+* Add a value to a histogram (not thread safe)
+* @param hist is the histogram, zeroed to start with
+* @param value is the value to add
+* @param weight is the number of times to count it
+* @return nothing
+*/
+void dlogHistAdd(struct dlogHistogram *hist, unsigned long value,
+                 unsigned long weight)
+{
+   if (hist->count == 0 || value < hist->min)
+      hist->min = value;
+   if (value > hist->max)
+      hist->max = value;
+   hist->count += weight;
+   hist->sum += value * weight;
+   hist->buckets[dlogHistBucket(value)] += weight;
+}
+
+/**
+* Add the counts of one histogram to another
+* @param into is the histogram to add to
+* @param hist is the histogram to add
+* @return nothing
+*/
+void dlogHistMerge(struct dlogHistogram *into, struct dlogHistogram *hist)
+{
+   unsigned int i;
+   if (hist->count == 0)
+      return;
+   if (into->count == 0 || hist->min < into->min)
+      into->min = hist->min;
+   if (hist->max > into->max)
+      into->max = hist->max;
+   into->count += hist->count;
+   into->sum += hist->sum;
+   for (i=0; i < DLOG_HIST_BUCKETS; i++)
+      into->buckets[i] += hist->buckets[i];
+}
+
+/**
+* Find the value at a percentile of a histogram
+* @param hist is the histogram
+* @param percentile is 0.0 - 100.0
+* @return the lower bound of the bucket holding the percentile,
+*         clamped to min and max; 0 if the histogram is empty
+*/
+unsigned long dlogHistValueAt(struct dlogHistogram *hist,
+                              double percentile)
+{
+   unsigned long total=0, target, value;
+   unsigned int i;
+
+   if (hist->count == 0)
+      return 0;
+   target = (unsigned long) (hist->count * percentile / 100.0 + 0.5);
+   if (target < 1)
+      target = 1;
+   for (i=0; i < DLOG_HIST_BUCKETS-1; i++)
+   {
+      total += hist->buckets[i];
+      if (total >= target)
+         break;
+   }
+   value = dlogHistBucketStart(i);
+   if (value < hist->min)
+      value = hist->min;
+   if (value > hist->max)
+      value = hist->max;
+   return value;
+}
+
+/** Number of bits set per key in the Bloom filters */
+#define BLOOMHASHES  7
+
+/**
+* FNV-1a hash of a key, seeded with its kind so that the same string
+* as, e.g., a user and a host name sets different bits
+* @param kind is one of DLOGKEY_*
+* @param str is the key text
+* @param len is its length
+* @return the hash
+*/
+unsigned long dlogKeyHash(unsigned int kind, const char *str,
+                          unsigned int len)
+{
+   unsigned long hash = 14695981039346656037UL ^ kind;
+   unsigned int i;
+   for (i=0; i < len; i++)
+      hash = (hash ^ (unsigned char) str[i]) * 1099511628211UL;
+   // finish with a mix, so the high bits depend on every byte too
+   hash ^= hash >> 33;
+   hash *= 0xff51afd7ed558ccdUL;
+   hash ^= hash >> 33;
+   return hash;
+}
+
+/**
+* Hash the first DLOGINDEX_HEAD bytes of a log; if a log is rotated or
+* replaced, its head changes and its index is rebuilt
+* @param log is the log text
+* @param size is the log size
+* @return the hash
+*/
+unsigned long dlogLogHeadHash(const char *log, unsigned long size)
+{
+   return dlogKeyHash(0, log, size < DLOGINDEX_HEAD ? size : DLOGINDEX_HEAD);
+}
+
+/**
+* Add a key hash to a Bloom filter; the bit positions come from double
+* hashing the two halves of the hash
+* @param bloom is the filter
+* @param bytes is its size in bytes
+* @param hash is from dlogKeyHash()
+* @return nothing
+*/
+void dlogBloomAdd(unsigned char *bloom, unsigned int bytes,
+                  unsigned long hash)
+{
+   unsigned long bits = bytes * 8UL, h1 = hash, h2 = (hash >> 32) | 1;
+   int i;
+   for (i=0; i < BLOOMHASHES; i++, h1 += h2)
+      bloom[(h1 % bits) / 8] |= 1 << (h1 % 8);
+}
+
+/**
+* Test whether a key hash may be in a Bloom filter
+* @param bloom is the filter
+* @param bytes is its size in bytes
+* @param hash is from dlogKeyHash()
+* @return 0 if the key is certainly not in the filter, 1 if it may be
+*/
+int dlogBloomHas(const unsigned char *bloom, unsigned int bytes,
+                 unsigned long hash)
+{
+   unsigned long bits = bytes * 8UL, h1 = hash, h2 = (hash >> 32) | 1;
+   int i;
+   for (i=0; i < BLOOMHASHES; i++, h1 += h2)
+      if (!(bloom[(h1 % bits) / 8] & (1 << (h1 % 8))))
+         return 0;
+   return 1;
+}
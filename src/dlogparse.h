@@ -0,0 +1,118 @@
+/**
+* @file  dlogparse.h
+* Parser for libdlog log records, shared by the offline log tools
+*/
+
+#ifndef DLOGPARSE_H
+#define DLOGPARSE_H
+
+#include <libdlog.h>
+
+/* A field value: points into the log text and is not terminated;
+* quotes are removed, but JSON and syslog escapes are left as is
+*/
+struct dlogText
+{
+   const char *str;
+   unsigned int len;
+};
+
+/* String fields of a transfer record */
+#define DLOGP_APP 0
+#define DLOGP_NAME 1
+#define DLOGP_FILEEXT 2
+#define DLOGP_SOURCEDIR 3
+#define DLOGP_TARGETDIR 4
+#define DLOGP_USER 5
+#define DLOGP_SOURCEIP 6
+#define DLOGP_TARGETIP 7
+#define DLOGP_NOTE 8
+#define DLOGP_STRINGS 9
+
+/* A parsed transfer record; fields not in the line are empty or 0 */
+struct dlogParsedRecord
+{
+   unsigned int type;          /* DLOG_SEND or DLOG_RECEIVE */
+   struct dlogText text[DLOGP_STRINGS];
+   unsigned long size;
+   unsigned long session;
+   unsigned long startTime;    /* seconds since the epoch */
+   double duration;            /* milliseconds; < 0 if the clock went back */
+   unsigned int success;       /* 1 if the transfer succeeded */
+   unsigned int weight;        /* transfers this record stands for */
+};
+
+/* Results of dlogParseRecord */
+#define DLOGPARSE_RECORD 0     /* a transfer record */
+#define DLOGPARSE_OTHER 1      /* a SUMMARY, DROPPED, STATS, RING line */
+#define DLOGPARSE_BAD 2        /* not a libdlog record */
+
+/* parse one log line (without its newline) in any of the formats
+* libdlog writes: key='value' text, including the old format with
+* xferDuration, JSON, or an RFC 5424 syslog message; returns one of
+* DLOGPARSE_*
+*/
+int dlogParseRecord(const char *line, unsigned int len,
+                    struct dlogParsedRecord *rec);
+
+/* find the start of the line after pos, or end if there is none */
+const char *dlogNextLine(const char *pos, const char *end);
+
+/* histogram buckets with the same layout as libdlog's session
+* histograms, so dlogHistogram snapshots can be built offline
+*/
+unsigned int dlogHistBucket(unsigned long value);
+unsigned long dlogHistBucketStart(unsigned int bucket);
+void dlogHistAdd(struct dlogHistogram *hist, unsigned long value,
+                 unsigned long weight);
+void dlogHistMerge(struct dlogHistogram *into, struct dlogHistogram *hist);
+unsigned long dlogHistValueAt(struct dlogHistogram *hist,
+                              double percentile);
+
+/* Sidecar index of a log file (logfile.idx), written by dlogindex and
+* read by dlogquery: a header, then for each block of consecutive log
+* lines a dlogIndexBlock followed by its Bloom filter of bloomBytes
+*/
+#define DLOGINDEX_MAGIC "DLOGIDX1"
+#define DLOGINDEX_HEAD 4096    /* log bytes hashed to detect rotation */
+
+struct dlogIndexHeader
+{
+   char magic[8];
+   unsigned long logSize;      /* bytes of the log that are indexed */
+   unsigned long logHead;      /* hash of the first DLOGINDEX_HEAD bytes */
+   unsigned long blockCount;
+};
+
+struct dlogIndexBlock
+{
+   unsigned long offset;       /* of the first line in the log */
+   unsigned long length;       /* bytes of whole lines */
+   unsigned long minTime;      /* start times of the block's records */
+   unsigned long maxTime;
+   unsigned int records;       /* transfer records in the block */
+   unsigned int bloomBytes;    /* size of the Bloom filter after this */
+};
+
+/* Kinds of keys in the Bloom filters */
+#define DLOGKEY_USER 0
+#define DLOGKEY_SESSION 1
+#define DLOGKEY_SOURCEIP 2
+#define DLOGKEY_TARGETIP 3
+#define DLOGKEY_NAME 4
+#define DLOGKEY_KINDS 5
+
+/* hash a key of the given kind for the Bloom filters */
+unsigned long dlogKeyHash(unsigned int kind, const char *str,
+                          unsigned int len);
+
+/* hash of the start of a log, to tell if an index still matches it */
+unsigned long dlogLogHeadHash(const char *log, unsigned long size);
+
+/* set or test a key hash in a Bloom filter of the given size */
+void dlogBloomAdd(unsigned char *bloom, unsigned int bytes,
+                  unsigned long hash);
+int dlogBloomHas(const unsigned char *bloom, unsigned int bytes,
+                 unsigned long hash);
+
+#endif        //  #ifndef DLOGPARSE_H
@@ -0,0 +1,286 @@
+/**
+* @file dlogquery.c
+*
+* Print the transfer records of libdlog logs that match a query. If a
+* log has an index from dlogindex, only the blocks whose time range
+* overlaps the query and whose Bloom filters may hold all of the
+* queried user, session, IPs and name are read; the rest of the log,
+* written after it was indexed, is scanned in full. The predicates on
+* size, duration and success are checked on each record read.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "dlogparse.h"
+
+/** A query; an empty text or a zero limit is not part of it */
+struct query
+{
+   struct dlogText keys[DLOGKEY_KINDS];   // session is text too
+   unsigned long session;
+   unsigned long keyHash[DLOGKEY_KINDS];
+   unsigned long after, before;           // start time, seconds
+   unsigned long minSize, maxSize;
+   double minDuration, maxDuration;       // milliseconds
+   int success;                           // -1 if either
+};
+
+static struct query query;
+static unsigned long blocksRead, blocksTotal, matches;
+
+/** String field of a record that each key kind is matched against */
+static const int keyField[DLOGKEY_KINDS] =
+   { DLOGP_USER, -1, DLOGP_SOURCEIP, DLOGP_TARGETIP, DLOGP_NAME };
+
+/**
+* Compare a record field with a query key
+* @param field is the record's value
+* @param key is the query's value
+* @return 1 if they are equal, else 0
+*/
+static int textEquals(struct dlogText *field, struct dlogText *key)
+{
+   return field->len == key->len &&
+          memcmp(field->str, key->str, key->len) == 0;
+}
+
+/**
+* Check a parsed record against the query
+* @param rec is the record
+* @return 1 if it matches, else 0
+*/
+static int recordMatches(struct dlogParsedRecord *rec)
+{
+   int k;
+
+   for (k=0; k < DLOGKEY_KINDS; k++)
+   {
+      if (!query.keys[k].str)
+         continue;
+      if (k == DLOGKEY_SESSION ? rec->session != query.session :
+          !textEquals(&rec->text[keyField[k]], &query.keys[k]))
+         return 0;
+   }
+   if ((query.after && rec->startTime < query.after) ||
+       (query.before && rec->startTime >= query.before) ||
+       (query.minSize && rec->size < query.minSize) ||
+       (query.maxSize && rec->size > query.maxSize) ||
+       (query.minDuration > 0 && rec->duration < query.minDuration) ||
+       (query.maxDuration > 0 && rec->duration > query.maxDuration) ||
+       (query.success >= 0 && rec->success != (unsigned int) query.success))
+      return 0;
+   return 1;
+}
+
+/**
+* Check whether an index block can hold matching records
+* @param block is the block entry
+* @param bloom is its Bloom filter
+* @return 1 if the block must be read, 0 if it can be skipped
+*/
+static int blockMayMatch(struct dlogIndexBlock *block,
+                         const unsigned char *bloom)
+{
+   int k;
+
+   if (block->records == 0)
+      return 0;
+   if ((query.after && block->maxTime < query.after) ||
+       (query.before && block->minTime >= query.before))
+      return 0;
+   for (k=0; k < DLOGKEY_KINDS; k++)
+      if (query.keys[k].str &&
+          !dlogBloomHas(bloom, block->bloomBytes, query.keyHash[k]))
+         return 0;
+   return 1;
+}
+
+/**
+* Print the matching records of a part of a log
+* @param pos is the start of the part, at a line start
+* @param end is its end
+* @return nothing
+*/
+static void scanLines(const char *pos, const char *end)
+{
+   struct dlogParsedRecord rec;
+   const char *next;
+   unsigned int len;
+
+   for (; pos < end; pos = next)
+   {
+      next = dlogNextLine(pos, end);
+      len = next - pos - (next[-1] == '\n');
+      if (len > 0 && dlogParseRecord(pos, len, &rec) == DLOGPARSE_RECORD &&
+          recordMatches(&rec))
+      {
+         fwrite(pos, len, 1, stdout);
+         putchar('\n');
+         matches++;
+      }
+   }
+}
+
+/**
+* Read the index of a log and scan its candidate blocks
+* @param idxname is the index file name
+* @param log is the mapped log
+* @param size is the log size
+* @return the number of log bytes covered by the index, 0 if there is
+*         no usable index
+*/
+static unsigned long scanIndexed(const char *idxname, const char *log,
+                                 unsigned long size)
+{
+   struct dlogIndexHeader header;
+   struct dlogIndexBlock block;
+   unsigned char *bloom = 0;
+   unsigned int bloomSize = 0;
+   unsigned long b, covered = 0;
+   FILE *idx;
+
+   if (!(idx = fopen(idxname, "r")))
+      return 0;
+   if (fread(&header, sizeof(header), 1, idx) != 1 ||
+       memcmp(header.magic, DLOGINDEX_MAGIC, 8) != 0 ||
+       header.logSize > size ||
+       header.logHead != dlogLogHeadHash(log, header.logSize))
+   {
+      fprintf(stderr, "Warning: %s is stale, run dlogindex\n", idxname);
+      fclose(idx);
+      return 0;
+   }
+   for (b=0; b < header.blockCount; b++)
+   {
+      if (fread(&block, sizeof(block), 1, idx) != 1 ||
+          block.offset != covered || block.offset + block.length > size)
+         break;
+      if (block.bloomBytes > bloomSize)
+      {
+         free(bloom);
+         bloomSize = block.bloomBytes;
+         if (!(bloom = (unsigned char *) malloc(bloomSize)))
+            break;
+      }
+      if (fread(bloom, block.bloomBytes, 1, idx) != 1)
+         break;
+      blocksTotal++;
+      if (blockMayMatch(&block, bloom))
+      {
+         blocksRead++;
+         scanLines(log + block.offset, log + block.offset + block.length);
+      }
+      covered = block.offset + block.length;
+   }
+   if (b < header.blockCount)
+      fprintf(stderr, "Warning: %s is damaged, run dlogindex\n", idxname);
+   free(bloom);
+   fclose(idx);
+   return covered;
+}
+
+/**
+* Query one log file, through its index if it has one
+* @param filename is the log
+* @return 0 on success, 1 if the log cannot be read
+*/
+static int queryFile(const char *filename)
+{
+   char idxname[1024];
+   unsigned long covered;
+   struct stat st;
+   char *log;
+   int fd;
+
+   if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+      return 1;
+   if (st.st_size == 0)
+   {
+      close(fd);
+      return 0;
+   }
+   log = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (log == MAP_FAILED)
+      return 1;
+   madvise(log, st.st_size, MADV_RANDOM);
+   snprintf(idxname, sizeof(idxname), "%s.idx", filename);
+   covered = scanIndexed(idxname, log, st.st_size);
+   scanLines(log + covered, log + st.st_size);
+   munmap(log, st.st_size);
+   return 0;
+}
+
+/**
+* Set a key of the query
+* @param kind is one of DLOGKEY_*
+* @param value is the key from the command line
+* @return nothing
+*/
+static void setKey(int kind, const char *value)
+{
+   query.keys[kind].str = value;
+   query.keys[kind].len = strlen(value);
+   if (kind == DLOGKEY_SESSION)
+   {
+      query.session = strtoul(value, 0, 10);
+      query.keyHash[kind] = dlogKeyHash(kind, (char *) &query.session,
+                                        sizeof(query.session));
+   }
+   else
+      query.keyHash[kind] = dlogKeyHash(kind, value, query.keys[kind].len);
+}
+
+//
+// Main: parse the query and run it on every log given
+//
+int main(int argc, char* argv[])
+{
+   int opt, stat = 0;
+
+   query.success = -1;
+   while ((opt = getopt(argc, argv, "u:s:S:T:n:a:b:m:M:d:D:x:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'u': setKey(DLOGKEY_USER, optarg); break;
+         case 's': setKey(DLOGKEY_SESSION, optarg); break;
+         case 'S': setKey(DLOGKEY_SOURCEIP, optarg); break;
+         case 'T': setKey(DLOGKEY_TARGETIP, optarg); break;
+         case 'n': setKey(DLOGKEY_NAME, optarg); break;
+         case 'a': query.after = strtoul(optarg, 0, 10); break;
+         case 'b': query.before = strtoul(optarg, 0, 10); break;
+         case 'm': query.minSize = strtoul(optarg, 0, 10); break;
+         case 'M': query.maxSize = strtoul(optarg, 0, 10); break;
+         case 'd': query.minDuration = atof(optarg); break;
+         case 'D': query.maxDuration = atof(optarg); break;
+         case 'x': query.success = (strcmp(optarg, "yes") == 0); break;
+         default: optind = argc+1; break;
+      }
+   }
+   if (optind >= argc)
+   {
+      fprintf(stderr,"Usage: %s [-u user] [-s session] [-S source-IP] "
+              "[-T target-IP] [-n name]\n   [-a after-time] "
+              "[-b before-time] [-m min-size] [-M max-size]\n"
+              "   [-d min-duration-ms] [-D max-duration-ms] [-x yes|no] "
+              "<logfile>...\n", argv[0]);
+      return 1;
+   }
+   for (; optind < argc; optind++)
+      if (queryFile(argv[optind]) != 0)
+      {
+         fprintf(stderr, "Error: cannot read %s\n", argv[optind]);
+         stat = 2;
+      }
+   fflush(stdout);
+   fprintf(stderr, "%lu matches; read %lu of %lu indexed blocks\n",
+           matches, blocksRead, blocksTotal);
+   return stat;
+}
@@ -0,0 +1,463 @@
+/**
+* @file dlogvalidate.c
+*
+* Check a libdlog log against the manifest of the load generator that
+* produced it. Each generated transfer carries a record number in one
+* of its fields (e.g. the user), and the manifest gives the ranges of
+* numbers that were generated, the application name and the time
+* window of the run. The log is read as a stream, text or columnar,
+* and each number is checked off in a bitmap per range, one bit per
+* record, so a billion records need 125MB. Reported are malformed lines,
+* numbers outside the ranges, duplicates, records that never showed up,
+* and start times or durations outside the window of the run.
+*
+* Manifest lines are "keyword value", '#' starts a comment:
+*   app <name>            records of other applications are ignored
+*   idfield <field>       user (default), note, name, ..., or session;
+*                         the number is the last digits in the field
+*   range <first> <count> numbers first .. first+count-1; repeatable
+*   starttime <seconds>   no transfer started before this epoch time
+*   endtime <seconds>     all transfers had ended at this epoch time
+*   maxduration <ms>      longest possible transfer
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "dlogparse.h"
+#include "dlogcolumns.h"
+
+#define MAXRANGES    4096    //!< Most ranges in a manifest
+#define IDSESSION    (-1)    //!< idField value for the session ID
+
+/** A range of record numbers, with one bit per number seen */
+struct idRange
+{
+   unsigned long first;
+   unsigned long count;
+   unsigned long *seen;
+};
+
+/** The manifest */
+static char app[256];
+static int idField = DLOGP_USER;
+static struct idRange ranges[MAXRANGES];
+static unsigned int numRanges;
+static unsigned long startTime, endTime;
+static double maxDuration;
+
+/** What was found */
+static unsigned long records, otherLines, otherApps, malformed, unexpected,
+                     duplicates, missing, early, late, badDuration;
+static unsigned long reportLimit = 10;
+
+/**
+* Print one problem, unless too many of its kind were printed already
+* @param count is the number of problems of this kind so far
+* @param where is the file being read
+* @param line is the line or row number
+* @param what describes the problem
+* @param id is the record number, or ~0 if none
+* @return nothing
+*/
+static void report(unsigned long count, const char *where,
+                   unsigned long line, const char *what, unsigned long id)
+{
+   if (count > reportLimit)
+      return;
+   if (id == ~0UL)
+      printf("%s:%lu: %s\n", where, line, what);
+   else
+      printf("%s:%lu: record %lu %s\n", where, line, id, what);
+   if (count == reportLimit)
+      printf("(only the first %lu are listed)\n", reportLimit);
+}
+
+/**
+* Find the range of a record number
+* @param id is the number
+* @return the range, or null if no range has it
+*/
+static struct idRange *findRange(unsigned long id)
+{
+   unsigned int lo = 0, hi = numRanges, mid;
+
+   while (lo < hi)
+   {
+      mid = (lo + hi) / 2;
+      if (id < ranges[mid].first)
+         hi = mid;
+      else if (id - ranges[mid].first >= ranges[mid].count)
+         lo = mid + 1;
+      else
+         return &ranges[mid];
+   }
+   return 0;
+}
+
+/**
+* Get the record number of a record: the last run of digits in the
+* ID field, or the session ID
+* @param rec is the record
+* @param id is set to the number
+* @return 0 on success, 1 if the field has no number
+*/
+static int recordNumber(struct dlogParsedRecord *rec, unsigned long *id)
+{
+   const char *str, *digits;
+   unsigned int len;
+
+   if (idField == IDSESSION)
+   {
+      *id = rec->session;
+      return 0;
+   }
+   str = rec->text[idField].str;
+   len = rec->text[idField].len;
+   while (len > 0 && (str[len-1] < '0' || str[len-1] > '9'))
+      len--;
+   if (len == 0)
+      return 1;
+   for (digits = str + len; digits > str && digits[-1] >= '0' &&
+        digits[-1] <= '9'; digits--)
+      ;
+   for (*id = 0; digits < str + len; digits++)
+      *id = *id * 10 + (*digits - '0');
+   return 0;
+}
+
+/**
+* Check one transfer record against the manifest
+* @param rec is the record
+* @param where is the file being read
+* @param line is the line or row number
+* @return nothing
+*/
+static void checkRecord(struct dlogParsedRecord *rec, const char *where,
+                        unsigned long line)
+{
+   struct idRange *range;
+   unsigned long id, bit;
+
+   if (app[0] && (rec->text[DLOGP_APP].len != strlen(app) ||
+       memcmp(rec->text[DLOGP_APP].str, app, strlen(app)) != 0))
+   {
+      otherApps++;
+      return;
+   }
+   records++;
+   if (recordNumber(rec, &id) != 0)
+   {
+      report(++malformed, where, line, "malformed", ~0UL);
+      return;
+   }
+   if (!(range = findRange(id)))
+   {
+      report(++unexpected, where, line, "unexpected", id);
+      return;
+   }
+   bit = id - range->first;
+   if (range->seen[bit / 64] & (1UL << (bit % 64)))
+      report(++duplicates, where, line, "duplicate", id);
+   range->seen[bit / 64] |= 1UL << (bit % 64);
+
+   // start times are whole seconds; durations are rounded to 1us
+   if (startTime && rec->startTime < startTime)
+      report(++early, where, line, "started early", id);
+   if (endTime && rec->startTime * 1.0e3 + rec->duration >
+                  (endTime + 1) * 1.0e3)
+      report(++late, where, line, "ended late", id);
+   if (rec->duration < 0 || (maxDuration > 0 &&
+                             rec->duration > maxDuration + 0.001))
+      report(++badDuration, where, line, "has a bad duration", id);
+}
+
+/**
+* Check a text log, one line at a time
+* @param in is the log
+* @param where is its name
+* @return nothing
+*/
+static void checkText(FILE *in, const char *where)
+{
+   struct dlogParsedRecord rec;
+   unsigned long line = 0;
+   char *buf = 0;
+   size_t size = 0;
+   ssize_t len;
+
+   while ((len = getline(&buf, &size, in)) > 0)
+   {
+      line++;
+      if (buf[len-1] == '\n')
+         len--;
+      switch (dlogParseRecord(buf, len, &rec))
+      {
+         case DLOGPARSE_RECORD:
+            checkRecord(&rec, where, line);
+            break;
+         case DLOGPARSE_OTHER:
+            otherLines++;
+            break;
+         default:
+            report(++malformed, where, line, "malformed", ~0UL);
+            break;
+      }
+   }
+   free(buf);
+}
+
+/**
+* Check a columnar log, one row group at a time
+* @param data is the mapped file
+* @param size is its size
+* @param where is its name
+* @return 0 on success, 1 if the file is damaged
+*/
+static int checkColumns(const unsigned char *data, unsigned long size,
+                        const char *where)
+{
+   static const int needed[] = { DLOGCOL_APP, DLOGCOL_SESSION,
+      DLOGCOL_STARTTIME, DLOGCOL_DURATION, -1 };
+   struct dlogColumnData col[DLOGCOL_COLUMNS];
+   struct dlogColumnGroup group;
+   struct dlogParsedRecord rec;
+   unsigned long pos, r, row = 0;
+   int i, c, stat = 0;
+
+   memset(col, 0, sizeof(col));
+   memset(&rec, 0, sizeof(rec));
+   for (pos = 0; pos < size && stat == 0; pos += group.bytes)
+   {
+      if (dlogColumnReadGroup(data + pos, size - pos, &group) != 0)
+         return 1;
+      for (i=0; needed[i] >= 0 && stat == 0; i++)
+         stat = dlogColumnDecode(data + pos, &group, needed[i],
+                                 &col[needed[i]]);
+      if (stat == 0 && idField != IDSESSION && !col[idField].values)
+         stat = dlogColumnDecode(data + pos, &group, idField,
+                                 &col[idField]);
+      for (r=0; r < group.rows && stat == 0; r++)
+      {
+         // the string columns are in the parser's order
+         for (c=0; c < DLOGCOL_STRINGS; c++)
+            if (col[c].dict)
+            {
+               rec.text[c].str = col[c].dict[col[c].values[r]].str;
+               rec.text[c].len = col[c].dict[col[c].values[r]].len;
+            }
+         rec.session = col[DLOGCOL_SESSION].values[r];
+         rec.startTime = col[DLOGCOL_STARTTIME].values[r];
+         rec.duration = col[DLOGCOL_DURATION].values[r] / 1.0e3;
+         checkRecord(&rec, where, ++row);
+      }
+      for (c=0; c < DLOGCOL_COLUMNS; c++)
+         dlogColumnDataFree(&col[c]);
+   }
+   return stat;
+}
+
+/**
+* Check one log file, text or columnar; "-" is standard input
+* @param filename is the log
+* @return 0 on success, 1 if it cannot be read, 2 if it is damaged
+*/
+static int checkFile(const char *filename)
+{
+   unsigned char *data;
+   char magic[4];
+   struct stat st;
+   FILE *in;
+   int stat = 0;
+
+   if (strcmp(filename, "-") == 0)
+   {
+      checkText(stdin, "stdin");
+      return 0;
+   }
+   if (!(in = fopen(filename, "r")))
+      return 1;
+   if (fread(magic, 1, 4, in) == 4 && memcmp(magic, DLOGCOL_MAGIC, 4) == 0 &&
+       fstat(fileno(in), &st) == 0)
+   {
+      data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+      fclose(in);
+      if (data == MAP_FAILED)
+         return 1;
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      stat = checkColumns(data, st.st_size, filename) ? 2 : 0;
+      munmap(data, st.st_size);
+      return stat;
+   }
+   rewind(in);
+   checkText(in, filename);
+   fclose(in);
+   return 0;
+}
+
+/**
+* Sort ranges by their first number
+*/
+static int compareRanges(const void *a, const void *b)
+{
+   unsigned long x = ((const struct idRange *) a)->first;
+   unsigned long y = ((const struct idRange *) b)->first;
+   return (x > y) - (x < y);
+}
+
+/**
+* Read the manifest and allocate the bitmaps
+* @param filename is the manifest
+* @return 0 on success, 1 if it cannot be read or is invalid
+*/
+static int readManifest(const char *filename)
+{
+   char line[1024], key[64], value[512];
+   unsigned long first, count;
+   unsigned int i;
+   FILE *in;
+   int c;
+
+   if (!(in = fopen(filename, "r")))
+      return 1;
+   while (fgets(line, sizeof(line), in))
+   {
+      if (sscanf(line, "%63s %511s", key, value) < 1 || key[0] == '#')
+         continue;
+      if (!strcmp(key, "app"))
+         snprintf(app, sizeof(app), "%.255s", value);
+      else if (!strcmp(key, "idfield"))
+      {
+         for (c=0; c < DLOGCOL_STRINGS; c++)
+            if (!strcmp(value, dlogColumnNames[c]))
+               break;
+         idField = (c < DLOGCOL_STRINGS) ? c : IDSESSION;
+         if (c == DLOGCOL_STRINGS && strcmp(value, "session"))
+            break;
+      }
+      else if (!strcmp(key, "range") && numRanges < MAXRANGES &&
+               sscanf(line, "%*s %lu %lu", &first, &count) == 2)
+      {
+         ranges[numRanges].first = first;
+         ranges[numRanges++].count = count;
+      }
+      else if (!strcmp(key, "starttime"))
+         startTime = strtoul(value, 0, 10);
+      else if (!strcmp(key, "endtime"))
+         endTime = strtoul(value, 0, 10);
+      else if (!strcmp(key, "maxduration"))
+         maxDuration = atof(value);
+      else
+         break;
+   }
+   c = !feof(in);
+   fclose(in);
+   if (c)
+   {
+      fprintf(stderr, "Error: bad manifest line: %s", line);
+      return 1;
+   }
+   qsort(ranges, numRanges, sizeof(struct idRange), compareRanges);
+   for (i=0; i < numRanges; i++)
+   {
+      if (i > 0 && ranges[i].first - ranges[i-1].first < ranges[i-1].count)
+      {
+         fprintf(stderr, "Error: manifest ranges overlap\n");
+         return 1;
+      }
+      if (!(ranges[i].seen = (unsigned long *)
+            calloc(ranges[i].count / 64 + 1, sizeof(unsigned long))))
+      {
+         fprintf(stderr, "Error: no memory for %lu records\n",
+                 ranges[i].count);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/**
+* List the records of the manifest that were not seen
+* @return nothing
+*/
+static void findMissing()
+{
+   unsigned long w, b, words;
+   unsigned int i;
+
+   for (i=0; i < numRanges; i++)
+   {
+      words = (ranges[i].count + 63) / 64;
+      for (w=0; w < words; w++)
+      {
+         if (ranges[i].seen[w] == ~0UL)
+            continue;
+         for (b = w*64; b < (w+1)*64 && b < ranges[i].count; b++)
+            if (!(ranges[i].seen[w] & (1UL << (b % 64))) &&
+                ++missing <= reportLimit)
+               printf("record %lu not found\n", ranges[i].first + b);
+      }
+   }
+   if (missing > reportLimit)
+      printf("(%lu more records not found)\n", missing - reportLimit);
+}
+
+//
+// Main: read the manifest, check the logs, and report
+//
+int main(int argc, char* argv[])
+{
+   unsigned long expected = 0;
+   unsigned int i;
+   int opt, stat = 0;
+
+   while ((opt = getopt(argc, argv, "l:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'l': reportLimit = strtoul(optarg, 0, 10); break;
+         default: optind = argc+1; break;
+      }
+   }
+   if (optind >= argc-1)
+   {
+      fprintf(stderr,"Usage: %s [-l max-listed] <manifest> <logfile|->...\n",
+              argv[0]);
+      return 1;
+   }
+   if (readManifest(argv[optind]) != 0)
+   {
+      fprintf(stderr, "Error: cannot read manifest %s\n", argv[optind]);
+      return 1;
+   }
+   for (optind++; optind < argc; optind++)
+      if (checkFile(argv[optind]) != 0)
+      {
+         fprintf(stderr, "Error: cannot read %s\n", argv[optind]);
+         stat = 2;
+      }
+   findMissing();
+   for (i=0; i < numRanges; i++)
+   {
+      expected += ranges[i].count;
+      free(ranges[i].seen);
+   }
+
+   printf("expected %lu records, found %lu (%lu other lines, "
+          "%lu of other applications)\n", expected, records, otherLines,
+          otherApps);
+   printf("missing %lu, duplicate %lu, unexpected %lu, malformed %lu\n",
+          missing, duplicates, unexpected, malformed);
+   printf("started early %lu, ended late %lu, bad duration %lu\n",
+          early, late, badDuration);
+   if (stat == 0 && (missing || duplicates || unexpected || malformed ||
+                     early || late || badDuration))
+      stat = 3;
+   printf("%s\n", stat == 0 ? "log is valid" : "log is NOT valid");
+   return stat;
+}
@@ -14,6 +14,24 @@ unsigned int dlogInit(char * applicationName);
 /* call dlogFinalize once, after all transfers are completed */
 unsigned int dlogFinalize();
 
+/* call dlogFlush to write the records of ended transfers now rather
+* than when a batch is complete; returns 0 on success
+*/
+unsigned int dlogFlush();
+
+/* call dlogReloadConfig to re-read the config file without restarting,
+* e.g. when the application handles SIGHUP; transfers already begun
+* keep their configuration; returns 0 on success, nonzero if the file
+* cannot be read or is invalid (the configuration is then unchanged)
+*/
+unsigned int dlogReloadConfig();
+
+/* call dlogRunDaemon after dlogInit to serve as the dlogd daemon that
+* LoggingLocation = daemon and shm clients send their records to;
+* returns on SIGTERM/SIGINT (0), or nonzero if it cannot be started
+*/
+unsigned int dlogRunDaemon();
+
 /* call dlogBeginTransfer before an individual file transfer is started,
 * with the transfer information in the arguments; the return value is
 * the unique transfer ID, 0 if error; thread safe; xferFlag is DLOG_SEND 
@@ -35,8 +53,151 @@ unsigned int dlogEndTransfer(unsigned long transferID,
                              unsigned long fileSize,
                              unsigned int transferError);
 
+/* Per-file information for the batch begin call */
+struct dlogFileInfo
+{
+   char *filename;          /* full path of the file, non-null */
+   unsigned long fileSize;  /* 0 if not known until the end */
+   char *targetPath;        /* destination path, non-null */
+   char *annotation;        /* comment string (<128ch), may be null */
+};
+
+/* call dlogBeginTransferBatch instead of dlogBeginTransfer for each of
+* a group of files (e.g., a directory) that share user, hosts and
+* transfer type; one transfer ID per file is stored in transferIDs,
+* and they can be ended individually or with dlogEndTransferBatch;
+* returns 0 on success, nonzero if error
+*/
+unsigned int dlogBeginTransferBatch(struct dlogFileInfo *files,
+         unsigned int count, unsigned long logUserID, char* srcHostName,
+         char* targetHostName, unsigned int xferType,
+         unsigned long *transferIDs);
+
+/* call dlogEndTransferBatch to end a group of transfers at once;
+* fileSizes and transferErrors may be null (sizes from begin, no
+* errors); returns the number of transfer IDs not found, 0 if all ok
+*/
+unsigned int dlogEndTransferBatch(unsigned long *transferIDs,
+         unsigned long *fileSizes, unsigned int *transferErrors,
+         unsigned int count);
+
+/* call dlogUpdateTransfer any number of times during a transfer to
+* report the total bytes moved so far; lock-free and cheap. With
+* LogProgress enabled, min/avg/max rates and a stalled flag are logged
+* at dlogEndTransfer; returns 0 on success, 1 if the transfer is not
+* being tracked
+*/
+unsigned int dlogUpdateTransfer(unsigned long transferID,
+                                unsigned long bytesSoFar);
+
+/* call dlogSetTimeSource to replace the clock used for transfer
+* times (gettimeofday) with timeSource, e.g. for simulated time in a
+* load generator; it is called in the API caller's thread; null
+* restores gettimeofday
+*/
+struct timeval;
+void dlogSetTimeSource(void (*timeSource)(struct timeval *now));
+
+/* Custom field value types for dlogSetField */
+#define DLOG_FIELD_INT 0      /* value is a long */
+#define DLOG_FIELD_DOUBLE 1   /* value is a double */
+#define DLOG_FIELD_STRING 2   /* value is a char*, copied (<256ch) */
+
+/* call dlogRegisterField once per custom field name (letters, digits,
+* '_', '-', '.'); registering a name again returns the same key;
+* returns the key, 0 if the name is invalid or there are too many keys
+*/
+unsigned int dlogRegisterField(char *keyName);
+
+/* call dlogSetField between begin and end of a transfer to attach a
+* typed custom field to its log record, e.g.
+* dlogSetField(id, key, DLOG_FIELD_INT, (long) retries); setting a key
+* again replaces the value; returns 0 on success, 1 if the transfer is
+* not active, 2 if the record has no room left, 3 if key/type invalid
+*/
+unsigned int dlogSetField(unsigned long transferID, unsigned int key,
+                          unsigned int type, ...);
+
 #define DLOG_SEND 0
 #define DLOG_RECEIVE 1
+#define DLOG_ANY 2      /* histogram queries: all transfer types */
+
+/* Histogram metrics: transfer size in bytes, duration in microseconds,
+* throughput in bytes/second
+*/
+#define DLOG_HIST_SIZE 0
+#define DLOG_HIST_DURATION 1
+#define DLOG_HIST_THROUGHPUT 2
+#define DLOG_HIST_METRICS 3
+
+#define DLOG_HIST_BUCKETS 496
+
+/* Log-linear (HDR style) histogram: values below 16 have their own
+* bucket, above that each power-of-two range has 8 buckets
+*/
+struct dlogHistogram
+{
+   unsigned long count;
+   unsigned long min;
+   unsigned long max;
+   unsigned long sum;
+   unsigned long buckets[DLOG_HIST_BUCKETS];
+};
+
+/* call dlogGetHistogram to get a snapshot of a session histogram of
+* completed transfers (LogHistograms must be enabled); metric is one of
+* DLOG_HIST_*, xferType is DLOG_SEND, DLOG_RECEIVE or DLOG_ANY; returns
+* 0 on success, nonzero if histograms are off or arguments are invalid
+*/
+unsigned int dlogGetHistogram(unsigned int metric, unsigned int xferType,
+                              struct dlogHistogram *histogram);
+
+/* call dlogHistogramPercentile to find the value at a percentile
+* (0.0-100.0) of a histogram snapshot, to within bucket precision
+*/
+unsigned long dlogHistogramPercentile(struct dlogHistogram *histogram,
+                                      double percentile);
+
+/* Self-metrics timers, histograms of nanoseconds: one write of the
+* queued records, a contended wait for the record-list lock or the
+* log-writing lock (uncontended locks are not timed), one MD5 hash and
+* one host name lookup
+*/
+#define DLOG_STAT_WRITE 0
+#define DLOG_STAT_GENERALWAIT 1
+#define DLOG_STAT_LOGFILEWAIT 2
+#define DLOG_STAT_MD5 3
+#define DLOG_STAT_DNS 4
+#define DLOG_STAT_TIMERS 5
+
+/* What libdlog itself has done since dlogInit */
+struct dlogStats
+{
+   unsigned long begun;        /* transfers begun and logged */
+   unsigned long ended;        /* transfers ended */
+   unsigned long timedOut;     /* of which by LogTransferTimeout */
+   unsigned long refused;      /* not logged: LogMaxOpenTransfers or
+                                  LogMemoryBudget reached */
+   unsigned long stripped;     /* logged without their strings, in the
+                                  last eighth of LogMemoryBudget */
+   unsigned long written;      /* records written to the log */
+   unsigned long dropped;      /* records dropped, queue full */
+   unsigned long spilled;      /* records moved to spill files */
+   unsigned long active;       /* transfers active now */
+   unsigned long queued;       /* ended records waiting to be written */
+   unsigned long flushes;      /* writes of the queued records */
+   unsigned long bytesWritten; /* bytes of log lines written */
+   unsigned long memoryUsed;   /* bytes libdlog holds (records, strings,
+                                  tables, row group) */
+   unsigned long memoryBudget; /* LogMemoryBudget in bytes, 0 if none */
+   struct dlogHistogram timers[DLOG_STAT_TIMERS];
+};
+
+/* call dlogGetStats to get a snapshot of libdlog's own counters and
+* timers, e.g. to export them to a monitoring system; returns 0 on
+* success, 1 if libdlog is not initialized
+*/
+unsigned int dlogGetStats(struct dlogStats *stats);
 
 #endif        //  #ifndef LIBDLOG_H
 
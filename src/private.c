@@ -11,6 +11,12 @@
 * @version 0.9c
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // for sendmmsg()
+#endif
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 #include <stdio.h>	 
 #include <string.h>	
 #include <errno.h>	
@@ -25,7 +31,28 @@
 #include <syslog.h> 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <stdarg.h>
+#include <math.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <libdlog.h>
+#include "dlogcolumns.h"
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 #define MAXLOGTOFILE   2048  //!< Maximum size of log entry
 #define MAXFILEPATH     512  //!< Maximum size of filename
@@ -33,6 +60,31 @@
 #define MAXDIGEST        32  //!< Maximum size of MD5 digest
 #define MAXUSER          32  //!< Maximum size of username
 #define MAXANNOTATION   128  //!< Maximum annotation size
+#define MAXFIELDKEYS     64  //!< Maximum number of custom field keys
+#define MAXFIELDKEY      32  //!< Maximum size of a custom field key name
+#define MAXFIELDVALUE   255  //!< Maximum size of a string field value
+#define MAXFIELDARENA   320  //!< Space for custom fields in a record,
+                             //!< at least one string of MAXFIELDVALUE
+
+/**
+* USDT static tracepoint in the "dlog" provider, for perf, bpftrace or
+* SystemTap: a single nop until a tracer attaches, and nothing at all
+* if sys/sdt.h was not found by configure. The arguments must be
+* integers or pointers without side effects, and should be cheap to
+* compute, since they are evaluated even when no tracer is attached.
+* The probes are:
+*  - begin_entry(filename, size, xferType), begin_return(id, size)
+*  - end(id, size, error, duration in us), also for batch ends
+*  - flush_start(queued records), flush_done(written, bytes, ns)
+*  - file_lock(fd, ns to open and lock the log file)
+*  - dns_lookup(name, ip string, ns)
+*/
+#ifdef HAVE_SYS_SDT_H
+#define DLOGPROBE(name, ...)  STAP_PROBEV(dlog, name, __VA_ARGS__)
+#else
+static inline void noProbe(int unused, ...) { }
+#define DLOGPROBE(name, ...)  do { if (0) noProbe(0, __VA_ARGS__); } while (0)
+#endif
 
 /** Generic boolean config value */
 typedef enum {NO, YES} YesNoFlag;
@@ -40,7 +92,14 @@ typedef enum {NO, YES} YesNoFlag;
 typedef enum {M_NO, M_YES, M_MD5} YesNoMD5Flag;  
 typedef enum {R_NO, R_YES, R_RAW} YesNoRawFlag;  
 /** Where to put log data */
-typedef enum {LOGTOFILE, LOGTOSYSLOG} LoggingLocation; 
+typedef enum {LOGTOFILE, LOGTOSYSLOG, LOGTODAEMON, LOGTOSHM} LoggingLocation; 
+/** Log record format; FORMAT_SD is used for the RFC 5424 syslog sink */
+typedef enum {FORMAT_TEXT, FORMAT_JSON, FORMAT_SD} LogFormat;
+/** How syslog records are sent: through libc, or natively as RFC 5424 */
+typedef enum {SYSLOG_LIBC, SYSLOG_RFC5424} SyslogProtocol;
+/** What to do with an ended record when the write queue is full */
+typedef enum {OVERFLOW_BLOCK, OVERFLOW_DROPNEWEST, OVERFLOW_DROPOLDEST,
+              OVERFLOW_SPILL} OverflowPolicy;
 
 /** external MD5 implementation */
 extern char* dlogMD5(char* data, char *digest); 
@@ -63,96 +122,258 @@ static unsigned long nextTransferID = 0;
  */
 static char configFilename[MAXFILEPATH];
 
-/**
- * Flag whether to record the file-name into the logging file or not;
- * 0:YES 1:NO 2:MD5. It can be changed by modifying the config file.
- */
-static YesNoMD5Flag fileNameFormat = M_YES; 
+struct dlogLoggingData;
 
 /**
- * Flag whether to record the file-extension into the logging file or not; 
- * 0:YES 1:NO 2:MD5. It can be changed by modifying the config file.
- */
-static YesNoMD5Flag fileExtFormat = M_YES; 
+* The arguments of a begin call, for the begin steps
+*/
+struct dlogBeginArgs
+{
+   char *filename;
+   char *targetPath;
+   char *sourceHostname;
+   char *targetHostname;
+   char *annotation;
+   unsigned long userID;
+};
 
-/**
- * Flag whether to record the source path into the logging file or not; 
- * 0:YES 1:NO 2:MD5. It can be changed by modifying the config file.
- */
-static YesNoMD5Flag sourcePathFormat = M_YES; 
+/** A step that fills in some fields of a new record */
+typedef void (*BeginStep)(struct dlogLoggingData *logRecord,
+                          struct dlogBeginArgs *args);
 
 /**
- * Flag whether to record the destination path into logging file or not;
- * 0:YES 1:NO 2:MD5. It can be changed by modifying the config file
- */
-static YesNoMD5Flag targetPathFormat = M_YES; 
+* The configuration, as read from the config file. The options of a
+* snapshot never change once it is published: dlogReloadConfig()
+* builds a new one and swaps the activeConfig pointer, and each
+* transfer record keeps the snapshot it was begun with. The replaced
+* snapshot is freed once no record or reader has it (see
+* configReadBegin()). The options are described in the configOptions
+* table.
+*/
+struct dlogConfig
+{
+   /** Flag if logging or not */
+   YesNoFlag doLogging;
+   /** Whether to record the file name: yes, no or md5 */
+   YesNoMD5Flag fileNameFormat;
+   /** Whether to record the file extension: yes, no or md5 */
+   YesNoMD5Flag fileExtFormat;
+   /** Whether to record the source path: yes, no or md5 */
+   YesNoMD5Flag sourcePathFormat;
+   /** Whether to record the destination path: yes, no or md5 */
+   YesNoMD5Flag targetPathFormat;
+   /** Whether to record the user ID: yes, no or md5 */
+   YesNoMD5Flag userIDFormat;
+   /**
+   * Whether to record the source/target IP address: yes/no/raw. Raw
+   * means the host identifier string passed in will not be processed
+   */
+   YesNoRawFlag sourceIPFormat;
+   YesNoRawFlag targetIPFormat;
+   /** Bitmasks for logging source and target IP addresses */
+   unsigned int sourceIPMask;
+   unsigned int targetIPMask;
+   /** Logging identifier name, option, facility and level for syslog */
+   char syslogIdent[MAXFILEPATH];
+   int syslogOption;
+   int syslogFacility;
+   int syslogLevel;
+   /** Send syslog records through libc syslog(), or natively */
+   SyslogProtocol syslogProtocol;
+   /** Socket of the syslog daemon, for the native syslog sink */
+   char syslogSocket[MAXFILEPATH];
+   /** Include an annotation field in the log record */
+   YesNoFlag logAnnotation;
+   /** Batching level for log I/O: write when this many are available */
+   unsigned int logBatchSize;
+   /** Logging file location */
+   char dlogFilename[MAXFILEPATH];
+   /** Log to the file named by dlogFilename, to syslog, or to dlogd */
+   LoggingLocation loggingLocation;
+   /** Unix socket of the dlogd daemon, for LoggingLocation = daemon */
+   char daemonSocket[MAXFILEPATH];
+   /** Shared-memory ring file drained by dlogd, for LoggingLocation = shm */
+   char shmFile[MAXFILEPATH];
+   /** Size of the ring that dlogd creates, bytes */
+   unsigned long shmSize;
+   /** Overwrite the oldest records when the ring is full, not drop */
+   YesNoFlag shmOverwrite;
+   /** Rotate the log file when it reaches this many bytes; 0 never */
+   unsigned long rotateSize;
+   /** Number of rotated log files to keep */
+   unsigned int rotateCount;
+   /** Write the log file through io_uring while the rest of the batch
+   * is formatted, instead of with stdio */
+   YesNoFlag asyncWrites;
+   /** fdatasync() the log file after each batch */
+   YesNoFlag fileSync;
+   /** Format of the records: key='value' text or JSON objects */
+   LogFormat logFormat;
+   /** Track progress reported through dlogUpdateTransfer() */
+   YesNoFlag logProgress;
+   /** Minimum time between two throughput samples, microseconds */
+   unsigned long long progressInterval;
+   /** Time without progress for a transfer to be stalled, microseconds */
+   unsigned long long stallInterval;
+   /** Time without progress after which a transfer is ended as failed
+   * by the reaper thread, microseconds; 0 never */
+   unsigned long long transferTimeout;
+   /** Most transfers that can be active; 0 means no limit */
+   unsigned long maxOpenTransfers;
+   /** Memory the library may hold, megabytes; 0 means no limit */
+   unsigned long memoryBudget;
+   /** Keep session histograms and log their summary at dlogFinalize() */
+   YesNoFlag logHistograms;
+   /** Log a record for each transfer */
+   YesNoFlag logRecords;
+   /** Log only one in this many transfers; 1 logs every transfer */
+   unsigned int logSampleRate;
+   /** Shed load above this many unwritten records; 0 never sheds */
+   unsigned long shedThreshold;
+   /** Sample rate used while load shedding is in effect */
+   unsigned int shedSampleRate;
+   /** Maximum number of unwritten records; 0 means no limit */
+   unsigned long queueLimit;
+   /** What to do when an ended record finds the write queue full */
+   OverflowPolicy overflowPolicy;
+   /** Directory for spill files (overflow policy 'spill') */
+   char spillDirectory[MAXFILEPATH];
+   /** Size of the string intern table; 0 turns interning off */
+   unsigned int internTableSize;
+   /** Reload the configuration when the config file changes */
+   YesNoFlag reloadOnChange;
+   /** Log a STATS record this often, microseconds; 0 never */
+   unsigned long long statsInterval;
+   /** Columnar file the records are also written to; empty for none */
+   char columnFile[MAXFILEPATH];
+   /** Records per row group of the columnar file */
+   unsigned int columnRows;
+   /** Threads formatting a large batch of records; 1 formats inline */
+   unsigned int formatWorkers;
+   /** Begin steps for the logged fields, from compileBeginSteps() */
+   BeginStep fileSteps[5];
+   unsigned int numFileSteps;
+   BeginStep sharedSteps[3];
+   unsigned int numSharedSteps;
+   /** Records begun with this snapshot, from holdConfig() */
+   unsigned long refs;
+   /** The snapshot this one replaced, until freeRetiredConfigs() */
+   struct dlogConfig *retired;
+};
 
 /**
- * Flag whether to record the user ID into the logging file or not; 
- * 0:YES 1:NO 2:MD5. It can be changed by modifying the config file.
- */
-static YesNoMD5Flag userIDFormat = M_YES;   
+* The default configuration, used for options not in the config file
+*/
+static const struct dlogConfig defaultConfig =
+{
+   .doLogging = YES,
+   .fileNameFormat = M_YES,
+   .fileExtFormat = M_YES,
+   .sourcePathFormat = M_YES,
+   .targetPathFormat = M_YES,
+   .userIDFormat = M_YES,
+   .sourceIPFormat = R_YES,
+   .targetIPFormat = R_YES,
+   .sourceIPMask = 0xffffffff,
+   .targetIPMask = 0xffffffff,
+   .syslogIdent = "DLOG",
+   .syslogOption = LOG_PID,
+   .syslogFacility = LOG_USER,
+   .syslogLevel = LOG_INFO,
+   .syslogProtocol = SYSLOG_LIBC,
+   .syslogSocket = "/dev/log",
+   .logAnnotation = YES,
+   .logBatchSize = 5,
+   .dlogFilename = "/var/log/datalog.log",
+   .loggingLocation = LOGTOFILE,
+   .daemonSocket = "/var/run/dlogd.sock",
+   .shmFile = "/dev/shm/dlog.ring",
+   .shmSize = 4194304,
+   .shmOverwrite = NO,
+   .rotateSize = 0,
+   .rotateCount = 1,
+   .asyncWrites = NO,
+   .fileSync = NO,
+   .logFormat = FORMAT_TEXT,
+   .logProgress = NO,
+   .progressInterval = 10000000ULL,
+   .stallInterval = 60000000ULL,
+   .transferTimeout = 0,
+   .maxOpenTransfers = 0,
+   .memoryBudget = 0,
+   .logHistograms = NO,
+   .logRecords = YES,
+   .logSampleRate = 1,
+   .shedThreshold = 0,
+   .shedSampleRate = 10,
+   .queueLimit = 100000,
+   .overflowPolicy = OVERFLOW_DROPOLDEST,
+   .spillDirectory = "/var/tmp",
+   .internTableSize = 4096,
+   .reloadOnChange = NO,
+   .statsInterval = 0,
+   .columnFile = "",
+   .columnRows = 16384,
+   .formatWorkers = 1,
+   .retired = 0
+};
 
 /**
- * Flag whether to record the source IP address into logging file or not;
- * yes/no/raw. Raw means host identifier string passed in will not be
- * processed; flag can be changed by modifying the config file
- */
-static YesNoRawFlag sourceIPFormat = YES;    
+* The current configuration snapshot; read it with currentConfig()
+*/
+static struct dlogConfig *activeConfig = (struct dlogConfig *) &defaultConfig;
 
 /**
- * Flag whether to record the target IP address into logging file or not;
- * yes/no/raw. Raw means host identifier string passed in will not be
- * processed; flag can be changed by modifying the config file
- */
-static YesNoRawFlag targetIPFormat = YES;   
-
-/**  DJL libdlog 09/2012
- * Logging identifier name (for syslog use)
- * It can be changed by modifying the config file
- */
-static char syslogIdent[MAXFILEPATH];
-
-/** DJL libdlog 09/2012
- * Logging option (for syslog use)
- * It can be changed by modifying the config file
- */
-static int syslogOption = LOG_PID;
-
-/** DJL libdlog 09/2012
- * Logging facility (for syslog use)
- * It can be changed by modifying the config file
- */
-static int syslogFacility = LOG_USER;
-
-/** DJL libdlog 09/2012
-* Logging level (for syslog use)
-* It can be changed by modifying the config file
+* Number of snapshots on the retired list of the active one
 */
-static int syslogLevel = LOG_INFO;
+static unsigned int retiredConfigs = 0;
 
 /**
-* Include an annotation field in the log record 
+* Get the current configuration snapshot. Code that holds neither the
+* logfileMutex nor the configMutex reads it with configReadBegin()
+* instead, since a reload may retire and free it.
+* @return the snapshot
 */
-static YesNoFlag logAnnotation = YES;
+static struct dlogConfig *currentConfig()
+{
+   return __atomic_load_n(&activeConfig, __ATOMIC_ACQUIRE);
+}
 
 /**
-* Batching level for log I/O: write when this number of
-* records are available.
+* Names of the custom field keys registered with dlogRegisterField();
+* key k is fieldKeys[k-1]. Entries are never changed once set.
 */
-static unsigned int logBatchSize = 5;
+static char fieldKeys[MAXFIELDKEYS][MAXFIELDKEY];
+static unsigned int numFieldKeys = 0;
 
 /**
- * Logging file location
- * It can be changed by modifying the config file
- */
-static char dlogFilename[MAXFILEPATH];
+* An interned string. Entries are created once and never changed or
+* freed, so records can point at the string without a reference
+* count; the handle is the entry's table slot plus one.
+*/
+struct dlogInternEntry
+{
+   unsigned int handle;
+   unsigned int hash;
+   char str[];
+};
 
 /**
-* 0: log the data to some local files specified by "dlogFilename" variable,
-* 1: log it using the "syslog" capability
+* Intern table for the record strings with few distinct values (file
+* extension, directories, IP addresses): open addressing with linear
+* probing, lock free. Its size is a power of two, and it is only
+* filled to 3/4; values that do not fit are copied into the record.
 */
-static LoggingLocation loggingLocation = LOGTOFILE;
+static struct dlogInternEntry **internTable = 0;
+static unsigned int internTableSize = 4096;
+static unsigned int internCount = 0;
+
+/** Bits for the record strings that are owned copies, not interned */
+#define OWN_FILEEXT    1
+#define OWN_SOURCEDIR  2
+#define OWN_TARGETDIR  4
+#define OWN_SOURCEIP   8
+#define OWN_TARGETIP  16
 
 /* TODO: New options to implement
 static timeFormat;
@@ -160,7 +381,6 @@ static durationFormat;
 static annotationFormat;
 static transferModeFormat;
 static unsigned int optBatchLogging=1;
-static unsigned int optMaxOpenTransfers=1000000;
 */
 
 /**
@@ -169,15 +389,6 @@ static unsigned int optMaxOpenTransfers=1000000;
  */
 static char appName[MAXFILEPATH];
 
-/**
- * Bitmask for logging source IP address.
- */
-static unsigned int sourceIPMask = 0xffffffff;
-/**
- * Bitmask for logging target IP address.
- */
-static unsigned int targetIPMask = 0xffffffff;
-
 /**
  * Session ID
  */
@@ -190,32 +401,144 @@ static unsigned long sessionID = 0x00abcdef;
 struct dlogLoggingData
 {  
    unsigned long id;
+   struct dlogConfig *config; // snapshot the transfer was begun with
    unsigned int xferType;
    char fileName[MAXFILEPATH];
-   char fileExt[MAXFILEPATH];
+   const char *fileExt;    // interned, unless an OWN_ bit is set
    unsigned long size;
-   char sourceDir[MAXFILEPATH];
-   char targetDir[MAXFILEPATH];
+   const char *sourceDir;
+   const char *targetDir;
    char user[MAXUSER];
    char annotation[MAXANNOTATION];
-   char sourceIP[MAXHOSTNAME];
-   char targetIP[MAXHOSTNAME];
+   const char *sourceIP;
+   const char *targetIP;
+   unsigned char ownedStrings; // OWN_ bits of strings to free
    struct timeval startTval;
    struct timeval endTval;
    int errorFlag;
+   unsigned int weight;    // number of transfers this record stands for
+   YesNoFlag hasProgress;  // owns a progress table slot while active
+   YesNoFlag progressKnown; // had a slot, so the results below are set
+   unsigned long minRate;  // progress results, bytes/second
+   unsigned long maxRate;
+   YesNoFlag stalled;
+   YesNoFlag timedOut;     // ended by the reaper (LogTransferTimeout)
+   unsigned long wheelExpiry;     // tick the reaper next looks at it
+   struct dlogLoggingData *wheelNext, *wheelPrev;
+   struct dlogLoggingData **wheelSlot; // timeout wheel slot, 0 if none
+   struct dlogRecordBlock *block; // batch allocation, 0 if allocated alone
    struct dlogLoggingData *next;
+   // custom fields, packed as (key, type, length, value) entries
+   unsigned short fieldArenaUsed;
+   unsigned char fieldArena[MAXFIELDARENA];
+};
+
+/**
+* Header of a block of records allocated together by
+* dlogBeginTransferBatch(); the records follow the header, and the
+* block is freed when its last record is freed
+*/
+struct dlogRecordBlock
+{
+   unsigned long refs;
+   unsigned long bytes;  // size of the allocation, for memoryUsed
+};
+
+/**
+* A transfer ID of a batch call, with its position in the caller's
+* arrays
+*/
+struct dlogBatchID
+{
+   unsigned long id;
+   unsigned int index;
+};
+
+/**
+* Transfer IDs with this bit set belong to transfers that are not being
+* logged (sampled out); dlogEndTransfer() just ignores them
+*/
+#define UNLOGGEDID  (~(ULONG_MAX >> 1))
+
+/** Number of progress slots; must be a power of two */
+#define PROGRESSSLOTS  4096
+
+/**
+* Progress state of one active transfer. Slots are preallocated and
+* indexed by transfer ID so that dlogUpdateTransfer() needs neither the
+* general mutex nor any allocation; all fields are accessed atomically.
+*/
+struct dlogProgressSlot
+{
+   unsigned long id;                // owning transfer, 0 if slot is free
+   unsigned long bytes;             // last reported byte count
+   unsigned long sampleBytes;       // byte count at last sample
+   unsigned long long sampleTime;   // time of last sample (usec)
+   unsigned long long progressTime; // time byte count last grew (usec)
+   unsigned long minRate;           // sampled rates, bytes/second
+   unsigned long maxRate;
+   unsigned int samples;
+   unsigned int stalled;
+};
+
+/**
+* Table of progress slots, allocated by dlogInit() if progress
+* tracking is enabled
+*/
+static struct dlogProgressSlot *progressTable=0;
+
+/**
+* Histograms of completed transfers, indexed by transfer type
+* (DLOG_SEND, DLOG_RECEIVE) and metric (DLOG_HIST_SIZE, ...)
+*/
+static struct dlogHistogram transferHistograms[2][DLOG_HIST_METRICS];
+/** Whether the histograms have been set up (LogHistograms was on) */
+static YesNoFlag histogramsReady = NO;
+
+/**
+* Marks whether the histogram summary has been logged
+*/
+static YesNoFlag summaryWritten = NO;
+
+/**
+* A linked list of transfer records and its length; both are protected
+* by the generalMutex
+*/
+struct dlogRecordList
+{
+   struct dlogLoggingData *head;
+   struct dlogLoggingData *tail;
+   unsigned long count;
 };
 
 /**
 * List holding records of active transfers. Node is created when transfer
 * begins and is deleted when transfer ends.
 */
-static struct dlogLoggingData *activeXferList=0;
+static struct dlogRecordList activeXferList;
 
 /**
 * List holding records of ended-but-not-logged transfers. Will log in batch.
 */
-static struct dlogLoggingData *endedXferList=0;
+static struct dlogRecordList endedXferList;
+
+/**
+* Count of ended records that were dropped because the write queue was
+* full, and of records moved to spill files
+*/
+static unsigned long droppedRecords = 0;
+static unsigned long spilledRecords = 0;
+
+/**
+* Drop and spill counts last written to the log
+*/
+static unsigned long reportedDropped = 0;
+static unsigned long reportedSpilled = 0;
+
+/**
+* Set when spill files may exist and need replayed into the log
+*/
+static YesNoFlag spillPending = NO;
 
 /**
  * General mutex for internal data struct protection
@@ -231,6 +554,429 @@ static pthread_mutex_t logfileMutex = PTHREAD_MUTEX_INITIALIZER;
  */
 static YesNoFlag alreadyInitialized = NO;
 
+#define STATSHARDS  16   //!< Shards of the self-metrics, power of two
+
+/** Self-metrics counters kept in each shard */
+enum { STAT_BEGUN, STAT_ENDED, STAT_TIMEDOUT, STAT_WRITTEN, STAT_FLUSHES,
+       STAT_BYTES, STAT_REFUSED, STAT_STRIPPED, STATCOUNTERS };
+
+/**
+* One shard of libdlog's self-metrics. Each thread updates the shard it
+* was given on its first update, so threads seldom share a cache line;
+* dlogGetStats() adds the shards up.
+*/
+struct dlogStatShard
+{
+   unsigned long counters[STATCOUNTERS];
+   struct dlogHistogram timers[DLOG_STAT_TIMERS];
+   /** Config readers in progress, from configReadBegin() */
+   unsigned long configReaders;
+} __attribute__((aligned(64)));
+
+static struct dlogStatShard statShards[STATSHARDS];
+static unsigned int nextStatShard = 0;
+static __thread struct dlogStatShard *threadStatShard = 0;
+
+/**
+* Time the last STATS record was logged, protected by the logfileMutex
+*/
+static unsigned long long statsReportTime = 0;
+
+static void histogramRecord(struct dlogHistogram *hist, unsigned long value,
+                            unsigned int weight);
+
+/**
+* Get the self-metrics shard of the calling thread
+* @return the shard
+*/
+static struct dlogStatShard *statShard()
+{
+   if (!threadStatShard)
+      threadStatShard = &statShards[__atomic_fetch_add(&nextStatShard, 1,
+                                    __ATOMIC_RELAXED) % STATSHARDS];
+   return threadStatShard;
+}
+
+/**
+* Add to a self-metrics counter
+* @param counter is one of STAT_*
+* @param n is the amount to add
+* @return nothing
+*/
+static void statCount(unsigned int counter, unsigned long n)
+{
+   __atomic_add_fetch(&statShard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/**
+* Start reading the current config snapshot, outside the logfileMutex
+* and the configMutex. A snapshot retired by a reload is not freed
+* while a reader that may have it is in progress; the readers are
+* counted in the thread's stat shard, so threads seldom share the
+* counter. To keep the snapshot beyond configReadEnd(), e.g. in a
+* record, take a reference with holdConfig() first.
+* @return the current snapshot
+*/
+static struct dlogConfig *configReadBegin()
+{
+   // sequentially consistent with publishConfig() and the check in
+   // freeRetiredConfigs(): either a reader is counted there, or it
+   // gets the new snapshot
+   __atomic_add_fetch(&statShard()->configReaders, 1, __ATOMIC_SEQ_CST);
+   return __atomic_load_n(&activeConfig, __ATOMIC_SEQ_CST);
+}
+
+/**
+* Finish reading the config snapshot got from configReadBegin()
+* @return nothing
+*/
+static void configReadEnd()
+{
+   __atomic_sub_fetch(&statShard()->configReaders, 1, __ATOMIC_RELEASE);
+}
+
+/**
+* Take references on a config snapshot for records begun with it
+* @param cfg is the snapshot, from configReadBegin()
+* @param n is the number of records
+* @return the snapshot
+*/
+static struct dlogConfig *holdConfig(struct dlogConfig *cfg, unsigned long n)
+{
+   if (cfg != &defaultConfig)
+      __atomic_add_fetch(&cfg->refs, n, __ATOMIC_RELAXED);
+   return cfg;
+}
+
+/**
+* Drop the reference of a freed record on its config snapshot
+* @param cfg is the snapshot
+* @return nothing
+*/
+static void releaseConfig(struct dlogConfig *cfg)
+{
+   if (cfg && cfg != &defaultConfig)
+      __atomic_sub_fetch(&cfg->refs, 1, __ATOMIC_RELEASE);
+}
+
+/**
+* Bytes held by the long-lived allocations of the library: transfer
+* records (active and queued) and the strings they own, the intern
+* table and its entries, the progress table, config snapshots and the
+* column sink's row group. Buffers freed within the call that made
+* them are not counted.
+*/
+static unsigned long memoryUsed = 0;
+
+/**
+* Account for memory allocated or freed by the library
+* @param bytes is the size allocated
+* @return nothing
+*/
+static void memoryCharge(unsigned long bytes)
+{
+   __atomic_add_fetch(&memoryUsed, bytes, __ATOMIC_RELAXED);
+}
+
+static void memoryRelease(unsigned long bytes)
+{
+   __atomic_sub_fetch(&memoryUsed, bytes, __ATOMIC_RELAXED);
+}
+
+/** How transfers are begun under the limits, from transferLimit() */
+enum { LIMIT_NONE, LIMIT_STRIP, LIMIT_REFUSE };
+
+/**
+* Decide how new transfers are recorded under LogMaxOpenTransfers and
+* LogMemoryBudget. In the last eighth of the memory budget, records
+* are kept without their strings, so they take only their fixed size;
+* over the budget or the open transfer limit, transfers are not logged.
+* @param cfg is the configuration the transfers are begun with
+* @param count is the number of transfers being begun
+* @return LIMIT_NONE, LIMIT_STRIP or LIMIT_REFUSE
+*/
+static int transferLimit(struct dlogConfig *cfg, unsigned int count)
+{
+   unsigned long budget, used;
+
+   if (cfg->maxOpenTransfers > 0 &&
+       __atomic_load_n(&activeXferList.count, __ATOMIC_RELAXED) + count >
+       cfg->maxOpenTransfers)
+      return LIMIT_REFUSE;
+   if (cfg->memoryBudget == 0)
+      return LIMIT_NONE;
+   budget = cfg->memoryBudget << 20;
+   used = __atomic_load_n(&memoryUsed, __ATOMIC_RELAXED) +
+          count * sizeof(struct dlogLoggingData);
+   if (used > budget)
+      return LIMIT_REFUSE;
+   if (used > budget - budget/8)
+      return LIMIT_STRIP;
+   return LIMIT_NONE;
+}
+
+/**
+* Monotonic clock for the self-metrics timers
+* @return nanoseconds since an arbitrary start
+*/
+static unsigned long long statNanos()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+* Record the time since start in a self-metrics timer
+* @param timer is one of DLOG_STAT_*
+* @param start is the statNanos() time the timed work began
+* @return the time taken, nanoseconds
+*/
+static unsigned long long statTime(unsigned int timer,
+                                   unsigned long long start)
+{
+   unsigned long long elapsed = statNanos() - start;
+   histogramRecord(&statShard()->timers[timer], elapsed, 1);
+   return elapsed;
+}
+
+/**
+* Lock a mutex, timing the wait if it is contended; an uncontended
+* lock costs only the trylock
+* @param mutex is the mutex to lock
+* @param timer is the DLOG_STAT_* timer for the wait
+* @return nothing
+*/
+static void statLock(pthread_mutex_t *mutex, unsigned int timer)
+{
+   unsigned long long start;
+
+   if (pthread_mutex_trylock(mutex) == 0)
+      return;
+   start = statNanos();
+   pthread_mutex_lock(mutex);
+   statTime(timer, start);
+}
+
+/**
+* Reset the self-metrics, so the timers' min values start out high
+* @return nothing
+*/
+static void statsInit()
+{
+   int s,t;
+   memset(statShards, 0, sizeof(statShards));
+   for (s=0; s < STATSHARDS; s++)
+      for (t=0; t < DLOG_STAT_TIMERS; t++)
+         statShards[s].timers[t].min = ULONG_MAX;
+}
+
+
+#define WHEELBITS    6                  //!< Slots of a wheel level, log2
+#define WHEELSLOTS   (1 << WHEELBITS)
+#define WHEELLEVELS  4                  //!< 64^4 seconds, about 194 days
+
+/**
+* Hierarchical timing wheel of the active transfers that have a
+* LogTransferTimeout, in ticks of one second on the transfer clock.
+* Level n holds the transfers due within 64^(n+1) ticks, in the slot
+* given by bits 6n..6n+5 of their expiry tick; when level 0 wraps
+* around, the next slot of level 1 is spread over level 0, and so on
+* up. Adding and removing a transfer is O(1) and so is each tick, so
+* the reaper never scans the active list to find stale transfers.
+* Protected by the generalMutex.
+*/
+static struct dlogLoggingData *timeoutWheel[WHEELLEVELS][WHEELSLOTS];
+/** Next tick the reaper processes; 0 until a transfer is added */
+static unsigned long wheelTime = 0;
+
+/**
+* Put an active transfer in the timing wheel slot of its wheelExpiry.
+* The caller must hold the generalMutex.
+* @param rec is the transfer record, not in the wheel
+* @return nothing
+*/
+static void wheelInsert(struct dlogLoggingData *rec)
+{
+   struct dlogLoggingData **slot;
+   unsigned long expiry = rec->wheelExpiry, delta;
+   int level;
+
+   if (wheelTime == 0)
+      wheelTime = rec->startTval.tv_sec;
+   if (expiry < wheelTime)
+      expiry = wheelTime; // overdue, look at it on the next tick
+   delta = expiry - wheelTime;
+   if (delta >> (WHEELBITS*WHEELLEVELS))
+      expiry = wheelTime + (1UL << (WHEELBITS*WHEELLEVELS)) - 1;
+   for (level=0; level < WHEELLEVELS-1 &&
+        (delta >> (WHEELBITS*(level+1))); level++)
+      ;
+   slot = &timeoutWheel[level][(expiry >> (WHEELBITS*level)) &
+                               (WHEELSLOTS-1)];
+   rec->wheelPrev = 0;
+   rec->wheelNext = *slot;
+   if (*slot)
+      (*slot)->wheelPrev = rec;
+   *slot = rec;
+   rec->wheelSlot = slot;
+}
+
+/**
+* Take a transfer out of the timing wheel, if it is in it. The caller
+* must hold the generalMutex.
+* @param rec is the transfer record
+* @return nothing
+*/
+static void wheelRemove(struct dlogLoggingData *rec)
+{
+   if (!rec->wheelSlot)
+      return;
+   if (rec->wheelPrev)
+      rec->wheelPrev->wheelNext = rec->wheelNext;
+   else
+      *rec->wheelSlot = rec->wheelNext;
+   if (rec->wheelNext)
+      rec->wheelNext->wheelPrev = rec->wheelPrev;
+   rec->wheelNext = rec->wheelPrev = 0;
+   rec->wheelSlot = 0;
+}
+
+/**
+* Add a newly begun transfer to the timing wheel, if its configuration
+* has a LogTransferTimeout. The caller must hold the generalMutex.
+* @param rec is the transfer record, with its start time set
+* @return nothing
+*/
+static void wheelAdd(struct dlogLoggingData *rec)
+{
+   unsigned long long timeout = rec->config->transferTimeout;
+
+   if (timeout == 0)
+      return;
+   rec->wheelExpiry = rec->startTval.tv_sec + (timeout + 999999) / 1000000;
+   wheelInsert(rec);
+}
+
+/**
+* Find the tick at which a transfer in the wheel times out: its
+* LogTransferTimeout after it began or, if progress is tracked for it,
+* after its byte count last grew. dlogUpdateTransfer() does not touch
+* the wheel; a transfer that made progress is just put back when its
+* old expiry comes up.
+* @param rec is the transfer record
+* @return the tick
+*/
+static unsigned long wheelDeadline(struct dlogLoggingData *rec)
+{
+   struct dlogProgressSlot *slot;
+   unsigned long long last, progress;
+
+   last = (unsigned long long) rec->startTval.tv_sec * 1000000ULL +
+          rec->startTval.tv_usec;
+   if (rec->hasProgress == YES)
+   {
+      slot = &progressTable[rec->id & (PROGRESSSLOTS-1)];
+      progress = __atomic_load_n(&slot->progressTime, __ATOMIC_RELAXED);
+      if (progress > last)
+         last = progress;
+   }
+   return (last + rec->config->transferTimeout + 999999) / 1000000;
+}
+
+/**
+* Put every transfer in the timing wheel back in it at a new wheel
+* time, after the transfer clock jumped (see dlogSetTimeSource()) too
+* far to step through tick by tick. Each slot of each level is emptied
+* once, so this takes time in the number of slots and transfers, not
+* in the length of the jump; the overdue transfers land in the slot of
+* the new time. The caller must hold the generalMutex.
+* @param now is the new wheel time
+* @return nothing
+*/
+static void wheelRebuild(unsigned long now)
+{
+   struct dlogLoggingData *all = 0, *rec, *next;
+   int level, index;
+
+   for (level=0; level < WHEELLEVELS; level++)
+   {
+      for (index=0; index < WHEELSLOTS; index++)
+      {
+         for (rec = timeoutWheel[level][index]; rec; rec = next)
+         {
+            next = rec->wheelNext;
+            rec->wheelNext = all;
+            all = rec;
+         }
+         timeoutWheel[level][index] = 0;
+      }
+   }
+   wheelTime = now;
+   for (rec = all; rec; rec = next)
+   {
+      next = rec->wheelNext;
+      wheelInsert(rec);
+   }
+}
+
+/**
+* Advance the timing wheel to a time, taking out the transfers that
+* have timed out. A jump of the clock by a turn of level 0 or more, in
+* either direction, rebuilds the wheel at the new time instead. The
+* caller must hold the generalMutex.
+* @param now is the current time on the transfer clock, seconds
+* @param expired is set to the timed out transfers, linked through
+*        their wheelNext; they stay on the active list
+* @return the number of timed out transfers
+*/
+static unsigned long wheelAdvance(unsigned long now,
+                                  struct dlogLoggingData **expired)
+{
+   struct dlogLoggingData *rec, *next;
+   unsigned long n = 0, index;
+   int level;
+
+   *expired = 0;
+   if (wheelTime != 0 &&
+       (now >= wheelTime + WHEELSLOTS || now + WHEELSLOTS < wheelTime))
+      wheelRebuild(now);
+   for (; wheelTime != 0 && wheelTime <= now; wheelTime++)
+   {
+      // on wrapping around, spread the next slot of the level above
+      index = wheelTime & (WHEELSLOTS-1);
+      for (level=1; index == 0 && level < WHEELLEVELS; level++)
+      {
+         index = (wheelTime >> (WHEELBITS*level)) & (WHEELSLOTS-1);
+         rec = timeoutWheel[level][index];
+         timeoutWheel[level][index] = 0;
+         for (; rec; rec = next)
+         {
+            next = rec->wheelNext;
+            wheelInsert(rec);
+         }
+      }
+      index = wheelTime & (WHEELSLOTS-1);
+      rec = timeoutWheel[0][index];
+      timeoutWheel[0][index] = 0;
+      for (; rec; rec = next)
+      {
+         next = rec->wheelNext;
+         rec->wheelSlot = 0;
+         rec->wheelExpiry = wheelDeadline(rec);
+         if (rec->wheelExpiry > wheelTime)
+         {
+            wheelInsert(rec); // made progress, or was clamped
+            continue;
+         }
+         rec->wheelPrev = 0;
+         rec->wheelNext = *expired;
+         *expired = rec;
+         n++;
+      }
+   }
+   return n;
+}
 
 /**
 * Internal function to add initial logging data to a linked list before it
@@ -241,19 +987,25 @@ static YesNoFlag alreadyInitialized = NO;
 * @return 0 on success, 1 on error (logRecord is NULL)
 */
 
-static unsigned int dlogAddLoggingData(struct dlogLoggingData **llist,
+static unsigned int dlogAddLoggingData(struct dlogRecordList *llist,
                                 struct dlogLoggingData *logRecord) 
 {
    unsigned int stat=1; // assume error (record is null is only error)
    // protect shared list
-   pthread_mutex_lock( &generalMutex );
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
    if (logRecord != NULL) 
    {  
-      if (*llist != NULL)
-         logRecord->next = *llist;    
+      if (llist->head != NULL)
+         logRecord->next = llist->head;    
       else  // for first node
+      {
          logRecord->next = NULL;
-      *llist = logRecord;
+         llist->tail = logRecord;
+      }
+      llist->head = logRecord;
+      llist->count++;
+      if (llist == &activeXferList)
+         wheelAdd(logRecord);
       stat = 0;
    }
    // unprotect shared list
@@ -262,6 +1014,32 @@ static unsigned int dlogAddLoggingData(struct dlogLoggingData **llist,
 }
 
 
+/**
+* Internal function to append a record to the end of a list, making
+* the list a FIFO queue when records are taken off with
+* dlogRemoveLoggingData() and a transfer ID of 0
+* @param llist the linked list to add the record to
+* @param logRecord the record to add
+* @return 0 on success, 1 on error (logRecord is NULL)
+*/
+static unsigned int dlogQueueLoggingData(struct dlogRecordList *llist,
+                                struct dlogLoggingData *logRecord)
+{
+   if (logRecord == NULL)
+      return 1;
+   logRecord->next = NULL;
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   if (llist->tail != NULL)
+      llist->tail->next = logRecord;
+   else
+      llist->head = logRecord;
+   llist->tail = logRecord;
+   llist->count++;
+   pthread_mutex_unlock( &generalMutex );
+   return 0;
+}
+
+
 /**
 * Internal function to retrieve the logging data related to transferID and
 * then remove it from the linked list
@@ -272,17 +1050,17 @@ static unsigned int dlogAddLoggingData(struct dlogLoggingData **llist,
 * @return pointer to found+removed record, or NULL if not found
 */
 static struct dlogLoggingData *dlogRemoveLoggingData(
-                                   struct dlogLoggingData **llist, 
+                                   struct dlogRecordList *llist, 
                                    unsigned long transferID)
 {
    struct dlogLoggingData *cur,*prev;
 
-   if (*llist == NULL) 
+   if (llist->head == NULL) 
       return 0;
    // protect shared list
-   pthread_mutex_lock( &generalMutex );
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
 
-   cur = *llist;
+   cur = llist->head;
    prev = 0;
    while (cur != NULL && transferID) // skip if tid==0
    {
@@ -297,10 +1075,14 @@ static struct dlogLoggingData *dlogRemoveLoggingData(
    if (cur) // then found
    {  
       if (!prev)
-         *llist = cur->next; // cur is head of list
+         llist->head = cur->next; // cur is head of list
       else
          prev->next = cur->next; // ax it from middle
+      if (llist->tail == cur)
+         llist->tail = prev;
       cur->next = 0;
+      llist->count--;
+      wheelRemove(cur);
    }
    // unprotect shared list
    pthread_mutex_unlock( &generalMutex );
@@ -308,451 +1090,5449 @@ static struct dlogLoggingData *dlogRemoveLoggingData(
 }
 
 
-/*
-* Internal function that does actual recording of the logging data
-* into a file or syslog
-* @param rec the string containing the formatted logging record, 
-*            null terminated
-* @return  0 if data is recorded into a file successfully, other if not.
-*
-* NOT USED ANYMORE
-static int dlogRecordtoFile(const char * rec)
-{ 
+/**
+* Internal function to add a chain of records (linked through their
+* next pointers) to the head of a list, under one lock
+* @param llist the linked list to add the records to
+* @param first the first record of the chain
+* @param last the last record of the chain
+* @param n the number of records in the chain
+* @return nothing
+*/
+static void dlogAddLoggingDataChain(struct dlogRecordList *llist,
+                                    struct dlogLoggingData *first,
+                                    struct dlogLoggingData *last,
+                                    unsigned long n)
+{
+   struct dlogLoggingData *rec;
 
-   if (lres)
-   {
-      // No lock acquired!
-      // JEC: What to do here? certainly not perror()
-      // perror("Error locking libdlog log file");
-   } else {
-      // write log entry to file
-      fprintf(logFileHandle, "%s", rec);
-   }
-   // do unlock whether or not there was a lock
-   // error just in case of any system wierdness
-   if (lres)
-      return 2; // was a lockf() error
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   if (llist == &activeXferList)
+      for (rec = first; ; rec = rec->next)
+      {
+         wheelAdd(rec);
+         if (rec == last)
+            break;
+      }
+   last->next = llist->head;
+   if (llist->head == NULL)
+      llist->tail = last;
+   llist->head = first;
+   llist->count += n;
+   pthread_mutex_unlock( &generalMutex );
+}
+
+/**
+* Internal function to append a chain of records (linked through their
+* next pointers, last->next is 0) to the end of a list, under one lock
+* @param llist the linked list to add the records to
+* @param first the first record of the chain
+* @param last the last record of the chain
+* @param n the number of records in the chain
+* @return nothing
+*/
+static void dlogQueueLoggingDataChain(struct dlogRecordList *llist,
+                                      struct dlogLoggingData *first,
+                                      struct dlogLoggingData *last,
+                                      unsigned long n)
+{
+   last->next = NULL;
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   if (llist->tail != NULL)
+      llist->tail->next = first;
    else
-      return 0;
+      llist->head = first;
+   llist->tail = last;
+   llist->count += n;
+   pthread_mutex_unlock( &generalMutex );
 }
+
+/**
+* Internal function to detach every record of a list at once, under
+* one lock, e.g. to drain the active list at dlogFinalize()
+* @param llist the linked list to empty
+* @param n is set to the number of records taken
+* @return the first record (the rest are linked through their next
+*         pointers), or NULL if the list was empty
 */
+static struct dlogLoggingData *dlogTakeLoggingDataList(
+                                   struct dlogRecordList *llist,
+                                   unsigned long *n)
+{
+   struct dlogLoggingData *first, *rec;
+
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   first = llist->head;
+   *n = llist->count;
+   llist->head = llist->tail = NULL;
+   llist->count = 0;
+   if (llist == &activeXferList && wheelTime != 0)
+      for (rec = first; rec; rec = rec->next)
+         wheelRemove(rec);
+   pthread_mutex_unlock( &generalMutex );
+   return first;
+}
 
 /**
-* Process all finished transfer records and write them out to log file or
-* syslog. This processes the endedXferList and logs all entries on the
-* list, leaving it empty.
-* @return 0 on sucess, other if error
+* Compare function for sorting and searching batch IDs
 */
-static unsigned int writeLogData()
+static int compareBatchIDs(const void *a, const void *b)
 {
-   struct dlogLoggingData *data=0;
-   char buff[MAXLOGTOFILE];
-   int stat=0;
-   double duration;
-   struct timespec sleepTime;
-   int i=0,lres=0; // lockf result
-   FILE* logFileHandle = 0;
+   unsigned long x = ((struct dlogBatchID *) a)->id;
+   unsigned long y = ((struct dlogBatchID *) b)->id;
+   return (x > y) - (x < y);
+}
 
-   // a pthread lock is used for local thread mutex,
-   // then lockf() is used for system-wide file locking;
-   // perhaps only lockf() is not needed, but it should be safe
-   pthread_mutex_lock( &logfileMutex );
+/**
+* Internal function to remove every record whose ID is in a set from a
+* list, in a single pass and under one lock
+* @param llist the linked list to remove records from
+* @param ids the transfer IDs to find, sorted by compareBatchIDs()
+* @param n the number of IDs
+* @param found is set, at each ID's index, to the removed record
+* @return the number of records found and removed
+*/
+static unsigned int dlogRemoveLoggingDataSet(struct dlogRecordList *llist,
+                                             struct dlogBatchID *ids,
+                                             unsigned int n,
+                                             struct dlogLoggingData **found)
+{
+   struct dlogLoggingData *cur,*prev,*next;
+   struct dlogBatchID key, *match;
+   unsigned int numFound = 0;
 
-   // if 'syslog' capability is used for logging data,
-   // then write the syslog entry and return
-   if (loggingLocation == LOGTOSYSLOG) 
-   {
-      openlog(syslogIdent, syslogOption, syslogFacility);
-   } else if (loggingLocation == LOGTOFILE) 
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   prev = 0;
+   for (cur = llist->head; cur != NULL && numFound < n; cur = next)
    {
-      // file logging
-      logFileHandle = fopen(dlogFilename,"a"); 
-      if (! logFileHandle)
-      {
-         pthread_mutex_unlock( &logfileMutex );
-         return 1;
-      }
-      // else file was opened ok
-      // now lock file for writing (but control max time 
-      // spent trying, for now, 2 seconds)
-      for (i=0; i < 200; i++)
-      {
-         lres = lockf(fileno(logFileHandle), F_TLOCK, 0);
-         if (!lres) break; // acquired lock!
-         if (lres != EACCES && lres != EAGAIN)
-            break; // some other bad error!
-         sleepTime.tv_sec = 0;
-         sleepTime.tv_nsec = 10000000; // (1/100 second)
-         nanosleep(&sleepTime,0); // wait 1/100 second
-      }
-      if (lres) // file lock error!
+      next = cur->next;
+      key.id = cur->id;
+      match = (struct dlogBatchID *) bsearch(&key, ids, n,
+                                  sizeof(struct dlogBatchID), compareBatchIDs);
+      if (!match)
       {
-         pthread_mutex_unlock( &logfileMutex );
-         return 1;
+         prev = cur;
+         continue;
       }
-   } else // incorrect logging location
+      if (!prev)
+         llist->head = next;
+      else
+         prev->next = next;
+      if (llist->tail == cur)
+         llist->tail = prev;
+      cur->next = 0;
+      llist->count--;
+      wheelRemove(cur);
+      found[match->index] = cur;
+      numFound++;
+   }
+   pthread_mutex_unlock( &generalMutex );
+   return numFound;
+}
+
+/**
+* Free a string copy owned by a record
+* @param str is the string
+* @return nothing
+*/
+static void freeOwnedString(const char *str)
+{
+   memoryRelease(strlen(str) + 1);
+   free((char *) str);
+}
+
+/**
+* Free a transfer record; records allocated as part of a batch block
+* release their reference on the block instead
+* @param rec is the record to free
+* @return nothing
+*/
+static void freeLoggingData(struct dlogLoggingData *rec)
+{
+   releaseConfig(rec->config);
+   if (rec->ownedStrings)
    {
-      pthread_mutex_unlock( &logfileMutex );
-      return 1;
+      if (rec->ownedStrings & OWN_FILEEXT)
+         freeOwnedString(rec->fileExt);
+      if (rec->ownedStrings & OWN_SOURCEDIR)
+         freeOwnedString(rec->sourceDir);
+      if (rec->ownedStrings & OWN_TARGETDIR)
+         freeOwnedString(rec->targetDir);
+      if (rec->ownedStrings & OWN_SOURCEIP)
+         freeOwnedString(rec->sourceIP);
+      if (rec->ownedStrings & OWN_TARGETIP)
+         freeOwnedString(rec->targetIP);
    }
+   if (!rec->block)
+   {
+      memoryRelease(sizeof(struct dlogLoggingData));
+      free(rec);
+   } else if (__atomic_sub_fetch(&rec->block->refs, 1,
+                                 __ATOMIC_ACQ_REL) == 0) {
+      memoryRelease(rec->block->bytes);
+      free(rec->block);
+   }
+}
 
-   // Now we have our logging connection, so log some records
-   
-   // TODO: Create timestamp formats
+/**
+* Find or add a string in the intern table. A new entry is claimed
+* with a compare-and-swap on an empty slot; if another thread wins the
+* slot, probing continues from it, so two threads interning the same
+* new string end up with the same entry.
+* @param str is the string to intern
+* @param rec is the record the string is for
+* @param own is the OWN_ bit of the record field
+* @return the shared string, or a copy owned by the record (marked in
+*         rec->ownedStrings) if the table is full or off
+*/
+static const char *internString(const char *str,
+                                struct dlogLoggingData *rec,
+                                unsigned char own)
+{
+   struct dlogInternEntry *entry, *fresh = 0;
+   unsigned int hash = 2166136261u, len, slot, i;
+   const unsigned char *c;
+   char *copy;
 
-   // grab finished records until there are no more
-   while ((data=dlogRemoveLoggingData(&endedXferList,0))!=NULL)
+   if (str[0] == '\0')
+      return "";
+   if (internTable)
    {
-      duration =  (data->endTval.tv_sec - data->startTval.tv_sec)*1.0e6 + 
-                  (data->endTval.tv_usec - data->startTval.tv_usec); 
-      duration = duration / 1.0e3; // create milliseconds
-      // format record
-      sprintf(buff, "%s %s name='%s' fileExt='%s' size=%lu sourceDir='%s' "
-                 "targetDir='%s' session=%lu user='%s' startTime=%lu "
-                 "duration=%.3f success='%s' "
-                 "sourceIP='%s' targetIP='%s' "
-                 "note='%s'\n",
-            appName,
-            (data->xferType==DLOG_RECEIVE) ? "RECEIVE":"SEND", 
-            data->fileName, data->fileExt, data->size, data->sourceDir,
-            data->targetDir, sessionID, data->user, data->startTval.tv_sec,  
-            /*(data->endTval.tv_sec - data->startTval.tv_sec), 
-            (data->endTval.tv_usec - data->startTval.tv_usec),*/
-            duration,
-            (data->errorFlag) ? "no":"yes", 
-            data->sourceIP, data->targetIP, data->annotation);
-      // now log the record      
-      if (loggingLocation == LOGTOSYSLOG) 
+      // FNV-1a
+      for (c = (const unsigned char *) str; *c; c++)
+         hash = (hash ^ *c) * 16777619u;
+      len = (unsigned int) (c - (const unsigned char *) str);
+      slot = hash & (internTableSize-1);
+      for (i=0; i < internTableSize; i++, slot = (slot+1) & (internTableSize-1))
       {
-         syslog(syslogFacility | syslogLevel,"%s",buff);
-      } else if (loggingLocation == LOGTOFILE) 
+         entry = __atomic_load_n(&internTable[slot], __ATOMIC_ACQUIRE);
+         if (!entry)
+         {
+            if (!fresh)
+            {
+               if (__atomic_add_fetch(&internCount, 1, __ATOMIC_RELAXED) >
+                   internTableSize/4*3)
+                  break; // full; str cannot be further along
+               fresh = (struct dlogInternEntry *)
+                       malloc(sizeof(struct dlogInternEntry) + len + 1);
+               if (!fresh)
+                  break;
+               fresh->hash = hash;
+               memcpy(fresh->str, str, len+1);
+            }
+            fresh->handle = slot+1;
+            if (__atomic_compare_exchange_n(&internTable[slot], &entry, fresh,
+                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+               memoryCharge(sizeof(struct dlogInternEntry) + len + 1);
+               return fresh->str;
+            }
+            // lost the slot; entry is now the winner's
+         }
+         if (entry->hash == hash && !strcmp(entry->str, str))
+            break;
+      }
+      if (fresh)
       {
-         fprintf(logFileHandle, "%s", buff);
+         free(fresh);
+         __atomic_sub_fetch(&internCount, 1, __ATOMIC_RELAXED);
+      } else if (!entry) {
+         __atomic_sub_fetch(&internCount, 1, __ATOMIC_RELAXED);
       }
+      if (entry && i < internTableSize)
+         return entry->str;
    }
+   if (!(copy = strdup(str)))
+      return "";
+   memoryCharge(strlen(copy) + 1);
+   rec->ownedStrings |= own;
+   return copy;
+}
 
-   // now close off the logging facility
-   if (loggingLocation == LOGTOSYSLOG) 
-   {
-      closelog();
-   } else if (loggingLocation == LOGTOFILE) 
-   {
-      lockf(fileno(logFileHandle), F_ULOCK, 0);
-      fclose(logFileHandle);
-   }
-   
-   // release the logfile mutex
-   pthread_mutex_unlock( &logfileMutex );
-   
-   if (!stat)
+/**
+* Find the intern handle of a record string
+* @param rec is the record
+* @param str is one of its interned-or-owned strings
+* @param own is the OWN_ bit of the field
+* @return the handle, or 0 if the string is not interned
+*/
+static unsigned int internHandle(struct dlogLoggingData *rec,
+                                 const char *str, unsigned char own)
+{
+   if ((rec->ownedStrings & own) || str[0] == '\0')
       return 0;
-   return 2+stat; // send unique errors on up
+   return ((struct dlogInternEntry *)
+           (str - offsetof(struct dlogInternEntry, str)))->handle;
+}
+
+/**
+* Current wall clock time in microseconds
+* @return microseconds since the epoch
+*/
+static unsigned long long currentMicroseconds()
+{
+   struct timeval tv;
+   gettimeofday(&tv, 0);
+   return (unsigned long long) tv.tv_sec * 1000000ULL + tv.tv_usec;
 }
 
+/**
+* Clock for transfer start and end times and progress reports, set by
+* dlogSetTimeSource(); gettimeofday() is used if it is null
+*/
+static void (*transferClock)(struct timeval *now) = 0;
 
 /**
-* Internal function to find and return the location of the config file.
-* Locations in order: environment variable "DLOG_CONFIG"; file ".dlog.rc"
-* in directory of environment variable "HOME"; the absolute file
-* "/etc/dlog/dlog.conf"
-* @return 1 if a config file was found, otherwise 0
+* Get the current time on the transfer clock
+* @param now is set to the time
+* @return nothing
 */
-static int setConfigFile()
+static void transferTime(struct timeval *now)
 {
-   char *confFile;
-   FILE * checkFile;
-   
-   confFile = getenv("DLOG_CONFIG");
-   if (confFile != NULL)
-   {  
-      checkFile = fopen(confFile, "rf");
-      if (checkFile)
-      {
-         fclose(checkFile);
-         strncpy(configFilename, confFile, MAXFILEPATH);
-         return 1;
-      }
-   }
+   void (*clock)(struct timeval *) =
+      __atomic_load_n(&transferClock, __ATOMIC_ACQUIRE);
 
-   confFile = getenv("HOME");
-   strcat(confFile,"/.dlog.rc");
-   if (confFile != NULL)
-   {  
-      checkFile = fopen(confFile, "rf"); 
-      if (checkFile)
-      {
-         fclose(checkFile);
-         strncpy(configFilename, confFile, MAXFILEPATH);
-         return 1;
-      }
-   }
+   if (clock)
+      clock(now);
+   else
+      gettimeofday(now, 0);
+}
 
-   char tmp[MAXFILEPATH] = "/etc/dlog/dlog.rc";
-   checkFile = fopen(tmp, "rf"); 
-   if (checkFile)
-   {
-      fclose(checkFile);
-      strncpy(configFilename, tmp, MAXFILEPATH);
+/**
+* Decide whether a new transfer is logged. The decision is a hash of
+* the transfer ID, so it is deterministic and spreads evenly over
+* transfers; while the queue of unwritten records is above the load
+* shedding threshold the shedding sample rate is used instead.
+* @param cfg is the configuration the transfer is begun with
+* @param transferID is the new transfer's ID
+* @return the record weight (the current sample rate) if the transfer
+*         is to be logged, 0 if it is sampled out
+*/
+static unsigned int sampleTransfer(struct dlogConfig *cfg,
+                                   unsigned long transferID)
+{
+   unsigned long long h = transferID;
+   unsigned int rate = cfg->logSampleRate;
+
+   if (cfg->shedThreshold > 0 &&
+       __atomic_load_n(&endedXferList.count, __ATOMIC_RELAXED) >
+          cfg->shedThreshold && cfg->shedSampleRate > rate)
+      rate = cfg->shedSampleRate;
+   if (rate <= 1)
       return 1;
-   }
-   else
-      return 0;
+   // 64-bit mix finalizer (from MurmurHash3)
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return (h % rate == 0) ? rate : 0;
 }
 
 /**
-* Internal function to mask an IP address string with netmask and leave
-* the masked network address in the same string
-* @param ip  A string containing an IP address (in/out)
-* @param mask  An int containing a netmask,(e.g. 8, 16, 24, ...)
-* @param size is the (max) size of the ip string
-* @return  nothing, the input string is changed
+* Claim the progress slot for a newly begun transfer. If the slot is
+* still held by an older active transfer, the new transfer simply does
+* not get progress tracking.
+* @param rec is the new transfer record (id and startTval must be set)
+* @return nothing, rec->hasProgress is set if a slot was claimed
 */
-static void doIPBitmask(char *ip, unsigned int mask, unsigned int size)
+static void progressClaim(struct dlogLoggingData *rec)
 {
-   struct in_addr addr,netmask;
-   unsigned long network;
+   struct dlogProgressSlot *slot;
+   unsigned long freeID = 0;
+   unsigned long long start;
 
-   if (! inet_aton(ip,&addr) ) 
-   {
-      // not a valid IP address
+   slot = &progressTable[rec->id & (PROGRESSSLOTS-1)];
+   if (!__atomic_compare_exchange_n(&slot->id, &freeID, rec->id, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
       return;
-   }
+   start = (unsigned long long) rec->startTval.tv_sec * 1000000ULL +
+           rec->startTval.tv_usec;
+   __atomic_store_n(&slot->bytes, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->sampleBytes, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->sampleTime, start, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->progressTime, start, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->minRate, ULONG_MAX, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->maxRate, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->samples, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->stalled, 0, __ATOMIC_RELEASE);
+   rec->hasProgress = YES;
+}
 
-   netmask.s_addr = htonl(mask);
-   
-   network = ntohl(addr.s_addr) & ntohl(netmask.s_addr);
-   struct in_addr addr2;
-   addr2.s_addr = htonl(network);
+/**
+* Record a progress report in a transfer's slot; lock free. At most
+* one throughput sample is taken per progress interval, by whichever
+* caller wins the update of the sample time.
+* @param transferID is the transfer being reported on
+* @param bytes is the number of bytes transferred so far
+* @return 0 on success, 1 if the transfer has no progress slot
+*/
+static unsigned int progressUpdate(unsigned long transferID,
+                                   unsigned long bytes)
+{
+   struct dlogProgressSlot *slot;
+   struct dlogConfig *cfg;
+   struct timeval tv;
+   unsigned long long now, last, sampleTime, stallInterval, interval;
+   unsigned long prevBytes, sampleBytes, rate, cur;
 
-   strncpy(ip,inet_ntoa(addr2),size);
-   ip[size-1] = '\0';
+   slot = &progressTable[transferID & (PROGRESSSLOTS-1)];
+   if (__atomic_load_n(&slot->id, __ATOMIC_ACQUIRE) != transferID)
+      return 1;
+   cfg = configReadBegin();
+   stallInterval = cfg->stallInterval;
+   interval = cfg->progressInterval;
+   configReadEnd();
+   transferTime(&tv);
+   now = (unsigned long long) tv.tv_sec * 1000000ULL + tv.tv_usec;
 
-   return;
+   prevBytes = __atomic_exchange_n(&slot->bytes, bytes, __ATOMIC_RELAXED);
+   if (bytes > prevBytes)
+   {
+      last = __atomic_load_n(&slot->progressTime, __ATOMIC_RELAXED);
+      if (now > last && now - last >= stallInterval)
+         __atomic_store_n(&slot->stalled, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&slot->progressTime, now, __ATOMIC_RELAXED);
+   }
+
+   sampleTime = __atomic_load_n(&slot->sampleTime, __ATOMIC_RELAXED);
+   if (now <= sampleTime || now - sampleTime < interval)
+      return 0;
+   if (!__atomic_compare_exchange_n(&slot->sampleTime, &sampleTime, now,
+                                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 0; // another caller took this sample
+   sampleBytes = __atomic_exchange_n(&slot->sampleBytes, bytes,
+                                     __ATOMIC_RELAXED);
+   rate = 0;
+   if (bytes > sampleBytes)
+      rate = (unsigned long) ((double) (bytes - sampleBytes) * 1.0e6 /
+                              (double) (now - sampleTime));
+   cur = __atomic_load_n(&slot->minRate, __ATOMIC_RELAXED);
+   while (rate < cur &&
+          !__atomic_compare_exchange_n(&slot->minRate, &cur, rate, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+   cur = __atomic_load_n(&slot->maxRate, __ATOMIC_RELAXED);
+   while (rate > cur &&
+          !__atomic_compare_exchange_n(&slot->maxRate, &cur, rate, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+   __atomic_add_fetch(&slot->samples, 1, __ATOMIC_RELAXED);
+   return 0;
 }
 
 /**
-*  Get a local IP address. It is called if a 
-*  source or destination is local
-* @return  The local IP adress (dotted decimal), 0 if error
+* Copy the progress results of an ended transfer into its record and
+* free its progress slot. Transfers with no rate samples (e.g., shorter
+* than one progress interval) get their average rate as min and max;
+* transfers that never had a slot are left without results.
+* @param rec is the ended record (endTval and size must be set)
+* @return nothing
 */
-static char *getLocalIP()
+static void progressRelease(struct dlogLoggingData *rec)
 {
-   int i=0;
-   char *retString = (char *) malloc(MAXFILEPATH * sizeof (char));
-   struct hostent * host; 
-      //?? = (struct hostent * ) malloc ( sizeof ( struct hostent ));
+   struct dlogProgressSlot *slot;
+   unsigned long long end, last, duration;
+   unsigned long avgRate = 0;
 
-   gethostname ( retString , MAXFILEPATH ) ;
+   if (rec->hasProgress != YES)
+      return;
+   slot = &progressTable[rec->id & (PROGRESSSLOTS-1)];
+   end = (unsigned long long) rec->endTval.tv_sec * 1000000ULL +
+         rec->endTval.tv_usec;
+   duration = end - ((unsigned long long) rec->startTval.tv_sec *
+                     1000000ULL + rec->startTval.tv_usec);
+   if (duration > 0)
+      avgRate = (unsigned long) ((double) rec->size * 1.0e6 / duration);
 
-   if ((host = ( struct hostent * ) gethostbyname ( retString )) )
+   if (__atomic_load_n(&slot->samples, __ATOMIC_ACQUIRE) > 0)
    {
-      // JEC: May need to iterate here; danger of retrieving 127.0.?.?
-      do {
-         strcpy(retString , 
-                inet_ntoa(*((struct in_addr *)host->h_addr_list[i++])));
-      } while (strstr(retString,"127") == retString && host->h_addr_list[i]);
-      return retString;
+      rec->minRate = __atomic_load_n(&slot->minRate, __ATOMIC_RELAXED);
+      rec->maxRate = __atomic_load_n(&slot->maxRate, __ATOMIC_RELAXED);
+   } else {
+      rec->minRate = rec->maxRate = avgRate;
    }
-   else {
-      free(retString);
-      return 0;
+   last = __atomic_load_n(&slot->progressTime, __ATOMIC_RELAXED);
+   if (__atomic_load_n(&slot->stalled, __ATOMIC_RELAXED) ||
+       (end > last && end - last >= rec->config->stallInterval))
+      rec->stalled = YES;
+   __atomic_store_n(&slot->id, 0, __ATOMIC_RELEASE);
+   rec->hasProgress = NO;
+   rec->progressKnown = YES;
+}
+
+
+/*
+* Internal function that does actual recording of the logging data
+* into a file or syslog
+* @param rec the string containing the formatted logging record, 
+*            null terminated
+* @return  0 if data is recorded into a file successfully, other if not.
+*
+* NOT USED ANYMORE
+static int dlogRecordtoFile(const char * rec)
+{ 
+
+   if (lres)
+   {
+      // No lock acquired!
+      // JEC: What to do here? certainly not perror()
+      // perror("Error locking libdlog log file");
+   } else {
+      // write log entry to file
+      fprintf(logFileHandle, "%s", rec);
+   }
+   // do unlock whether or not there was a lock
+   // error just in case of any system wierdness
+   if (lres)
+      return 2; // was a lockf() error
+   else
+      return 0;
+}
+*/
+
+/**
+* Find the histogram bucket of a value. Buckets are log-linear as in
+* HDR histograms: values below 16 get their own bucket, and every
+* power-of-two range above that is split into 8 equal sub-buckets,
+* so bucket bounds are within 12.5% of any value in them.
+* @param value is the value to place
+* @return the bucket index, < DLOG_HIST_BUCKETS
+*/
+static unsigned int histogramBucket(unsigned long value)
+{
+   unsigned int exponent;
+   if (value < 16)
+      return (unsigned int) value;
+   exponent = 8*sizeof(unsigned long) - 1 - __builtin_clzl(value);
+   return (exponent - 3) * 8 + (unsigned int) (value >> (exponent - 3));
+}
+
+/**
+* Find the smallest value that falls into a histogram bucket; this
+* is the inverse of histogramBucket()
+* @param bucket is the bucket index
+* @return the lower bound of the bucket
+*/
+static unsigned long histogramBucketStart(unsigned int bucket)
+{
+   unsigned int exponent;
+   if (bucket < 16)
+      return bucket;
+   exponent = bucket / 8 + 2;
+   return (unsigned long) (bucket % 8 + 8) << (exponent - 3);
+}
+
+/**
+* Add a value to a histogram; lock free, safe to call from any thread
+* @param hist is the histogram to update
+* @param value is the value to add
+* @param weight is the number of times to count the value (the sampling
+*        weight of its record)
+* @return nothing
+*/
+static void histogramRecord(struct dlogHistogram *hist, unsigned long value,
+                            unsigned int weight)
+{
+   unsigned long cur;
+
+   __atomic_add_fetch(&hist->buckets[histogramBucket(value)], weight,
+                      __ATOMIC_RELAXED);
+   __atomic_add_fetch(&hist->sum, value * weight, __ATOMIC_RELAXED);
+   cur = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+   while (value < cur &&
+          !__atomic_compare_exchange_n(&hist->min, &cur, value, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+   cur = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+   while (value > cur &&
+          !__atomic_compare_exchange_n(&hist->max, &cur, value, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+   // count last, so a reader seeing the count also sees the bucket
+   __atomic_add_fetch(&hist->count, weight, __ATOMIC_RELEASE);
+}
+
+/**
+* Copy a histogram into a (possibly nonempty) snapshot, merging the
+* counts; individual fields are read atomically
+* @param snap is the snapshot to merge into
+* @param hist is the live histogram to read
+* @return nothing
+*/
+static void histogramMerge(struct dlogHistogram *snap,
+                           struct dlogHistogram *hist)
+{
+   unsigned int i;
+   unsigned long count, value;
+
+   count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+   if (count == 0)
+      return;
+   value = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+   if (snap->count == 0 || value < snap->min)
+      snap->min = value;
+   value = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+   if (value > snap->max)
+      snap->max = value;
+   snap->count += count;
+   snap->sum += __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+   for (i=0; i < DLOG_HIST_BUCKETS; i++)
+      snap->buckets[i] += __atomic_load_n(&hist->buckets[i],
+                                          __ATOMIC_RELAXED);
+}
+
+/**
+* Find the value at a percentile of a histogram snapshot
+* @param hist is the histogram snapshot
+* @param percentile is 0.0 - 100.0
+* @return the lower bound of the bucket holding the percentile value,
+*         clamped to the recorded min and max; 0 if hist is empty
+*/
+static unsigned long histogramPercentile(struct dlogHistogram *hist,
+                                         double percentile)
+{
+   unsigned long total=0, target, value;
+   unsigned int i;
+
+   for (i=0; i < DLOG_HIST_BUCKETS; i++)
+      total += hist->buckets[i];
+   if (total == 0)
+      return 0;
+   target = (unsigned long) (total * percentile / 100.0 + 0.5);
+   if (target < 1)
+      target = 1;
+   for (i=0, total=0; i < DLOG_HIST_BUCKETS-1; i++)
+   {
+      total += hist->buckets[i];
+      if (total >= target)
+         break;
+   }
+   value = histogramBucketStart(i);
+   if (value < hist->min)
+      value = hist->min;
+   if (value > hist->max)
+      value = hist->max;
+   return value;
+}
+
+/**
+* Add a completed transfer to the session histograms
+* @param rec is the ended transfer record
+* @return nothing
+*/
+static void histogramAddTransfer(struct dlogLoggingData *rec)
+{
+   struct dlogHistogram *hists = transferHistograms[rec->xferType];
+   long long duration;
+
+   duration = (rec->endTval.tv_sec - rec->startTval.tv_sec)*1000000LL +
+              (rec->endTval.tv_usec - rec->startTval.tv_usec);
+   if (duration < 0)
+      duration = 0;
+   histogramRecord(&hists[DLOG_HIST_SIZE], rec->size, rec->weight);
+   histogramRecord(&hists[DLOG_HIST_DURATION], (unsigned long) duration,
+                   rec->weight);
+   if (duration > 0)
+      histogramRecord(&hists[DLOG_HIST_THROUGHPUT], (unsigned long)
+                      ((double) rec->size * 1.0e6 / duration), rec->weight);
+}
+
+/**
+* Prepare the session histograms for use
+* @return nothing
+*/
+static void histogramInit()
+{
+   int t,m;
+   memset(transferHistograms, 0, sizeof(transferHistograms));
+   for (t=0; t < 2; t++)
+      for (m=0; m < DLOG_HIST_METRICS; m++)
+         transferHistograms[t][m].min = ULONG_MAX;
+   histogramsReady = YES;
+}
+
+/**
+* Complete a record taken off the active list: stamp its end time,
+* final size and error code, collect its progress results, and add it
+* to the session histograms
+* @param data is the ended record
+* @param endTval is the end time of the transfer
+* @param fileSize is the size given at the end (used if larger)
+* @param transError is the application's transfer error code
+* @return 0 if the record is to be logged, 1 if it has been freed
+*         because per-transfer records are not being logged
+*/
+static unsigned int endLoggingData(struct dlogLoggingData *data,
+                                   struct timeval *endTval,
+                                   unsigned long fileSize,
+                                   unsigned int transError)
+{
+   data->endTval = *endTval;
+
+   // if size is given here, use it
+   if (fileSize > data->size)
+      data->size = fileSize;
+   DLOGPROBE(end, data->id, data->size, transError,
+             (endTval->tv_sec - data->startTval.tv_sec)*1000000LL +
+             (endTval->tv_usec - data->startTval.tv_usec));
+
+   progressRelease(data);
+   
+   data->errorFlag += transError;
+
+   if (data->config->logHistograms == YES && histogramsReady == YES)
+      histogramAddTransfer(data);
+   if (data->config->logRecords == NO)
+   {
+      freeLoggingData(data);
+      return 1;
+   }
+   return 0;
+}
+
+/**
+* File handle of the log file while a batch is being written
+*/
+static FILE* logFileHandle = 0;
+
+/**
+* Configuration the logging connection was opened with, so a reload
+* cannot change the location between open and close
+*/
+static struct dlogConfig *sinkConfig = 0;
+
+/**
+* Where the open logging connection actually goes: the configured
+* location, or the log file if the daemon cannot be reached
+*/
+static LoggingLocation sinkLocation = LOGTOFILE;
+
+/**
+* Set when output to the open log file failed (e.g. the file system is
+* full), so that closeLogSink() reports the batch as not written
+*/
+static YesNoFlag sinkFailed = NO;
+
+#define DAEMONMAGIC     0x42474c44u  //!< "DLGB", starts a daemon batch
+#define DAEMONVERSION   1            //!< Version of the batch format
+#define MAXDAEMONBATCH  65536        //!< Maximum size of a batch message
+#define DAEMONRETRY     5            //!< Seconds between connect attempts
+
+/**
+* Header of a batch message sent to dlogd; each of the count lines
+* follows as a 2-byte length and the line bytes, without a NUL
+*/
+struct dlogDaemonHeader
+{
+   unsigned int magic;
+   unsigned short version;
+   unsigned short count;
+};
+
+/**
+* Connection to dlogd, -1 if not connected, and the time before which
+* a failed connection is not retried
+*/
+static int daemonSocket = -1;
+static time_t daemonRetryTime = 0;
+
+/**
+* The batch message being built while the daemon connection is open
+*/
+static unsigned char daemonBatch[MAXDAEMONBATCH];
+static unsigned int daemonBatchUsed = 0;
+static unsigned int daemonBatchLines = 0;
+
+/**
+* Set while this process is dlogd itself, so that its own sink never
+* points back at the daemon
+*/
+static YesNoFlag daemonServing = NO;
+
+/**
+* Connect to dlogd if not already connected. A failed attempt is not
+* repeated for DAEMONRETRY seconds, so that processes that find no
+* daemon fall back to the log file without paying for a connect() on
+* every batch. The caller must hold the logfileMutex.
+* @param cfg is the configuration naming the daemon socket
+* @return 0 if connected, 1 if not
+*/
+static int connectDaemon(struct dlogConfig *cfg)
+{
+   struct sockaddr_un addr;
+   struct timeval timeout;
+   time_t now;
+
+   if (daemonSocket >= 0)
+      return 0;
+   now = time(0);
+   if (now < daemonRetryTime)
+      return 1;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(cfg->daemonSocket) >= sizeof(addr.sun_path))
+      return 1;
+   strcpy(addr.sun_path, cfg->daemonSocket);
+   daemonSocket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+   if (daemonSocket >= 0 &&
+       connect(daemonSocket, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+   {
+      // a stuck daemon must not stall the application for long
+      timeout.tv_sec = 1;
+      timeout.tv_usec = 0;
+      setsockopt(daemonSocket, SOL_SOCKET, SO_SNDTIMEO,
+                 &timeout, sizeof(timeout));
+      return 0;
+   }
+   if (daemonSocket >= 0)
+      close(daemonSocket);
+   daemonSocket = -1;
+   daemonRetryTime = now + DAEMONRETRY;
+   return 1;
+}
+
+/**
+* Close the connection to dlogd, if open. The caller must hold the
+* logfileMutex.
+* @return nothing
+*/
+static void disconnectDaemon()
+{
+   if (daemonSocket >= 0)
+      close(daemonSocket);
+   daemonSocket = -1;
+}
+
+#define RINGMAGIC      0x474e5244u  //!< "DRNG", start of a ring segment
+#define RINGVERSION    1            //!< Version of the ring layout
+#define RINGSLOT       256          //!< Size of a ring slot, bytes
+#define RINGSLOTDATA   (RINGSLOT - sizeof(struct dlogRingSlot))
+#define MINRINGSLOTS   64           //!< Smallest ring, in slots
+#define RINGSTALE      5000000ULL   //!< Consumer silence that means it
+                                    //!< is gone, microseconds
+
+/**
+* Header of the shared-memory ring that libdlog processes write records
+* into and dlogd drains. Head and tail count slots from the start and
+* never wrap; a slot's index is its count modulo slotCount. They are on
+* their own cache lines since producers and the consumer hammer them.
+*/
+struct dlogRingHeader
+{
+   unsigned int magic;
+   unsigned int version;
+   unsigned int slotCount;   // a power of two
+   unsigned int overwrite;   // producers overwrite the oldest when full
+   unsigned long long heartbeat;   // consumer's last visit, microseconds
+   unsigned long long overflowed;  // records dropped because it was full
+   unsigned long long overwritten; // records overwritten before read
+   unsigned long long head __attribute__((aligned(64)));
+   unsigned long long tail __attribute__((aligned(64)));
+};
+
+/**
+* A ring slot. seq is the slot count + 1 once the slot is written,
+* and 0 while a producer is writing it. A record longer than one slot
+* continues in the following slots; its first slot has the record
+* length and number of slots, the others have nslots 0.
+*/
+struct dlogRingSlot
+{
+   unsigned long long seq;
+   unsigned int len;
+   unsigned int nslots;
+};
+
+/**
+* The mapped ring segment, if any, and its size
+*/
+static struct dlogRingHeader *shmRing = 0;
+static size_t shmRingSize = 0;
+static time_t shmRetryTime = 0;
+
+/**
+* Get a slot of the mapped ring
+* @param count is the slot count
+* @return the slot
+*/
+static struct dlogRingSlot *ringSlot(unsigned long long count)
+{
+   return (struct dlogRingSlot *) ((char *) shmRing +
+          RINGSLOT * (1 + (count & (shmRing->slotCount - 1))));
+}
+
+/**
+* Unmap the ring segment, if mapped
+* @return nothing
+*/
+static void unmapShmRing()
+{
+   if (shmRing)
+      munmap(shmRing, shmRingSize);
+   shmRing = 0;
+   shmRingSize = 0;
+}
+
+/**
+* Map the ring segment created by dlogd, as a producer. A failed
+* attempt is not repeated for DAEMONRETRY seconds. The caller must
+* hold the logfileMutex, or be in dlogInit().
+* @param cfg is the configuration naming the segment
+* @return 0 if mapped, 1 if not
+*/
+static int mapShmRing(struct dlogConfig *cfg)
+{
+   struct dlogRingHeader header;
+   struct stat st;
+   void *map;
+   time_t now;
+   int fd;
+
+   if (shmRing)
+      return 0;
+   now = time(0);
+   if (now < shmRetryTime)
+      return 1;
+   shmRetryTime = now + DAEMONRETRY;
+   if ((fd = open(cfg->shmFile, O_RDWR | O_CLOEXEC)) < 0)
+      return 1;
+   if (fstat(fd, &st) != 0 || st.st_size < (off_t) RINGSLOT ||
+       pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+       header.magic != RINGMAGIC || header.version != RINGVERSION ||
+       header.slotCount < MINRINGSLOTS ||
+       (header.slotCount & (header.slotCount - 1)) ||
+       st.st_size < (off_t) RINGSLOT * (header.slotCount + 1))
+   {
+      close(fd);
+      return 1;
+   }
+   map = mmap(0, RINGSLOT * (header.slotCount + 1),
+              PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return 1;
+   shmRing = (struct dlogRingHeader *) map;
+   shmRingSize = RINGSLOT * (header.slotCount + 1);
+   return 0;
+}
+
+/**
+* Check that the ring consumer is alive. If it has been silent too
+* long the ring is unmapped, so that the next attempt maps the
+* segment of a restarted dlogd.
+* @return 1 if the ring is usable, 0 if not
+*/
+static int shmRingAlive()
+{
+   unsigned long long beat;
+
+   beat = __atomic_load_n(&shmRing->heartbeat, __ATOMIC_RELAXED);
+   if (currentMicroseconds() - beat < RINGSTALE)
+      return 1;
+   unmapShmRing();
+   return 0;
+}
+
+/**
+* Put one line in the ring: reserve its slots with a compare and swap
+* on the head, copy the line in, and mark the slots written. When the
+* ring is full the line is dropped, or with overwrite on, the oldest
+* records are pushed out. Lock free, and no system call is made.
+* @param line is the line
+* @return 0 on success, 1 if the line was dropped
+*/
+static int ringPutLine(char *line)
+{
+   struct dlogRingHeader *ring = shmRing;
+   struct dlogRingSlot *slot;
+   unsigned long long head, tail, count;
+   unsigned int len, nslots, i, chunk, skip;
+
+   len = strnlen(line, MAXLOGTOFILE-1);
+   nslots = (len + RINGSLOTDATA - 1) / RINGSLOTDATA;
+   head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+   for (;;)
+   {
+      tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+      if (head + nslots - tail > ring->slotCount)
+      {
+         if (!ring->overwrite)
+         {
+            __atomic_add_fetch(&ring->overflowed, 1, __ATOMIC_RELAXED);
+            return 1;
+         }
+         // push the oldest record out; a slot that is not the written
+         // start of a record is skipped on its own
+         slot = ringSlot(tail);
+         skip = 1;
+         if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == tail+1 &&
+             slot->nslots > 0 && slot->nslots <= head - tail)
+            skip = slot->nslots;
+         if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + skip,
+                          0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+             slot->nslots > 0)
+            __atomic_add_fetch(&ring->overwritten, 1, __ATOMIC_RELAXED);
+         head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+         continue;
+      }
+      if (__atomic_compare_exchange_n(&ring->head, &head, head + nslots,
+                          0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+         break;
+   }
+   for (i = 0, count = head; i < nslots; i++, count++)
+   {
+      slot = ringSlot(count);
+      __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      slot->len = len;
+      slot->nslots = (i == 0) ? nslots : 0;
+      chunk = (len - i*RINGSLOTDATA < RINGSLOTDATA) ?
+              len - i*RINGSLOTDATA : RINGSLOTDATA;
+      memcpy(slot + 1, line + i*RINGSLOTDATA, chunk);
+      __atomic_store_n(&slot->seq, count+1, __ATOMIC_RELEASE);
+   }
+   return 0;
+}
+
+/**
+* Rename the log file to <name>.1, shifting older rotated files up
+* to <name>.<rotateCount> (the oldest is replaced). The caller holds
+* the lock on the file being rotated.
+* @param cfg is the configuration naming the file
+* @return nothing
+*/
+static void rotateLogFile(struct dlogConfig *cfg)
+{
+   char from[MAXFILEPATH+16], to[MAXFILEPATH+16];
+   unsigned int i;
+
+   for (i = cfg->rotateCount; i > 1; i--)
+   {
+      snprintf(from, sizeof(from), "%s.%u", cfg->dlogFilename, i-1);
+      snprintf(to, sizeof(to), "%s.%u", cfg->dlogFilename, i);
+      rename(from, to);
+   }
+   snprintf(to, sizeof(to), "%s.1", cfg->dlogFilename);
+   rename(cfg->dlogFilename, to);
+}
+
+#define ASYNCBUFFERS     4          //!< Output buffers of LogAsyncWrites
+#define ASYNCBUFFER      (128<<10)  //!< Size of each of them
+#define ASYNCSYNC        0x100      //!< Completion tag of an fdatasync
+
+/**
+* A buffer of log file output for LogAsyncWrites. Lines are copied in
+* while a batch is written; when it is full, or at the end of the
+* batch, the buffer goes to the kernel, and the rest of the batch is
+* formatted into the others while it is being written.
+*/
+struct dlogAsyncBuffer
+{
+   char *data;
+   unsigned long used;
+   /** Operations in flight for it: the write and maybe an fdatasync */
+   unsigned int pending;
+   /** Whether its write is one of them */
+   YesNoFlag writing;
+};
+
+/**
+* The output buffers, the one being filled, and whether the open log
+* file takes its lines through them. All are guarded by logfileMutex.
+*/
+static struct dlogAsyncBuffer asyncBuffers[ASYNCBUFFERS];
+static unsigned int asyncFilling = 0;
+static YesNoFlag sinkAsync = NO;
+
+/**
+* Descriptor the buffers are written to, a dup() of the log file kept
+* across batches, since closing it while a write is in flight would
+* cancel the write; made again when the log file is rotated
+*/
+static int asyncFd = -1;
+static dev_t asyncDev;
+static ino_t asyncIno;
+
+/**
+* Process that set up the buffers and the ring, -1 if they are not
+* set up
+*/
+static pid_t asyncPid = -1;
+
+#ifdef HAVE_LINUX_IO_URING_H
+/**
+* The io_uring of LogAsyncWrites, used through raw system calls: the
+* mapped submission and completion rings, and the submission entries
+*/
+struct dlogUring
+{
+   int fd;                        //!< -1 if io_uring is not available
+   void *map, *sqes;
+   size_t mapSize, sqesSize;
+   unsigned int *sqTail, *sqMask, *sqArray;
+   unsigned int *cqHead, *cqTail, *cqMask;
+   struct io_uring_cqe *cqes;
+};
+
+static struct dlogUring uring = { .fd = -1 };
+
+/**
+* Unmap and close the io_uring; whatever is still in flight completes
+* or is cancelled by the kernel
+* @return nothing
+*/
+static void closeUring()
+{
+   if (uring.sqes)
+      munmap(uring.sqes, uring.sqesSize);
+   if (uring.map)
+      munmap(uring.map, uring.mapSize);
+   if (uring.fd >= 0)
+      close(uring.fd);
+   memset(&uring, 0, sizeof(uring));
+   uring.fd = -1;
+}
+
+/**
+* Set up the io_uring and register the output buffers with it. If that
+* is not possible (a kernel older than 5.4, a seccomp filter, or the
+* buffers over RLIMIT_MEMLOCK), the buffers are written with write().
+* @return nothing
+*/
+static void setupUring()
+{
+   struct io_uring_params params;
+   struct iovec iov[ASYNCBUFFERS];
+   unsigned char *map;
+   size_t cqSize;
+   unsigned int i;
+
+   memset(&params, 0, sizeof(params));
+   uring.fd = syscall(__NR_io_uring_setup, 4*ASYNCBUFFERS, &params);
+   if (uring.fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP))
+   {
+      closeUring();
+      return;
+   }
+   uring.mapSize = params.sq_off.array +
+                   params.sq_entries * sizeof(unsigned int);
+   cqSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+   if (cqSize > uring.mapSize)
+      uring.mapSize = cqSize;
+   uring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+   uring.map = mmap(0, uring.mapSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+   uring.sqes = mmap(0, uring.sqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+   if (uring.map == MAP_FAILED || uring.sqes == MAP_FAILED)
+   {
+      if (uring.map == MAP_FAILED)
+         uring.map = 0;
+      if (uring.sqes == MAP_FAILED)
+         uring.sqes = 0;
+      closeUring();
+      return;
+   }
+   map = uring.map;
+   uring.sqTail = (unsigned int *) (map + params.sq_off.tail);
+   uring.sqMask = (unsigned int *) (map + params.sq_off.ring_mask);
+   uring.sqArray = (unsigned int *) (map + params.sq_off.array);
+   uring.cqHead = (unsigned int *) (map + params.cq_off.head);
+   uring.cqTail = (unsigned int *) (map + params.cq_off.tail);
+   uring.cqMask = (unsigned int *) (map + params.cq_off.ring_mask);
+   uring.cqes = (struct io_uring_cqe *) (map + params.cq_off.cqes);
+   for (i=0; i < ASYNCBUFFERS; i++)
+   {
+      iov[i].iov_base = asyncBuffers[i].data;
+      iov[i].iov_len = ASYNCBUFFER;
+   }
+   if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS,
+               iov, ASYNCBUFFERS) != 0)
+      closeUring();
+}
+
+/**
+* Get the next free submission entry, cleared
+* @param tail is the submission tail, advanced past the entry
+* @return the entry
+*/
+static struct io_uring_sqe *uringEntry(unsigned int *tail)
+{
+   struct io_uring_sqe *sqe;
+   unsigned int slot = *tail & *uring.sqMask;
+
+   sqe = (struct io_uring_sqe *) uring.sqes + slot;
+   memset(sqe, 0, sizeof(*sqe));
+   uring.sqArray[slot] = slot;
+   (*tail)++;
+   return sqe;
+}
+#endif
+
+/**
+* Wait for the writes of an output buffer, or of all of them, to
+* complete. A write that fails marks the open log as failed, as a
+* failed fputs() does. The caller must hold the logfileMutex.
+* @param index is the buffer, or -1 for all of them
+* @param syncs is nonzero to wait for their fdatasync()s too
+* @return nothing
+*/
+static void waitAsyncWrites(int index, int syncs)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+   struct io_uring_cqe *cqe;
+   struct dlogAsyncBuffer *buf;
+   unsigned int head, i, busy;
+
+   while (uring.fd >= 0)
+   {
+      for (i=0, busy=0; i < ASYNCBUFFERS; i++)
+         if (index < 0 || i == (unsigned int) index)
+            busy += syncs ? asyncBuffers[i].pending :
+                            (asyncBuffers[i].writing == YES);
+      if (!busy)
+         break;
+      head = *uring.cqHead;
+      if (head == __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE))
+      {
+         syscall(__NR_io_uring_enter, uring.fd, 0, 1,
+                 IORING_ENTER_GETEVENTS, 0, 0);
+         continue;
+      }
+      cqe = &uring.cqes[head & *uring.cqMask];
+      buf = &asyncBuffers[cqe->user_data & (ASYNCSYNC-1)];
+      // a failed or short write, e.g. with the file system full; its
+      // fdatasync is cancelled
+      if (!(cqe->user_data & ASYNCSYNC))
+      {
+         if (cqe->res != (int) buf->used)
+            sinkFailed = YES;
+         buf->writing = NO;
+      }
+      __atomic_store_n(uring.cqHead, head+1, __ATOMIC_RELEASE);
+      if (--buf->pending == 0)
+         buf->used = 0;
+   }
+#endif
+}
+
+/**
+* Get the descriptor the output buffers are written to: the dup() of
+* the locked log file, made again after the file was rotated
+* @return the descriptor, -1 if the log file cannot be checked
+*/
+static int asyncFileDescriptor()
+{
+   struct stat fileStat;
+
+   if (fstat(fileno(logFileHandle), &fileStat) != 0)
+      return -1;
+   if (asyncFd >= 0 && fileStat.st_dev == asyncDev &&
+       fileStat.st_ino == asyncIno)
+      return asyncFd;
+   if (asyncFd >= 0)
+   {
+      // the rotated file: we hold no lock on it that closing would drop
+      waitAsyncWrites(-1, 1);
+      close(asyncFd);
+   }
+   if ((asyncFd = fcntl(fileno(logFileHandle), F_DUPFD_CLOEXEC, 0)) < 0)
+      return -1;
+   asyncDev = fileStat.st_dev;
+   asyncIno = fileStat.st_ino;
+   return asyncFd;
+}
+
+/**
+* Send the buffer being filled to the log file, and start filling the
+* next one, once its own write is done. The write is queued once the
+* writes in flight are done, so the log stays in order, and an
+* fdatasync is linked to it with LogFileSync; earlier fdatasyncs need
+* not be done. Without io_uring the buffer is written with write() and
+* fdatasync() here.
+* @return nothing
+*/
+static void submitAsyncBuffer()
+{
+   struct dlogAsyncBuffer *buf = &asyncBuffers[asyncFilling];
+   int fd, sync = (sinkConfig->fileSync == YES);
+#ifdef HAVE_LINUX_IO_URING_H
+   struct io_uring_sqe *sqe;
+   unsigned int tail;
+   int ret;
+#endif
+
+   if (buf->used == 0)
+      return;
+   if ((fd = asyncFileDescriptor()) < 0)
+      fd = fileno(logFileHandle);
+#ifdef HAVE_LINUX_IO_URING_H
+   if (uring.fd >= 0 && fd == asyncFd)
+   {
+      waitAsyncWrites(-1, 0);
+      tail = *uring.sqTail;
+      sqe = uringEntry(&tail);
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->fd = fd;
+      sqe->off = 0; // O_APPEND: written at the end of the file
+      sqe->addr = (unsigned long) buf->data;
+      sqe->len = buf->used;
+      sqe->buf_index = asyncFilling;
+      sqe->user_data = asyncFilling;
+      if (sync)
+      {
+         sqe->flags |= IOSQE_IO_LINK;
+         sqe = uringEntry(&tail);
+         sqe->opcode = IORING_OP_FSYNC;
+         sqe->fd = fd;
+         sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+         sqe->user_data = asyncFilling | ASYNCSYNC;
+      }
+      __atomic_store_n(uring.sqTail, tail, __ATOMIC_RELEASE);
+      do
+         ret = syscall(__NR_io_uring_enter, uring.fd, 1 + sync, 0, 0, 0, 0);
+      while (ret < 0 && errno == EINTR);
+      if (ret == 1 + sync)
+      {
+         buf->pending = 1 + sync;
+         buf->writing = YES;
+         asyncFilling = (asyncFilling + 1) % ASYNCBUFFERS;
+         waitAsyncWrites(asyncFilling, 1);
+         return;
+      }
+      // give up on the ring once what it took is done
+      waitAsyncWrites(-1, 1);
+      closeUring();
+   }
+#endif
+   waitAsyncWrites(-1, 1);
+   if (write(fd, buf->data, buf->used) != (ssize_t) buf->used)
+      sinkFailed = YES;
+   if (sync)
+      fdatasync(fd);
+   buf->used = 0;
+}
+
+/**
+* Copy output for the log file into the buffer being filled, sending
+* the buffer whenever it is full. Output larger than the room left is
+* split between lines, so that each write has only whole lines. The
+* caller must hold the logfileMutex.
+* @param text is the output, whole lines
+* @param len is its length
+* @return nothing
+*/
+static void putAsyncOutput(const char *text, unsigned long len)
+{
+   struct dlogAsyncBuffer *buf = &asyncBuffers[asyncFilling];
+   const char *end;
+   unsigned long part;
+
+   while (len > ASYNCBUFFER - buf->used)
+   {
+      // the whole lines that fit
+      end = memrchr(text, '\n', ASYNCBUFFER - buf->used);
+      if (!end && buf->used == 0)
+         break; // cannot happen with lines of at most MAXLOGTOFILE
+      part = end ? end + 1 - text : 0;
+      memcpy(buf->data + buf->used, text, part);
+      buf->used += part;
+      text += part;
+      len -= part;
+      submitAsyncBuffer();
+      buf = &asyncBuffers[asyncFilling];
+   }
+   if (len > ASYNCBUFFER - buf->used)
+   {
+      waitAsyncWrites(-1, 1);
+      if (write(fileno(logFileHandle), text, len) != (ssize_t) len)
+         sinkFailed = YES;
+      return;
+   }
+   memcpy(buf->data + buf->used, text, len);
+   buf->used += len;
+}
+
+/**
+* Free the output buffers of LogAsyncWrites and close the io_uring,
+* after waiting for the writes in flight. The caller must hold the
+* logfileMutex.
+* @return nothing
+*/
+static void stopAsyncWrites()
+{
+   unsigned int i;
+
+   if (asyncPid < 0)
+      return;
+   if (asyncPid == getpid())
+      waitAsyncWrites(-1, 1);
+#ifdef HAVE_LINUX_IO_URING_H
+   closeUring();
+#endif
+   for (i=0; i < ASYNCBUFFERS; i++)
+   {
+      free(asyncBuffers[i].data);
+      memset(&asyncBuffers[i], 0, sizeof(asyncBuffers[i]));
+   }
+   memoryRelease(ASYNCBUFFERS * ASYNCBUFFER);
+   if (asyncFd >= 0)
+      close(asyncFd);
+   asyncFd = -1;
+   asyncFilling = 0;
+   asyncPid = -1;
+}
+
+/**
+* Set up the output buffers and the io_uring of LogAsyncWrites the
+* first time they are used, and again in a forked child, which must not
+* share its parent's ring. Lines a child inherited unwritten are its
+* parent's to write.
+* @return 0 if the log file can be written through them, 1 if not
+*/
+static int startAsyncWrites()
+{
+   unsigned int i;
+
+   if (asyncPid == getpid())
+      return 0;
+   if (asyncPid >= 0)
+   {
+      for (i=0; i < ASYNCBUFFERS; i++)
+      {
+         asyncBuffers[i].used = asyncBuffers[i].pending = 0;
+         asyncBuffers[i].writing = NO;
+      }
+      asyncFilling = 0;
+#ifdef HAVE_LINUX_IO_URING_H
+      closeUring();
+      setupUring();
+#endif
+      asyncPid = getpid();
+      return 0;
+   }
+   for (i=0; i < ASYNCBUFFERS; i++)
+      if (!(asyncBuffers[i].data = malloc(ASYNCBUFFER)))
+      {
+         for (i=0; i < ASYNCBUFFERS; i++)
+         {
+            free(asyncBuffers[i].data);
+            asyncBuffers[i].data = 0;
+         }
+         return 1;
+      }
+   memoryCharge(ASYNCBUFFERS * ASYNCBUFFER);
+   asyncPid = getpid();
+#ifdef HAVE_LINUX_IO_URING_H
+   setupUring();
+#endif
+   return 0;
+}
+
+/**
+* Open and lock the log file for appending, rotating it first if it
+* has reached the rotation size. If another process rotated the file
+* while we waited for the lock, the new file is opened instead.
+* @param cfg is the configuration naming the file
+* @return 0 on success, 1 if the file cannot be opened or locked
+*/
+static int openLogFile(struct dlogConfig *cfg)
+{
+   struct timespec sleepTime;
+   struct stat fileStat, nameStat;
+   int i=0,lres=0; // lockf result
+   int tries;
+   unsigned long long start = statNanos();
+
+   for (tries = 0; tries < 3; tries++)
+   {
+      logFileHandle = fopen(cfg->dlogFilename,"a"); 
+      if (! logFileHandle)
+         return 1;
+      // else file was opened ok
+      // now lock file for writing (but control max time 
+      // spent trying, for now, 2 seconds)
+      for (i=0; i < 200; i++)
+      {
+         lres = lockf(fileno(logFileHandle), F_TLOCK, 0);
+         if (!lres) break; // acquired lock!
+         if (lres != EACCES && lres != EAGAIN)
+            break; // some other bad error!
+         sleepTime.tv_sec = 0;
+         sleepTime.tv_nsec = 10000000; // (1/100 second)
+         nanosleep(&sleepTime,0); // wait 1/100 second
+      }
+      if (lres) // file lock error!
+      {
+         fclose(logFileHandle);
+         logFileHandle = 0;
+         return 1;
+      }
+      DLOGPROBE(file_lock, fileno(logFileHandle), statNanos() - start);
+      sinkAsync = (cfg->asyncWrites == YES && startAsyncWrites() == 0) ?
+                  YES : NO;
+      if (sinkAsync == NO && asyncPid == getpid())
+         waitAsyncWrites(-1, 1); // turned off: stdio must not overtake them
+      if (cfg->rotateSize == 0)
+         return 0;
+      if (fstat(fileno(logFileHandle), &fileStat) != 0)
+         return 0;
+      if (stat(cfg->dlogFilename, &nameStat) == 0 &&
+          nameStat.st_ino == fileStat.st_ino &&
+          nameStat.st_dev == fileStat.st_dev)
+      {
+         if ((unsigned long) fileStat.st_size < cfg->rotateSize)
+            return 0;
+         rotateLogFile(cfg);
+      }
+      // rotated, by us or by another process: open the new file
+      lockf(fileno(logFileHandle), F_ULOCK, 0);
+      fclose(logFileHandle);
+      logFileHandle = 0;
+   }
+   return 1;
+}
+
+#define MAXSYSLOGBATCH   64   //!< Messages sent with one sendmmsg()
+#define MAXSYSLOGMSG     (MAXLOGTOFILE + 256) //!< Largest RFC 5424 message
+#define MAXSYSLOGBACKOFF 60   //!< Longest wait between reconnects, seconds
+
+/**
+* Native syslog sink state: the socket to the syslog daemon (-1 if not
+* connected) and the path it is connected to, the reconnect backoff,
+* and the header values that do not change per message
+*/
+static int syslogSocket = -1;
+static char syslogSocketPath[MAXFILEPATH];
+static time_t syslogRetryTime = 0;
+static unsigned int syslogBackoff = 0;
+static char syslogHost[MAXHOSTNAME];
+static pid_t syslogPid;
+
+/**
+* Messages of the native syslog sink waiting to be sent together
+*/
+static char syslogMessages[MAXSYSLOGBATCH][MAXSYSLOGMSG];
+static unsigned int syslogMessageLens[MAXSYSLOGBATCH];
+static unsigned int syslogBatchCount = 0;
+
+/**
+* Close the native syslog socket, if open, and wait before the next
+* connect attempt: 1 second after the first failure, doubling up to
+* MAXSYSLOGBACKOFF. The caller must hold the logfileMutex.
+* @param backoff is nonzero if the connection failed
+* @return nothing
+*/
+static void disconnectSyslog(int backoff)
+{
+   if (syslogSocket >= 0)
+      close(syslogSocket);
+   syslogSocket = -1;
+   if (!backoff)
+      return;
+   syslogBackoff = syslogBackoff ? syslogBackoff * 2 : 1;
+   if (syslogBackoff > MAXSYSLOGBACKOFF)
+      syslogBackoff = MAXSYSLOGBACKOFF;
+   syslogRetryTime = time(0) + syslogBackoff;
+}
+
+/**
+* Connect the native syslog sink to the syslog daemon's datagram
+* socket, unless it is already connected to the configured path or is
+* waiting out a backoff. The caller must hold the logfileMutex.
+* @param cfg is the configuration naming the socket
+* @return 0 if connected, 1 if not
+*/
+static int connectSyslog(struct dlogConfig *cfg)
+{
+   struct sockaddr_un addr;
+   struct timeval timeout;
+
+   if (syslogSocket >= 0 && !strcmp(syslogSocketPath, cfg->syslogSocket))
+      return 0;
+   disconnectSyslog(0);
+   if (time(0) < syslogRetryTime)
+      return 1;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(cfg->syslogSocket) >= sizeof(addr.sun_path))
+      return 1;
+   strcpy(addr.sun_path, cfg->syslogSocket);
+   syslogSocket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+   if (syslogSocket < 0 ||
+       connect(syslogSocket, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+   {
+      disconnectSyslog(1);
+      return 1;
+   }
+   // a stuck syslog daemon must not stall the application for long
+   timeout.tv_sec = 1;
+   timeout.tv_usec = 0;
+   setsockopt(syslogSocket, SOL_SOCKET, SO_SNDTIMEO,
+              &timeout, sizeof(timeout));
+   strcpy(syslogSocketPath, cfg->syslogSocket);
+   syslogBackoff = 0;
+   if (gethostname(syslogHost, sizeof(syslogHost)) != 0 ||
+       syslogHost[0] == '\0')
+      strcpy(syslogHost, "-");
+   syslogHost[sizeof(syslogHost)-1] = '\0';
+   return 0;
+}
+
+/**
+* Send the waiting native syslog messages with as few sendmmsg() calls
+* as possible. Messages that cannot be sent are dropped and counted;
+* if the socket failed it is closed and reconnected after a backoff.
+* @return nothing
+*/
+static void sendSyslogBatch()
+{
+   struct mmsghdr msgs[MAXSYSLOGBATCH];
+   struct iovec iov[MAXSYSLOGBATCH];
+   unsigned int i, sent = 0;
+   int n;
+
+   if (syslogBatchCount == 0)
+      return;
+   memset(msgs, 0, sizeof(msgs));
+   for (i = 0; i < syslogBatchCount; i++)
+   {
+      iov[i].iov_base = syslogMessages[i];
+      iov[i].iov_len = syslogMessageLens[i];
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+   while (sent < syslogBatchCount)
+   {
+      n = sendmmsg(syslogSocket, msgs + sent, syslogBatchCount - sent,
+                   MSG_NOSIGNAL);
+      if (n > 0)
+         sent += n;
+      else if (n < 0 && errno == EINTR)
+         continue;
+      else
+         break;
+   }
+   if (sent < syslogBatchCount)
+   {
+      __atomic_add_fetch(&droppedRecords, syslogBatchCount - sent,
+                         __ATOMIC_RELAXED);
+      // a timeout means the daemon is slow, anything else that it left
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+         disconnectSyslog(1);
+   }
+   syslogBatchCount = 0;
+}
+
+/**
+* Format a log line as an RFC 5424 message for the native syslog sink
+* and add it to the batch. A structured-data line ("MSGID [...]") from
+* formatRecord() becomes the message ID and structured data; any other
+* line becomes the message text.
+* @param line is the newline-terminated line
+* @return nothing
+*/
+static void putSyslogLine(char *line)
+{
+   static time_t lastSecond = -1;
+   static char lastTime[32];
+   struct timeval now;
+   struct tm tm;
+   char *sd, *msgid = "-", *msg;
+   unsigned int msgidLen = 1, len;
+   int n;
+
+   if (syslogSocket < 0)
+   {
+      __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+      return;
+   }
+   if (syslogBatchCount == MAXSYSLOGBATCH)
+      sendSyslogBatch();
+   if (syslogSocket < 0)
+   {
+      __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+      return;
+   }
+   gettimeofday(&now, 0);
+   if (now.tv_sec != lastSecond)
+   {
+      gmtime_r(&now.tv_sec, &tm);
+      strftime(lastTime, sizeof(lastTime), "%Y-%m-%dT%H:%M:%S", &tm);
+      lastSecond = now.tv_sec;
+   }
+   len = strlen(line);
+   if (len > 0 && line[len-1] == '\n')
+      len--;
+   sd = strchr(line, ' ');
+   if (sd && sd[1] == '[' && sd - line <= 32)
+   {
+      msgid = line;
+      msgidLen = sd - line;
+      msg = sd + 1;
+   } else {
+      sd = 0;
+      msg = line;
+   }
+   n = snprintf(syslogMessages[syslogBatchCount], MAXSYSLOGMSG,
+                "<%d>1 %s.%06ldZ %s %.48s %d %.*s %s%.*s",
+                sinkConfig->syslogFacility | sinkConfig->syslogLevel,
+                lastTime, (long) now.tv_usec, syslogHost,
+                sinkConfig->syslogIdent, (int) syslogPid,
+                (int) msgidLen, msgid, sd ? "" : "- ",
+                (int) (line + len - msg), msg);
+   if (n < 0)
+      return;
+   syslogMessageLens[syslogBatchCount++] =
+      (n < MAXSYSLOGMSG) ? n : MAXSYSLOGMSG-1;
+}
+
+/**
+* Open the logging connection (log file, syslog, dlogd, or the
+* shared-memory ring) for a batch of output. The caller must hold the
+* logfileMutex. For file logging the file is also locked system-wide
+* with lockf(). If the daemon cannot be reached, or the ring has no
+* live consumer, the log file is written directly instead.
+* @return 0 on success, 1 if the log cannot be opened or locked
+*/
+static int openLogSink()
+{
+   struct dlogConfig *cfg;
+
+   cfg = sinkConfig = currentConfig();
+   sinkLocation = cfg->loggingLocation;
+   sinkFailed = NO;
+   if (sinkLocation == LOGTODAEMON)
+   {
+      if (daemonServing == NO && connectDaemon(cfg) == 0)
+      {
+         daemonBatchUsed = sizeof(struct dlogDaemonHeader);
+         daemonBatchLines = 0;
+         return 0;
+      }
+      sinkLocation = LOGTOFILE; // no daemon: write the file ourselves
+   }
+   if (sinkLocation == LOGTOSHM)
+   {
+      if (daemonServing == NO && mapShmRing(cfg) == 0 && shmRingAlive())
+         return 0;
+      sinkLocation = LOGTOFILE; // no consumer: write the file ourselves
+   }
+   // if 'syslog' capability is used for logging data,
+   // then just open the syslog connection
+   if (sinkLocation == LOGTOSYSLOG &&
+       cfg->syslogProtocol == SYSLOG_RFC5424)
+   {
+      // lines are dropped and counted while it cannot connect
+      connectSyslog(cfg);
+      syslogPid = getpid();
+      syslogBatchCount = 0;
+   } else if (sinkLocation == LOGTOSYSLOG) 
+   {
+      openlog(cfg->syslogIdent, cfg->syslogOption, cfg->syslogFacility);
+   } else if (sinkLocation == LOGTOFILE) 
+   {
+      // file logging
+      return openLogFile(cfg);
+   } else // incorrect logging location
+   {
+      return 1;
+   }
+   return 0;
+}
+
+static void putLogLine(char *line);
+
+/**
+* Send the batch being built to dlogd. If the send fails, the daemon
+* connection is dropped and the rest of this logging connection, the
+* unsent batch included, goes to the log file instead.
+* @return nothing
+*/
+static void sendDaemonBatch()
+{
+   struct dlogDaemonHeader header;
+   unsigned char *pos, *end;
+   unsigned short len;
+   char line[MAXLOGTOFILE];
+
+   if (daemonBatchLines == 0)
+      return;
+   header.magic = DAEMONMAGIC;
+   header.version = DAEMONVERSION;
+   header.count = daemonBatchLines;
+   memcpy(daemonBatch, &header, sizeof(header));
+   if (send(daemonSocket, daemonBatch, daemonBatchUsed, MSG_NOSIGNAL) ==
+       (ssize_t) daemonBatchUsed)
+   {
+      daemonBatchUsed = sizeof(struct dlogDaemonHeader);
+      daemonBatchLines = 0;
+      return;
+   }
+   disconnectDaemon();
+   daemonRetryTime = time(0) + DAEMONRETRY;
+   sinkLocation = LOGTOFILE;
+   if (openLogFile(sinkConfig) != 0)
+   {
+      __atomic_add_fetch(&droppedRecords, daemonBatchLines,
+                         __ATOMIC_RELAXED);
+      sinkLocation = LOGTODAEMON; // nothing is open; drop the rest too
+      daemonBatchLines = 0;
+      return;
+   }
+   pos = daemonBatch + sizeof(struct dlogDaemonHeader);
+   end = daemonBatch + daemonBatchUsed;
+   while (pos < end)
+   {
+      memcpy(&len, pos, sizeof(len));
+      memcpy(line, pos + sizeof(len), len);
+      line[len] = '\0';
+      putLogLine(line);
+      pos += sizeof(len) + len;
+   }
+   daemonBatchLines = 0;
+}
+
+/**
+* Write one formatted, newline-terminated line to the open logging
+* connection. The caller must hold the logfileMutex.
+* @param line is the line to log
+* @return nothing
+*/
+static void putLogLine(char *line)
+{
+   unsigned short len;
+
+   if (sinkLocation == LOGTOSYSLOG &&
+       sinkConfig->syslogProtocol == SYSLOG_RFC5424)
+   {
+      putSyslogLine(line);
+   } else if (sinkLocation == LOGTOSYSLOG) 
+   {
+      syslog(sinkConfig->syslogFacility | sinkConfig->syslogLevel,
+             "%s",line);
+   } else if (sinkLocation == LOGTOFILE && sinkAsync == YES)
+   {
+      putAsyncOutput(line, strlen(line));
+   } else if (sinkLocation == LOGTOFILE) 
+   {
+      if (fputs(line, logFileHandle) == EOF)
+         sinkFailed = YES;
+   } else if (sinkLocation == LOGTOSHM)
+   {
+      ringPutLine(line); // counted in the ring if dropped
+   } else if (sinkLocation == LOGTODAEMON && daemonSocket >= 0)
+   {
+      len = strnlen(line, MAXLOGTOFILE-1);
+      if (daemonBatchUsed + sizeof(len) + len > MAXDAEMONBATCH ||
+          daemonBatchLines == USHRT_MAX)
+         sendDaemonBatch();
+      if (sinkLocation != LOGTODAEMON || daemonSocket < 0)
+      {
+         putLogLine(line); // the daemon went away
+         return;
+      }
+      memcpy(daemonBatch + daemonBatchUsed, &len, sizeof(len));
+      memcpy(daemonBatch + daemonBatchUsed + sizeof(len), line, len);
+      daemonBatchUsed += sizeof(len) + len;
+      daemonBatchLines++;
+   } else if (sinkLocation == LOGTODAEMON)
+   {
+      // daemon gone and the log file could not be opened
+      __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+   }
+}
+
+/**
+* Close the logging connection opened by openLogSink(), sending the
+* last batch if it goes to dlogd or the native syslog sink. The caller
+* must hold the logfileMutex. The log file is unlocked only once its
+* writes are done, so that other processes append after them; with
+* LogAsyncWrites and LogFileSync the fdatasync may still be running.
+* @return 0 on success, 1 if output to the log file failed, so that
+*         the caller can keep what it wrote for another try
+*/
+static unsigned int closeLogSink()
+{
+   if (sinkLocation == LOGTODAEMON && daemonSocket >= 0)
+      sendDaemonBatch();
+   if (sinkLocation == LOGTOSYSLOG &&
+       sinkConfig->syslogProtocol == SYSLOG_RFC5424)
+   {
+      sendSyslogBatch();
+   } else if (sinkLocation == LOGTOSYSLOG) 
+   {
+      closelog();
+   } else if (sinkLocation == LOGTOFILE) 
+   {
+      if (sinkAsync == YES)
+      {
+         submitAsyncBuffer();
+         waitAsyncWrites(-1, 0);
+      } else if (fflush(logFileHandle) != 0 || ferror(logFileHandle))
+         sinkFailed = YES;
+      else if (sinkConfig->fileSync == YES &&
+               fdatasync(fileno(logFileHandle)) != 0 && errno != EINVAL)
+         sinkFailed = YES; // EINVAL: a file that cannot be synced
+      lockf(fileno(logFileHandle), F_ULOCK, 0);
+      if (fclose(logFileHandle) != 0)
+         sinkFailed = YES;
+      logFileHandle = 0;
+      return (sinkFailed == YES);
+   }
+   return 0;
+}
+
+/**
+* Make sure the lines put in the open log so far have been written,
+* e.g. before the spill file they came from is removed. The caller must
+* hold the logfileMutex.
+* @return 0 on success, 1 if output to the log file failed
+*/
+static unsigned int flushLogSink()
+{
+   if (sinkLocation == LOGTOFILE && sinkAsync == YES)
+   {
+      submitAsyncBuffer();
+      waitAsyncWrites(-1, 1);
+   } else if (sinkLocation == LOGTOFILE &&
+              (fflush(logFileHandle) != 0 || ferror(logFileHandle)))
+   {
+      sinkFailed = YES;
+   }
+   return (sinkFailed == YES);
+}
+
+/**
+* Register a custom field key name, or find it if already registered.
+* Names may only contain letters, digits, '_', '-' and '.', so they can
+* be logged as is in every format.
+* @param name is the key name
+* @return the key (1..MAXFIELDKEYS), or 0 if the name is invalid or
+*         the key table is full
+*/
+static unsigned int registerFieldKey(char *name)
+{
+   unsigned int i, key = 0;
+
+   if (!name || name[0] == '\0' || strlen(name) >= MAXFIELDKEY)
+      return 0;
+   for (i=0; name[i]; i++)
+      if (!isalnum((unsigned char) name[i]) && name[i] != '_' &&
+          name[i] != '-' && name[i] != '.')
+         return 0;
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   for (i=0; i < numFieldKeys; i++)
+      if (!strcmp(fieldKeys[i], name))
+         break;
+   if (i < numFieldKeys)
+      key = i+1;
+   else if (numFieldKeys < MAXFIELDKEYS)
+   {
+      strcpy(fieldKeys[numFieldKeys], name);
+      key = numFieldKeys+1;
+      // publish the name before the key can be used without the lock
+      __atomic_store_n(&numFieldKeys, key, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock( &generalMutex );
+   return key;
+}
+
+/**
+* Store a custom field value in a record's field arena, replacing any
+* earlier value of the same key. An arena entry is the key, the type
+* and the value length (one byte each) followed by the value.
+* @param rec is the record
+* @param key is a registered field key
+* @param type is DLOG_FIELD_INT, DLOG_FIELD_DOUBLE or DLOG_FIELD_STRING
+* @param value points to the value (a long, a double, or characters)
+* @param len is the value length, at most MAXFIELDVALUE
+* @return 0 on success, 1 if the arena is full
+*/
+static unsigned int arenaSetField(struct dlogLoggingData *rec,
+                                  unsigned int key, unsigned int type,
+                                  void *value, unsigned int len)
+{
+   unsigned char *arena = rec->fieldArena;
+   unsigned int pos = 0, entry;
+
+   while (pos < rec->fieldArenaUsed)
+   {
+      entry = 3 + arena[pos+2];
+      if (arena[pos] == key)
+      {
+         // remove the old value, compacting the arena
+         memmove(arena+pos, arena+pos+entry,
+                 rec->fieldArenaUsed - pos - entry);
+         rec->fieldArenaUsed -= entry;
+         break;
+      }
+      pos += entry;
+   }
+   if (rec->fieldArenaUsed + 3 + len > MAXFIELDARENA)
+      return 1;
+   pos = rec->fieldArenaUsed;
+   arena[pos] = (unsigned char) key;
+   arena[pos+1] = (unsigned char) type;
+   arena[pos+2] = (unsigned char) len;
+   memcpy(arena+pos+3, value, len);
+   rec->fieldArenaUsed += 3 + len;
+   return 0;
+}
+
+/**
+* Append formatted text to a buffer, never going past its end (less
+* room for a newline and null)
+* @param buff is the buffer
+* @param len is the current length of the text in buff
+* @param size is the size of buff
+* @param format is a printf format, followed by its arguments
+* @return the new length of the text in buff
+*/
+static unsigned int bufferPrintf(char *buff, unsigned int len,
+                                 unsigned int size, const char *format, ...)
+{
+   va_list args;
+   int n;
+
+   if (len >= size-2)
+      return len;
+   va_start(args, format);
+   n = vsnprintf(buff+len, size-1-len, format, args);
+   va_end(args);
+   if (n < 0)
+      return len;
+   len += n;
+   return (len > size-2) ? size-2 : len;
+}
+
+/**
+* Append a string as a quoted JSON string, escaping as needed
+* @param buff is the buffer
+* @param len is the current length of the text in buff
+* @param size is the size of buff
+* @param str is the string to append
+* @return the new length of the text in buff
+*/
+static unsigned int bufferJSONString(char *buff, unsigned int len,
+                                     unsigned int size, const char *str)
+{
+   unsigned char c;
+
+   len = bufferPrintf(buff, len, size, "\"");
+   for (; (c = (unsigned char) *str) != '\0' && len < size-8; str++)
+   {
+      if (c == '"' || c == '\\')
+      {
+         buff[len++] = '\\';
+         buff[len++] = c;
+      } else if (c < 0x20)
+      {
+         len += sprintf(buff+len, "\\u%04x", c);
+      } else {
+         buff[len++] = c;
+      }
+   }
+   return bufferPrintf(buff, len, size, "\"");
+}
+
+/**
+* Start a log line that is not a transfer record (STATS, DROPPED, RING
+* or SUMMARY) with the application name: as the escaped "app" member
+* of a JSON object, as formatRecord() does, or as the first word of a
+* text line
+* @param buff is the buffer
+* @param size is the size of buff
+* @param json is nonzero for a JSON line
+* @return the length of the text in buff
+*/
+static unsigned int bufferAppName(char *buff, unsigned int size, int json)
+{
+   if (!json)
+      return bufferPrintf(buff, 0, size, "%s", appName);
+   return bufferJSONString(buff, bufferPrintf(buff, 0, size, "{\"app\":"),
+                           size, appName);
+}
+
+/**
+* Append a string as a quoted RFC 5424 structured-data value, escaping
+* '"', '\\' and ']'
+* @param buff is the buffer
+* @param len is the current length of the text in buff
+* @param size is the size of buff
+* @param str is the string to append
+* @return the new length of the text in buff
+*/
+static unsigned int bufferSDString(char *buff, unsigned int len,
+                                   unsigned int size, const char *str)
+{
+   unsigned char c;
+
+   len = bufferPrintf(buff, len, size, "\"");
+   for (; (c = (unsigned char) *str) != '\0' && len < size-6; str++)
+   {
+      if (c == '"' || c == '\\' || c == ']')
+         buff[len++] = '\\';
+      buff[len++] = c;
+   }
+   return bufferPrintf(buff, len, size, "\"");
+}
+
+/**
+* Append the custom fields of a record in a log format
+* @param rec is the record
+* @param format is the log format
+* @param buff is the buffer
+* @param len is the current length of the text in buff
+* @param size is the size of buff
+* @return the new length of the text in buff
+*/
+static unsigned int formatFields(struct dlogLoggingData *rec,
+                                 LogFormat format, char *buff,
+                                 unsigned int len, unsigned int size)
+{
+   unsigned char *arena = rec->fieldArena;
+   char str[MAXFIELDVALUE+1], *quote;
+   unsigned int pos = 0;
+   long ival;
+   double dval;
+   char *key;
+
+   while (pos < rec->fieldArenaUsed)
+   {
+      key = fieldKeys[arena[pos]-1];
+      if (format == FORMAT_JSON)
+         len = bufferPrintf(buff, len, size, ",\"%s\":", key);
+      else
+         len = bufferPrintf(buff, len, size, " %s=", key);
+      // structured-data values are always quoted
+      quote = (format == FORMAT_SD) ? "\"" : "";
+      switch (arena[pos+1])
+      {
+         case DLOG_FIELD_INT:
+            memcpy(&ival, arena+pos+3, sizeof(ival));
+            len = bufferPrintf(buff, len, size, "%s%ld%s", quote, ival,
+                               quote);
+            break;
+         case DLOG_FIELD_DOUBLE:
+            memcpy(&dval, arena+pos+3, sizeof(dval));
+            // JSON has no NaN or infinity; %.17g reads back the same
+            if (format == FORMAT_JSON && !isfinite(dval))
+               len = bufferPrintf(buff, len, size, "null");
+            else
+               len = bufferPrintf(buff, len, size, "%s%.17g%s", quote,
+                                  dval, quote);
+            break;
+         default:
+            memcpy(str, arena+pos+3, arena[pos+2]);
+            str[arena[pos+2]] = '\0';
+            if (format == FORMAT_JSON)
+               len = bufferJSONString(buff, len, size, str);
+            else if (format == FORMAT_SD)
+               len = bufferSDString(buff, len, size, str);
+            else
+               len = bufferPrintf(buff, len, size, "'%s'", str);
+            break;
+      }
+      pos += 3 + arena[pos+2];
+   }
+   return len;
+}
+
+/** Structured-data ID of the RFC 5424 records; 32473 is the example
+*  enterprise number of RFC 5612 */
+#define SYSLOGSDID   "dlog@32473"
+
+/**
+* Format a transfer record as a log line, in text or JSON format, or
+* for the native syslog sink, as a message ID and an RFC 5424
+* structured-data element. The caller must have the log sink open.
+* @param data is the ended transfer record
+* @param app is the application name to log
+* @param session is the session ID to log
+* @param buff is the buffer to hold the line
+* @param size is the size of buff
+* @return the length of the newline-terminated line in buff
+*/
+static unsigned int formatRecord(struct dlogLoggingData *data, char *app,
+                                 unsigned long session, char *buff,
+                                 unsigned int size)
+{
+   struct dlogConfig *cfg = data->config;
+   double duration;
+   unsigned int len;
+   unsigned long avgRate;
+   LogFormat format = cfg->logFormat;
+
+   duration =  (data->endTval.tv_sec - data->startTval.tv_sec)*1.0e6 + 
+               (data->endTval.tv_usec - data->startTval.tv_usec); 
+   duration = duration / 1.0e3; // create milliseconds
+   avgRate = (duration > 0) ? (unsigned long)
+             (data->size * 1.0e3 / duration) : 0;
+   if (sinkLocation == LOGTOSYSLOG &&
+       sinkConfig->syslogProtocol == SYSLOG_RFC5424)
+      format = FORMAT_SD;
+   if (format == FORMAT_JSON)
+   {
+      len = bufferPrintf(buff, 0, size, "{\"app\":");
+      len = bufferJSONString(buff, len, size, app);
+      len = bufferPrintf(buff, len, size, ",\"type\":\"%s\",\"name\":",
+                 (data->xferType==DLOG_RECEIVE) ? "RECEIVE":"SEND");
+      len = bufferJSONString(buff, len, size, data->fileName);
+      len = bufferPrintf(buff, len, size, ",\"fileExt\":");
+      len = bufferJSONString(buff, len, size, data->fileExt);
+      len = bufferPrintf(buff, len, size, ",\"size\":%lu,\"sourceDir\":",
+                         data->size);
+      len = bufferJSONString(buff, len, size, data->sourceDir);
+      len = bufferPrintf(buff, len, size, ",\"targetDir\":");
+      len = bufferJSONString(buff, len, size, data->targetDir);
+      len = bufferPrintf(buff, len, size, ",\"session\":%lu,\"user\":",
+                         session);
+      len = bufferJSONString(buff, len, size, data->user);
+      len = bufferPrintf(buff, len, size, ",\"startTime\":%lu,"
+                 "\"duration\":%.3f,\"success\":%s,\"sourceIP\":",
+                 data->startTval.tv_sec, duration,
+                 (data->errorFlag) ? "false":"true");
+      len = bufferJSONString(buff, len, size, data->sourceIP);
+      len = bufferPrintf(buff, len, size, ",\"targetIP\":");
+      len = bufferJSONString(buff, len, size, data->targetIP);
+      len = bufferPrintf(buff, len, size, ",\"note\":");
+      len = bufferJSONString(buff, len, size, data->annotation);
+      if (cfg->logProgress == YES && data->progressKnown == YES)
+         len = bufferPrintf(buff, len, size, ",\"minRate\":%lu,"
+                    "\"avgRate\":%lu,\"maxRate\":%lu,\"stalled\":%s",
+                    data->minRate, avgRate, data->maxRate,
+                    (data->stalled == YES) ? "true":"false");
+      else if (cfg->logProgress == YES)
+         len = bufferPrintf(buff, len, size, ",\"avgRate\":%lu", avgRate);
+      if (cfg->logSampleRate > 1 || cfg->shedThreshold > 0)
+         len = bufferPrintf(buff, len, size, ",\"weight\":%u",
+                            data->weight);
+      if (data->timedOut == YES)
+         len = bufferPrintf(buff, len, size, ",\"timedOut\":true");
+      len = formatFields(data, format, buff, len, size);
+      // a truncated record still has to be a JSON object
+      if (len >= size-3)
+         len = size-3;
+      buff[len++] = '}';
+   } else if (format == FORMAT_SD)
+   {
+      len = bufferPrintf(buff, 0, size, "%s [" SYSLOGSDID " app=",
+                 (data->xferType==DLOG_RECEIVE) ? "RECEIVE":"SEND");
+      len = bufferSDString(buff, len, size, app);
+      len = bufferPrintf(buff, len, size, " name=");
+      len = bufferSDString(buff, len, size, data->fileName);
+      len = bufferPrintf(buff, len, size, " fileExt=");
+      len = bufferSDString(buff, len, size, data->fileExt);
+      len = bufferPrintf(buff, len, size, " size=\"%lu\" sourceDir=",
+                         data->size);
+      len = bufferSDString(buff, len, size, data->sourceDir);
+      len = bufferPrintf(buff, len, size, " targetDir=");
+      len = bufferSDString(buff, len, size, data->targetDir);
+      len = bufferPrintf(buff, len, size, " session=\"%lu\" user=",
+                         session);
+      len = bufferSDString(buff, len, size, data->user);
+      len = bufferPrintf(buff, len, size, " startTime=\"%lu\" "
+                 "duration=\"%.3f\" success=\"%s\" sourceIP=",
+                 data->startTval.tv_sec, duration,
+                 (data->errorFlag) ? "no":"yes");
+      len = bufferSDString(buff, len, size, data->sourceIP);
+      len = bufferPrintf(buff, len, size, " targetIP=");
+      len = bufferSDString(buff, len, size, data->targetIP);
+      len = bufferPrintf(buff, len, size, " note=");
+      len = bufferSDString(buff, len, size, data->annotation);
+      if (cfg->logProgress == YES && data->progressKnown == YES)
+         len = bufferPrintf(buff, len, size, " minRate=\"%lu\" "
+                    "avgRate=\"%lu\" maxRate=\"%lu\" stalled=\"%s\"",
+                    data->minRate, avgRate, data->maxRate,
+                    (data->stalled == YES) ? "yes":"no");
+      else if (cfg->logProgress == YES)
+         len = bufferPrintf(buff, len, size, " avgRate=\"%lu\"", avgRate);
+      if (cfg->logSampleRate > 1 || cfg->shedThreshold > 0)
+         len = bufferPrintf(buff, len, size, " weight=\"%u\"",
+                            data->weight);
+      if (data->timedOut == YES)
+         len = bufferPrintf(buff, len, size, " timedOut=\"yes\"");
+      len = formatFields(data, format, buff, len, size);
+      // a truncated record still has to be a complete element
+      if (len >= size-3)
+         len = size-3;
+      buff[len++] = ']';
+   } else {
+      len = bufferPrintf(buff, 0, size,
+                 "%s %s name='%s' fileExt='%s' size=%lu sourceDir='%s' "
+                 "targetDir='%s' session=%lu user='%s' startTime=%lu "
+                 "duration=%.3f success='%s' "
+                 "sourceIP='%s' targetIP='%s' "
+                 "note='%s'",
+            app,
+            (data->xferType==DLOG_RECEIVE) ? "RECEIVE":"SEND", 
+            data->fileName, data->fileExt, data->size, data->sourceDir,
+            data->targetDir, session, data->user, data->startTval.tv_sec,  
+            /*(data->endTval.tv_sec - data->startTval.tv_sec), 
+            (data->endTval.tv_usec - data->startTval.tv_usec),*/
+            duration,
+            (data->errorFlag) ? "no":"yes", 
+            data->sourceIP, data->targetIP, data->annotation);
+      // without a progress slot only the average rate is known
+      if (cfg->logProgress == YES && data->progressKnown == YES)
+         len = bufferPrintf(buff, len, size,
+                    " minRate=%lu avgRate=%lu maxRate=%lu stalled='%s'",
+                    data->minRate, avgRate, data->maxRate,
+                    (data->stalled == YES) ? "yes":"no");
+      else if (cfg->logProgress == YES)
+         len = bufferPrintf(buff, len, size, " avgRate=%lu", avgRate);
+      if (cfg->logSampleRate > 1 || cfg->shedThreshold > 0)
+         len = bufferPrintf(buff, len, size, " weight=%u", data->weight);
+      if (data->timedOut == YES)
+         len = bufferPrintf(buff, len, size, " timedOut='yes'");
+      len = formatFields(data, format, buff, len, size);
+   }
+   buff[len++] = '\n';
+   buff[len] = '\0';
+   return len;
+}
+
+/**
+* Row group of the column sink being built, and the columnar file it
+* goes to; both are only used with the logfileMutex held
+*/
+static struct dlogColumnWriter *columnWriter = 0;
+static unsigned int columnGroupRows;
+static unsigned long columnMemory = 0;  // of columnWriter, in memoryUsed
+static char columnPath[MAXFILEPATH];
+
+/**
+* Append the row group being built to the columnar file, locked with
+* lockf() so that the groups of several processes are not interleaved,
+* and start a new one. The caller must hold the logfileMutex.
+* @return 0 on success or if there are no rows, 1 if the file cannot
+*         be written (the rows are lost; the text log still has them)
+*/
+static int flushColumnSink()
+{
+   int fd, stat = 1;
+
+   if (!columnWriter)
+      return 0;
+   fd = open(columnPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+   if (fd >= 0 && lockf(fd, F_LOCK, 0) == 0)
+   {
+      stat = dlogColumnWrite(columnWriter, fd);
+      lockf(fd, F_ULOCK, 0);
+   }
+   if (fd >= 0)
+      close(fd);
+   dlogColumnFree(columnWriter);
+   columnWriter = 0;
+   memoryRelease(columnMemory);
+   columnMemory = 0;
+   return stat;
+}
+
+/**
+* Add a record to the column sink, if LogColumnFile is set, writing
+* the row group when it is full. The caller must hold the logfileMutex.
+* @param data is the record, with the same fields as its log line
+* @param app is the application name to log
+* @param session is the session ID to log
+* @return nothing
+*/
+static void columnSinkRecord(struct dlogLoggingData *data, char *app,
+                             unsigned long session)
+{
+   struct dlogConfig *cfg = currentConfig();
+   struct dlogColumnRow row;
+   const char *str[DLOGCOL_STRINGS];
+   int c;
+
+   // a reload may have changed the file: finish the old one's group
+   if (columnWriter && strcmp(columnPath, cfg->columnFile) != 0)
+      flushColumnSink();
+   if (cfg->columnFile[0] == '\0')
+      return;
+   if (!columnWriter)
+   {
+      if (!(columnWriter = dlogColumnCreate(cfg->columnRows)))
+         return;
+      columnGroupRows = cfg->columnRows;
+      strcpy(columnPath, cfg->columnFile);
+   }
+   str[DLOGCOL_APP] = app;
+   str[DLOGCOL_NAME] = data->fileName;
+   str[DLOGCOL_FILEEXT] = data->fileExt;
+   str[DLOGCOL_SOURCEDIR] = data->sourceDir;
+   str[DLOGCOL_TARGETDIR] = data->targetDir;
+   str[DLOGCOL_USER] = data->user;
+   str[DLOGCOL_SOURCEIP] = data->sourceIP;
+   str[DLOGCOL_TARGETIP] = data->targetIP;
+   str[DLOGCOL_NOTE] = data->annotation;
+   for (c=0; c < DLOGCOL_STRINGS; c++)
+   {
+      row.str[c] = str[c] ? str[c] : "";
+      row.len[c] = strlen(row.str[c]);
+   }
+   row.num[DLOGCOL_TYPE - DLOGCOL_STRINGS] = data->xferType;
+   row.num[DLOGCOL_SIZE - DLOGCOL_STRINGS] = data->size;
+   row.num[DLOGCOL_SESSION - DLOGCOL_STRINGS] = session;
+   row.num[DLOGCOL_STARTTIME - DLOGCOL_STRINGS] = data->startTval.tv_sec;
+   row.num[DLOGCOL_DURATION - DLOGCOL_STRINGS] =
+      (data->endTval.tv_sec - data->startTval.tv_sec) * 1000000L +
+      (data->endTval.tv_usec - data->startTval.tv_usec);
+   row.num[DLOGCOL_SUCCESS - DLOGCOL_STRINGS] = !data->errorFlag;
+   row.num[DLOGCOL_WEIGHT - DLOGCOL_STRINGS] = data->weight;
+   if (dlogColumnAdd(columnWriter, &row) >= columnGroupRows)
+   {
+      flushColumnSink();
+      return;
+   }
+   // the row group only grows until it is written
+   memoryCharge(dlogColumnMemory(columnWriter) - columnMemory);
+   columnMemory = dlogColumnMemory(columnWriter);
+}
+
+#define MAXFORMATWORKERS  16   //!< Most threads formatting one batch
+#define PARALLELFORMAT   128   //!< Smallest batch split among workers
+#define FORMATBUFFER  (64<<10) //!< Initial size of a worker's buffer
+
+/**
+* A contiguous part of a batch of ended records, formatted by one
+* worker into its own buffer of log lines
+*/
+struct dlogFormatJob
+{
+   struct dlogLoggingData *first;  // records, linked through next
+   unsigned long count;
+   unsigned long formatted;        // < count if the buffer cannot grow
+   char *buf;                      // the lines, each ending in '\n'
+   unsigned long used, size;
+   int ready;                      // set by the writer, cleared when done
+};
+
+/**
+* The formatting workers: the writing thread formats job 0 itself and
+* the helper thread of each further job is started when first needed.
+* Jobs are only posted with the logfileMutex held, so there is one
+* batch in flight at a time; the rest is protected by formatMutex.
+*/
+static struct dlogFormatJob formatJobs[MAXFORMATWORKERS];
+static pthread_t formatThreads[MAXFORMATWORKERS];
+static unsigned int formatThreadCount = 1; // job 0 has no thread
+static unsigned int formatPending = 0;     // posted jobs not done yet
+static int formatStop = 0;
+static pthread_mutex_t formatMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t formatStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t formatDone = PTHREAD_COND_INITIALIZER;
+
+/**
+* Format the records of a job into its buffer, growing it as needed
+* so that a whole record always fits
+* @param job is the job
+* @return nothing; job->formatted is how many records were formatted
+*/
+static void formatJobRecords(struct dlogFormatJob *job)
+{
+   struct dlogLoggingData *rec = job->first;
+   unsigned long size;
+   char *buf;
+
+   job->used = 0;
+   for (job->formatted = 0; job->formatted < job->count;
+        job->formatted++, rec = rec->next)
+   {
+      if (job->size - job->used < MAXLOGTOFILE)
+      {
+         size = job->size ? job->size * 2 : FORMATBUFFER;
+         if (!(buf = (char *) realloc(job->buf, size)))
+            return; // the writer formats the rest
+         memoryCharge(size - job->size);
+         job->buf = buf;
+         job->size = size;
+      }
+      job->used += formatRecord(rec, appName, sessionID,
+                                job->buf + job->used, MAXLOGTOFILE);
+   }
+}
+
+/**
+* Formatting worker thread: waits for its job to be posted, formats
+* it and reports it done
+* @param arg is the job index
+* @return nothing
+*/
+static void *formatWorker(void *arg)
+{
+   struct dlogFormatJob *job = &formatJobs[(unsigned long) arg];
+
+   pthread_mutex_lock( &formatMutex );
+   for (;;)
+   {
+      while (!job->ready && !formatStop)
+         pthread_cond_wait( &formatStart, &formatMutex );
+      if (formatStop)
+         break;
+      pthread_mutex_unlock( &formatMutex );
+      formatJobRecords(job);
+      pthread_mutex_lock( &formatMutex );
+      job->ready = 0;
+      if (--formatPending == 0)
+         pthread_cond_signal( &formatDone );
+   }
+   pthread_mutex_unlock( &formatMutex );
+   return 0;
+}
+
+/**
+* Stop the formatting worker threads and free their buffers
+* @return nothing
+*/
+static void stopFormatWorkers()
+{
+   unsigned int i;
+
+   pthread_mutex_lock( &formatMutex );
+   formatStop = 1;
+   pthread_cond_broadcast( &formatStart );
+   pthread_mutex_unlock( &formatMutex );
+   for (i=1; i < formatThreadCount; i++)
+      pthread_join(formatThreads[i], 0);
+   formatThreadCount = 1;
+   formatStop = 0;
+   for (i=0; i < MAXFORMATWORKERS; i++)
+   {
+      memoryRelease(formatJobs[i].size);
+      free(formatJobs[i].buf);
+      formatJobs[i].buf = 0;
+      formatJobs[i].size = 0;
+   }
+}
+
+/**
+* Put the lines of a formatted buffer in the log: with one write for
+* the log file, else line by line
+* @param buf is the lines, each ending in '\n', followed by a NUL
+* @param len is their length
+* @return nothing
+*/
+static void putLogLines(char *buf, unsigned long len)
+{
+   char *line, *end, saved;
+
+   if (sinkLocation == LOGTOFILE && sinkAsync == YES)
+   {
+      putAsyncOutput(buf, len);
+      return;
+   }
+   if (sinkLocation == LOGTOFILE)
+   {
+      if (fwrite(buf, 1, len, logFileHandle) != len)
+         sinkFailed = YES;
+      return;
+   }
+   for (line = buf; line < buf + len; line = end)
+   {
+      end = (char *) memchr(line, '\n', buf + len - line) + 1;
+      saved = *end;
+      *end = '\0';
+      putLogLine(line);
+      *end = saved;
+   }
+}
+
+/**
+* Write the whole queue of ended records, formatted in parallel by up
+* to LogFormatWorkers threads: the queue is split into contiguous
+* parts, each formatted into its own buffer, and the buffers are put
+* in the log in order, so the log is the same as with one worker. The
+* records are left linked in queue order, for the caller to free once
+* the log is closed. The caller must hold the logfileMutex and have the
+* log open.
+* @param workers is the number of workers to use
+* @param bytes is increased by the bytes written
+* @param first is set to the first record written, 0 if none
+* @param last is set to the last record written
+* @return the number of records written
+*/
+static unsigned long writeFormattedParallel(unsigned int workers,
+                                            unsigned long *bytes,
+                                            struct dlogLoggingData **first,
+                                            struct dlogLoggingData **last)
+{
+   struct dlogLoggingData *rec;
+   struct dlogFormatJob *job;
+   char buff[MAXLOGTOFILE];
+   unsigned long n, per, i;
+   unsigned int j, jobs;
+
+   for (; formatThreadCount < workers; formatThreadCount++)
+      if (pthread_create(&formatThreads[formatThreadCount], 0, formatWorker,
+                         (void *) (unsigned long) formatThreadCount) != 0)
+         break;
+   if (!(rec = *first = dlogTakeLoggingDataList(&endedXferList, &n)))
+      return 0;
+   jobs = (workers < formatThreadCount) ? workers : formatThreadCount;
+   per = (n + jobs - 1) / jobs;
+   for (j=0; j < jobs && rec; j++)
+   {
+      formatJobs[j].first = rec;
+      formatJobs[j].count = (n - j*per < per) ? n - j*per : per;
+      for (i=0; i < formatJobs[j].count; i++)
+         rec = rec->next;
+   }
+   jobs = j;
+
+   pthread_mutex_lock( &formatMutex );
+   for (j=1; j < jobs; j++)
+      formatJobs[j].ready = 1;
+   formatPending = jobs - 1;
+   pthread_cond_broadcast( &formatStart );
+   pthread_mutex_unlock( &formatMutex );
+   formatJobRecords(&formatJobs[0]);
+   pthread_mutex_lock( &formatMutex );
+   while (formatPending > 0)
+      pthread_cond_wait( &formatDone, &formatMutex );
+   pthread_mutex_unlock( &formatMutex );
+
+   // in order: the lines of each job, and the records a job could not
+   // format done here
+   for (j=0; j < jobs; j++)
+   {
+      job = &formatJobs[j];
+      putLogLines(job->buf, job->used);
+      *bytes += job->used;
+      for (i=0, rec = job->first; i < job->count; i++, rec = rec->next)
+      {
+         if (i >= job->formatted)
+         {
+            *bytes += formatRecord(rec, appName, sessionID, buff,
+                                   sizeof(buff));
+            putLogLine(buff);
+         }
+         *last = rec;
+      }
+   }
+   return n;
+}
+
+/** Magic string at the start of every spill file */
+#define SPILLMAGIC    "DLOGSPL2"
+/** Largest encoded record: fixed part plus all strings */
+#define MAXENCODED    (112 + 4*MAXFILEPATH + MAXUSER + MAXANNOTATION + \
+                       2*MAXHOSTNAME + 16 + 2 + \
+                       MAXFIELDARENA + MAXFIELDARENA/3*(MAXFIELDKEY+2))
+/** Length flag of a spill file entry that defines an interned string */
+#define SPILLDEFINE   0x80000000u
+/** Largest spill file entry: a record and the definitions of its strings */
+#define MAXSPILLENTRY (sizeof(unsigned int) + MAXENCODED + \
+                       5*(2*sizeof(unsigned int) + MAXFILEPATH))
+/** Spill file output is written this much at a time */
+#define SPILLCHUNK    (64<<10)
+/** Largest intern handle accepted from a spill file */
+#define MAXSPILLHANDLE (1u<<20)
+
+/**
+* Append a byte string to an encoding buffer
+* @return the new buffer position
+*/
+static unsigned char *encodeBytes(unsigned char *pos, void *val,
+                                  unsigned int len)
+{
+   memcpy(pos, val, len);
+   return pos + len;
+}
+
+/**
+* Append a string to an encoding buffer as a 16-bit length and the
+* characters, without the terminating null
+* @return the new buffer position
+*/
+static unsigned char *encodeString(unsigned char *pos, const char *str)
+{
+   unsigned short len = (unsigned short) strlen(str);
+   pos = encodeBytes(pos, &len, sizeof(len));
+   return encodeBytes(pos, (void *) str, len);
+}
+
+/**
+* Append an interned record string to an encoding buffer as its 32-bit
+* handle; a string that is not interned has handle 0 and follows as a
+* 16-bit length and the characters, null terminated so the decoded
+* record can point at it
+* @return the new buffer position
+*/
+static unsigned char *encodeInterned(unsigned char *pos,
+                                     struct dlogLoggingData *data,
+                                     const char *str, unsigned char own)
+{
+   unsigned int handle = internHandle(data, str, own);
+   pos = encodeBytes(pos, &handle, sizeof(handle));
+   if (handle)
+      return pos;
+   pos = encodeString(pos, str);
+   *pos = '\0';
+   return pos + 1;
+}
+
+/**
+* Encode a record in the compact binary form used in spill files:
+* the numeric fields in host byte order, then each string with a
+* 16-bit length prefix, then the custom fields. Interned strings are
+* written as handles, defined once per spill file by encodeSpillStrings().
+* Only the logged values are kept, so a record with most fields
+* disabled encodes to a few dozen bytes. Custom fields are written with
+* their key names, since key numbers are only meaningful within one
+* process.
+* @param data is the record to encode
+* @param buf is the output buffer, at least MAXENCODED bytes
+* @return the number of bytes used in buf
+*/
+static unsigned int encodeRecord(struct dlogLoggingData *data,
+                                 unsigned char *buf)
+{
+   unsigned char *pos = buf, *arena = data->fieldArena;
+   unsigned char flags;
+   unsigned short nfields;
+   long long sec;
+   unsigned int usec, i;
+
+   pos = encodeBytes(pos, &data->id, sizeof(data->id));
+   pos = encodeBytes(pos, &data->size, sizeof(data->size));
+   sec = data->startTval.tv_sec;
+   usec = data->startTval.tv_usec;
+   pos = encodeBytes(pos, &sec, sizeof(sec));
+   pos = encodeBytes(pos, &usec, sizeof(usec));
+   sec = data->endTval.tv_sec;
+   usec = data->endTval.tv_usec;
+   pos = encodeBytes(pos, &sec, sizeof(sec));
+   pos = encodeBytes(pos, &usec, sizeof(usec));
+   pos = encodeBytes(pos, &data->errorFlag, sizeof(data->errorFlag));
+   pos = encodeBytes(pos, &data->weight, sizeof(data->weight));
+   pos = encodeBytes(pos, &data->minRate, sizeof(data->minRate));
+   pos = encodeBytes(pos, &data->maxRate, sizeof(data->maxRate));
+   flags = (data->xferType == DLOG_RECEIVE) | 
+           ((data->stalled == YES) << 1) | ((data->timedOut == YES) << 2) |
+           ((data->progressKnown == YES) << 3);
+   pos = encodeBytes(pos, &flags, sizeof(flags));
+   pos = encodeString(pos, data->fileName);
+   pos = encodeInterned(pos, data, data->fileExt, OWN_FILEEXT);
+   pos = encodeInterned(pos, data, data->sourceDir, OWN_SOURCEDIR);
+   pos = encodeInterned(pos, data, data->targetDir, OWN_TARGETDIR);
+   pos = encodeString(pos, data->user);
+   pos = encodeString(pos, data->annotation);
+   pos = encodeInterned(pos, data, data->sourceIP, OWN_SOURCEIP);
+   pos = encodeInterned(pos, data, data->targetIP, OWN_TARGETIP);
+   for (i=0, nfields=0; i < data->fieldArenaUsed; i += 3 + arena[i+2])
+      nfields++;
+   pos = encodeBytes(pos, &nfields, sizeof(nfields));
+   for (i=0; i < data->fieldArenaUsed; i += 3 + arena[i+2])
+   {
+      pos = encodeString(pos, fieldKeys[arena[i]-1]);
+      pos = encodeBytes(pos, arena+i+1, 2 + arena[i+2]);
+   }
+   return pos - buf;
+}
+
+/**
+* Take a value out of an encoded record
+* @return the new buffer position, or 0 if the record is too short
+*/
+static unsigned char *decodeBytes(unsigned char *pos, unsigned char *end,
+                                  void *val, unsigned int len)
+{
+   if (!pos || pos + len > end)
+      return 0;
+   memcpy(val, pos, len);
+   return pos + len;
+}
+
+/**
+* Take a string out of an encoded record, truncating it if it does not
+* fit its destination
+* @return the new buffer position, or 0 if the record is too short
+*/
+static unsigned char *decodeString(unsigned char *pos, unsigned char *end,
+                                   char *str, unsigned int size)
+{
+   unsigned short len;
+   if (!(pos = decodeBytes(pos, end, &len, sizeof(len))) || pos+len > end)
+      return 0;
+   if (len < size)
+      size = len + 1;
+   memcpy(str, pos, size-1);
+   str[size-1] = '\0';
+   return pos + len;
+}
+
+/**
+* Take an interned string out of an encoded record: either a handle
+* defined earlier in the spill file, or an inline string
+* @param pos is the buffer position
+* @param end is the end of the encoded record
+* @param str is set to the string; it points into strings or the buffer
+* @param strings is the table of strings defined in the spill file
+* @param numStrings is the size of strings
+* @return the new buffer position, or 0 if the record is malformed
+*/
+static unsigned char *decodeInterned(unsigned char *pos, unsigned char *end,
+                                     const char **str, char **strings,
+                                     unsigned int numStrings)
+{
+   unsigned int handle;
+   unsigned short len;
+
+   if (!(pos = decodeBytes(pos, end, &handle, sizeof(handle))))
+      return 0;
+   if (handle)
+   {
+      if (handle >= numStrings || !strings[handle])
+         return 0;
+      *str = strings[handle];
+      return pos;
+   }
+   if (!(pos = decodeBytes(pos, end, &len, sizeof(len))) ||
+       pos + len + 1 > end || pos[len] != '\0')
+      return 0;
+   *str = (const char *) pos;
+   return pos + len + 1;
+}
+
+/**
+* Decode a record encoded by encodeRecord()
+* @param buf is the encoded record
+* @param len is its length
+* @param data is the (zeroed) record to fill in; its interned strings
+*        point into strings or buf
+* @param strings is the table of strings defined in the spill file
+* @param numStrings is the size of strings
+* @return 0 on success, 1 if the encoding is malformed
+*/
+static unsigned int decodeRecord(unsigned char *buf, unsigned int len,
+                                 struct dlogLoggingData *data,
+                                 char **strings, unsigned int numStrings)
+{
+   unsigned char *pos = buf, *end = buf + len;
+   unsigned char flags = 0, field[2];
+   unsigned short nfields = 0;
+   long long sec = 0;
+   unsigned int usec = 0, key;
+   char keyName[MAXFIELDKEY];
+
+   pos = decodeBytes(pos, end, &data->id, sizeof(data->id));
+   pos = decodeBytes(pos, end, &data->size, sizeof(data->size));
+   pos = decodeBytes(pos, end, &sec, sizeof(sec));
+   pos = decodeBytes(pos, end, &usec, sizeof(usec));
+   data->startTval.tv_sec = sec;
+   data->startTval.tv_usec = usec;
+   pos = decodeBytes(pos, end, &sec, sizeof(sec));
+   pos = decodeBytes(pos, end, &usec, sizeof(usec));
+   data->endTval.tv_sec = sec;
+   data->endTval.tv_usec = usec;
+   pos = decodeBytes(pos, end, &data->errorFlag, sizeof(data->errorFlag));
+   pos = decodeBytes(pos, end, &data->weight, sizeof(data->weight));
+   pos = decodeBytes(pos, end, &data->minRate, sizeof(data->minRate));
+   pos = decodeBytes(pos, end, &data->maxRate, sizeof(data->maxRate));
+   pos = decodeBytes(pos, end, &flags, sizeof(flags));
+   data->xferType = (flags & 1) ? DLOG_RECEIVE : DLOG_SEND;
+   data->stalled = (flags & 2) ? YES : NO;
+   data->timedOut = (flags & 4) ? YES : NO;
+   data->progressKnown = (flags & 8) ? YES : NO;
+   pos = decodeString(pos, end, data->fileName, sizeof(data->fileName));
+   pos = decodeInterned(pos, end, &data->fileExt, strings, numStrings);
+   pos = decodeInterned(pos, end, &data->sourceDir, strings, numStrings);
+   pos = decodeInterned(pos, end, &data->targetDir, strings, numStrings);
+   pos = decodeString(pos, end, data->user, sizeof(data->user));
+   pos = decodeString(pos, end, data->annotation,
+                      sizeof(data->annotation));
+   pos = decodeInterned(pos, end, &data->sourceIP, strings, numStrings);
+   pos = decodeInterned(pos, end, &data->targetIP, strings, numStrings);
+   pos = decodeBytes(pos, end, &nfields, sizeof(nfields));
+   for (; pos && nfields > 0; nfields--)
+   {
+      pos = decodeString(pos, end, keyName, sizeof(keyName));
+      pos = decodeBytes(pos, end, field, sizeof(field));
+      if (!pos || pos + field[1] > end)
+         return 1;
+      // keys from another process are registered here by name
+      if ((key = registerFieldKey(keyName)) != 0)
+         arenaSetField(data, key, field[0], pos, field[1]);
+      pos += field[1];
+   }
+   return (pos == 0);
+}
+
+/**
+* Encode the definitions of a record's interned strings that are not
+* yet defined in a spill file. A definition is an entry whose length
+* has the SPILLDEFINE bit set, holding the handle and the characters.
+* @param out is the output buffer
+* @param data is the record about to be spilled
+* @param defined is a bitmap of the handles already defined in this
+*        file, or 0 to define every string
+* @return the number of bytes used in out
+*/
+static unsigned int encodeSpillStrings(unsigned char *out,
+                                       struct dlogLoggingData *data,
+                                       unsigned char *defined)
+{
+   const char *strs[5];
+   unsigned char owns[5] = {OWN_FILEEXT, OWN_SOURCEDIR, OWN_TARGETDIR,
+                            OWN_SOURCEIP, OWN_TARGETIP};
+   unsigned char *pos = out;
+   unsigned int i, handle, len;
+
+   strs[0] = data->fileExt;
+   strs[1] = data->sourceDir;
+   strs[2] = data->targetDir;
+   strs[3] = data->sourceIP;
+   strs[4] = data->targetIP;
+   for (i=0; i < 5; i++)
+   {
+      if (!(handle = internHandle(data, strs[i], owns[i])))
+         continue;
+      if (defined)
+      {
+         if (defined[handle>>3] & (1 << (handle&7)))
+            continue;
+         defined[handle>>3] |= 1 << (handle&7);
+      }
+      len = (sizeof(handle) + strlen(strs[i])) | SPILLDEFINE;
+      pos = encodeBytes(pos, &len, sizeof(len));
+      pos = encodeBytes(pos, &handle, sizeof(handle));
+      pos = encodeBytes(pos, (void *) strs[i], strlen(strs[i]));
+   }
+   return pos - out;
+}
+
+/**
+* Open this session's spill file for appending and lock it, so that no
+* other process replays it while it is written. The spill directory
+* may be shared with other users (/var/tmp), so a symbolic link, a
+* file with more than one link, or one owned by someone else is not
+* written to. If the file was replayed and removed while we waited for
+* the lock, it is created again.
+* @param filename is the spill file
+* @param size is set to its size
+* @return the locked file descriptor, or -1 if it cannot be used
+*/
+static int openSpillFile(const char *filename, off_t *size)
+{
+   struct stat fileStat, nameStat;
+   int fd, tries;
+
+   for (tries = 0; tries < 3; tries++)
+   {
+      fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW |
+                O_CLOEXEC, 0600);
+      if (fd < 0)
+         return -1;
+      if (lockf(fd, F_LOCK, 0) != 0 || fstat(fd, &fileStat) != 0 ||
+          !S_ISREG(fileStat.st_mode) || fileStat.st_uid != geteuid())
+         break;
+      if (stat(filename, &nameStat) == 0 &&
+          nameStat.st_ino == fileStat.st_ino &&
+          nameStat.st_dev == fileStat.st_dev)
+      {
+         if (fileStat.st_nlink != 1)
+            break;
+         *size = fileStat.st_size;
+         return fd;
+      }
+      close(fd); // replayed meanwhile
+   }
+   if (tries < 3)
+      close(fd);
+   return -1;
+}
+
+/**
+* Write spill file output, or cut the file back to what was written
+* before if it cannot all be written, so that a failed write never
+* leaves a partial entry in the middle of the file
+* @param fd is the spill file
+* @param buf is the output
+* @param len is its length
+* @param size is the size of the file, updated if the write succeeds
+* @return 0 on success, 1 if the output could not be written
+*/
+static unsigned int writeSpillChunk(int fd, unsigned char *buf,
+                                    unsigned long len, off_t *size)
+{
+   unsigned long done = 0;
+   ssize_t ret;
+
+   while (done < len)
+   {
+      ret = write(fd, buf + done, len - done);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+      {
+         // if this fails too, replaying stops at the partial entry
+         ret = ftruncate(fd, *size);
+         return 1;
+      }
+      done += ret;
+   }
+   *size += len;
+   return 0;
+}
+
+/**
+* Move every record in the ended queue to this session's spill file in
+* the spill directory. A spill file starts with SPILLMAGIC, the session
+* ID and the application name, followed by length-prefixed encoded
+* records and string definitions. The file is locked while it is
+* written and written SPILLCHUNK bytes at a time; records that cannot
+* be written are dropped. The caller must hold the logfileMutex.
+* @return 0 on success, 1 if the spill file cannot be written (the
+*         records are left queued)
+*/
+static unsigned int spillLoggingData()
+{
+   char filename[MAXFILEPATH+64];
+   struct dlogLoggingData *data;
+   unsigned char *chunk, *defined;
+   unsigned long used = 0, records = 0;
+   unsigned int len;
+   unsigned short appLen;
+   off_t size;
+   int fd;
+
+   snprintf(filename, sizeof(filename), "%s/dlog-spill-%lu.bin",
+            currentConfig()->spillDirectory, sessionID);
+   if ((fd = openSpillFile(filename, &size)) < 0)
+      return 1;
+   // strings are defined again each time the file is opened, since
+   // another process may have replayed it in between
+   chunk = (unsigned char *) malloc(SPILLCHUNK);
+   defined = (unsigned char *) calloc(internTableSize/8 + 1, 1);
+   if (!chunk || !defined)
+   {
+      free(chunk);
+      free(defined);
+      close(fd);
+      return 1;
+   }
+   if (size == 0)
+   {
+      appLen = (unsigned short) strlen(appName);
+      memcpy(chunk, SPILLMAGIC, strlen(SPILLMAGIC));
+      used = strlen(SPILLMAGIC);
+      memcpy(chunk + used, &sessionID, sizeof(sessionID));
+      used += sizeof(sessionID);
+      memcpy(chunk + used, &appLen, sizeof(appLen));
+      used += sizeof(appLen);
+      memcpy(chunk + used, appName, appLen);
+      used += appLen;
+      if (writeSpillChunk(fd, chunk, used, &size) != 0)
+      {
+         free(chunk);
+         free(defined);
+         close(fd);
+         return 1;
+      }
+      used = 0;
+   }
+   while ((data=dlogRemoveLoggingData(&endedXferList,0))!=NULL)
+   {
+      if (used + MAXSPILLENTRY > SPILLCHUNK)
+      {
+         if (writeSpillChunk(fd, chunk, used, &size) != 0)
+         {
+            // out of spill space too; nothing left to do but drop them
+            __atomic_add_fetch(&droppedRecords, records, __ATOMIC_RELAXED);
+            memset(defined, 0, internTableSize/8 + 1);
+         } else {
+            __atomic_add_fetch(&spilledRecords, records, __ATOMIC_RELAXED);
+         }
+         used = records = 0;
+      }
+      used += encodeSpillStrings(chunk + used, data, defined);
+      len = encodeRecord(data, chunk + used + sizeof(len));
+      memcpy(chunk + used, &len, sizeof(len));
+      used += sizeof(len) + len;
+      records++;
+      freeLoggingData(data);
+   }
+   if (used > 0 && writeSpillChunk(fd, chunk, used, &size) != 0)
+      __atomic_add_fetch(&droppedRecords, records, __ATOMIC_RELAXED);
+   else
+      __atomic_add_fetch(&spilledRecords, records, __ATOMIC_RELAXED);
+   free(chunk);
+   free(defined);
+   close(fd); // and unlock
+   spillPending = YES;
+   return 0;
+}
+
+/**
+* Replay one spill file into the open log. A record that cannot be
+* decoded is skipped; only a damaged length (e.g. a tail cut short by
+* a crash while spilling) ends the replay early. The caller must hold
+* the logfileMutex and the lock on the file.
+* @param spill is the spill file
+* @return 0 if every record was put in the log, 1 if the log could not
+*         be written, so the file must be kept
+*/
+static unsigned int replaySpillFile(FILE *spill)
+{
+   char buff[MAXLOGTOFILE], app[MAXFILEPATH];
+   char **strings = 0, **grown;
+   unsigned char *buf;
+   unsigned long session, replayed = 0, bytes = 0;
+   unsigned short appLen;
+   unsigned int len, handle, numStrings = 0, n;
+   struct dlogLoggingData *data;
+
+   buf = (unsigned char *) malloc(MAXENCODED);
+   data = (struct dlogLoggingData *) malloc(sizeof(struct dlogLoggingData));
+   if (buf && data &&
+       fread(buff, 1, strlen(SPILLMAGIC), spill) == strlen(SPILLMAGIC) &&
+       !strncmp(buff, SPILLMAGIC, strlen(SPILLMAGIC)) &&
+       fread(&session, sizeof(session), 1, spill) == 1 &&
+       fread(&appLen, sizeof(appLen), 1, spill) == 1 &&
+       appLen < sizeof(app) && fread(app, 1, appLen, spill) == appLen)
+   {
+      app[appLen] = '\0';
+      while (fread(&len, sizeof(len), 1, spill) == 1)
+      {
+         if (len & SPILLDEFINE)
+         {
+            // an interned string definition: handle and characters
+            len &= ~SPILLDEFINE;
+            if (len < sizeof(handle) || len > sizeof(handle) + MAXFILEPATH ||
+                fread(&handle, sizeof(handle), 1, spill) != 1)
+               break;
+            len -= sizeof(handle);
+            if (handle == 0 || handle > MAXSPILLHANDLE)
+            {
+               if (fseek(spill, len, SEEK_CUR) != 0)
+                  break;
+               continue; // records using it are skipped
+            }
+            if (handle >= numStrings)
+            {
+               n = (handle+1 > 2*numStrings) ? handle+1 : 2*numStrings;
+               if (!(grown = (char **) realloc(strings, n*sizeof(char *))))
+                  break;
+               memset(grown+numStrings, 0, (n-numStrings)*sizeof(char *));
+               strings = grown;
+               numStrings = n;
+            }
+            free(strings[handle]);
+            if (!(strings[handle] = (char *) malloc(len+1)) ||
+                fread(strings[handle], 1, len, spill) != len)
+               break;
+            strings[handle][len] = '\0';
+            continue;
+         }
+         if (len > MAXENCODED || fread(buf, 1, len, spill) != len)
+            break;
+         memset(data, 0, sizeof(struct dlogLoggingData));
+         if (decodeRecord(buf, len, data, strings, numStrings) != 0)
+         {
+            __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+            continue; // damaged, or planted; the rest may be fine
+         }
+         data->config = currentConfig();
+         bytes += formatRecord(data, app, session, buff, sizeof(buff));
+         replayed++;
+         columnSinkRecord(data, app, session);
+         putLogLine(buff);
+      }
+   }
+   for (n=0; n < numStrings; n++)
+      free(strings[n]);
+   free(strings);
+   free(buf);
+   free(data);
+   if (!buf || !data || flushLogSink() != 0)
+      return 1;
+   statCount(STAT_WRITTEN, replayed);
+   statCount(STAT_BYTES, bytes);
+   return 0;
+}
+
+/**
+* Replay all spill files in the spill directory into the open log,
+* including those left behind by other processes. A file is only
+* replayed if it is a regular file of ours with one link, and if we get
+* its lock: a live process spilling into it holds the lock, and a dead
+* one does not. It is removed, with the lock held, once all its records
+* are in the log; if the log cannot be written it is kept for the next
+* try. The caller must hold the logfileMutex.
+* @return nothing
+*/
+static void replaySpillFiles()
+{
+   char filename[MAXFILEPATH+256];
+   char *spillDirectory = currentConfig()->spillDirectory;
+   struct stat fileStat, nameStat;
+   struct dirent *entry;
+   YesNoFlag kept = NO;
+   unsigned int len;
+   FILE *spill;
+   DIR *dir;
+   int fd;
+
+   if (!(dir = opendir(spillDirectory)))
+      return;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      len = strlen(entry->d_name);
+      if (strncmp(entry->d_name, "dlog-spill-", 11) || len < 4 ||
+          strcmp(entry->d_name + len - 4, ".bin"))
+         continue;
+      snprintf(filename, sizeof(filename), "%s/%s", spillDirectory,
+               entry->d_name);
+      if ((fd = open(filename, O_RDWR | O_NOFOLLOW | O_NONBLOCK |
+                     O_CLOEXEC)) < 0)
+         continue;
+      if (fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode) ||
+          fileStat.st_uid != geteuid() || fileStat.st_nlink != 1 ||
+          lockf(fd, F_TLOCK, 0) != 0 || stat(filename, &nameStat) != 0 ||
+          nameStat.st_ino != fileStat.st_ino ||
+          nameStat.st_dev != fileStat.st_dev || !(spill = fdopen(fd, "rb")))
+      {
+         // not ours, being written, or replayed by someone else already
+         close(fd);
+         continue;
+      }
+      if (replaySpillFile(spill) == 0)
+         unlink(filename);
+      else
+         kept = YES;
+      fclose(spill); // and unlock
+      if (kept == YES)
+         break; // the log cannot be written now
+   }
+   closedir(dir);
+   spillPending = kept;
+}
+
+/**
+* Add up the self-metrics shards into a snapshot
+* @param stats is the snapshot to fill in
+* @return nothing
+*/
+static void collectStats(struct dlogStats *stats)
+{
+   unsigned long counters[STATCOUNTERS];
+   int s,c,t;
+
+   memset(stats, 0, sizeof(struct dlogStats));
+   memset(counters, 0, sizeof(counters));
+   for (s=0; s < STATSHARDS; s++)
+   {
+      for (c=0; c < STATCOUNTERS; c++)
+         counters[c] += __atomic_load_n(&statShards[s].counters[c],
+                                        __ATOMIC_RELAXED);
+      for (t=0; t < DLOG_STAT_TIMERS; t++)
+         histogramMerge(&stats->timers[t], &statShards[s].timers[t]);
+   }
+   stats->begun = counters[STAT_BEGUN];
+   stats->ended = counters[STAT_ENDED];
+   stats->refused = counters[STAT_REFUSED];
+   stats->stripped = counters[STAT_STRIPPED];
+   stats->timedOut = counters[STAT_TIMEDOUT];
+   stats->written = counters[STAT_WRITTEN];
+   stats->flushes = counters[STAT_FLUSHES];
+   stats->bytesWritten = counters[STAT_BYTES];
+   stats->dropped = __atomic_load_n(&droppedRecords, __ATOMIC_RELAXED);
+   stats->spilled = __atomic_load_n(&spilledRecords, __ATOMIC_RELAXED);
+   stats->active = __atomic_load_n(&activeXferList.count, __ATOMIC_RELAXED);
+   stats->queued = __atomic_load_n(&endedXferList.count, __ATOMIC_RELAXED);
+   stats->memoryUsed = __atomic_load_n(&memoryUsed, __ATOMIC_RELAXED);
+   stats->memoryBudget = configReadBegin()->memoryBudget << 20;
+   configReadEnd();
+}
+
+/**
+* Log a STATS record with the self-metrics, if LogStatsInterval has
+* passed since the last one and records have come and gone. The
+* counters are totals since dlogInit(); the timers give count, total,
+* p50, p99 and max in nanoseconds. The caller must hold the
+* logfileMutex and have the log open.
+* @return nothing
+*/
+static void writeStatsData()
+{
+   static char *timerNames[DLOG_STAT_TIMERS] =
+      {"write", "generalWait", "logfileWait", "md5", "dns"};
+   static unsigned long reportedActivity = ULONG_MAX;
+   unsigned long activity;
+   struct dlogStats *stats;
+   struct dlogHistogram *hist;
+   char buff[MAXLOGTOFILE];
+   unsigned long long now = currentMicroseconds();
+   unsigned int len, end = sizeof(buff) - 3; // room for the terminator
+   int json = (sinkConfig->logFormat == FORMAT_JSON), t;
+
+   if (sinkConfig->statsInterval == 0 ||
+       now < statsReportTime + sinkConfig->statsInterval)
+      return;
+   if (!(stats = (struct dlogStats *) malloc(sizeof(struct dlogStats))))
+      return;
+   collectStats(stats);
+   activity = stats->begun + stats->ended + stats->written +
+              stats->dropped + stats->spilled;
+   if (activity == reportedActivity)
+   {
+      free(stats);
+      return;
+   }
+   reportedActivity = activity;
+   statsReportTime = now;
+   len = bufferAppName(buff, end, json);
+   len = bufferPrintf(buff, len, end, json ?
+                  ",\"type\":\"STATS\",\"session\":%lu,"
+                  "\"begun\":%lu,\"ended\":%lu,\"timedOut\":%lu,"
+                  "\"written\":%lu,"
+                  "\"dropped\":%lu,\"spilled\":%lu,\"active\":%lu,"
+                  "\"queued\":%lu,\"flushes\":%lu,\"bytes\":%lu,"
+                  "\"memory\":%lu,\"refused\":%lu,\"stripped\":%lu" :
+                  " STATS session=%lu begun=%lu ended=%lu timedOut=%lu "
+                  "written=%lu "
+                  "dropped=%lu spilled=%lu active=%lu queued=%lu "
+                  "flushes=%lu bytes=%lu memory=%lu refused=%lu "
+                  "stripped=%lu",
+                  sessionID, stats->begun, stats->ended,
+                  stats->timedOut, stats->written, stats->dropped,
+                  stats->spilled, stats->active, stats->queued, stats->flushes,
+                  stats->bytesWritten, stats->memoryUsed, stats->refused,
+                  stats->stripped);
+   for (t=0; t < DLOG_STAT_TIMERS && len < end; t++)
+   {
+      hist = &stats->timers[t];
+      len += snprintf(buff+len, end-len, json ?
+                      ",\"%s\":{\"count\":%lu,\"totalNs\":%lu,"
+                      "\"p50Ns\":%lu,\"p99Ns\":%lu,\"maxNs\":%lu}" :
+                      " %s=%lu/%lu/%lu/%lu/%lu",
+                      timerNames[t], hist->count, hist->sum,
+                      histogramPercentile(hist, 50.0),
+                      histogramPercentile(hist, 99.0), hist->max);
+   }
+   if (len >= end) // truncated: snprintf() returns the length it wanted
+      len = end - 1;
+   snprintf(buff+len, sizeof(buff)-len, json ? "}\n" : "\n");
+   putLogLine(buff);
+   free(stats);
+}
+
+static void freeRetiredConfigs();
+
+/**
+* Process all finished transfer records and write them out to log file or
+* syslog. This processes the endedXferList and logs all entries on the
+* list, leaving it empty. Spill files are replayed first, since their
+* records are older, and a DROPPED record is logged if records were
+* dropped or spilled since the last report. The records are freed once
+* the log is closed; if writing the log file failed they are put back
+* at the head of the queue, where the overflow policy applies to them.
+* @return 0 on sucess, other if error
+*/
+static unsigned int writeLogData()
+{
+   struct dlogLoggingData *data=0, *first=0, *last=0, *next;
+   char buff[MAXLOGTOFILE];
+   unsigned long dropped, spilled, written=0, bytes=0;
+   unsigned long long start = statNanos(), elapsed;
+   unsigned int workers;
+   int stat=0, json;
+
+   DLOGPROBE(flush_start, endedXferList.count);
+
+   // a pthread lock is used for local thread mutex,
+   // then lockf() is used for system-wide file locking;
+   // perhaps only lockf() is not needed, but it should be safe
+   statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+
+   if (openLogSink() != 0)
+   {
+      pthread_mutex_unlock( &logfileMutex );
+      DLOGPROBE(flush_done, 0, 0, statNanos() - start);
+      return 1;
+   }
+
+   // Now we have our logging connection, so log some records
+   
+   if (spillPending == YES)
+      replaySpillFiles();
+
+   // TODO: Create timestamp formats
+
+   // large batches are formatted by several workers
+   workers = currentConfig()->formatWorkers;
+   if (workers > 1 && endedXferList.count >= PARALLELFORMAT)
+      written = writeFormattedParallel(workers, &bytes, &first, &last);
+
+   // grab finished records until there are no more
+   while ((data=dlogRemoveLoggingData(&endedXferList,0))!=NULL)
+   {
+      bytes += formatRecord(data, appName, sessionID, buff, sizeof(buff));
+      // now log the record      
+      putLogLine(buff);
+      if (last)
+         last->next = data;
+      else
+         first = data;
+      last = data;
+      written++;
+   }
+
+   dropped = __atomic_load_n(&droppedRecords, __ATOMIC_RELAXED);
+   spilled = __atomic_load_n(&spilledRecords, __ATOMIC_RELAXED);
+   if (dropped != reportedDropped || spilled != reportedSpilled)
+   {
+      json = (sinkConfig->logFormat == FORMAT_JSON);
+      bufferPrintf(buff, bufferAppName(buff, sizeof(buff), json),
+                   sizeof(buff), json ? ",\"type\":\"DROPPED\","
+                   "\"session\":%lu,\"dropped\":%lu,\"spilled\":%lu}\n" :
+                   " DROPPED session=%lu dropped=%lu spilled=%lu\n",
+                   sessionID, dropped, spilled);
+      putLogLine(buff);
+      reportedDropped = dropped;
+      reportedSpilled = spilled;
+   }
+   writeStatsData();
+
+   // now close off the logging facility
+   if (closeLogSink() != 0 && written > 0)
+   {
+      // keep them for another try, or for the overflow policy
+      dlogAddLoggingDataChain(&endedXferList, first, last, written);
+      written = bytes = 0;
+      stat = 1;
+   }
+   for (data = first; written > 0 && data; data = next)
+   {
+      next = (data == last) ? 0 : data->next;
+      columnSinkRecord(data, appName, sessionID);
+      freeLoggingData(data);
+   }
+   if (written > 0)
+   {
+      statCount(STAT_WRITTEN, written);
+      statCount(STAT_BYTES, bytes);
+      statCount(STAT_FLUSHES, 1);
+   }
+   // the records freed may have held the last of a replaced config
+   freeRetiredConfigs();
+   
+   // release the logfile mutex
+   pthread_mutex_unlock( &logfileMutex );
+   elapsed = statTime(DLOG_STAT_WRITE, start);
+   DLOGPROBE(flush_done, written, bytes, elapsed);
+   
+   if (!stat)
+      return 0;
+   return 2+stat; // send unique errors on up
+}
+
+
+/**
+* Put an ended record on the write queue, applying the overflow policy
+* if the queue is at its limit: block until the queue is written, drop
+* the new record, drop the oldest queued record, or spill the queue to
+* disk (falling back to dropping the oldest if spilling fails).
+* @param data is the ended record
+* @return nothing
+*/
+static void queueEndedRecord(struct dlogLoggingData *data)
+{
+   struct dlogConfig *cfg = configReadBegin();
+   struct dlogLoggingData *old;
+   struct timespec sleepTime;
+   unsigned int stat;
+
+   if (cfg->queueLimit == 0 || endedXferList.count < cfg->queueLimit)
+   {
+      dlogQueueLoggingData(&endedXferList, data);
+      configReadEnd();
+      return;
+   }
+   switch (cfg->overflowPolicy)
+   {
+      case OVERFLOW_BLOCK:
+         while (endedXferList.count >= cfg->queueLimit)
+         {
+            if (writeLogData() != 0)
+            {
+               sleepTime.tv_sec = 0;
+               sleepTime.tv_nsec = 10000000; // (1/100 second)
+               nanosleep(&sleepTime,0);
+            }
+         }
+         break;
+      case OVERFLOW_DROPNEWEST:
+         freeLoggingData(data);
+         __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+         configReadEnd();
+         return;
+      case OVERFLOW_SPILL:
+         statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+         stat = spillLoggingData();
+         pthread_mutex_unlock( &logfileMutex );
+         if (stat == 0)
+            break;
+         // else fall through and drop instead
+      case OVERFLOW_DROPOLDEST:
+         if ((old = dlogRemoveLoggingData(&endedXferList, 0)) != NULL)
+         {
+            freeLoggingData(old);
+            __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+         }
+         break;
+   }
+   dlogQueueLoggingData(&endedXferList, data);
+   configReadEnd();
+}
+
+/**
+* Put a chain of ended records on the write queue: all at once if they
+* fit, else record by record so that the overflow policy is applied
+* @param first is the first record, linked through next
+* @param last is the last record
+* @param n is the number of records
+* @return nothing
+*/
+static void queueEndedChain(struct dlogLoggingData *first,
+                            struct dlogLoggingData *last, unsigned long n)
+{
+   struct dlogLoggingData *next;
+   unsigned long queueLimit = configReadBegin()->queueLimit;
+
+   configReadEnd();
+   if (n == 0)
+      return;
+   if (queueLimit == 0 || endedXferList.count + n <= queueLimit)
+   {
+      dlogQueueLoggingDataChain(&endedXferList, first, last, n);
+      return;
+   }
+   for (; first != NULL && n > 0; first = next, n--)
+   {
+      next = first->next;
+      queueEndedRecord(first);
+   }
+}
+
+/**
+* Check if a full batch of ended records is waiting to be written
+* @return 1 if so, else 0
+*/
+static int batchReady()
+{
+   int ready = (endedXferList.count >= configReadBegin()->logBatchSize);
+
+   configReadEnd();
+   return ready;
+}
+
+#define DRAINBATCH  16384  //!< Records queued per write when draining
+
+/**
+* End every active transfer as failed, for dlogFinalize(). The active
+* list is detached in one step and the records are stamped with one
+* end time in a single pass, then written DRAINBATCH at a time (or a
+* queue limit at a time, if smaller), so the time taken is linear in
+* the number of open transfers.
+* @return nothing
+*/
+static void drainActiveTransfers()
+{
+   struct dlogLoggingData *rec, *next, *first, *last;
+   struct timeval endTval;
+   unsigned long n, batch;
+
+   if (!(rec = dlogTakeLoggingDataList(&activeXferList, &n)))
+      return;
+   statCount(STAT_ENDED, n);
+   transferTime(&endTval);
+   batch = configReadBegin()->queueLimit;
+   configReadEnd();
+   if (batch == 0 || batch > DRAINBATCH)
+      batch = DRAINBATCH;
+   while (rec)
+   {
+      first = last = 0;
+      for (n=0; rec && n < batch; rec = next)
+      {
+         next = rec->next;
+         if (endLoggingData(rec, &endTval, 0, 1) != 0)
+            continue; // not to be logged
+         if (last)
+            last->next = rec;
+         else
+            first = rec;
+         last = rec;
+         n++;
+      }
+      queueEndedChain(first, last, n);
+      writeLogData();
+   }
+}
+
+/**
+* Log one summary line per nonempty session histogram: one for each
+* transfer type and one for all transfers of the session. Only done
+* once it has been written, even if dlogFinalize() is called again.
+* @return 0 on success, 1 if the log could not be opened or written
+*/
+static unsigned int writeSummaryData()
+{
+   static char *metricNames[DLOG_HIST_METRICS] =
+      {"size", "duration", "throughput"};
+   static char *typeNames[3] = {"SEND", "RECEIVE", "ALL"};
+   struct dlogHistogram *hist;
+   char buff[MAXLOGTOFILE];
+   int t,m,json;
+
+   if (histogramsReady != YES || summaryWritten == YES)
+      return 0;
+   hist = (struct dlogHistogram *) malloc(sizeof(struct dlogHistogram));
+   if (!hist)
+      return 1;
+
+   statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+   if (openLogSink() != 0)
+   {
+      pthread_mutex_unlock( &logfileMutex );
+      free(hist);
+      return 1;
+   }
+   json = (sinkConfig->logFormat == FORMAT_JSON);
+   for (t=0; t <= DLOG_ANY; t++)
+   {
+      for (m=0; m < DLOG_HIST_METRICS; m++)
+      {
+         memset(hist, 0, sizeof(struct dlogHistogram));
+         if (t == DLOG_ANY || t == DLOG_SEND)
+            histogramMerge(hist, &transferHistograms[DLOG_SEND][m]);
+         if (t == DLOG_ANY || t == DLOG_RECEIVE)
+            histogramMerge(hist, &transferHistograms[DLOG_RECEIVE][m]);
+         if (hist->count == 0)
+            continue;
+         bufferPrintf(buff, bufferAppName(buff, sizeof(buff), json),
+                  sizeof(buff), json ?
+                  ",\"type\":\"SUMMARY\",\"xferType\":\"%s\","
+                  "\"metric\":\"%s\",\"session\":%lu,\"count\":%lu,"
+                  "\"min\":%lu,\"mean\":%lu,\"p50\":%lu,\"p90\":%lu,"
+                  "\"p99\":%lu,\"p999\":%lu,\"max\":%lu}\n" :
+                  " SUMMARY type='%s' metric='%s' session=%lu count=%lu "
+                  "min=%lu mean=%lu p50=%lu p90=%lu p99=%lu p999=%lu "
+                  "max=%lu\n",
+                  typeNames[t], metricNames[m], sessionID,
+                  hist->count, hist->min, hist->sum / hist->count,
+                  histogramPercentile(hist, 50.0),
+                  histogramPercentile(hist, 90.0),
+                  histogramPercentile(hist, 99.0),
+                  histogramPercentile(hist, 99.9), hist->max);
+         putLogLine(buff);
+      }
+   }
+   if (closeLogSink() == 0)
+      summaryWritten = YES;
+   pthread_mutex_unlock( &logfileMutex );
+   free(hist);
+   return (summaryWritten == YES) ? 0 : 1;
+}
+
+
+/**
+* Internal function to find and return the location of the config file.
+* Locations in order: environment variable "DLOG_CONFIG"; file ".dlog.rc"
+* in directory of environment variable "HOME"; the absolute file
+* "/etc/dlog/dlog.conf"
+* @return 1 if a config file was found, otherwise 0
+*/
+static int setConfigFile()
+{
+   char *confFile;
+   FILE * checkFile;
+   
+   confFile = getenv("DLOG_CONFIG");
+   if (confFile != NULL)
+   {  
+      checkFile = fopen(confFile, "rf");
+      if (checkFile)
+      {
+         fclose(checkFile);
+         strncpy(configFilename, confFile, MAXFILEPATH);
+         return 1;
+      }
+   }
+
+   confFile = getenv("HOME");
+   strcat(confFile,"/.dlog.rc");
+   if (confFile != NULL)
+   {  
+      checkFile = fopen(confFile, "rf"); 
+      if (checkFile)
+      {
+         fclose(checkFile);
+         strncpy(configFilename, confFile, MAXFILEPATH);
+         return 1;
+      }
+   }
+
+   char tmp[MAXFILEPATH] = "/etc/dlog/dlog.rc";
+   checkFile = fopen(tmp, "rf"); 
+   if (checkFile)
+   {
+      fclose(checkFile);
+      strncpy(configFilename, tmp, MAXFILEPATH);
+      return 1;
+   }
+   else
+      return 0;
+}
+
+/**
+* Internal function to mask an IP address string with netmask and leave
+* the masked network address in the same string
+* @param ip  A string containing an IP address (in/out)
+* @param mask  An int containing a netmask,(e.g. 8, 16, 24, ...)
+* @param size is the (max) size of the ip string
+* @return  nothing, the input string is changed
+*/
+static void doIPBitmask(char *ip, unsigned int mask, unsigned int size)
+{
+   struct in_addr addr,netmask;
+   unsigned long network;
+
+   if (! inet_aton(ip,&addr) ) 
+   {
+      // not a valid IP address
+      return;
+   }
+
+   netmask.s_addr = htonl(mask);
+   
+   network = ntohl(addr.s_addr) & ntohl(netmask.s_addr);
+   struct in_addr addr2;
+   addr2.s_addr = htonl(network);
+
+   strncpy(ip,inet_ntoa(addr2),size);
+   ip[size-1] = '\0';
+
+   return;
+}
+
+/**
+*  Get a local IP address. It is called if a 
+*  source or destination is local
+* @return  The local IP adress (dotted decimal), 0 if error
+*/
+static char *getLocalIP()
+{
+   int i=0;
+   char *retString = (char *) malloc(MAXFILEPATH * sizeof (char));
+   struct hostent * host; 
+      //?? = (struct hostent * ) malloc ( sizeof ( struct hostent ));
+
+   gethostname ( retString , MAXFILEPATH ) ;
+
+   if ((host = ( struct hostent * ) gethostbyname ( retString )) )
+   {
+      // JEC: May need to iterate here; danger of retrieving 127.0.?.?
+      do {
+         strcpy(retString , 
+                inet_ntoa(*((struct in_addr *)host->h_addr_list[i++])));
+      } while (strstr(retString,"127") == retString && host->h_addr_list[i]);
+      return retString;
+   }
+   else {
+      free(retString);
+      return 0;
+   }
+}
+
+
+/**
+* Get a remote host IP address from a host-name. Note that this
+* is potentially a DNS operation and thus should really be avoided.
+* @param hostName  A string containing a host-name 
+* @return  IP address of the remote host (dotted decimal string), 
+*          NULL if error
+*/
+static char *getRemoteIP(char * hostName) 
+{       
+   char *retString = 0;
+   char *tmp=0;
+
+   struct hostent *he;
+   struct in_addr **addr_list;
+   int i;
+
+   if ((he = gethostbyname( hostName ) ) == NULL) 
+   {
+      // error in gethostbyname?
+      return 0;
+   }
+
+   retString = (char *) malloc(MAXHOSTNAME * sizeof (char));
+
+   addr_list = (struct in_addr **) he->h_addr_list;
+
+   for (i = 0; addr_list[i] != NULL; i++)
+   {
+      tmp = inet_ntoa(*addr_list[i]);
+      if (strstr(tmp,"127") != tmp)
+         break;
+   }
+
+   strcpy(retString,tmp);
+   return retString;
+} 
+
+
+/**
+* Find and create an IP address string from a given machine name
+* @param name is the machine name (might be an IP address already)
+* @param ipString is a char array to hold output IP address string
+* @param size is the size of ipString array
+* @return nothing
+*/
+static void findIPAddress(char *name, char *ipString, unsigned int size)
+{
+   struct in_addr ipaddr;
+   unsigned long long start, elapsed;
+   // check if given machine name is already a valid IP address
+   if (inet_aton(name,&ipaddr))
+   {
+      strncpy(ipString,name,size);
+      ipString[size-1] = '\0';
+      return;
+   }
+   start = statNanos();
+   // else process name as a machine name
+   if (!strcmp(name,"localhost") || name[0]=='\0') 
+   {
+      // doesn't really work -- should not do this
+      char *tmp = getLocalIP();
+      if (tmp != NULL)
+      {
+         strncpy(ipString,tmp,size);
+         free(tmp);
+         tmp=NULL;
+      }
+      else
+         strcpy(ipString,"?no-IP?");
+   }
+   else
+   {  
+      char *tmp = getRemoteIP(name);
+      if (tmp != NULL)
+      {
+         strncpy(ipString,tmp,size);
+         free(tmp);
+         tmp=NULL;
+      }
+      else
+         strcpy(ipString,"?no-IP?");
+   }
+   ipString[size-1] = '\0';
+   elapsed = statTime(DLOG_STAT_DNS, start);
+   DLOGPROBE(dns_lookup, name, ipString, elapsed);
+}
+
+
+/**
+* To check and convert a number string to an integer
+* return the converted integer, and -1 if there is an error.
+* @param numstr the string to be check if it's a number.
+* @return an integer of the number string or -1 if not. (JEC: -1 is valid??)
+*/
+static int stringToNumber(char *numstr) 
+{
+  int numVal;
+  char *endPtr;
+
+  numVal = (int)strtol(numstr, &endPtr, 10);
+
+  if ((endPtr == numstr) || (*endPtr != '\0'))
+  {
+      numVal = -1;
+  }
+
+  return numVal;
+}
+
+
+/** 
+* Extract a base filename from a full path.
+* @param name  A string containing a source full path of a file including
+*              its extension.
+* @param root  Character array to hold the root file name
+* @param size  The number of characters in root;
+               root name will be at most 1 less
+* @return Nothing
+*/
+static void getBaseFilename(char *name, char *root, unsigned int size)
+{  
+   char *tmp;
+   if (!name || !root)
+      return;
+   if ((tmp = strrchr(name,'/')) )
+      strncpy(root,++tmp,size);
+   else
+      strncpy(root,name,size);
+   root[size-1] = '\0';
+}
+
+
+/**
+* Extract a directory path of a filename that has 
+* a full path (e.g. to remove the file-name and its extension)
+* @param name  string containing the full path of a file
+* @param path  character array to hold the path name
+* @param size  size of path[]; path will be at most 1 less + \0
+* @return nothing
+*/
+static void getPathFromFilename(char *name, char *path, unsigned int size)
+{  
+   char *fileNameOnly = NULL;
+   if (!name || !path) 
+      return;
+   // find last / in filename
+   if ((fileNameOnly = strrchr(name,'/')) )
+   {
+      ++fileNameOnly;
+      if ((fileNameOnly-name) < size)
+         size = (fileNameOnly-name)+1;
+      strncpy(path, name, size);
+      path[size-1] = '\0'; 
+   } else {
+      path[0] = '\0';
+   }
+   return;
+}
+
+/**
+* Extract a file extension from a file-name
+* @param name  string containing the full filename.
+* @param ext   character array to hold the file name extension
+* @param size  size of ext[]; extension will be at most 1 less + \0
+* @return nothing
+*/
+static void getFilenameExtension(char *name, char *ext, unsigned int size) 
+{
+   char *tmp;
+   if (!name || !ext)
+      return;
+   // find last dot in filename
+   if ((tmp = strrchr(name,'.')) )
+   {
+      strncpy(ext,++tmp, size);
+      ext[size-1] = '\0';
+   } else {
+      ext[0] = '\0';
+   }
+   return;
+}
+
+/**
+* Clean a string of 'bad' characters -- simply replace with '-'.
+* Characters replaced are single and double quotes (maybe more to follow).
+* @param str is the string to be cleaned (modified)
+* @param max is maximum length of string (for safety, should not be needed)
+* @return nothing, the string is modified if necessary
+*/
+static void cleanString(char* str, int max)
+{
+   int i;
+   if (max==0) max = 9999999;
+   for (i=0; str[i]!='\0' && i < max; i++) {
+      if (str[i] == '\'' || str[i]=='\"')
+         str[i] = '-';
+   }
+}
+
+/**
+* MD5 hash a logged field, timing the hash for the self-metrics
+* @param data is the field value
+* @param digest receives the hash string
+* @return nothing
+*/
+static void hashField(char *data, char *digest)
+{
+   unsigned long long start = statNanos();
+   dlogMD5(data, digest);
+   statTime(DLOG_STAT_MD5, start);
+}
+
+/**
+* Begin step: the base name of the source file, copied or MD5 hashed.
+* Quote characters are replaced, as in all the begin steps.
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginFileName(struct dlogLoggingData *logRecord,
+                          struct dlogBeginArgs *args)
+{
+   char md5buffer[24];
+
+   getBaseFilename(args->filename, logRecord->fileName,
+                   sizeof(logRecord->fileName));
+   if (logRecord->config->fileNameFormat == M_MD5)
+   {
+      hashField(logRecord->fileName, md5buffer);
+      strncpy(logRecord->fileName, md5buffer,
+              sizeof(logRecord->fileName));
+      logRecord->fileName[sizeof(logRecord->fileName)-1] = '\0';
+   }
+   cleanString(logRecord->fileName, sizeof(logRecord->fileName));
+}
+
+/**
+* Begin step: the extension of the source file, copied or MD5 hashed
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginFileExt(struct dlogLoggingData *logRecord,
+                         struct dlogBeginArgs *args)
+{
+   char md5buffer[24], fileExt[MAXFILEPATH];
+
+   getFilenameExtension(args->filename, fileExt, sizeof(fileExt));
+   if (logRecord->config->fileExtFormat == M_MD5)
+   {
+      hashField(fileExt, md5buffer);
+      strcpy(fileExt, md5buffer);
+   }
+   cleanString(fileExt, sizeof(fileExt));
+   logRecord->fileExt = internString(fileExt, logRecord, OWN_FILEEXT);
+}
+
+/**
+* Begin step: the directory of the source file (the current directory
+* if the filename has none), copied or MD5 hashed
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginSourceDir(struct dlogLoggingData *logRecord,
+                           struct dlogBeginArgs *args)
+{
+   char md5buffer[24], sourceDir[MAXFILEPATH];
+
+   getPathFromFilename(args->filename, sourceDir, sizeof(sourceDir));
+   // if source dir is empty (not in filename), use CWD
+   if (sourceDir[0] == '\0')
+   {
+      if (!getcwd(sourceDir, sizeof(sourceDir)))
+         sourceDir[0] = '\0';
+   }
+   if (logRecord->config->sourcePathFormat == M_MD5) 
+   {
+      hashField(sourceDir, md5buffer);
+      strcpy(sourceDir, md5buffer);
+   }
+   cleanString(sourceDir, sizeof(sourceDir));
+   logRecord->sourceDir = internString(sourceDir, logRecord, OWN_SOURCEDIR);
+}
+
+/**
+* Begin step: the target path, copied or MD5 hashed
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginTargetDir(struct dlogLoggingData *logRecord,
+                           struct dlogBeginArgs *args)
+{
+   char md5buffer[24], targetDir[MAXFILEPATH];
+
+   strncpy(targetDir, args->targetPath, sizeof(targetDir));
+   targetDir[sizeof(targetDir)-1] = '\0';
+   if (logRecord->config->targetPathFormat == M_MD5)
+   {
+      hashField(targetDir, md5buffer);
+      strcpy(targetDir, md5buffer);
+   }
+   cleanString(targetDir, sizeof(targetDir));
+   logRecord->targetDir = internString(targetDir, logRecord, OWN_TARGETDIR);
+}
+
+/**
+* Find the IP address string of a host for a record, as configured:
+* looked up and masked, or the host identifier as given (raw)
+* @param format is the configured format (not R_NO)
+* @param mask is the configured IP bitmask
+* @param hostname is the host name or IP address
+* @param ip is the buffer for the result
+* @param size is the size of ip
+* @return nothing
+*/
+static void hostIPString(YesNoRawFlag format, unsigned int mask,
+                         char *hostname, char *ip, unsigned int size)
+{
+   //
+   // Get IP address data TODO: simplify with less processing
+   //
+   if (format == R_YES)
+   {
+      findIPAddress(hostname, ip, size);
+      doIPBitmask(ip, mask, size);
+   } else {
+      strncpy(ip, hostname, size);
+      ip[size-1] = '\0';
+   }
+   cleanString(ip, size);
+}
+
+/**
+* Begin step: the source IP address; this may involve a name lookup
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginSourceIP(struct dlogLoggingData *logRecord,
+                          struct dlogBeginArgs *args)
+{
+   char sourceIP[MAXHOSTNAME];
+
+   hostIPString(logRecord->config->sourceIPFormat,
+                logRecord->config->sourceIPMask, args->sourceHostname,
+                sourceIP, sizeof(sourceIP));
+   logRecord->sourceIP = internString(sourceIP, logRecord, OWN_SOURCEIP);
+}
+
+/**
+* Begin step: the target IP address; this may involve a name lookup
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginTargetIP(struct dlogLoggingData *logRecord,
+                          struct dlogBeginArgs *args)
+{
+   char targetIP[MAXHOSTNAME];
+
+   hostIPString(logRecord->config->targetIPFormat,
+                logRecord->config->targetIPMask, args->targetHostname,
+                targetIP, sizeof(targetIP));
+   logRecord->targetIP = internString(targetIP, logRecord, OWN_TARGETIP);
+}
+
+/**
+* Begin step: the annotation, if one is given
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginAnnotation(struct dlogLoggingData *logRecord,
+                            struct dlogBeginArgs *args)
+{
+   if (!args->annotation)
+      return;
+   strncpy(logRecord->annotation, args->annotation,
+           sizeof(logRecord->annotation));
+   logRecord->annotation[sizeof(logRecord->annotation)-1] = '\0';
+   // Clean annotation of any quote chars
+   cleanString(logRecord->annotation, sizeof(logRecord->annotation));
+}
+
+/**
+* Begin step: the user ID, as a number or MD5 hashed
+* @param logRecord is the new record
+* @param args are the arguments of the begin call
+* @return nothing
+*/
+static void beginUser(struct dlogLoggingData *logRecord,
+                      struct dlogBeginArgs *args)
+{
+   char md5buffer[24];
+
+   sprintf(logRecord->user,"%lu",args->userID);
+   if (logRecord->config->userIDFormat == M_MD5)
+   {
+      hashField(logRecord->user, md5buffer);
+      strncpy(logRecord->user, md5buffer, sizeof(logRecord->user));
+      logRecord->user[sizeof(logRecord->user)-1] = '\0';
+   }
+   // JEC: impossible?!?
+   //if ((userID >= ULONG_MAX) || (userID < 0))
+   //   errorFlag = 1;
+}
+
+/**
+* Compile a configuration into the lists of begin steps that fill in
+* the logged fields of a new record, so that fields that are not
+* logged cost nothing at all. The per-file steps depend on the file;
+* the shared steps (hosts and user) can be done once for a batch.
+* @param cfg is the configuration, not yet published
+* @return nothing
+*/
+static void compileBeginSteps(struct dlogConfig *cfg)
+{
+   unsigned int n = 0;
+
+   if (cfg->fileNameFormat != M_NO)
+      cfg->fileSteps[n++] = beginFileName;
+   if (cfg->fileExtFormat != M_NO)
+      cfg->fileSteps[n++] = beginFileExt;
+   if (cfg->sourcePathFormat != M_NO)
+      cfg->fileSteps[n++] = beginSourceDir;
+   if (cfg->targetPathFormat != M_NO)
+      cfg->fileSteps[n++] = beginTargetDir;
+   if (cfg->logAnnotation == YES)
+      cfg->fileSteps[n++] = beginAnnotation;
+   cfg->numFileSteps = n;
+
+   n = 0;
+   if (cfg->sourceIPFormat != R_NO)
+      cfg->sharedSteps[n++] = beginSourceIP;
+   if (cfg->targetIPFormat != R_NO)
+      cfg->sharedSteps[n++] = beginTargetIP;
+   if (cfg->userIDFormat != M_NO)
+      cfg->sharedSteps[n++] = beginUser;
+   cfg->numSharedSteps = n;
+}
+
+/**
+* Fill in the logged fields of a new record by running the begin steps
+* of its configuration
+* @param logRecord is the new record, with its config set
+* @param args are the arguments of the begin call
+* @param shared is a record of the same batch whose host and user
+*        fields can be copied, or 0
+* @return nothing
+*/
+static void runBeginSteps(struct dlogLoggingData *logRecord,
+                          struct dlogBeginArgs *args,
+                          struct dlogLoggingData *shared)
+{
+   struct dlogConfig *cfg = logRecord->config;
+   unsigned int i;
+
+   // the interned fields of the steps that do not run are empty
+   logRecord->fileExt = logRecord->sourceDir = logRecord->targetDir = "";
+   logRecord->sourceIP = logRecord->targetIP = "";
+   for (i=0; i < cfg->numFileSteps; i++)
+      cfg->fileSteps[i](logRecord, args);
+   if (!shared)
+   {
+      for (i=0; i < cfg->numSharedSteps; i++)
+         cfg->sharedSteps[i](logRecord, args);
+   } else if (cfg->numSharedSteps > 0) {
+      logRecord->sourceIP = internString(shared->sourceIP, logRecord,
+                                         OWN_SOURCEIP);
+      logRecord->targetIP = internString(shared->targetIP, logRecord,
+                                         OWN_TARGETIP);
+      strcpy(logRecord->user, shared->user);
+   }
+}
+
+/**
+* Leave the logged strings of a new record empty, for a transfer begun
+* near LogMemoryBudget: the record holds no memory beyond its own
+* fixed size, and no name lookup or digest is done for it
+* @param logRecord is the new record
+* @return nothing
+*/
+static void stripBeginSteps(struct dlogLoggingData *logRecord)
+{
+   logRecord->fileExt = logRecord->sourceDir = logRecord->targetDir = "";
+   logRecord->sourceIP = logRecord->targetIP = "";
+   logRecord->fileName[0] = logRecord->user[0] = '\0';
+   logRecord->annotation[0] = '\0';
+}
+
+/** Kinds of config file values, for the option table */
+typedef enum {OPT_CHOICE, OPT_NUMBER, OPT_SECONDS, OPT_STRING, OPT_HOSTIP,
+              OPT_SYSLOGNAME, OPT_SYSLOGFLAGS} OptionType;
+
+/** A name for a config value */
+struct dlogNamedValue
+{
+   const char *name;
+   int value;
+};
+
+/**
+* Description of one config file option: the kind of value, where it
+* goes in struct dlogConfig, and what values are valid
+*/
+struct dlogOption
+{
+   const char *name;
+   OptionType type;
+   size_t offset;     // of the value in struct dlogConfig
+   size_t size;       // of the value
+   size_t auxOffset;  // of the IP mask, for OPT_HOSTIP
+   long min, max;     // range of numbers
+   const struct dlogNamedValue *names; // choices, or syslog names
+   YesNoFlag reloadable; // can be changed by dlogReloadConfig()
+};
+
+/** Offset and size of a struct dlogConfig member */
+#define CONFIGFIELD(f) offsetof(struct dlogConfig, f), \
+                       sizeof(((struct dlogConfig *) 0)->f)
+
+static const struct dlogNamedValue yesNoNames[] =
+   {{"yes", YES}, {"no", NO}, {0, 0}};
+static const struct dlogNamedValue yesNoMD5Names[] =
+   {{"yes", M_YES}, {"no", M_NO}, {"md5", M_MD5}, {0, 0}};
+static const struct dlogNamedValue locationNames[] =
+   {{"file", LOGTOFILE}, {"syslog", LOGTOSYSLOG}, {"daemon", LOGTODAEMON},
+    {"shm", LOGTOSHM}, {0, 0}};
+static const struct dlogNamedValue formatNames[] =
+   {{"text", FORMAT_TEXT}, {"json", FORMAT_JSON}, {0, 0}};
+static const struct dlogNamedValue overflowNames[] =
+   {{"block", OVERFLOW_BLOCK}, {"drop-newest", OVERFLOW_DROPNEWEST},
+    {"drop-oldest", OVERFLOW_DROPOLDEST}, {"spill", OVERFLOW_SPILL},
+    {0, 0}};
+static const struct dlogNamedValue syslogProtocolNames[] =
+   {{"libc", SYSLOG_LIBC}, {"rfc5424", SYSLOG_RFC5424}, {0, 0}};
+static const struct dlogNamedValue syslogOptionNames[] =
+   {{"LOG_CONS", LOG_CONS}, {"LOG_NDELAY", LOG_NDELAY},
+    {"LOG_NOWAIT", LOG_NOWAIT}, {"LOG_ODELAY", LOG_ODELAY},
+    {"LOG_PERROR", LOG_PERROR}, {"LOG_PID", LOG_PID}, {0, 0}};
+static const struct dlogNamedValue syslogFacilityNames[] =
+   {{"LOG_AUTH", LOG_AUTH}, {"LOG_AUTHPRIV", LOG_AUTHPRIV},
+    {"LOG_CRON", LOG_CRON}, {"LOG_DAEMON", LOG_DAEMON},
+    {"LOG_FTP", LOG_FTP}, {"LOG_KERN", LOG_KERN},
+    {"LOG_LOCAL0", LOG_LOCAL0}, {"LOG_LOCAL1", LOG_LOCAL1},
+    {"LOG_LOCAL2", LOG_LOCAL2}, {"LOG_LOCAL3", LOG_LOCAL3},
+    {"LOG_LOCAL4", LOG_LOCAL4}, {"LOG_LOCAL5", LOG_LOCAL5},
+    {"LOG_LOCAL6", LOG_LOCAL6}, {"LOG_LOCAL7", LOG_LOCAL7},
+    {"LOG_LPR", LOG_LPR}, {"LOG_MAIL", LOG_MAIL}, {"LOG_NEWS", LOG_NEWS},
+    {"LOG_SYSLOG", LOG_SYSLOG}, {"LOG_USER", LOG_USER},
+    {"LOG_UUCP", LOG_UUCP}, {0, 0}};
+static const struct dlogNamedValue syslogLevelNames[] =
+   {{"LOG_EMERG", LOG_EMERG}, {"LOG_ALERT", LOG_ALERT},
+    {"LOG_ERR", LOG_ERR}, {"LOG_WARNING", LOG_WARNING},
+    {"LOG_NOTICE", LOG_NOTICE}, {"LOG_INFO", LOG_INFO},
+    {"LOG_DEBUG", LOG_DEBUG}, {0, 0}};
+
+/**
+* The config file options. Options that size data structures at
+* dlogInit() cannot be reloaded; a reload keeps their old values.
+*/
+static const struct dlogOption configOptions[] =
+{
+   {"DoLogging", OPT_CHOICE, CONFIGFIELD(doLogging), 0, 0, 0,
+    yesNoNames, NO},
+   {"LogIdent", OPT_STRING, CONFIGFIELD(syslogIdent), 0, 0, 0, 0, YES},
+   {"LogOption", OPT_SYSLOGFLAGS, CONFIGFIELD(syslogOption), 0, 1, 63,
+    syslogOptionNames, YES},
+   {"LogFacility", OPT_SYSLOGNAME, CONFIGFIELD(syslogFacility), 0, 0, 255,
+    syslogFacilityNames, YES},
+   {"LogLevel", OPT_SYSLOGNAME, CONFIGFIELD(syslogLevel), 0, 0, 7,
+    syslogLevelNames, YES},
+   {"LogSyslogProtocol", OPT_CHOICE, CONFIGFIELD(syslogProtocol), 0, 0, 0,
+    syslogProtocolNames, YES},
+   {"LogSyslogSocket", OPT_STRING, CONFIGFIELD(syslogSocket), 0, 0, 0, 0,
+    YES},
+   {"LogFilename", OPT_STRING, CONFIGFIELD(dlogFilename), 0, 0, 0, 0, YES},
+   {"LoggingLocation", OPT_CHOICE, CONFIGFIELD(loggingLocation), 0, 0, 0,
+    locationNames, YES},
+   {"LogDaemonSocket", OPT_STRING, CONFIGFIELD(daemonSocket), 0, 0, 0, 0,
+    NO},
+   {"LogShmFile", OPT_STRING, CONFIGFIELD(shmFile), 0, 0, 0, 0, NO},
+   {"LogShmSize", OPT_NUMBER, CONFIGFIELD(shmSize), 0, RINGSLOT*MINRINGSLOTS,
+    1<<30, 0, NO},
+   {"LogShmOverwrite", OPT_CHOICE, CONFIGFIELD(shmOverwrite), 0, 0, 0,
+    yesNoNames, NO},
+   {"LogRotateSize", OPT_NUMBER, CONFIGFIELD(rotateSize), 0, 0, INT_MAX,
+    0, YES},
+   {"LogRotateCount", OPT_NUMBER, CONFIGFIELD(rotateCount), 0, 1, 99,
+    0, YES},
+   {"LogAsyncWrites", OPT_CHOICE, CONFIGFIELD(asyncWrites), 0, 0, 0,
+    yesNoNames, YES},
+   {"LogFileSync", OPT_CHOICE, CONFIGFIELD(fileSync), 0, 0, 0,
+    yesNoNames, YES},
+   {"LogSourcename", OPT_CHOICE, CONFIGFIELD(fileNameFormat), 0, 0, 0,
+    yesNoMD5Names, YES},
+   {"LogExtension", OPT_CHOICE, CONFIGFIELD(fileExtFormat), 0, 0, 0,
+    yesNoMD5Names, YES},
+   {"LogSourcePath", OPT_CHOICE, CONFIGFIELD(sourcePathFormat), 0, 0, 0,
+    yesNoMD5Names, YES},
+   {"LogTargetPath", OPT_CHOICE, CONFIGFIELD(targetPathFormat), 0, 0, 0,
+    yesNoMD5Names, YES},
+   {"LogUserID", OPT_CHOICE, CONFIGFIELD(userIDFormat), 0, 0, 0,
+    yesNoMD5Names, YES},
+   {"LogSourceIP", OPT_HOSTIP, CONFIGFIELD(sourceIPFormat),
+    offsetof(struct dlogConfig, sourceIPMask), 0, 0, 0, YES},
+   {"LogTargetIP", OPT_HOSTIP, CONFIGFIELD(targetIPFormat),
+    offsetof(struct dlogConfig, targetIPMask), 0, 0, 0, YES},
+   {"LogBatchSize", OPT_NUMBER, CONFIGFIELD(logBatchSize), 0, 1, 255,
+    0, YES},
+   {"LogFormat", OPT_CHOICE, CONFIGFIELD(logFormat), 0, 0, 0,
+    formatNames, YES},
+   {"LogProgress", OPT_CHOICE, CONFIGFIELD(logProgress), 0, 0, 0,
+    yesNoNames, YES},
+   {"LogProgressInterval", OPT_SECONDS, CONFIGFIELD(progressInterval), 0,
+    1, INT_MAX, 0, YES},
+   {"LogStallInterval", OPT_SECONDS, CONFIGFIELD(stallInterval), 0,
+    1, INT_MAX, 0, YES},
+   {"LogTransferTimeout", OPT_SECONDS, CONFIGFIELD(transferTimeout), 0,
+    0, INT_MAX, 0, YES},
+   {"LogMaxOpenTransfers", OPT_NUMBER, CONFIGFIELD(maxOpenTransfers), 0,
+    0, INT_MAX, 0, YES},
+   {"LogMemoryBudget", OPT_NUMBER, CONFIGFIELD(memoryBudget), 0,
+    0, 1<<20, 0, YES},
+   {"LogHistograms", OPT_CHOICE, CONFIGFIELD(logHistograms), 0, 0, 0,
+    yesNoNames, YES},
+   {"LogRecords", OPT_CHOICE, CONFIGFIELD(logRecords), 0, 0, 0,
+    yesNoNames, YES},
+   {"LogSampleRate", OPT_NUMBER, CONFIGFIELD(logSampleRate), 0,
+    1, INT_MAX, 0, YES},
+   {"LogShedThreshold", OPT_NUMBER, CONFIGFIELD(shedThreshold), 0,
+    0, INT_MAX, 0, YES},
+   {"LogShedSampleRate", OPT_NUMBER, CONFIGFIELD(shedSampleRate), 0,
+    1, INT_MAX, 0, YES},
+   {"LogQueueLimit", OPT_NUMBER, CONFIGFIELD(queueLimit), 0,
+    0, INT_MAX, 0, YES},
+   {"LogOverflowPolicy", OPT_CHOICE, CONFIGFIELD(overflowPolicy), 0,
+    0, 0, overflowNames, YES},
+   {"LogSpillDirectory", OPT_STRING, CONFIGFIELD(spillDirectory), 0,
+    0, 0, 0, YES},
+   {"LogInternTableSize", OPT_NUMBER, CONFIGFIELD(internTableSize), 0,
+    0, 1<<20, 0, NO},
+   {"LogReloadOnChange", OPT_CHOICE, CONFIGFIELD(reloadOnChange), 0,
+    0, 0, yesNoNames, YES},
+   {"LogStatsInterval", OPT_SECONDS, CONFIGFIELD(statsInterval), 0,
+    0, INT_MAX, 0, YES},
+   {"LogColumnFile", OPT_STRING, CONFIGFIELD(columnFile), 0, 0, 0, 0, YES},
+   {"LogColumnRows", OPT_NUMBER, CONFIGFIELD(columnRows), 0,
+    1, 1<<20, 0, YES},
+   {"LogFormatWorkers", OPT_NUMBER, CONFIGFIELD(formatWorkers), 0,
+    1, MAXFORMATWORKERS, 0, YES},
+   {0, OPT_STRING, 0, 0, 0, 0, 0, 0, NO}
+};
+
+/**
+* Store a number in a config value of the given size
+* @return nothing
+*/
+static void setConfigNumber(void *field, size_t size,
+                            unsigned long long number)
+{
+   if (size == sizeof(unsigned long long))
+      *(unsigned long long *) field = number;
+   else
+      *(unsigned int *) field = (unsigned int) number;
+}
+
+/**
+* Set one option in a config snapshot from its config file value
+* @param cfg is the snapshot being built
+* @param opt is the option
+* @param value is the first word of the value
+* @param line is the whole value, for options that take a list
+* @return 0 on success, 1 if the value is not valid for the option
+*/
+static unsigned int setConfigOption(struct dlogConfig *cfg,
+                                    const struct dlogOption *opt,
+                                    char *value, char *line)
+{
+   void *field = (char *) cfg + opt->offset;
+   const struct dlogNamedValue *nv;
+   unsigned int d1,d2,d3,d4;
+   char *token, *save;
+   int number, flags;
+
+   switch (opt->type)
+   {
+      case OPT_CHOICE:
+         for (nv = opt->names; nv->name; nv++)
+            if (!strcmp(nv->name, value))
+               break;
+         if (!nv->name)
+            return 1;
+         *(int *) field = nv->value;
+         return 0;
+      case OPT_NUMBER:
+      case OPT_SECONDS:
+         number = stringToNumber(value);
+         if (number < opt->min || number > opt->max)
+            return 1;
+         setConfigNumber(field, opt->size, (opt->type == OPT_SECONDS) ?
+                         number * 1000000ULL : (unsigned long long) number);
+         return 0;
+      case OPT_STRING:
+         strncpy((char *) field, value, opt->size);
+         ((char *) field)[opt->size-1] = '\0';
+         return 0;
+      case OPT_HOSTIP:
+         // yes, no, raw, or an IP bitmask (which implies yes)
+         if (!strcmp("no",value))
+         {
+            *(YesNoRawFlag *) field = R_NO;
+            return 0;
+         }
+         if (!strcmp("yes",value))
+         {
+            *(YesNoRawFlag *) field = R_YES;
+            d1 = d2 = d3 = d4 = 255;
+         } else if (!strcmp("raw",value))
+         {
+            *(YesNoRawFlag *) field = R_RAW;
+            d1 = d2 = d3 = d4 = 255;
+         } else if (sscanf(value,"%u.%u.%u.%u",&d1,&d2,&d3,&d4) == 4)
+         {
+            *(YesNoRawFlag *) field = R_YES;
+         } else
+            return 1;
+         *(unsigned int *) ((char *) cfg + opt->auxOffset) =
+            (d1<<24) | (d2<<16) | (d3<<8) | (d4);
+         return 0;
+      case OPT_SYSLOGNAME:
+         // a number in range, or a symbolic name
+         number = stringToNumber(value);
+         if (number < opt->min || number > opt->max)
+         {
+            for (nv = opt->names; nv->name; nv++)
+               if (!strcmp(nv->name, value))
+                  break;
+            if (!nv->name)
+               return 1;
+            number = nv->value;
+         }
+         *(int *) field = number;
+         return 0;
+      case OPT_SYSLOGFLAGS:
+         // a number in range, or names separated by '|' or spaces
+         token = strtok_r(line," |\r\n",&save);
+         flags = token ? stringToNumber(token) : 0;
+         if (flags >= opt->min && flags <= opt->max)
+         {
+            *(int *) field = flags;
+            return 0;
+         }
+         for (flags = 0; token != NULL;
+              token = strtok_r(NULL," |\r\n",&save))
+         {
+            for (nv = opt->names; nv->name; nv++)
+               if (!strcmp(nv->name, token))
+                  break;
+            if (!nv->name)
+               return 1;
+            flags |= nv->value;
+         }
+         if (flags == 0)
+            return 1;
+         *(int *) field = flags;
+         return 0;
+   }
+   return 1;
+}
+
+/**
+* Build a config snapshot from the config file: defaults first, then
+* each option found in the file. Unknown options are ignored.
+* @param cfg is the snapshot to fill in
+* @return 0 on success, 3 if the config file cannot be opened, 4 if an
+*         option has an invalid value
+*/
+static unsigned int readConfig(struct dlogConfig *cfg)
+{
+   const struct dlogOption *opt;
+   char buf[MAXLOGTOFILE], option[MAXFILEPATH], value[MAXFILEPATH];
+   char *sp;
+   unsigned int size;
+   FILE *configFilenamehandle;
+
+   *cfg = defaultConfig;
+   if (! (configFilenamehandle = fopen (configFilename,"r")))
+      return 3; // Error : can't open file
+
+   while (fgets(buf, MAXLOGTOFILE-1, configFilenamehandle))
+   {
+      if (buf[0] == '#' || buf[0] == '\n' || buf[0] == '\r')
+         // skip comment line or blank line
+         continue;
+      sp = strchr(buf,'=');
+      if (sp == 0)
+         continue;
+      *sp = '\0'; // split line at equals sign
+      option[0] = value[0] = '\0';
+      sscanf(buf,"%511s",option);  // get no-whitespace strings
+      sscanf(sp+1,"%511s",value);
+      for (opt = configOptions; opt->name; opt++)
+         if (!strcmp(opt->name, option))
+            break;
+      if (opt->name && setConfigOption(cfg, opt, value, sp+1) != 0)
+      {
+         fclose(configFilenamehandle);
+         return 4;
+      }
+   }
+   fclose(configFilenamehandle);
+
+   // the intern table size is rounded up to a power of two
+   for (size = cfg->internTableSize ? 1 : 0;
+        size && size < cfg->internTableSize; size <<= 1)
+      ;
+   cfg->internTableSize = size;
+   return 0;
+}
+
+/**
+* Make a config snapshot the current one. Structures that a newly
+* enabled option needs are set up first; the old snapshot is kept on
+* the retired list until freeRetiredConfigs() finds it unused. The
+* caller must hold the configMutex.
+* @param cfg is the new snapshot
+* @return nothing
+*/
+static void publishConfig(struct dlogConfig *cfg)
+{
+   struct dlogProgressSlot *table;
+
+   // replay spill files left by earlier processes on the first write
+   if (cfg->overflowPolicy == OVERFLOW_SPILL)
+      spillPending = YES;
+   if (cfg->logHistograms == YES && histogramsReady == NO)
+      histogramInit();
+   if (cfg->logProgress == YES && !progressTable)
+   {
+      table = (struct dlogProgressSlot *)
+              calloc(PROGRESSSLOTS, sizeof(struct dlogProgressSlot));
+      if (table)
+      {
+         memoryCharge(PROGRESSSLOTS * sizeof(struct dlogProgressSlot));
+         __atomic_store_n(&progressTable, table, __ATOMIC_RELEASE);
+      } else
+         cfg->logProgress = NO; // log without progress fields
+   }
+   compileBeginSteps(cfg);
+   memoryCharge(sizeof(struct dlogConfig));
+   if (activeConfig != &defaultConfig)
+   {
+      cfg->retired = activeConfig;
+      __atomic_add_fetch(&retiredConfigs, 1, __ATOMIC_RELAXED);
+   }
+   __atomic_store_n(&activeConfig, cfg, __ATOMIC_SEQ_CST);
+}
+
+/**
+* Serializes config reloads and starting/stopping the watcher thread
+*/
+static pthread_mutex_t configMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+* Free the config snapshots replaced by reloads that nothing can refer
+* to any more: no record holds them, the log sink was not opened with
+* them, and no config reader is in progress, so none can still have
+* one from before it was replaced. If a reader is in progress, they
+* are tried again with the next write. The caller must hold the
+* logfileMutex, which keeps the writer from using sinkConfig meanwhile.
+* @return nothing
+*/
+static void freeRetiredConfigs()
+{
+   struct dlogConfig **prev, *old;
+   int s;
+
+   if (__atomic_load_n(&retiredConfigs, __ATOMIC_RELAXED) == 0)
+      return;
+   pthread_mutex_lock( &configMutex );
+   for (s=0; s < STATSHARDS; s++)
+      if (__atomic_load_n(&statShards[s].configReaders, __ATOMIC_SEQ_CST))
+         break;
+   prev = &currentConfig()->retired;
+   while (s == STATSHARDS && (old = *prev) != NULL)
+   {
+      if (old == sinkConfig ||
+          __atomic_load_n(&old->refs, __ATOMIC_ACQUIRE) != 0)
+      {
+         prev = &old->retired;
+         continue;
+      }
+      *prev = old->retired;
+      __atomic_sub_fetch(&retiredConfigs, 1, __ATOMIC_RELAXED);
+      memoryRelease(sizeof(struct dlogConfig));
+      free(old);
+   }
+   pthread_mutex_unlock( &configMutex );
+}
+
+static void startConfigWatcher();
+static void startTimeoutReaper();
+
+/**
+* Read the config file again and switch to the new configuration.
+* Transfers already begun keep the configuration they were begun with.
+* @return 0 on success, 3 if the config file cannot be opened, 4 if it
+*         has an invalid value (the configuration is then unchanged),
+*         5 if out of memory
+*/
+static unsigned int reloadConfig()
+{
+   const struct dlogOption *opt;
+   struct dlogConfig *cfg, *old;
+   unsigned int stat;
+
+   if (!(cfg = (struct dlogConfig *) malloc(sizeof(struct dlogConfig))))
+      return 5;
+   pthread_mutex_lock( &configMutex );
+   if ((stat = readConfig(cfg)) != 0)
+   {
+      pthread_mutex_unlock( &configMutex );
+      free(cfg);
+      return stat;
+   }
+   old = currentConfig();
+   for (opt = configOptions; opt->name; opt++)
+      if (opt->reloadable == NO)
+         memcpy((char *) cfg + opt->offset, (char *) old + opt->offset,
+                opt->size);
+   publishConfig(cfg);
+   if (cfg->reloadOnChange == YES)
+      startConfigWatcher();
+   if (cfg->transferTimeout > 0)
+      startTimeoutReaper();
+   pthread_mutex_unlock( &configMutex );
+   return 0;
+}
+
+/**
+* Config file watcher thread state, protected by the configMutex. The
+* thread counts as running until it has been joined, so that it is
+* not started again while stopConfigWatcher() waits for it.
+*/
+static pthread_t watcherThread;
+static YesNoFlag watcherRunning = NO;
+static YesNoFlag watcherStopping = NO;
+static int watcherStop = 0;
+
+/**
+* Thread that reloads the configuration when the config file changes.
+* The directory is watched rather than the file, so editors that
+* replace the file are seen too; the thread polls so that it can be
+* stopped by stopConfigWatcher().
+* @param arg is unused
+* @return nothing
+*/
+static void *watchConfigFile(void *arg)
+{
+   char dirName[MAXFILEPATH], *baseName, *p;
+   char events[4096] __attribute__((aligned(8)));
+   struct inotify_event *event;
+   struct pollfd pfd;
+   ssize_t len;
+   int changed, reload;
+
+   (void) arg;
+   strcpy(dirName, configFilename);
+   if ((baseName = strrchr(dirName, '/')) != NULL)
+   {
+      *baseName++ = '\0';
+      if (dirName[0] == '\0')
+         strcpy(dirName, "/");
+   } else {
+      baseName = configFilename;
+      strcpy(dirName, ".");
+   }
+   pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   pfd.events = POLLIN;
+   if (pfd.fd < 0)
+      return 0;
+   if (inotify_add_watch(pfd.fd, dirName,
+                         IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+   {
+      close(pfd.fd);
+      return 0;
+   }
+   while (!__atomic_load_n(&watcherStop, __ATOMIC_ACQUIRE))
+   {
+      if (poll(&pfd, 1, 500) <= 0)
+         continue;
+      changed = 0;
+      while ((len = read(pfd.fd, events, sizeof(events))) > 0)
+      {
+         for (p = events; p < events + len;
+              p += sizeof(struct inotify_event) + event->len)
+         {
+            event = (struct inotify_event *) p;
+            if (event->len && !strcmp(event->name, baseName))
+               changed = 1;
+         }
+      }
+      reload = (configReadBegin()->reloadOnChange == YES);
+      configReadEnd();
+      if (changed && reload)
+         reloadConfig();
+   }
+   close(pfd.fd);
+   return 0;
+}
+
+/**
+* Start the config file watcher thread, if it is not running. The
+* caller must hold the configMutex. While the thread is being stopped
+* it is not restarted.
+* @return nothing
+*/
+static void startConfigWatcher()
+{
+   if (watcherRunning == YES)
+      return;
+   __atomic_store_n(&watcherStop, 0, __ATOMIC_RELEASE);
+   if (pthread_create(&watcherThread, 0, watchConfigFile, 0) == 0)
+      watcherRunning = YES;
+}
+
+/**
+* Stop the config file watcher thread, if it is running and no other
+* thread is stopping it
+* @return nothing
+*/
+static void stopConfigWatcher()
+{
+   pthread_mutex_lock( &configMutex );
+   if (watcherRunning == NO || watcherStopping == YES)
+   {
+      pthread_mutex_unlock( &configMutex );
+      return;
    }
+   __atomic_store_n(&watcherStop, 1, __ATOMIC_RELEASE);
+   watcherStopping = YES;
+   // the watcher may be waiting for the configMutex to reload
+   pthread_mutex_unlock( &configMutex );
+   pthread_join(watcherThread, 0);
+   pthread_mutex_lock( &configMutex );
+   watcherRunning = NO;
+   watcherStopping = NO;
+   pthread_mutex_unlock( &configMutex );
 }
 
-
 /**
-* Get a remote host IP address from a host-name. Note that this
-* is potentially a DNS operation and thus should really be avoided.
-* @param hostName  A string containing a host-name 
-* @return  IP address of the remote host (dotted decimal string), 
-*          NULL if error
+* Timeout reaper thread state; the thread waits on reaperCond between
+* ticks so that stopping it does not have to wait out a tick. Like the
+* config watcher, it counts as running until it has been joined.
 */
-static char *getRemoteIP(char * hostName) 
-{       
-   char *retString = 0;
-   char *tmp=0;
+static pthread_t reaperThread;
+static YesNoFlag reaperRunning = NO;
+static YesNoFlag reaperStopping = NO;
+static int reaperStop = 0;
+static pthread_mutex_t reaperMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaperCond = PTHREAD_COND_INITIALIZER;
 
-   struct hostent *he;
-   struct in_addr **addr_list;
-   int i;
+/**
+* End the transfers that have timed out, as failed and marked
+* timedOut, and queue their records as dlogEndTransferBatch() does.
+* The timing wheel hands over their IDs, and they are taken off the
+* active list in one pass; a transfer the application ends meanwhile
+* is simply not found.
+* @return the number of transfers ended
+*/
+static unsigned long reapTimedOut()
+{
+   struct dlogLoggingData *expired, *rec, **found;
+   struct dlogBatchID *ids;
+   struct timeval now;
+   unsigned long n, i, numFound;
 
-   if ((he = gethostbyname( hostName ) ) == NULL) 
+   transferTime(&now);
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   if ((n = wheelAdvance(now.tv_sec, &expired)) == 0)
    {
-      // error in gethostbyname?
+      pthread_mutex_unlock( &generalMutex );
+      return 0;
+   }
+   ids = (struct dlogBatchID *) malloc(n*sizeof(struct dlogBatchID));
+   found = (struct dlogLoggingData **)
+           calloc(n, sizeof(struct dlogLoggingData *));
+   if (!ids || !found)
+   {
+      // put them back, to be tried again on the next tick
+      for (; expired; expired = rec)
+      {
+         rec = expired->wheelNext;
+         wheelInsert(expired);
+      }
+      pthread_mutex_unlock( &generalMutex );
+      free(ids);
+      free(found);
       return 0;
    }
+   for (i=0, rec = expired; rec; rec = rec->wheelNext, i++)
+   {
+      ids[i].id = rec->id;
+      ids[i].index = i;
+   }
+   pthread_mutex_unlock( &generalMutex );
 
-   retString = (char *) malloc(MAXHOSTNAME * sizeof (char));
+   qsort(ids, n, sizeof(struct dlogBatchID), compareBatchIDs);
+   numFound = dlogRemoveLoggingDataSet(&activeXferList, ids, n, found);
+   statCount(STAT_ENDED, numFound);
+   statCount(STAT_TIMEDOUT, numFound);
+   transferTime(&now);
+   for (i=0; i < n; i++)
+   {
+      if (!found[i])
+         continue;
+      found[i]->timedOut = YES;
+      if (endLoggingData(found[i], &now, 0, 1) == 0)
+         queueEndedRecord(found[i]);
+   }
+   free(ids);
+   free(found);
+   if (batchReady())
+      writeLogData();
+   return numFound;
+}
 
-   addr_list = (struct in_addr **) he->h_addr_list;
+/**
+* Thread that ends stale transfers, once a second, for
+* LogTransferTimeout. It reads the transfer clock from its own thread,
+* so a clock set with dlogSetTimeSource() must work from any thread.
+* @param arg is unused
+* @return nothing
+*/
+static void *reapTransfers(void *arg)
+{
+   struct timespec wake;
 
-   for (i = 0; addr_list[i] != NULL; i++)
+   (void) arg;
+   pthread_mutex_lock( &reaperMutex );
+   while (!reaperStop)
    {
-      tmp = inet_ntoa(*addr_list[i]);
-      if (strstr(tmp,"127") != tmp)
+      clock_gettime(CLOCK_REALTIME, &wake);
+      wake.tv_sec++;
+      pthread_cond_timedwait(&reaperCond, &reaperMutex, &wake);
+      if (reaperStop)
          break;
+      pthread_mutex_unlock( &reaperMutex );
+      reapTimedOut();
+      pthread_mutex_lock( &reaperMutex );
    }
+   pthread_mutex_unlock( &reaperMutex );
+   return 0;
+}
 
-   strcpy(retString,tmp);
-   return retString;
-} 
-
+/**
+* Start the timeout reaper thread, if it is not running. Once started
+* it runs until dlogFinalize(), since transfers begun with a timeout
+* keep it after a reload turns the option off. The caller must hold
+* the configMutex.
+* @return nothing
+*/
+static void startTimeoutReaper()
+{
+   if (reaperRunning == YES)
+      return;
+   reaperStop = 0;
+   if (pthread_create(&reaperThread, 0, reapTransfers, 0) == 0)
+      reaperRunning = YES;
+}
 
 /**
-* Find and create an IP address string from a given machine name
-* @param name is the machine name (might be an IP address already)
-* @param ipString is a char array to hold output IP address string
-* @param size is the size of ipString array
+* Stop the timeout reaper thread, if it is running and no other thread
+* is stopping it
 * @return nothing
 */
-static void findIPAddress(char *name, char *ipString, unsigned int size)
+static void stopTimeoutReaper()
 {
-   struct in_addr ipaddr;
-   // check if given machine name is already a valid IP address
-   if (inet_aton(name,&ipaddr))
+   pthread_mutex_lock( &configMutex );
+   if (reaperRunning == NO || reaperStopping == YES)
    {
-      strncpy(ipString,name,size);
-      ipString[size-1] = '\0';
+      pthread_mutex_unlock( &configMutex );
       return;
    }
-   // else process name as a machine name
-   if (!strcmp(name,"localhost") || name[0]=='\0') 
-   {
-      // doesn't really work -- should not do this
-      char *tmp = getLocalIP();
-      if (tmp != NULL)
-      {
-         strncpy(ipString,tmp,size);
-         free(tmp);
-         tmp=NULL;
-      }
-      else
-         strcpy(ipString,"?no-IP?");
-   }
-   else
-   {  
-      char *tmp = getRemoteIP(name);
-      if (tmp != NULL)
-      {
-         strncpy(ipString,tmp,size);
-         free(tmp);
-         tmp=NULL;
-      }
-      else
-         strcpy(ipString,"?no-IP?");
-   }
-   ipString[size-1] = '\0';
+   reaperStopping = YES;
+   pthread_mutex_unlock( &configMutex );
+   pthread_mutex_lock( &reaperMutex );
+   reaperStop = 1;
+   pthread_cond_signal( &reaperCond );
+   pthread_mutex_unlock( &reaperMutex );
+   pthread_join(reaperThread, 0);
+   pthread_mutex_lock( &configMutex );
+   reaperRunning = NO;
+   reaperStopping = NO;
+   pthread_mutex_unlock( &configMutex );
 }
 
+#define MAXDAEMONCLIENTS  1024      //!< Maximum connected dlogd clients
+#define MAXDAEMONPENDING  (16<<20)  //!< Maximum unwritten bytes in dlogd
+#define DAEMONFLUSHMS     1000      //!< Longest a line waits in dlogd, ms
 
 /**
-* To check and convert a number string to an integer
-* return the converted integer, and -1 if there is an error.
-* @param numstr the string to be check if it's a number.
-* @return an integer of the number string or -1 if not. (JEC: -1 is valid??)
+* Lines received by dlogd and not yet written, each NUL terminated
 */
-static int stringToNumber(char *numstr) 
+struct dlogPendingLines
 {
-  int numVal;
-  char *endPtr;
-
-  numVal = (int)strtol(numstr, &endPtr, 10);
+   char *buf;
+   unsigned int size;
+   unsigned int used;
+   unsigned int lines;
+   unsigned long long oldest; // arrival of the first line, microseconds
+};
 
-  if ((endPtr == numstr) || (*endPtr != '\0'))
-  {
-      numVal = -1;
-  }
+/**
+* Make room for more pending lines
+* @param pending is the pending lines
+* @param bytes is the room needed, NULs included
+* @return 0 on success, 1 if the pending lines are at their limit
+*/
+static unsigned int reservePending(struct dlogPendingLines *pending,
+                                   unsigned int bytes)
+{
+   unsigned int need = pending->used + bytes;
+   char *buf;
 
-  return numVal;
+   if (need > MAXDAEMONPENDING)
+      return 1;
+   if (need > pending->size)
+   {
+      buf = (char *) realloc(pending->buf, need * 2);
+      if (!buf)
+         return 1;
+      pending->buf = buf;
+      pending->size = need * 2;
+   }
+   if (pending->lines == 0)
+      pending->oldest = currentMicroseconds();
+   return 0;
 }
 
-
-/** 
-* Extract a base filename from a full path.
-* @param name  A string containing a source full path of a file including
-*              its extension.
-* @param root  Character array to hold the root file name
-* @param size  The number of characters in root;
-               root name will be at most 1 less
-* @return Nothing
+/**
+* Check a batch message from a client and add its lines to the
+* pending lines. A message that is not a valid batch is rejected
+* whole. If the pending lines are at their limit, the batch is
+* dropped and counted.
+* @param pending is the pending lines
+* @param msg is the message
+* @param len is the message length
+* @return 0 if the message was valid, 1 if not
 */
-static void getBaseFilename(char *name, char *root, unsigned int size)
-{  
-   char *tmp;
-   if (!name || !root)
-      return;
-   if ((tmp = strrchr(name,'/')) )
-      strncpy(root,++tmp,size);
-   else
-      strncpy(root,name,size);
-   root[size-1] = '\0';
+static unsigned int addDaemonBatch(struct dlogPendingLines *pending,
+                                   unsigned char *msg, unsigned int len)
+{
+   struct dlogDaemonHeader header;
+   unsigned char *pos, *end;
+   unsigned short lineLen;
+   unsigned int i;
+
+   if (len < sizeof(header))
+      return 1;
+   memcpy(&header, msg, sizeof(header));
+   if (header.magic != DAEMONMAGIC || header.version != DAEMONVERSION)
+      return 1;
+   // check every line before taking any
+   pos = msg + sizeof(header);
+   end = msg + len;
+   for (i = 0; i < header.count; i++)
+   {
+      if (pos + sizeof(lineLen) > end)
+         return 1;
+      memcpy(&lineLen, pos, sizeof(lineLen));
+      if (lineLen == 0 || lineLen >= MAXLOGTOFILE ||
+          pos + sizeof(lineLen) + lineLen > end)
+         return 1;
+      pos += sizeof(lineLen) + lineLen;
+   }
+   if (pos != end)
+      return 1;
+   // the NULs take the place of the length prefixes
+   if (reservePending(pending, len) != 0)
+   {
+      __atomic_add_fetch(&droppedRecords, header.count, __ATOMIC_RELAXED);
+      return 0;
+   }
+   for (pos = msg + sizeof(header); pos < end; pos += lineLen)
+   {
+      memcpy(&lineLen, pos, sizeof(lineLen));
+      pos += sizeof(lineLen);
+      memcpy(pending->buf + pending->used, pos, lineLen);
+      pending->used += lineLen;
+      pending->buf[pending->used++] = '\0';
+      pending->lines++;
+   }
+   return 0;
 }
 
+#define RINGPOLLMS     10       //!< How often dlogd drains the ring, ms
+#define RINGSTUCK      1000000  //!< Time a reserved slot may stay
+                                //!< unwritten (its writer died), us
 
 /**
-* Extract a directory path of a filename that has 
-* a full path (e.g. to remove the file-name and its extension)
-* @param name  string containing the full path of a file
-* @param path  character array to hold the path name
-* @param size  size of path[]; path will be at most 1 less + \0
-* @return nothing
+* Create the shared-memory ring, or take over the one a previous dlogd
+* left if it has the configured size, so that records still in it are
+* not lost. The file is made writable by all, since every process
+* that logs maps it; any local user can thus add lines to the log, as
+* through the daemon socket. An existing file is only used if it is a
+* regular file of this user with no other links, so that a symbolic or
+* hard link planted in a shared directory cannot make dlogd change the
+* mode or size of another file.
+* @param cfg is the configuration naming the ring file and size
+* @return 0 on success, 1 on error
 */
-static void getPathFromFilename(char *name, char *path, unsigned int size)
-{  
-   char *fileNameOnly = NULL;
-   if (!name || !path) 
-      return;
-   // find last / in filename
-   if ((fileNameOnly = strrchr(name,'/')) )
+static unsigned int createShmRing(struct dlogConfig *cfg)
+{
+   struct dlogRingHeader *ring;
+   unsigned int slotCount;
+   struct stat st;
+   size_t size;
+   int fd;
+
+   for (slotCount = MINRINGSLOTS;
+        (unsigned long) RINGSLOT * (slotCount*2 + 1) <= cfg->shmSize;
+        slotCount *= 2)
+      ;
+   size = (size_t) RINGSLOT * (slotCount + 1);
+   if ((fd = open(cfg->shmFile, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                  0666)) < 0)
+      return 1;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+       st.st_uid != geteuid() || st.st_nlink != 1 || fchmod(fd, 0666) != 0 ||
+       (st.st_size != (off_t) size && (ftruncate(fd, 0) != 0 ||
+                                       ftruncate(fd, size) != 0)))
    {
-      ++fileNameOnly;
-      if ((fileNameOnly-name) < size)
-         size = (fileNameOnly-name)+1;
-      strncpy(path, name, size);
-      path[size-1] = '\0'; 
-   } else {
-      path[0] = '\0';
+      close(fd);
+      return 1;
    }
-   return;
+   ring = (struct dlogRingHeader *) mmap(0, size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED, fd, 0);
+   close(fd);
+   if (ring == MAP_FAILED)
+      return 1;
+   if (ring->magic != RINGMAGIC || ring->version != RINGVERSION ||
+       ring->slotCount != slotCount)
+   {
+      memset(ring, 0, size);
+      ring->version = RINGVERSION;
+      ring->slotCount = slotCount;
+      __atomic_store_n(&ring->magic, RINGMAGIC, __ATOMIC_RELEASE);
+   }
+   ring->overwrite = (cfg->shmOverwrite == YES);
+   __atomic_store_n(&ring->heartbeat, currentMicroseconds(),
+                    __ATOMIC_RELEASE);
+   shmRing = ring;
+   shmRingSize = size;
+   return 0;
 }
 
 /**
-* Extract a file extension from a file-name
-* @param name  string containing the full filename.
-* @param ext   character array to hold the file name extension
-* @param size  size of ext[]; extension will be at most 1 less + \0
+* Move the records written to the ring into the pending lines. A
+* record is copied, then checked to be unchanged, since with overwrite
+* on a producer may reuse its slots meanwhile; the tail is advanced
+* with a compare and swap for the same reason. A reserved slot that
+* stays unwritten for RINGSTUCK (its writer died) is skipped.
+* @param pending is the pending lines
 * @return nothing
 */
-static void getFilenameExtension(char *name, char *ext, unsigned int size) 
+static void drainShmRing(struct dlogPendingLines *pending)
 {
-   char *tmp;
-   if (!name || !ext)
-      return;
-   // find last dot in filename
-   if ((tmp = strrchr(name,'.')) )
+   static unsigned long long stuckTail = ~0ULL, stuckSince = 0;
+   struct dlogRingHeader *ring = shmRing;
+   struct dlogRingSlot *slot;
+   unsigned long long tail, head, now;
+   unsigned int len, nslots, i, chunk, ok;
+   char line[MAXLOGTOFILE];
+
+   now = currentMicroseconds();
+   __atomic_store_n(&ring->heartbeat, now, __ATOMIC_RELEASE);
+   for (;;)
    {
-      strncpy(ext,++tmp, size);
-      ext[size-1] = '\0';
-   } else {
-      ext[0] = '\0';
+      tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      if (tail == head)
+         return;
+      slot = ringSlot(tail);
+      ok = (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == tail+1);
+      len = slot->len;
+      nslots = slot->nslots;
+      if (ok && (nslots == 0 || nslots > head - tail || len == 0 ||
+                 len >= MAXLOGTOFILE || len > nslots * RINGSLOTDATA ||
+                 len <= (nslots-1) * RINGSLOTDATA))
+      {
+         // not the start of a record: its start was overwritten
+         __atomic_compare_exchange_n(&ring->tail, &tail, tail+1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+         continue;
+      }
+      for (i = 1; ok && i < nslots; i++)
+         ok = (__atomic_load_n(&ringSlot(tail+i)->seq, __ATOMIC_ACQUIRE) ==
+               tail+i+1);
+      if (!ok)
+      {
+         // still being written; skip it if that is taking too long
+         if (tail != stuckTail)
+         {
+            stuckTail = tail;
+            stuckSince = now;
+         } else if (now - stuckSince > RINGSTUCK &&
+                    __atomic_compare_exchange_n(&ring->tail, &tail, tail+1,
+                         0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+         return;
+      }
+      for (i = 0; i < nslots; i++)
+      {
+         chunk = (len - i*RINGSLOTDATA < RINGSLOTDATA) ?
+                 len - i*RINGSLOTDATA : RINGSLOTDATA;
+         memcpy(line + i*RINGSLOTDATA, ringSlot(tail+i) + 1, chunk);
+      }
+      line[len] = '\0';
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      for (i = 0; ok && i < nslots; i++)
+         ok = (__atomic_load_n(&ringSlot(tail+i)->seq, __ATOMIC_RELAXED) ==
+               tail+i+1);
+      if (!ok || !__atomic_compare_exchange_n(&ring->tail, &tail,
+                   tail+nslots, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+         continue; // overwritten while we copied it
+      if (reservePending(pending, len+1) != 0)
+      {
+         __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED);
+         continue;
+      }
+      memcpy(pending->buf + pending->used, line, len+1);
+      pending->used += len+1;
+      pending->lines++;
    }
-   return;
 }
 
 /**
-* Clean a string of 'bad' characters -- simply replace with '-'.
-* Characters replaced are single and double quotes (maybe more to follow).
-* @param str is the string to be cleaned (modified)
-* @param max is maximum length of string (for safety, should not be needed)
-* @return nothing, the string is modified if necessary
+* Write the pending lines through the daemon's own logging connection.
+* If the log cannot be opened or written the lines are kept for the
+* next try.
+* @param pending is the pending lines
+* @return 0 on success, 1 if the log could not be opened or written
 */
-static void cleanString(char* str, int max)
+static unsigned int writeDaemonLines(struct dlogPendingLines *pending)
 {
-   int i;
-   if (max==0) max = 9999999;
-   for (i=0; str[i]!='\0' && i < max; i++) {
-      if (str[i] == '\'' || str[i]=='\"')
-         str[i] = '-';
+   static unsigned long long reportedOverflowed = 0;
+   static unsigned long long reportedOverwritten = 0;
+   unsigned long long overflowed = 0, overwritten = 0;
+   char buff[MAXLOGTOFILE], *line;
+   unsigned long dropped;
+   int json;
+
+   if (shmRing)
+   {
+      overflowed = __atomic_load_n(&shmRing->overflowed, __ATOMIC_RELAXED);
+      overwritten = __atomic_load_n(&shmRing->overwritten,
+                                    __ATOMIC_RELAXED);
+   }
+   if (pending->lines == 0 && overflowed == reportedOverflowed &&
+       overwritten == reportedOverwritten)
+      return 0;
+   statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+   if (openLogSink() != 0)
+   {
+      pthread_mutex_unlock( &logfileMutex );
+      return 1;
+   }
+   json = (sinkConfig->logFormat == FORMAT_JSON);
+   for (line = pending->buf; line < pending->buf + pending->used;
+        line += strlen(line) + 1)
+      putLogLine(line);
+   dropped = __atomic_load_n(&droppedRecords, __ATOMIC_RELAXED);
+   if (dropped != reportedDropped)
+   {
+      bufferPrintf(buff, bufferAppName(buff, sizeof(buff), json),
+                   sizeof(buff), json ? ",\"type\":\"DROPPED\","
+                   "\"session\":%lu,\"dropped\":%lu,\"spilled\":0}\n" :
+                   " DROPPED session=%lu dropped=%lu spilled=0\n",
+                   sessionID, dropped);
+      putLogLine(buff);
+      reportedDropped = dropped;
    }
+   if (overflowed != reportedOverflowed ||
+       overwritten != reportedOverwritten)
+   {
+      bufferPrintf(buff, bufferAppName(buff, sizeof(buff), json),
+                   sizeof(buff), json ? ",\"type\":\"RING\","
+                   "\"session\":%lu,\"overflowed\":%llu,"
+                   "\"overwritten\":%llu}\n" :
+                   " RING session=%lu overflowed=%llu overwritten=%llu\n",
+                   sessionID, overflowed, overwritten);
+      putLogLine(buff);
+      reportedOverflowed = overflowed;
+      reportedOverwritten = overwritten;
+   }
+   writeStatsData();
+   if (closeLogSink() != 0)
+   {
+      pthread_mutex_unlock( &logfileMutex );
+      return 1; // kept, and written again with the next lines
+   }
+   freeRetiredConfigs(); // after a SIGHUP reload
+   pthread_mutex_unlock( &logfileMutex );
+   statCount(STAT_WRITTEN, pending->lines);
+   statCount(STAT_BYTES, pending->used - pending->lines);
+   statCount(STAT_FLUSHES, 1);
+   pending->used = pending->lines = 0;
+   return 0;
+}
+
+/**
+* Remove the daemon socket a previous dlogd left behind. The path is
+* only removed if it is a socket that nothing accepts connections on,
+* so a second dlogd does not take the socket of one that is running.
+* @param addr is the address of the daemon socket
+* @return 0 if the path is free, 1 if a daemon is serving it or it is
+*         not a socket
+*/
+static unsigned int removeStaleSocket(struct sockaddr_un *addr)
+{
+   struct stat st;
+   int fd, ret;
+
+   if (lstat(addr->sun_path, &st) != 0)
+      return (errno != ENOENT);
+   if (!S_ISSOCK(st.st_mode))
+      return 1;
+   if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+      return 1;
+   ret = connect(fd, (struct sockaddr *) addr, sizeof(*addr));
+   close(fd);
+   if (ret == 0 || errno != ECONNREFUSED)
+      return 1;
+   return (unlink(addr->sun_path) != 0 && errno != ENOENT);
 }
 
+/**
+* Run the dlogd daemon loop: accept client connections on the daemon
+* socket, collect their batches, drain the shared-memory ring every
+* RINGPOLLMS, and write the lines through this process's logging
+* connection in batches of LogBatchSize lines, or after DAEMONFLUSHMS
+* if fewer arrive. Overflow and overwrite counts of the ring are
+* logged when they change. SIGHUP reloads the config; SIGTERM or
+* SIGINT writes what is pending and returns. The ring file is left in
+* place, so a restarted dlogd picks up what was written meanwhile.
+* @return 0 after a clean shutdown, 2 if this process's own config
+*         logs to the daemon, 3 if the socket or ring cannot be set up
+*         (also if another dlogd is serving the socket)
+*/
+static unsigned int runDaemon()
+{
+   struct pollfd fds[MAXDAEMONCLIENTS+2];
+   struct dlogPendingLines pending;
+   struct signalfd_siginfo sig;
+   struct sockaddr_un addr;
+   struct dlogConfig *cfg;
+   unsigned char *msg;
+   unsigned long long age;
+   sigset_t signals;
+   int numFds, stop, timeout, full, i, fd;
+   ssize_t len;
+
+   // the startup options are read until the socket and ring are set up
+   cfg = configReadBegin();
+   if (cfg->loggingLocation == LOGTODAEMON)
+   {
+      configReadEnd();
+      return 2;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(cfg->daemonSocket) >= sizeof(addr.sun_path) ||
+       !(msg = (unsigned char *) malloc(MAXDAEMONBATCH)))
+   {
+      configReadEnd();
+      return 3;
+   }
+   strcpy(addr.sun_path, cfg->daemonSocket);
+
+   // signals are taken through a descriptor so the loop can poll them
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGTERM);
+   sigaddset(&signals, SIGINT);
+   sigaddset(&signals, SIGHUP);
+   pthread_sigmask(SIG_BLOCK, &signals, 0);
+   fds[0].fd = signalfd(-1, &signals, SFD_CLOEXEC);
+   fds[1].fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+   if (fds[0].fd < 0 || fds[1].fd < 0 || removeStaleSocket(&addr) != 0 ||
+       bind(fds[1].fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+       chmod(addr.sun_path, 0666) != 0 || listen(fds[1].fd, 128) != 0 ||
+       createShmRing(cfg) != 0)
+   {
+      configReadEnd();
+      if (fds[0].fd >= 0)
+         close(fds[0].fd);
+      if (fds[1].fd >= 0)
+         close(fds[1].fd);
+      free(msg);
+      return 3;
+   }
+   configReadEnd();
+   fds[0].events = fds[1].events = POLLIN;
+   numFds = 2;
+   daemonServing = YES;
+   memset(&pending, 0, sizeof(pending));
+
+   for (stop = 0; !stop; )
+   {
+      timeout = -1;
+      if (pending.lines > 0)
+      {
+         age = (currentMicroseconds() - pending.oldest) / 1000;
+         timeout = (age >= DAEMONFLUSHMS) ? 0 : DAEMONFLUSHMS - age;
+      }
+      if (timeout < 0 || timeout > RINGPOLLMS)
+         timeout = RINGPOLLMS;
+      // with every client slot taken, new connections wait in the
+      // backlog until a client leaves
+      fds[1].events = (numFds < MAXDAEMONCLIENTS+2) ? POLLIN : 0;
+      if (poll(fds, numFds, timeout) < 0 && errno != EINTR)
+         break;
+      if (fds[0].revents & POLLIN)
+      {
+         if (read(fds[0].fd, &sig, sizeof(sig)) == sizeof(sig))
+         {
+            if (sig.ssi_signo == SIGHUP)
+               reloadConfig();
+            else
+               stop = 1;
+         }
+      }
+      if (fds[1].revents & POLLIN)
+      {
+         fd = accept(fds[1].fd, 0, 0);
+         if (fd >= 0)
+         {
+            fds[numFds].fd = fd;
+            fds[numFds].events = POLLIN;
+            fds[numFds].revents = 0;
+            numFds++;
+         }
+      }
+      for (i = 2; i < numFds; i++)
+      {
+         if (!fds[i].revents)
+            continue;
+         len = 0;
+         if (fds[i].revents & POLLIN)
+            len = recv(fds[i].fd, msg, MAXDAEMONBATCH, MSG_DONTWAIT);
+         if (len > 0 && addDaemonBatch(&pending, msg, len) == 0)
+            continue;
+         if (len < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+         // end of file, error, or a bad message: drop the client
+         close(fds[i].fd);
+         fds[i--] = fds[--numFds];
+      }
+      drainShmRing(&pending);
+      if (pending.lines == 0)
+         continue;
+      full = (pending.lines >= configReadBegin()->logBatchSize);
+      configReadEnd();
+      age = (currentMicroseconds() - pending.oldest) / 1000;
+      if (full || age >= DAEMONFLUSHMS)
+         if (writeDaemonLines(&pending) != 0)
+            pending.oldest = currentMicroseconds(); // retry later
+   }
+
+   drainShmRing(&pending);
+   writeDaemonLines(&pending);
+   unmapShmRing();
+   for (i = 0; i < numFds; i++)
+      close(fds[i].fd);
+   unlink(addr.sun_path);
+   pthread_sigmask(SIG_UNBLOCK, &signals, 0);
+   daemonServing = NO;
+   free(pending.buf);
+   free(msg);
+   return 0;
+}
@@ -19,6 +19,10 @@
 *  - dlogBeginTransfer(): called when a file transfer begins
 *  - dlogEndTransfer(): called when a file transfer ends
 *  - dlogFinalize(): called once to complete the execution
+* Long transfers can optionally report their progress with
+* dlogUpdateTransfer() in between begin and end, and groups of files
+* (e.g., a directory) can be begun and ended together with
+* dlogBeginTransferBatch() and dlogEndTransferBatch().
 * The pairs of dlogBeginTransfer() / dlogEndTransfer() calls are 
 * associated with a unique transfer ID returned from dlogBeginTransfer().
 * With this mechanism, parallel multi-threaded transfers are safe
@@ -27,12 +31,15 @@
 * Libdlog has extensive configuration control. See the sample
 * dlog.rc file provided in the distribution. Most logged values can
 * be included, excluded, or hashed to anonymize information. Logging
-* can be directed to a file, or to syslog. When libDlog initializes
-* it searches for a config file in the following places in sequence:
-* a file named by $DLOG_CONFIG, if the environment variable exists; a
-* file named $HOME/.dlog.rc if the variable and file exist; or a file
-* named /etc/dlog/dlog.rc. If all three are not available, libdlog will
-* not be activated and will silently do nothing.
+* can be directed to a file, to syslog, or to the dlogd daemon, which
+* merges the records of many processes into a single writer. When
+* libDlog initializes it searches for a config file in the following
+* places in sequence: a file named by $DLOG_CONFIG, if the environment
+* variable exists; a file named $HOME/.dlog.rc if the variable and file
+* exist; or a file named /etc/dlog/dlog.rc. If all three are not
+* available, libdlog will not be activated and will silently do nothing.
+* The configuration can be re-read while running with dlogReloadConfig()
+* or, with LogReloadOnChange, whenever the file changes.
 *
 * Note that the transfer times calculated internally by libdlog are the
 * time intervals between calls to the begin/end transfer routines. This
@@ -70,7 +77,9 @@
 *                 DLOG_RECEIVE is a receive
 * @param annotation is a user defined annotation/comment string (<128ch)
 * @return A transfer ID > 0 to be used in the call to 
-*         dlogEndTransfer(), or 0 if some error occurred
+*         dlogEndTransfer(), or 0 if some error occurred; with sampling
+*         enabled, transfers that are not logged still get a valid ID,
+*         as do transfers over LogMaxOpenTransfers or LogMemoryBudget
 */
 unsigned long dlogBeginTransfer(char* filename, unsigned long size ,
                                 unsigned long userID, char* sourceHostname,
@@ -82,10 +91,14 @@ unsigned long dlogBeginTransfer(char* filename, unsigned long size ,
    // JEC: get time of file transfer start
    //struct timeval startTval;
    // transfer ID and error flag
+   struct dlogConfig *cfg;
+   struct dlogBeginArgs args;
    unsigned long tid;
-   int errorFlag = 0; 
-   char md5buffer[24];
+   unsigned int weight;
+   int errorFlag = 0, limit = LIMIT_NONE; 
    
+   DLOGPROBE(begin_entry, filename, size, xferType);
+
    // if logging is disabled, return
    if (logDoLogging == NO)
       return 0;
@@ -98,10 +111,23 @@ unsigned long dlogBeginTransfer(char* filename, unsigned long size ,
    if (!filename || !sourceHostname || !targetPath || !targetHostname)
       return 0;
    
-   // Generate a new transfer-ID (must lock since a global var)
-   pthread_mutex_lock( &generalMutex );
-   tid = ++nextTransferID; 
-   pthread_mutex_unlock( &generalMutex );
+   // Generate a new transfer-ID (atomically, since a global var)
+   tid = __atomic_add_fetch(&nextTransferID, 1, __ATOMIC_RELAXED);
+
+   // the transfer is logged with the configuration of this moment
+   cfg = configReadBegin();
+
+   // sampled-out transfers get a marked ID and no record at all, and
+   // so do those over LogMaxOpenTransfers or LogMemoryBudget
+   if ((weight = sampleTransfer(cfg, tid)) == 0 ||
+       (limit = transferLimit(cfg, 1)) == LIMIT_REFUSE)
+   {
+      configReadEnd();
+      if (weight)
+         statCount(STAT_REFUSED, 1);
+      DLOGPROBE(begin_return, tid | UNLOGGEDID, size);
+      return tid | UNLOGGEDID;
+   }
 
    // create new logging record -- make sure all zeroed w/ calloc()
    logRecord = (struct dlogLoggingData *) 
@@ -109,143 +135,38 @@ unsigned long dlogBeginTransfer(char* filename, unsigned long size ,
    if (!logRecord)
    {
       // memory allocation error! Skip everything else!
+      configReadEnd();
       return 0;
    }
+   memoryCharge(sizeof(struct dlogLoggingData));
 
    logRecord->id = tid; // assign transfer ID
-
-   //
-   // Get source file rootname, path, and extension
-   //
-
-   if (fileNameFormat != M_NO)
-      getBaseFilename(filename, logRecord->fileName,
-                      sizeof(logRecord->fileName));
-
-   if (fileExtFormat != M_NO)
-      getFilenameExtension(filename, logRecord->fileExt,
-                     sizeof(logRecord->fileExt));
-
-   if (sourcePathFormat != M_NO)
-   {
-      getPathFromFilename(filename, logRecord->sourceDir,
-                      sizeof(logRecord->sourceDir));
-      // if source dir is empty (not in filename), use CWD
-      if (logRecord->sourceDir[0] == '\0')
-      {
-         getcwd(logRecord->sourceDir, sizeof(logRecord->sourceDir));
-      }
-   }
-
-   /* md5/bitmask operations on source file components */
-   if (fileNameFormat == M_MD5)
-   {
-      dlogMD5(logRecord->fileName, md5buffer);
-      strncpy(logRecord->fileName, md5buffer,
-              sizeof(logRecord->fileName));
-      logRecord->fileName[sizeof(logRecord->fileName)-1] = '\0';
-   }
-   if (fileExtFormat == M_MD5)
-   {
-      dlogMD5(logRecord->fileExt, md5buffer);
-      strncpy(logRecord->fileExt, md5buffer,
-              sizeof(logRecord->fileExt));
-      logRecord->fileExt[sizeof(logRecord->fileExt)-1] = '\0';
-   }
-   if (sourcePathFormat == M_MD5) 
-   {
-      dlogMD5(logRecord->sourceDir, md5buffer);
-      strncpy(logRecord->sourceDir, md5buffer,
-              sizeof(logRecord->sourceDir));
-      logRecord->sourceDir[sizeof(logRecord->sourceDir)-1] = '\0';
-   }
-
-   // Clean source strings of any quote chars
-   cleanString(logRecord->fileName, sizeof(logRecord->fileName));
-   cleanString(logRecord->fileExt, sizeof(logRecord->fileExt));
-   cleanString(logRecord->sourceDir, sizeof(logRecord->sourceDir));
-
-   //
-   // Create the target path data
-   //
-
-   if (targetPathFormat != M_NO)
-   {
-      strncpy(logRecord->targetDir, targetPath, 
-              sizeof(logRecord->targetDir));
-      logRecord->targetDir[sizeof(logRecord->targetDir)-1] = '\0';
-   }
-
-   if (targetPathFormat == M_MD5)
-   {
-      dlogMD5(logRecord->targetDir, md5buffer);
-      strncpy(logRecord->targetDir, md5buffer, 
-              sizeof(logRecord->targetDir));
-      logRecord->targetDir[sizeof(logRecord->targetDir)-1] = '\0';
-   }
-   // Clean target string of any quote chars
-   cleanString(logRecord->targetDir, sizeof(logRecord->targetDir));
-
-   //
-   // Get IP address data TODO: simplify with less processing
-   //
-
-   if (sourceIPFormat == R_YES)
-   {
-      findIPAddress(sourceHostname, logRecord->sourceIP,
-                    sizeof(logRecord->sourceIP));
-      doIPBitmask(logRecord->sourceIP, sourceIPMask,
-                  sizeof(logRecord->sourceIP));
-   } else if (sourceIPFormat == R_RAW)
-   {
-      strncpy(logRecord->sourceIP, sourceHostname, 
-              sizeof(logRecord->sourceIP));
-      logRecord->sourceIP[sizeof(logRecord->sourceIP)-1] = '\0';
-   }
-   cleanString(logRecord->sourceIP, sizeof(logRecord->sourceIP));
-
-   if (targetIPFormat == R_YES)
+   logRecord->config = holdConfig(cfg, 1); // kept until the record is freed
+   configReadEnd();
+   logRecord->weight = weight;
+
+   // fill in the logged fields, as configured
+   args.filename = filename;
+   args.targetPath = targetPath;
+   args.sourceHostname = sourceHostname;
+   args.targetHostname = targetHostname;
+   args.annotation = annotation;
+   args.userID = userID;
+   if (limit == LIMIT_STRIP)
    {
-      findIPAddress(targetHostname, logRecord->targetIP,
-                    sizeof(logRecord->targetIP));
-      doIPBitmask(logRecord->targetIP, targetIPMask,
-                  sizeof(logRecord->targetIP));
-   } else if (targetIPFormat == R_RAW)
-   {
-      strncpy(logRecord->targetIP, targetHostname, 
-              sizeof(logRecord->targetIP));
-      logRecord->targetIP[sizeof(logRecord->targetIP)-1] = '\0';
-   }
-   cleanString(logRecord->targetIP, sizeof(logRecord->targetIP));
-
-   // Annotation 
-   if (logAnnotation == YES) {
-      strncpy(logRecord->annotation, annotation,
-              sizeof(logRecord->annotation));
-      logRecord->annotation[sizeof(logRecord->annotation)-1] = '\0';
-      // Clean annotation of any quote chars
-      cleanString(logRecord->annotation, sizeof(logRecord->annotation));
+      stripBeginSteps(logRecord);
+      statCount(STAT_STRIPPED, 1);
+   } else {
+      runBeginSteps(logRecord, &args, 0);
    }
-//------------------------------------------------------------
 
    logRecord->xferType = xferType;
 
    /* Now is time of file transfer start */
-   gettimeofday(&(logRecord->startTval),0);
+   transferTime(&(logRecord->startTval));
 
-   if (userIDFormat != M_NO)
-   {
-      sprintf(logRecord->user,"%lu",userID);
-      if (userIDFormat == M_MD5)
-      {
-         dlogMD5(logRecord->user, md5buffer);
-         strncpy(logRecord->user, md5buffer, sizeof(logRecord->user));
-         logRecord->user[sizeof(logRecord->user)-1] = '\0';
-      }
-      // JEC: impossible?!?
-      //if ((userID >= ULONG_MAX) || (userID < 0))
-      //   errorFlag = 1;
-   }
+   if (progressTable && cfg->logProgress == YES)
+      progressClaim(logRecord);
 
    logRecord->size = size;
    // JEC: impossible?!?
@@ -258,15 +179,145 @@ unsigned long dlogBeginTransfer(char* filename, unsigned long size ,
    // Add transfer info to outstanding tranfers list (is mutexed internally)
    if (dlogAddLoggingData(&activeXferList, logRecord) != 0)
    {
-      free(logRecord); // didn't get added for some reason?
+      progressRelease(logRecord);
+      freeLoggingData(logRecord); // didn't get added for some reason?
       return 0;
    }
+   statCount(STAT_BEGUN, 1);
+   DLOGPROBE(begin_return, tid, size);
 
    // return transfer ID
    return tid;
 }
 
 
+/**
+* Called during a file transfer to report how many bytes have been
+* transferred so far. This is cheap (no locking, no allocation) and can
+* be called as often as the application likes; the library takes a
+* throughput sample at most once per LogProgressInterval and flags the
+* transfer as stalled if its byte count does not grow for
+* LogStallInterval. The min/avg/max rates and the stall flag are logged
+* with the record when dlogEndTransfer() is called. Does nothing unless
+* LogProgress is enabled in the config file.
+* @param transferID The ID returned by dlogBeginTransfer()
+* @param bytesSoFar Total bytes transferred so far (not an increment)
+* @return 0 on success or if progress logging is disabled, 1 if the
+*         transfer is unknown or not being tracked
+*/
+unsigned int dlogUpdateTransfer(unsigned long transferID,
+                                unsigned long bytesSoFar)
+{
+   if (logDoLogging == NO || !progressTable)
+      return 0;
+   if (transferID == 0)
+      return 1;
+   if (transferID & UNLOGGEDID)
+      return 0;
+   return progressUpdate(transferID, bytesSoFar);
+}
+
+/**
+* Replaces the clock used for transfer start and end times and for
+* progress reports, e.g. to drive libdlog on simulated time in a load
+* generator. The function is called from the thread making the API
+* call, so a per-thread clock works. Set it before transfers begin.
+* @param timeSource is called to get the current time, or null to go
+*        back to gettimeofday()
+* @return nothing
+*/
+void dlogSetTimeSource(void (*timeSource)(struct timeval *now))
+{
+   __atomic_store_n(&transferClock, timeSource, __ATOMIC_RELEASE);
+}
+
+/**
+* Registers a custom field key to be used with dlogSetField(). 
+* Registering the same name again returns the same key, so each
+* module of an application can register the keys it uses.
+* @param keyName is the field name as it will appear in the log; it
+*        may only contain letters, digits, '_', '-' and '.'
+* @return the key (nonzero), or 0 if the name is invalid or too many
+*         keys have been registered
+*/
+unsigned int dlogRegisterField(char *keyName)
+{
+   return registerFieldKey(keyName);
+}
+
+
+/**
+* Sets a custom field of an active transfer; it will be logged with
+* the transfer record at dlogEndTransfer(). Setting a field again
+* replaces its value. The value is copied, so strings need not be
+* kept by the caller.
+* @param transferID is the ID returned by dlogBeginTransfer()
+* @param key is a key returned by dlogRegisterField()
+* @param type is DLOG_FIELD_INT, DLOG_FIELD_DOUBLE or DLOG_FIELD_STRING
+* @param ... is the value, a long, a double or a char* respectively
+* @return 0 on success (or logging is disabled), 1 if the transfer is
+*         not active, 2 if the record has no room left for fields,
+*         3 if the key or type is invalid
+*/
+unsigned int dlogSetField(unsigned long transferID, unsigned int key,
+                          unsigned int type, ...)
+{
+   struct dlogLoggingData *rec;
+   char str[MAXFIELDVALUE+1];
+   unsigned int len, ret;
+   va_list args;
+   long ival;
+   double dval;
+   void *value;
+
+   if (logDoLogging == NO)
+      return 0;
+   if (key == 0 || key > __atomic_load_n(&numFieldKeys, __ATOMIC_ACQUIRE))
+      return 3;
+   va_start(args, type);
+   switch (type)
+   {
+      case DLOG_FIELD_INT:
+         ival = va_arg(args, long);
+         value = &ival;
+         len = sizeof(ival);
+         break;
+      case DLOG_FIELD_DOUBLE:
+         dval = va_arg(args, double);
+         value = &dval;
+         len = sizeof(dval);
+         break;
+      case DLOG_FIELD_STRING:
+         value = va_arg(args, char *);
+         if (!value)
+            value = "";
+         // strings are cleaned like the other logged strings
+         strncpy(str, value, sizeof(str)-1);
+         str[sizeof(str)-1] = '\0';
+         cleanString(str, sizeof(str));
+         value = str;
+         len = strlen(str);
+         break;
+      default:
+         va_end(args);
+         return 3;
+   }
+   va_end(args);
+   if (transferID & UNLOGGEDID)
+      return 0;
+   ret = 1;
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
+   for (rec = activeXferList.head; rec; rec = rec->next)
+      if (rec->id == transferID)
+      {
+         ret = arenaSetField(rec, key, type, value, len) ? 2 : 0;
+         break;
+      }
+   pthread_mutex_unlock( &generalMutex );
+   return ret;
+}
+
+
 /**
 * Called when each file transfer completes. 
 * This function calculates the transfer duration and then calls
@@ -286,13 +337,15 @@ unsigned int dlogEndTransfer(unsigned long transferID,
                              unsigned long fileSize,
                              unsigned int transError)
 {  
-   static int numCalled=0;
    if (logDoLogging == NO)
       return 0;
 
    if (transferID == 0) // no transfer to end??
       return 1;
 
+   if (transferID & UNLOGGEDID) // sampled out, nothing to log
+      return 0;
+
    /* JEC: get time of file transfer start */
    struct timeval logEndTval;
    struct dlogLoggingData *data;
@@ -303,24 +356,240 @@ unsigned int dlogEndTransfer(unsigned long transferID,
       return 2; 
    }
 
-   // Get ending time of this transfer
-   gettimeofday(&logEndTval, 0);
-   data->endTval = logEndTval;
+   statCount(STAT_ENDED, 1);
 
-   // if size is given here, use it
-   if (fileSize > data->size)
-      data->size = fileSize;
-   
-   data->errorFlag += transError;
+   // Get ending time of this transfer
+   transferTime(&logEndTval);
+   if (endLoggingData(data, &logEndTval, fileSize, transError) != 0)
+      return 0; // not to be logged
 
-   // queue record for later logging
-   dlogAddLoggingData(&endedXferList,data);
-   numCalled++;
-   if (numCalled % logBatchSize)
+   // queue record for later logging, and write out a full batch
+   queueEndedRecord(data);
+   if (batchReady())
       writeLogData();
    return 0;
 }
 
+/**
+* Called before a group of file transfers is started, e.g. for each
+* directory of a recursive copy. This does the same as calling
+* dlogBeginTransfer() for each file, but the transfer IDs are allocated
+* in one step, the records in one allocation, the start time, user and
+* host fields are computed once for the whole batch, and all records
+* are made active under a single lock.
+* @param files Array of per-file information; filename and targetPath
+*              must be non-null, annotation is ignored if null
+* @param count Number of entries in files[] (and transferIDs[])
+* @param userID User ID associated with all transfers
+* @param sourceHostname Non-null string, source hostname or IP adress
+* @param targetHostname Non-null string, destination hostname or IP
+* @param xferType Type of transfer: DLOG_SEND or DLOG_RECEIVE
+* @param transferIDs Array that receives the transfer ID of each file,
+*                    to be given to dlogEndTransfer() or
+*                    dlogEndTransferBatch(); all are 0 on error
+* @return 0 on success or if logging is disabled, nonzero on error
+*/
+unsigned int dlogBeginTransferBatch(struct dlogFileInfo *files,
+                                    unsigned int count,
+                                    unsigned long userID,
+                                    char* sourceHostname,
+                                    char* targetHostname,
+                                    unsigned int xferType,
+                                    unsigned long *transferIDs)
+{
+   struct dlogRecordBlock *block;
+   struct dlogLoggingData *records, *shared=0, *first=0, *last=0;
+   struct timeval startTval;
+   struct dlogConfig *cfg;
+   struct dlogBeginArgs args;
+   unsigned long firstID;
+   unsigned int i, n, weight;
+   int limit;
+
+   if (!transferIDs)
+      return 1;
+   memset(transferIDs, 0, count*sizeof(unsigned long));
+   if (logDoLogging == NO || count == 0)
+      return 0;
+   if ((xferType != DLOG_RECEIVE) && (xferType != DLOG_SEND))
+      return 1;
+   if (!files || !sourceHostname || !targetHostname)
+      return 1;
+   for (i=0; i < count; i++)
+      if (!files[i].filename || !files[i].targetPath)
+         return 1;
+
+   // one atomic step allocates the whole range of IDs; sampled-out
+   // transfers get their marked IDs right away, the others hold their
+   // record weight until their record is made
+   firstID = __atomic_add_fetch(&nextTransferID, count, __ATOMIC_RELAXED)
+             - count + 1;
+   cfg = configReadBegin();
+   for (i=0, n=0; i < count; i++)
+   {
+      if ((weight = sampleTransfer(cfg, firstID + i)) != 0)
+      {
+         transferIDs[i] = weight;
+         n++;
+      } else {
+         transferIDs[i] = (firstID + i) | UNLOGGEDID;
+      }
+   }
+   if (n == 0)
+   {
+      configReadEnd();
+      return 0;
+   }
+   // over the limits the whole batch is not logged, or is stripped
+   if ((limit = transferLimit(cfg, n)) == LIMIT_REFUSE)
+   {
+      configReadEnd();
+      for (i=0; i < count; i++)
+         transferIDs[i] = (firstID + i) | UNLOGGEDID;
+      statCount(STAT_REFUSED, n);
+      return 0;
+   }
+
+   // all logged records in one zeroed block
+   block = (struct dlogRecordBlock *) calloc(1, sizeof(*block) +
+                                      n*sizeof(struct dlogLoggingData));
+   if (!block)
+   {
+      configReadEnd();
+      memset(transferIDs, 0, count*sizeof(unsigned long));
+      return 2;
+   }
+   holdConfig(cfg, n); // one reference per record
+   configReadEnd();
+   block->refs = n;
+   block->bytes = sizeof(*block) + n*sizeof(struct dlogLoggingData);
+   memoryCharge(block->bytes);
+   records = (struct dlogLoggingData *) (block + 1);
+
+   args.sourceHostname = sourceHostname;
+   args.targetHostname = targetHostname;
+   args.userID = userID;
+   transferTime(&startTval);
+   for (i=0, n=0; i < count; i++)
+   {
+      struct dlogLoggingData *logRecord;
+      if (transferIDs[i] & UNLOGGEDID) // sampled out
+         continue;
+      logRecord = &records[n++];
+      logRecord->block = block;
+      logRecord->id = firstID + i;
+      logRecord->config = cfg;
+      logRecord->weight = (unsigned int) transferIDs[i];
+      args.filename = files[i].filename;
+      args.targetPath = files[i].targetPath;
+      args.annotation = files[i].annotation;
+      // the fields common to the batch are computed only once
+      if (limit == LIMIT_STRIP)
+         stripBeginSteps(logRecord);
+      else
+         runBeginSteps(logRecord, &args, shared);
+      shared = logRecord;
+      logRecord->xferType = xferType;
+      logRecord->startTval = startTval;
+      logRecord->size = files[i].fileSize;
+      if (progressTable && cfg->logProgress == YES)
+         progressClaim(logRecord);
+      if (last)
+         last->next = logRecord;
+      else
+         first = logRecord;
+      last = logRecord;
+      transferIDs[i] = logRecord->id;
+   }
+
+   // make the whole batch active at once
+   dlogAddLoggingDataChain(&activeXferList, first, last, n);
+   statCount(STAT_BEGUN, n);
+   if (limit == LIMIT_STRIP)
+      statCount(STAT_STRIPPED, n);
+   return 0;
+}
+
+/**
+* Called after a group of file transfers is complete or aborted. This
+* does the same as calling dlogEndTransfer() for each transfer, but
+* the end time is taken once, the records are found and removed from
+* the active list in a single pass under one lock, and queued for
+* logging together. The transfers need not all come from the same
+* dlogBeginTransferBatch() call.
+* @param transferIDs Array of IDs from dlogBeginTransfer() or
+*                    dlogBeginTransferBatch()
+* @param fileSizes Array of sizes if not given at begin (see
+*                  dlogEndTransfer()), or null
+* @param transferErrors Array of application error codes (0 is
+*                       success), or null if all succeeded
+* @param count Number of entries in each array
+* @return 0 if all transfers were ended or logging is disabled,
+*         otherwise the number of transfer IDs that were not found
+*/
+unsigned int dlogEndTransferBatch(unsigned long *transferIDs,
+                                  unsigned long *fileSizes,
+                                  unsigned int *transferErrors,
+                                  unsigned int count)
+{
+   struct dlogBatchID *ids;
+   struct dlogLoggingData **found, *first=0, *last=0;
+   struct timeval endTval;
+   unsigned int i, n, numFound, numQueued=0;
+
+   if (logDoLogging == NO || count == 0)
+      return 0;
+   if (!transferIDs)
+      return count;
+
+   ids = (struct dlogBatchID *) malloc(count*sizeof(struct dlogBatchID));
+   found = (struct dlogLoggingData **)
+           calloc(count, sizeof(struct dlogLoggingData *));
+   if (!ids || !found)
+   {
+      free(ids);
+      free(found);
+      return count;
+   }
+   for (i=0, n=0; i < count; i++)
+   {
+      if (transferIDs[i] == 0 || (transferIDs[i] & UNLOGGEDID))
+         continue;
+      ids[n].id = transferIDs[i];
+      ids[n].index = i;
+      n++;
+   }
+   qsort(ids, n, sizeof(struct dlogBatchID), compareBatchIDs);
+   numFound = dlogRemoveLoggingDataSet(&activeXferList, ids, n, found);
+   statCount(STAT_ENDED, numFound);
+
+   transferTime(&endTval);
+   for (i=0; i < count; i++)
+   {
+      if (!found[i])
+         continue;
+      if (endLoggingData(found[i], &endTval,
+                         fileSizes ? fileSizes[i] : 0,
+                         transferErrors ? transferErrors[i] : 0) != 0)
+         continue; // not to be logged
+      if (last)
+         last->next = found[i];
+      else
+         first = found[i];
+      last = found[i];
+      numQueued++;
+   }
+
+   queueEndedChain(first, last, numQueued);
+   if (batchReady())
+      writeLogData();
+
+   free(ids);
+   free(found);
+   return n - numFound;
+}
+
+
 /**
 * Called to initialize LibDLOG. It reads the config file which contains
 * config variables that determine in which format data fields will 
@@ -335,8 +604,10 @@ unsigned int dlogEndTransfer(unsigned long transferID,
 */
 unsigned int dlogInit(char * nameOfApp)
 {   
+   struct dlogConfig *cfg;
+   unsigned int stat;
 
-   pthread_mutex_lock( &generalMutex );
+   statLock( &generalMutex, DLOG_STAT_GENERALWAIT );
 
    if (alreadyInitialized == YES)
    {
@@ -347,7 +618,9 @@ unsigned int dlogInit(char * nameOfApp)
    strncpy(appName, nameOfApp, MAXFILEPATH);
    appName[MAXFILEPATH-1] = '\0';
    
-   activeXferList = endedXferList = NULL; 
+   activeXferList.head = endedXferList.head = NULL; 
+   activeXferList.tail = endedXferList.tail = NULL; 
+   activeXferList.count = endedXferList.count = 0;
    
    // reset nextTransferID
    nextTransferID = 0;
@@ -355,6 +628,7 @@ unsigned int dlogInit(char * nameOfApp)
    if (setConfigFile() != 1)
    {
       logDoLogging = NO;
+      pthread_mutex_unlock( &generalMutex );
       return 2;
    }
 
@@ -362,310 +636,95 @@ unsigned int dlogInit(char * nameOfApp)
    time_t curtime = time(0);
    sessionID = ((curtime << 20) | getpid()) & 0xfffffffff;
 
-   /* JEC: These are initialized upon creation
-   fileNameFormat = 0; 
-   fileExtFormat = 0; 
-   sourcePathFormat = 0; 
-   targetPathFormat = 0; 
-   userIDFormat = 0;   
-   sourceIPFormat = 0;    
-   targetIPFormat = 0;
-   // log the data using 'syslog' capability 1 yes 0 no
-   loggingLocation = 0; 
-   */
-   strcpy(syslogIdent,"DLOG");
-   
-   FILE* configFilenamehandle;
-   if (! (configFilenamehandle = fopen (configFilename,"rf")))
+   cfg = (struct dlogConfig *) malloc(sizeof(struct dlogConfig));
+   if (!cfg)
    {
-      // Error : can't open file
       logDoLogging = NO;
       pthread_mutex_unlock( &generalMutex );
       return 3;
    }
-   strcpy(dlogFilename, "/var/log/datalog.log"); // default value
-
-   char buf[MAXLOGTOFILE], option[MAXFILEPATH],
-        value[MAXFILEPATH];
-   char *sp;
    // read conf file
-   while (!feof(configFilenamehandle)) 
+   stat = readConfig(cfg);
+   if (stat == 3)
    {
-      *buf = '\0';  
-      fgets(buf, MAXLOGTOFILE-1, configFilenamehandle);
-      if (buf[0] == '#' || buf[0] == '\n' || buf[0] == '\r')
-         // skip comment line or blank line
-         continue;
-      //buf[strlen(buf)-1] = '\0'; // remove newline (doesn't matter, really)
-      //printf("(%s)\n",buf); // debugging
-      sp = strchr(buf,'=');
-      if (sp == 0)
-         continue;
-      *sp = '\0'; // split line at equals sign
-      sscanf(buf,"%s",option);  // get no-whitespace strings
-      sscanf(sp+1,"%s",value);
-      //printf("  (%s) = (%s)\n",option,value); // debugging
-      *sp = '='; // restore line in case we print an error message
-
-      if (strcmp(option,"DoLogging") == 0)
-      {
-         if (!strcmp("yes",value))
-            logDoLogging = YES;
-         else if (!strcmp("no",value))
-            logDoLogging = NO;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option, "LogIdent") == 0)  //DJL libdlog 09/2012
-      {
-         strncpy(syslogIdent, value, MAXFILEPATH);
-         syslogIdent[MAXFILEPATH-1] = '\0';
-      }
-      else if (strcmp(option, "LogOption") == 0)  //DJL libdlog 09/2012
-      {
-         char *tmpOption;
-         int tmpInt = 0;
-         tmpOption = strtok(sp+1," |\n");
-
-         tmpInt = stringToNumber(tmpOption);
-         if (tmpInt > 0 && tmpInt < 64)
-         {
-            tmpOption = NULL; // skip rest
-         }
-
-         while (tmpOption != NULL)
-         {
-             if (!strcmp("LOG_CONS",tmpOption))
-                 tmpInt |= LOG_CONS;
-             else if (!strcmp("LOG_NDELAY",tmpOption))
-                 tmpInt |= LOG_NDELAY;
-             else if (!strcmp("LOG_NOWAIT",tmpOption))
-                 tmpInt |= LOG_NOWAIT;
-             else if (!strcmp("LOG_ODELAY",tmpOption))
-                 tmpInt |= LOG_ODELAY;
-             else if (!strcmp("LOG_PERROR",tmpOption))
-                 tmpInt |= LOG_PERROR;
-             else if (!strcmp("LOG_PID",tmpOption))
-                 tmpInt |= LOG_PID;
-             else
-                 goto FORMATERROR; //raise error
-
-                 tmpOption = strtok(NULL," |\n");
-         }
-
-         if (tmpInt == 0)
-            goto FORMATERROR; //raise error
-
-         syslogOption = tmpInt;
-
-      }
-      else if (strcmp(option, "LogFacility") == 0) //DJL libdlog 09/2012
-      {
-         int tmpInt;
-         tmpInt = stringToNumber(value);
-         if (tmpInt >= 0 && tmpInt < 256) 
-            syslogFacility = tmpInt;
-         else if ((!strcmp("LOG_AUTH",value)) || (!strcmp("32",value)))
-            syslogFacility = LOG_AUTH;
-         else if ((!strcmp("LOG_AUTHPRIV",value)) || (!strcmp("80",value)))
-            syslogFacility = LOG_AUTHPRIV;
-         else if ((!strcmp("LOG_CRON",value)) || (!strcmp("72",value)))
-            syslogFacility = LOG_CRON;
-         else if ((!strcmp("LOG_DAEMON",value)) || (!strcmp("24",value)))
-            syslogFacility = LOG_DAEMON;
-         else if ((!strcmp("LOG_FTP",value)) || (!strcmp("88",value)))
-            syslogFacility = LOG_FTP;
-         else if ((!strcmp("LOG_KERN",value)) || (!strcmp("0",value)))
-            syslogFacility = LOG_KERN;
-         else if ((!strcmp("LOG_LOCAL0",value)) || (!strcmp("128",value)))
-            syslogFacility = LOG_LOCAL0;
-         else if ((!strcmp("LOG_LOCAL1",value)) || (!strcmp("136",value)))
-            syslogFacility = LOG_LOCAL1;
-         else if ((!strcmp("LOG_LOCAL2",value)) || (!strcmp("144",value)))
-            syslogFacility = LOG_LOCAL2;
-         else if ((!strcmp("LOG_LOCAL3",value)) || (!strcmp("152",value)))
-            syslogFacility = LOG_LOCAL3;
-         else if ((!strcmp("LOG_LOCAL4",value)) || (!strcmp("160",value)))
-            syslogFacility = LOG_LOCAL4;
-         else if ((!strcmp("LOG_LOCAL5",value)) || (!strcmp("168",value)))
-            syslogFacility = LOG_LOCAL5;
-         else if ((!strcmp("LOG_LOCAL6",value)) || (!strcmp("176",value)))
-            syslogFacility = LOG_LOCAL6;
-         else if ((!strcmp("LOG_LOCAL7",value)) || (!strcmp("184",value)))
-            syslogFacility = LOG_LOCAL7;
-         else if ((!strcmp("LOG_LPR",value)) || (!strcmp("48",value)))
-            syslogFacility = LOG_LPR;
-         else if ((!strcmp("LOG_MAIL",value)) || (!strcmp("16",value)))
-            syslogFacility = LOG_MAIL;
-         else if ((!strcmp("LOG_NEWS",value)) || (!strcmp("56",value)))
-            syslogFacility = LOG_NEWS;
-         else if ((!strcmp("LOG_SYSLOG",value)) || (!strcmp("40",value)))
-            syslogFacility = LOG_SYSLOG;
-         else if ((!strcmp("LOG_USER",value)) || (!strcmp("8",value)))
-            syslogFacility = LOG_USER;
-         else if ((!strcmp("LOG_UUCP",value)) || (!strcmp("64",value)))
-            syslogFacility = LOG_UUCP;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option, "LogLevel") == 0)     //DJL libdlog 10/2012
-      {
-
-         int tmpInt;
-         tmpInt = stringToNumber(value);
-         if (tmpInt >= 0 && tmpInt <= 7)
-            syslogLevel = tmpInt;
-         else if (!strcmp("LOG_EMERG",value))
-            syslogLevel |= LOG_EMERG;
-         else if (!strcmp("LOG_ALERT",value))
-            syslogLevel |= LOG_ALERT;
-         else if (!strcmp("LOG_ERR",value))
-            syslogLevel |= LOG_ERR;
-         else if (!strcmp("LOG_WARNING",value))
-            syslogLevel |= LOG_WARNING;
-         else if (!strcmp("LOG_NOTICE",value))
-            syslogLevel |= LOG_NOTICE;
-         else if (!strcmp("LOG_INFO",value))
-            syslogLevel |= LOG_INFO;
-         else if (!strcmp("LOG_DEBUG",value))
-            syslogLevel |= LOG_DEBUG;
-         else
-            goto FORMATERROR; //raise error      
-      }
-
-      else if (strcmp(option, "LogFilename") == 0)
-      {
-         strncpy(dlogFilename, value, MAXFILEPATH);
-         dlogFilename[MAXFILEPATH-1] = '\0';
-      }
-      else if (strcmp(option, "LoggingLocation") == 0)
-      {  
-         if (!strcmp("file",value))
-            loggingLocation = LOGTOFILE;
-         else if (!strcmp("syslog",value))
-            loggingLocation = LOGTOSYSLOG;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option,"LogSourcename") == 0)
-      {  
-         if (!strcmp("yes",value))
-            fileNameFormat = M_YES;
-         else if (!strcmp("no",value))
-            fileNameFormat = M_NO;
-         else if (!strcmp("md5",value))
-            fileNameFormat = M_MD5;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option,"LogExtension") == 0)
-      {  
-         if (!strcmp("yes",value))
-            fileExtFormat = M_YES;
-         else if (!strcmp("no",value))
-            fileExtFormat = M_NO;
-         else if (!strcmp("md5",value))
-            fileExtFormat = M_MD5;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option,"LogSourcePath") == 0)
-      {  
-         if (!strcmp("yes",value))
-            sourcePathFormat = M_YES;
-         else if (!strcmp("no",value))
-            sourcePathFormat = M_NO;
-         else if (!strcmp("md5",value))
-            sourcePathFormat = M_MD5;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option,"LogTargetPath") == 0)
-      {  
-         if (!strcmp("yes",value))
-            targetPathFormat = M_YES;
-         else if (!strcmp("no",value))
-            targetPathFormat = M_NO;
-         else if (!strcmp("md5",value))
-            targetPathFormat = M_MD5;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option,"LogUserID") == 0)
-      {  
-         if (!strcmp("yes",value))
-            userIDFormat = M_YES;
-         else if (!strcmp("no",value))
-            userIDFormat = M_NO;
-         else if (!strcmp("md5",value))
-            userIDFormat = M_MD5;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option,"LogBatchSize") == 0)
-      {  
-         int tmpInt = stringToNumber(value);
-         if (tmpInt > 0 && tmpInt < 256)
-            logBatchSize = (unsigned) tmpInt;
-         else
-            goto FORMATERROR; //raise error
-      }
-      else if (strcmp(option,"LogSourceIP") == 0)
-      {
-         if (!strcmp("yes",value))
-         {
-            sourceIPFormat = R_YES;
-            sourceIPMask = 0xffffffff;
-         } else if (!strcmp("no",value))
-         {
-            sourceIPFormat = R_NO;
-         } else if (!strcmp("raw",value))
-         {
-            sourceIPFormat = R_RAW;
-            sourceIPMask = 0xffffffff;
-         } else {
-            unsigned int d1,d2,d3,d4;
-            if (sscanf(value,"%u.%u.%u.%u",&d1,&d2,&d3,&d4) != 4)
-               goto FORMATERROR; //raise error
-            sourceIPFormat = M_YES;
-            sourceIPMask = (d1<<24) | (d2<<16) | (d3<<8) | (d4);
-         }
-      }
-      else if (strcmp(option,"LogTargetIP") == 0)
-      {  
-         if (!strcmp("yes",value))
-         {
-            targetIPFormat = R_YES;
-            targetIPMask = 0xffffffff;
-         } else if (!strcmp("no",value))
-         {
-            targetIPFormat = R_NO;
-         } else if (!strcmp("raw",value))
-         {
-            targetIPFormat = R_RAW;
-            targetIPMask = 0xffffffff;
-         } else {
-            unsigned int d1,d2,d3,d4;
-            if (sscanf(value,"%u.%u.%u.%u",&d1,&d2,&d3,&d4) != 4)
-               goto FORMATERROR; //raise error
-            targetIPFormat = M_YES;
-            targetIPMask = (d1<<24) | (d2<<16) | (d3<<8) | (d4);
-         }
-      }
-   } 
-   fclose(configFilenamehandle);  
+      // Error : can't open file
+      free(cfg);
+      logDoLogging = NO;
+      pthread_mutex_unlock( &generalMutex );
+      return 3;
+   } else if (stat != 0)
+   {
+      free(cfg);
+      alreadyInitialized = YES;
+      logDoLogging = NO;
+      //fprintf(stderr,"Error in DLOG configuration file format");
+      //fprintf(stderr," -- no logging will be done.\n");
+      pthread_mutex_unlock( &generalMutex );
+      return 4;
+   }
+   logDoLogging = cfg->doLogging;
+   internTableSize = cfg->internTableSize;
+   if (internTableSize > 0)
+      internTable = (struct dlogInternEntry **)
+                    calloc(internTableSize, sizeof(struct dlogInternEntry *));
+   if (internTable)
+      memoryCharge(internTableSize * sizeof(struct dlogInternEntry *));
+   pthread_mutex_lock( &configMutex );
+   publishConfig(cfg);
+   if (cfg->loggingLocation == LOGTOSHM)
+      mapShmRing(cfg);
+   if (cfg->reloadOnChange == YES)
+      startConfigWatcher();
+   if (logDoLogging == YES && cfg->transferTimeout > 0)
+      startTimeoutReaper();
+   pthread_mutex_unlock( &configMutex );
    alreadyInitialized = YES;
    pthread_mutex_unlock( &generalMutex );
    return 0;
+}
 
-FORMATERROR:
-   fclose(configFilenamehandle);  
-   alreadyInitialized = YES;
-   logDoLogging = NO;
-   //fprintf(stderr,"Error in DLOG configuration file format, line (%s)", buf);
-   //fprintf(stderr," -- no logging will be done.\n");
-   pthread_mutex_unlock( &generalMutex );
-   return 4;
+/**
+* Reads the config file again and switches to the new configuration,
+* without restarting the application. Transfers already begun are
+* logged with the configuration they were begun with. Options that
+* size internal tables (DoLogging, LogInternTableSize) keep their
+* values. The library does not install a SIGHUP handler of its own;
+* an application can call this when it handles SIGHUP (but not from
+* inside the signal handler), and LogReloadOnChange = yes reloads
+* whenever the config file changes.
+* @return 0 on success, nonzero if the config file cannot be read or
+*         is invalid (the configuration is then unchanged)
+*/
+unsigned int dlogReloadConfig()
+{
+   if (alreadyInitialized == NO || logDoLogging == NO)
+      return 1;
+   return reloadConfig();
+}
+
+/**
+* Writes the records of ended transfers now, instead of when a batch
+* of LogBatchSize is complete, e.g. at a checkpoint or before the
+* application forks. With LogColumnFile set, the row group being built
+* is written as well, even if it is not full, and with LogAsyncWrites
+* the fdatasync() in flight is waited for.
+* @return 0 on success, 1 if libdlog is not logging, 2 if the log
+*         could not be written
+*/
+unsigned int dlogFlush()
+{
+   unsigned int stat;
+
+   if (alreadyInitialized == NO || logDoLogging == NO)
+      return 1;
+   stat = writeLogData() ? 2 : 0;
+   // a partial row group of the column sink too
+   statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+   flushColumnSink();
+   if (asyncPid == getpid())
+      waitAsyncWrites(-1, 1); // LogAsyncWrites: synced when we return
+   pthread_mutex_unlock( &logfileMutex );
+   return stat;
 }
 
 /**
@@ -677,40 +736,130 @@ FORMATERROR:
 */
 unsigned int dlogFinalize()
 { 
-   struct dlogLoggingData *cur;
-   unsigned long tids[500];
-   int i,n;
+   stopConfigWatcher();
+   stopTimeoutReaper();
 
    // first log any actual ended-but=notlogged entries
    writeLogData();
 
-   // Process up to 500 outstanding transfers at a time, then
-   // check if more are left; this is done to ensure no linked
-   // list weirdness, because dlogEndTransfer will delete items
-   // from the linked list, so our walk through it could break.
-   n = 1;
-   while (n)  // if n==0, didn't process any last time, but loop
-   {          // should really end at the break, just being safe here
-      cur = activeXferList; // restart on current list
-      if (!cur) break;
-      n = 0;
-      while (cur && n < 500)
-      {
-         tids[n++] = cur->id;
-         cur = cur->next;
-      }
-      cur = 0; // for safety
-      for (i=0; i < n; i++)
-      {
-         // now call dlogEndTransfer for the found records
-         dlogEndTransfer(tids[i], 0, 1); // record transfer as error
-      }
+   // then end the outstanding transfers as errors, all at once
+   drainActiveTransfers();
+
+   // now log error entries, and the final STATS record if they are
+   // logged; with the spill policy, whatever cannot be written is kept
+   // on disk for a later process to replay
+   statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+   statsReportTime = 0;
+   pthread_mutex_unlock( &logfileMutex );
+   if (writeLogData() != 0)
+   {
+      statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+      if (currentConfig()->overflowPolicy == OVERFLOW_SPILL)
+         spillLoggingData();
+      pthread_mutex_unlock( &logfileMutex );
    }
-   // now log error entries
-   writeLogData();
+   // and the session histograms, if kept
+   writeSummaryData();
+   statLock( &logfileMutex, DLOG_STAT_LOGFILEWAIT );
+   flushColumnSink();
+   disconnectDaemon();
+   disconnectSyslog(0);
+   unmapShmRing();
+   stopAsyncWrites();
+   freeRetiredConfigs();
+   pthread_mutex_unlock( &logfileMutex );
+   stopFormatWorkers();
    return 0;
 } 
 
+/**
+* Runs the dlogd aggregation daemon in the calling process, until it
+* gets SIGTERM or SIGINT. Clients configured with LoggingLocation =
+* daemon send their formatted records in batches over the Unix socket
+* named by LogDaemonSocket, and clients with LoggingLocation = shm
+* put them in the shared-memory ring LogShmFile, which the daemon
+* creates and drains. The daemon is then the only writer of the log:
+* it writes the lines with its own LoggingLocation (file or syslog),
+* LogBatchSize, and LogRotateSize. SIGHUP reloads the daemon's config.
+* dlogInit() must have been called first; this is what the dlogd
+* program does.
+* @return 0 after a clean shutdown, 1 if libdlog is not initialized or
+*         not logging, 2 if the config has LoggingLocation = daemon,
+*         3 if the socket cannot be set up or another dlogd serves it
+*/
+unsigned int dlogRunDaemon()
+{
+   if (alreadyInitialized == NO || logDoLogging == NO)
+      return 1;
+   return runDaemon();
+}
+
+
+/**
+* Get a snapshot of one of the session histograms of completed
+* transfers. Histograms are only kept if LogHistograms is enabled;
+* they are updated lock free as transfers end, so the snapshot may
+* be slightly behind concurrent dlogEndTransfer() calls.
+* @param metric is DLOG_HIST_SIZE (bytes), DLOG_HIST_DURATION
+*        (microseconds), or DLOG_HIST_THROUGHPUT (bytes/second)
+* @param xferType is DLOG_SEND, DLOG_RECEIVE, or DLOG_ANY for all
+*        transfers of the session
+* @param histogram is filled in with the snapshot
+* @return 0 on success, nonzero if histograms are not being kept or an
+*         argument is invalid
+*/
+unsigned int dlogGetHistogram(unsigned int metric, unsigned int xferType,
+                              struct dlogHistogram *histogram)
+{
+   if (logDoLogging == NO || histogramsReady == NO)
+      return 1;
+   if (metric >= DLOG_HIST_METRICS || xferType > DLOG_ANY || !histogram)
+      return 2;
+   memset(histogram, 0, sizeof(struct dlogHistogram));
+   if (xferType == DLOG_ANY || xferType == DLOG_SEND)
+      histogramMerge(histogram, &transferHistograms[DLOG_SEND][metric]);
+   if (xferType == DLOG_ANY || xferType == DLOG_RECEIVE)
+      histogramMerge(histogram, &transferHistograms[DLOG_RECEIVE][metric]);
+   return 0;
+}
+
+/**
+* Find the value at a percentile of a histogram snapshot taken with
+* dlogGetHistogram(). The result is the lower bound of the bucket that
+* holds the percentile, so it is within 12.5% of the true value.
+* @param histogram is the snapshot
+* @param percentile is a percentile from 0.0 to 100.0
+* @return the value at the percentile, 0 if the histogram is empty
+*/
+unsigned long dlogHistogramPercentile(struct dlogHistogram *histogram,
+                                      double percentile)
+{
+   if (!histogram || histogram->count == 0)
+      return 0;
+   return histogramPercentile(histogram, percentile);
+}
+
+/**
+* Get a snapshot of libdlog's self-metrics: counts of records begun,
+* ended, written, dropped and spilled, the current number of active
+* and queued records, the number of writes and bytes written, and
+* timers (in nanoseconds) for writing, contended lock waits, MD5
+* hashing and host name lookups. The counters are kept per thread
+* shard and updated without locks, so the snapshot costs the callers
+* of the logging API nothing, and may be slightly behind concurrent
+* calls. With LogStatsInterval set, the same numbers are also logged
+* as STATS records.
+* @param stats is filled in with the snapshot
+* @return 0 on success, 1 if libdlog is not initialized or stats is null
+*/
+unsigned int dlogGetStats(struct dlogStats *stats)
+{
+   if (alreadyInitialized == NO || !stats)
+      return 1;
+   collectStats(stats);
+   return 0;
+}
+
 
 // Gnu attribute declarations (on the prototype so that they
 // don't mess up Doxygen)
@@ -718,7 +867,7 @@ void libdlogInitialize (void)  __attribute__((constructor));
 void libdlogFinalize (void)  __attribute__((destructor));
 
 /**
-* Library constructor: nothing to do for now.
+* Library constructor: resets the self-metrics.
 * Uses gcc attribute syntax, other compilers may need something else
 * or they might need the function to be named "_init".
 * @return nothing
@@ -726,7 +875,7 @@ void libdlogFinalize (void)  __attribute__((destructor));
 void libdlogInitialize (void)
 {
    //printf ("\nBegin Libdlog Attribute\n");
-   // Nothing to do here for now, maybe someday
+   statsInit();
 }
 
 /**
@@ -0,0 +1,266 @@
+/**
+* @file dlogbench.c
+*
+* Microbenchmarks of the libdlog hot paths: dlogBeginTransfer(),
+* dlogEndTransfer(), dlogFlush() (which writes the queued records,
+* as writeLogData() does internally) and dlogMD5(). Every call is
+* timed, and the mean, p50, p99 and p999 latencies in nanoseconds are
+* reported for each config file given, at 1, 2, 4, ... up to the
+* maximum number of threads. Each configuration and thread count runs
+* in its own process, since libdlog is initialized once per process.
+* Results go to stdout or to files as CSV or JSON, so they can be
+* compared between releases.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <libdlog.h>
+#include <string.h>
+
+#define MAX_THREAD 256
+#define WINDOW 16
+#define NUM_OPS 4
+
+/** external MD5 implementation in libdlog */
+extern char* dlogMD5(char* data, char *digest);
+
+static const char *opNames[NUM_OPS] = {"begin", "end", "flush", "md5"};
+
+void *dlogbencher(void *arg);
+
+/** Latency samples of one thread, in nanoseconds, per operation */
+struct benchThread
+{
+   int tid;
+   long transfers;
+   unsigned int *samples[NUM_OPS];
+   long count[NUM_OPS];
+};
+
+static unsigned long long nowNanos()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a;
+   unsigned int y = *(const unsigned int *) b;
+   return (x > y) - (x < y);
+}
+
+//
+// Run one configuration at one thread count, in a child process; one
+// result line per operation is written to fd
+//
+static int runBench(char *config, int numThreads, long transfers, int fd)
+{
+   struct benchThread *bench;
+   pthread_t *threads;
+   unsigned int *all;
+   double sum;
+   long n, i;
+   int t, op, stat;
+   FILE *out;
+
+   setenv("DLOG_CONFIG",config,1);
+   remove("./dlogxfer.log");
+   if ((stat=dlogInit("BenchProgram")) != 0)
+   {
+      fprintf(stderr,"Error %d in dlogInit() for %s\n", stat, config);
+      return 3;
+   }
+   threads = (pthread_t *) malloc(numThreads*sizeof(*threads));
+   bench = (struct benchThread *) calloc(numThreads, sizeof(*bench));
+   for (t=0; t < numThreads; t++)
+   {
+      bench[t].tid = t+1;
+      bench[t].transfers = transfers;
+      for (op=0; op < NUM_OPS; op++)
+         bench[t].samples[op] = (unsigned int *)
+                                malloc(transfers*sizeof(unsigned int));
+      pthread_create(&threads[t],NULL,dlogbencher,&bench[t]);
+   }
+   for (t=0; t < numThreads; t++)
+      pthread_join(threads[t],NULL);
+   dlogFinalize();
+
+   out = fdopen(fd, "w");
+   all = (unsigned int *) malloc(numThreads*transfers*sizeof(unsigned int));
+   for (op=0; op < NUM_OPS; op++)
+   {
+      n = 0;
+      sum = 0;
+      for (t=0; t < numThreads; t++)
+         for (i=0; i < bench[t].count[op]; i++)
+         {
+            all[n++] = bench[t].samples[op][i];
+            sum += bench[t].samples[op][i];
+         }
+      if (n == 0)
+         continue;
+      qsort(all, n, sizeof(unsigned int), compareSamples);
+      fprintf(out, "%s %ld %.1f %u %u %u %u\n", opNames[op], n, sum / n,
+              all[(long) (0.5*(n-1))], all[(long) (0.99*(n-1))],
+              all[(long) (0.999*(n-1))], all[n-1]);
+   }
+   fclose(out);
+   return 0;
+}
+
+//
+// Thread function: begin and end windows of transfers, flush after
+// each window, and hash each file name, timing every call
+//
+void *dlogbencher(void *arg)
+{
+   struct benchThread *bench = (struct benchThread *) arg;
+   unsigned long ids[WINDOW];
+   char name[WINDOW][64], digest[33];
+   unsigned long long t;
+   long done = 0;
+   int i, n;
+
+   for (i = 0; i < WINDOW; i++)
+      sprintf(name[i], "/bench%d/file%d.dat", bench->tid, i);
+   while (done < bench->transfers)
+   {
+      n = bench->transfers - done < WINDOW ? bench->transfers - done : WINDOW;
+      for (i = 0; i < n; i++)
+      {
+         t = nowNanos();
+         ids[i] = dlogBeginTransfer(name[i], 4096, bench->tid, "10.1.2.3",
+                                    "/bench/target/", "10.4.5.6", 0,
+                                    "bench");
+         bench->samples[0][bench->count[0]++] = nowNanos() - t;
+      }
+      for (i = 0; i < n; i++)
+      {
+         t = nowNanos();
+         dlogEndTransfer(ids[i], 4096, 0);
+         bench->samples[1][bench->count[1]++] = nowNanos() - t;
+      }
+      t = nowNanos();
+      dlogFlush();
+      bench->samples[2][bench->count[2]++] = nowNanos() - t;
+      for (i = 0; i < n; i++)
+      {
+         t = nowNanos();
+         dlogMD5(name[i], digest);
+         bench->samples[3][bench->count[3]++] = nowNanos() - t;
+      }
+      done += n;
+   }
+   return NULL;
+}
+
+//
+// Print the command line usage; returns the exit status
+//
+static int printUsage(const char *prog)
+{
+   fprintf(stderr,"Usage: %s [-t max-threads] [-n transfers-per-thread] "
+           "[-c out.csv] [-j out.json] <libdlog-config-file>...\n", prog);
+   return 1;
+}
+
+//
+// Main: run every config at every thread count and report
+//
+int main(int argc, char* argv[])
+{
+   FILE *csv = 0, *json = 0;
+   int maxThreads = 4, numThreads, opt, pipefd[2], first = 1, status;
+   long transfers = 20000, count;
+   unsigned int p50, p99, p999, max;
+   char line[256], op[16], *config;
+   double mean;
+   pid_t pid;
+   FILE *in;
+
+   while ((opt = getopt(argc, argv, "t:n:c:j:")) != -1)
+   {
+      switch (opt)
+      {
+         case 't': maxThreads = atoi(optarg); break;
+         case 'n': transfers = atol(optarg); break;
+         case 'c': csv = fopen(optarg, "w"); break;
+         case 'j': json = fopen(optarg, "w"); break;
+         default: return printUsage(argv[0]);
+      }
+   }
+   if (optind >= argc)
+      return printUsage(argv[0]);
+   if ((maxThreads < 1) || (maxThreads > MAX_THREAD) || (transfers < 1))
+   {
+      fprintf(stderr, "Error: threads should be 1 - %d and transfers > 0.\n",
+              MAX_THREAD);
+      return 2;
+   }
+   if (!csv && !json)
+      csv = stdout;
+   if (csv)
+      fprintf(csv, "config,threads,op,ops,mean_ns,p50_ns,p99_ns,"
+              "p999_ns,max_ns\n");
+   if (json)
+      fprintf(json, "{\"transfersPerThread\":%ld,\"results\":[", transfers);
+
+   for (; optind < argc; optind++)
+   {
+      config = argv[optind];
+      for (numThreads = 1; numThreads <= maxThreads;
+           numThreads = (numThreads*2 > maxThreads && numThreads < maxThreads)
+                        ? maxThreads : numThreads*2)
+      {
+         if (pipe(pipefd) != 0)
+            return 3;
+         fflush(0);
+         if ((pid = fork()) == 0)
+         {
+            close(pipefd[0]);
+            exit(runBench(config, numThreads, transfers, pipefd[1]));
+         }
+         close(pipefd[1]);
+         in = fdopen(pipefd[0], "r");
+         while (fgets(line, sizeof(line), in))
+         {
+            if (sscanf(line, "%15s %ld %lf %u %u %u %u", op, &count, &mean,
+                       &p50, &p99, &p999, &max) != 7)
+               continue;
+            if (csv)
+               fprintf(csv, "%s,%d,%s,%ld,%.1f,%u,%u,%u,%u\n", config,
+                       numThreads, op, count, mean, p50, p99, p999, max);
+            if (json)
+               fprintf(json, "%s\n {\"config\":\"%s\",\"threads\":%d,"
+                       "\"op\":\"%s\",\"ops\":%ld,\"meanNs\":%.1f,"
+                       "\"p50Ns\":%u,\"p99Ns\":%u,\"p999Ns\":%u,"
+                       "\"maxNs\":%u}", first ? "" : ",", config,
+                       numThreads, op, count, mean, p50, p99, p999, max);
+            first = 0;
+         }
+         fclose(in);
+         waitpid(pid, &status, 0);
+         if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "Warning: %s with %d threads failed\n",
+                    config, numThreads);
+         if (numThreads == maxThreads)
+            break;
+      }
+   }
+   if (json)
+   {
+      fprintf(json, "\n]}\n");
+      fclose(json);
+   }
+   if (csv && csv != stdout)
+      fclose(csv);
+   return 0;
+}
@@ -0,0 +1,419 @@
+/**
+* @file dlogload.c
+*
+* Open-loop load generator for libdlog. Each thread begins transfers
+* at a target arrival rate (Poisson arrivals), whether or not earlier
+* calls have returned, and ends each transfer when its simulated
+* duration is up. File sizes follow a Zipf distribution, paths have a
+* configurable depth and fan-out, and a transfer lasts its size divided
+* by the bandwidth, so the number of concurrently active transfers is
+* the rate times the mean duration and can reach millions.
+*
+* Latency is measured from the time a call was scheduled for, not the
+* time it was made, so a stalled library shows up in the tail instead
+* of silently lowering the offered load (no coordinated omission).
+* With -v, libdlog runs on a simulated clock through
+* dlogSetTimeSource(): the schedule is executed as fast as possible,
+* logged durations are in simulated time, and the latency is the
+* service time of each call.
+*
+* The report gives the achieved rate, records/s, peak active
+* transfers, the memory high-water mark and latency percentiles.
+* With -m, a manifest for dlogvalidate is written too: the user ID of
+* each transfer is its thread number times 2^32 plus its sequence
+* number in the thread, so the log can be checked for lost, duplicated
+* and mistimed records.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <libdlog.h>
+#include <string.h>
+
+#define MAX_THREAD 256
+#define ZIPF_RANKS 65536
+
+void *dlogloader(void *arg);
+
+/** Load parameters, from the command line */
+static double rate = 10000;          // transfers/s, all threads
+static double runSeconds = 10;       // length of the arrival phase
+static double zipfExponent = 1.2;
+static double maxSize = 1e9;         // size of the largest Zipf rank
+static double bandwidth = 1e8;       // bytes/s of each transfer
+static int pathDepth = 3;
+static int fanOut = 10;
+static int virtualClock = 0;
+static int numThreads = 1;
+static char *manifestName = 0;
+
+/** Zipf cumulative distribution over the size ranks */
+static double zipfCDF[ZIPF_RANKS];
+
+/** A transfer waiting to end, in a min-heap on the end time */
+struct pendingEnd
+{
+   unsigned long long endTime;  // ns from the start of the run
+   unsigned long id;
+   unsigned long size;
+};
+
+/** Latency samples of one operation, in ns */
+struct samples
+{
+   unsigned int *ns;
+   long count, size;
+};
+
+/** State of one generator thread */
+struct loadThread
+{
+   int tid;
+   unsigned long long rng;
+   struct pendingEnd *heap;
+   long heapCount, heapSize, peakActive;
+   long begun, ended, failed;
+   struct samples begin, end;
+};
+
+/** The simulated time of each thread, for the -v clock */
+static __thread unsigned long long simulatedNow;
+static struct timeval simulatedEpoch;
+
+static void simulatedTime(struct timeval *now)
+{
+   unsigned long long us = simulatedNow / 1000;
+   now->tv_sec = simulatedEpoch.tv_sec + us / 1000000;
+   now->tv_usec = simulatedEpoch.tv_usec + us % 1000000;
+   if (now->tv_usec >= 1000000)
+   {
+      now->tv_sec++;
+      now->tv_usec -= 1000000;
+   }
+}
+
+static unsigned long long monoNanos()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64* random numbers, uniform in (0,1)
+static double uniform(struct loadThread *lt)
+{
+   lt->rng ^= lt->rng >> 12;
+   lt->rng ^= lt->rng << 25;
+   lt->rng ^= lt->rng >> 27;
+   return ((lt->rng * 2685821657736338717ULL) >> 11) * (1.0/9007199254740992.0)
+          + 1e-18;
+}
+
+static unsigned long zipfSize(struct loadThread *lt)
+{
+   double u = uniform(lt);
+   int lo = 0, hi = ZIPF_RANKS-1, mid;
+   while (lo < hi)
+   {
+      mid = (lo + hi) / 2;
+      if (zipfCDF[mid] < u)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return (unsigned long) ((lo + 1) * (maxSize / ZIPF_RANKS));
+}
+
+static void addSample(struct samples *s, unsigned long long ns)
+{
+   if (s->count == s->size)
+   {
+      s->size = s->size ? s->size * 2 : 65536;
+      s->ns = (unsigned int *) realloc(s->ns, s->size * sizeof(*s->ns));
+   }
+   s->ns[s->count++] = (ns > 0xffffffffULL) ? 0xffffffffU : ns;
+}
+
+static void heapPush(struct loadThread *lt, struct pendingEnd *e)
+{
+   long i, parent;
+   if (lt->heapCount == lt->heapSize)
+   {
+      lt->heapSize = lt->heapSize ? lt->heapSize * 2 : 65536;
+      lt->heap = (struct pendingEnd *)
+                 realloc(lt->heap, lt->heapSize * sizeof(*lt->heap));
+   }
+   for (i = lt->heapCount++; i > 0; i = parent)
+   {
+      parent = (i - 1) / 2;
+      if (lt->heap[parent].endTime <= e->endTime)
+         break;
+      lt->heap[i] = lt->heap[parent];
+   }
+   lt->heap[i] = *e;
+   if (lt->heapCount > lt->peakActive)
+      lt->peakActive = lt->heapCount;
+}
+
+static void heapPop(struct loadThread *lt)
+{
+   struct pendingEnd last = lt->heap[--lt->heapCount];
+   long i = 0, child;
+   while ((child = 2*i + 1) < lt->heapCount)
+   {
+      if (child + 1 < lt->heapCount &&
+          lt->heap[child+1].endTime < lt->heap[child].endTime)
+         child++;
+      if (last.endTime <= lt->heap[child].endTime)
+         break;
+      lt->heap[i] = lt->heap[child];
+      i = child;
+   }
+   lt->heap[i] = last;
+}
+
+// wait (real clock) or jump (simulated clock) to a scheduled time
+static void waitUntil(unsigned long long start, unsigned long long when)
+{
+   struct timespec ts;
+   unsigned long long target = start + when;
+   if (virtualClock)
+   {
+      simulatedNow = when;
+      return;
+   }
+   if (monoNanos() >= target)
+      return; // behind schedule: go now, the lateness is latency
+   ts.tv_sec = target / 1000000000ULL;
+   ts.tv_nsec = target % 1000000000ULL;
+   clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a;
+   unsigned int y = *(const unsigned int *) b;
+   return (x > y) - (x < y);
+}
+
+static void report(const char *op, struct samples *s)
+{
+   long n = s->count;
+   if (n == 0)
+      return;
+   qsort(s->ns, n, sizeof(unsigned int), compareSamples);
+   printf("  %-6s %10ld %10.1f %10.1f %10.1f %10.1f %10.1f\n", op, n,
+          s->ns[(long) (0.5*(n-1))] / 1e3, s->ns[(long) (0.9*(n-1))] / 1e3,
+          s->ns[(long) (0.99*(n-1))] / 1e3,
+          s->ns[(long) (0.999*(n-1))] / 1e3, s->ns[n-1] / 1e3);
+}
+
+static void mergeSamples(struct samples *all, struct samples *s)
+{
+   long i;
+   for (i = 0; i < s->count; i++)
+      addSample(all, s->ns[i]);
+   free(s->ns);
+}
+
+//
+// Print the command line usage; returns the exit status
+//
+static int printUsage(const char *prog)
+{
+   fprintf(stderr,"Usage: %s [-r rate/s] [-d seconds] [-z zipf-exponent] "
+           "[-Z max-size] [-b bytes/s] [-p path-depth] [-f fan-out] "
+           "[-t threads] [-v] [-m manifest] <libdlog-config-file>\n", prog);
+   return 1;
+}
+
+//
+// Main: Init, launch generator threads and report
+//
+int main(int argc, char* argv[])
+{
+   struct loadThread *load;
+   struct samples beginAll = {0,0,0}, endAll = {0,0,0};
+   struct rusage usage;
+   struct timeval startTime;
+   pthread_t *threads;
+   FILE *mf;
+   long begun = 0, ended = 0, failed = 0, active = 0, peak = 0;
+   unsigned long long start, elapsed;
+   double sum;
+   int i, opt, stat;
+
+   while ((opt = getopt(argc, argv, "r:d:z:Z:b:p:f:t:vm:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'r': rate = atof(optarg); break;
+         case 'd': runSeconds = atof(optarg); break;
+         case 'z': zipfExponent = atof(optarg); break;
+         case 'Z': maxSize = atof(optarg); break;
+         case 'b': bandwidth = atof(optarg); break;
+         case 'p': pathDepth = atoi(optarg); break;
+         case 'f': fanOut = atoi(optarg); break;
+         case 't': numThreads = atoi(optarg); break;
+         case 'v': virtualClock = 1; break;
+         case 'm': manifestName = optarg; break;
+         default: return printUsage(argv[0]);
+      }
+   }
+   if (optind != argc-1)
+      return printUsage(argv[0]);
+   if ((numThreads < 1) || (numThreads > MAX_THREAD) || rate <= 0 ||
+       runSeconds <= 0 || bandwidth <= 0 || maxSize < ZIPF_RANKS ||
+       pathDepth < 0 || fanOut < 1)
+   {
+      fprintf(stderr, "Error: invalid load parameters\n");
+      return 2;
+   }
+   setenv("DLOG_CONFIG",argv[optind],1);
+   remove("./dlogxfer.log");
+
+   for (i = 0, sum = 0; i < ZIPF_RANKS; i++)
+      sum += 1.0 / pow(i+1, zipfExponent);
+   for (i = 0; i < ZIPF_RANKS; i++)
+      zipfCDF[i] = (i ? zipfCDF[i-1] : 0) + 1.0 / pow(i+1, zipfExponent) / sum;
+
+   if (virtualClock)
+   {
+      gettimeofday(&simulatedEpoch, 0);
+      dlogSetTimeSource(simulatedTime);
+   }
+   if ((stat=dlogInit("LoadProgram")) != 0)
+   {
+      fprintf(stderr,"Error %d in dlogInit() \n", stat);
+      return 3;
+   }
+
+   threads = (pthread_t *) malloc(numThreads*sizeof(*threads));
+   load = (struct loadThread *) calloc(numThreads, sizeof(*load));
+   if (virtualClock)
+      startTime = simulatedEpoch;
+   else
+      gettimeofday(&startTime, 0);
+   start = monoNanos();
+   for (i=0; i < numThreads; i++)
+   {
+      load[i].tid = i+1;
+      load[i].rng = 0x9e3779b97f4a7c15ULL * (i+1);
+      pthread_create(&threads[i],NULL,dlogloader,&load[i]);
+   }
+   for (i=0; i < numThreads; i++)
+   {
+      pthread_join(threads[i],NULL);
+      begun += load[i].begun;
+      ended += load[i].ended;
+      failed += load[i].failed;
+      active += load[i].heapCount;
+      peak += load[i].peakActive;
+      mergeSamples(&beginAll, &load[i].begin);
+      mergeSamples(&endAll, &load[i].end);
+      free(load[i].heap);
+   }
+   elapsed = monoNanos() - start;
+   // transfers still active are logged as failed by dlogFinalize(),
+   // which ends them at the end of the run on the simulated clock
+   simulatedNow = (unsigned long long) (runSeconds * 1e9);
+   dlogFinalize();
+   getrusage(RUSAGE_SELF, &usage);
+
+   if (manifestName && (mf = fopen(manifestName, "w")) != NULL)
+   {
+      fprintf(mf, "# written by dlogload\napp LoadProgram\nidfield user\n");
+      for (i=0; i < numThreads; i++)
+         fprintf(mf, "range %lu %ld\n", (unsigned long) load[i].tid << 32,
+                 load[i].begun);
+      fprintf(mf, "starttime %ld\nendtime %ld\n", (long) startTime.tv_sec,
+              virtualClock ? (long) (startTime.tv_sec + runSeconds + 1) :
+              (long) time(0));
+      // on the real clock, ends that fall behind schedule run long
+      if (virtualClock)
+         fprintf(mf, "maxduration %.3f\n", 1e3 * maxSize / bandwidth);
+      fclose(mf);
+   }
+
+   printf("offered %.0f/s for %.1f s (%s clock), %d threads\n", rate,
+          runSeconds, virtualClock ? "simulated" : "real", numThreads);
+   printf("begun %ld, ended %ld, begin errors %ld, left to finalize %ld\n",
+          begun, ended, failed, active);
+   printf("achieved %.0f begins/s, %.0f records/s (wall clock)\n",
+          begun / (elapsed / 1e9), ended / (elapsed / 1e9));
+   printf("peak active transfers %ld, memory high-water mark %ld KB\n",
+          peak, usage.ru_maxrss);
+   printf("  latency from scheduled time, us:\n");
+   printf("  %-6s %10s %10s %10s %10s %10s %10s\n", "op", "count", "p50",
+          "p90", "p99", "p999", "max");
+   report("begin", &beginAll);
+   report("end", &endAll);
+   return 0;
+}
+
+//
+// Thread function: run the open-loop schedule of one thread's share
+// of the load
+//
+void *dlogloader(void *arg)
+{
+   struct loadThread *lt = (struct loadThread *) arg;
+   unsigned long long start = monoNanos(), nextArrival, when, done;
+   unsigned long long end = (unsigned long long) (runSeconds * 1e9);
+   double meanGap = 1e9 * numThreads / rate;
+   struct pendingEnd pe;
+   char name[600], path[512];
+   int i, n;
+
+   nextArrival = (unsigned long long) (-log(uniform(lt)) * meanGap);
+   while (nextArrival < end ||
+          (lt->heapCount > 0 && lt->heap[0].endTime < end))
+   {
+      if (lt->heapCount > 0 && lt->heap[0].endTime <= nextArrival)
+      {
+         // next event is the end of an active transfer
+         pe = lt->heap[0];
+         heapPop(lt);
+         waitUntil(start, pe.endTime);
+         done = virtualClock ? monoNanos() : start + pe.endTime;
+         dlogEndTransfer(pe.id, pe.size, 0);
+         addSample(&lt->end, monoNanos() - done);
+         lt->ended++;
+         continue;
+      }
+      when = nextArrival;
+      nextArrival += (unsigned long long) (-log(uniform(lt)) * meanGap);
+      waitUntil(start, when);
+      pe.size = zipfSize(lt);
+      n = 0;
+      for (i = 0; i < pathDepth && n < 400; i++)
+         n += sprintf(path+n, "/d%d",
+                      (int) (uniform(lt) * fanOut));
+      sprintf(path+n, "/");
+      sprintf(name, "%sfile%d.dat", path, (int) (uniform(lt) * 1000));
+      done = virtualClock ? monoNanos() : start + when;
+      pe.id = dlogBeginTransfer(name, pe.size,
+                                ((unsigned long) lt->tid << 32) + lt->begun,
+                                "10.1.2.3",
+                                "/load/target/", "10.4.5.6",
+                                (uniform(lt) < 0.5) ? 0 : 1, "load");
+      addSample(&lt->begin, monoNanos() - done);
+      if (pe.id == 0)
+      {
+         lt->failed++;
+         continue;
+      }
+      lt->begun++;
+      pe.endTime = when + (unsigned long long) (1e9 * pe.size / bandwidth);
+      heapPush(lt, &pe);
+   }
+   return NULL;
+}
@@ -23,8 +23,12 @@
 #define MAX_THREAD 10000
 #define REC_PER_THREAD 100
 
+// the log validator when run from the test directory of the build tree;
+// otherwise $DLOGVALIDATE or the installed one is run
+#define BUILDVALIDATE "../src/dlogvalidate"
+
 void *dlogtester(void *arg);
-int checkDataAfterTrans(int numThreads);
+int checkDataAfterTrans(int numThreads, time_t startTime, char *logName);
 
 //
 // Main: Init and launch testing threads
@@ -33,10 +37,13 @@ int main(int argc, char* argv[])
 {
    int stat;
    char ebuf[1024];
+   char *logName = "./dlogxfer.log";
+   time_t startTime = time(0);
    //getcwd(ebuf, 1024);
    
    if (--argc < 1) {
-      fprintf(stderr,"Usage: %s <libdlog-config-file> [num-threads]\n",argv[0]);
+      fprintf(stderr,"Usage: %s <libdlog-config-file> [num-threads] "
+              "[log-file]\n",argv[0]);
       return 1;
    }
    
@@ -56,10 +63,14 @@ int main(int argc, char* argv[])
    int numThreads=20;
    pthread_t *threads;
 
-   if (argc == 2) 
+   if (argc >= 2) 
    {
       numThreads = atoi(argv[2]);
    }
+   if (argc >= 3)
+   {
+      logName = argv[3]; // where the config file has LogFilename
+   }
    
    if ((numThreads < 1) || (numThreads > MAX_THREAD)) 
    {
@@ -68,7 +79,7 @@ int main(int argc, char* argv[])
    }
    
    // delete previous logging file
-   remove("./dlogxfer.log");
+   remove(logName);
 
    threads = (pthread_t *) malloc(numThreads*sizeof(*threads));
 
@@ -95,7 +106,7 @@ int main(int argc, char* argv[])
    sleep(1);
    
    // check if data is transferred correctly ...
-   checkDataAfterTrans(numThreads);
+   checkDataAfterTrans(numThreads, startTime, logName);
 
    //fprintf(stderr,"Ending sleep\n");
    //sleep(3);
@@ -151,53 +162,36 @@ void *dlogtester(void *arg)
 
 
 //
-// Code to check if log file is correct? Does this work?
+// Check the log: write the manifest of what the threads generated (the
+// user ID of each record is its number) and run dlogvalidate on it,
+// which lists records not found, duplicates and timing errors
 //
-int checkDataAfterTrans(int numThreads)
-{  
-   int ids[(MAX_THREAD+1)*REC_PER_THREAD];
-   int i,j,k;
-   FILE* logfh;
-   char buf[5000];
-   char *up; int transID;
-
-   for (i=0; i < (MAX_THREAD+1)*REC_PER_THREAD; i++)
-      ids[i] = 0; 
-  
-   char *xferconf="./dlogxfer.log";
-   
-   printf("Checking log file for TIDs...\n");
+int checkDataAfterTrans(int numThreads, time_t startTime, char *logName)
+{
+   char manifest[1024], cmd[3072];
+   const char *validate;
+   FILE *mf;
 
-   if (! (logfh = fopen (xferconf,"r")))
+   snprintf(manifest, sizeof(manifest), "%s.manifest", logName);
+   if (! (mf = fopen(manifest, "w")))
    {
-      printf("Error : can't open '%s' file\n",xferconf);
+      printf("Error : can't create '%s' file\n", manifest);
       return 0;
    }
-
-   // start reading from logging file
-   while (fgets(buf, sizeof(buf), logfh) != 0) 
-   {  
-      up = strstr(buf,"user=");
-      if (up) {
-         transID = strtol(up+6,0,10);
-         if (transID >= 0 && transID < (MAX_THREAD+1)*REC_PER_THREAD)
-            ids[transID]++;
-      }      
-   } 
-   fclose(logfh);
-   //printf("Last buf={%s}\n",buf);
-   //printf("Last TID=%d\n",transID);
-   
-   for (i=1; i <= numThreads; i++) {
-      for (j=0; j < REC_PER_THREAD; j++) {
-         k = i*REC_PER_THREAD + j;
-         if (ids[k] != 1) { 
-            printf("TID %d (%d,%d:%d) not found in file ...\n",k,i,j,ids[k]);
-         }
-      }
-   }
-   
+   fprintf(mf, "# written by dlogtest\napp TestProgram\nidfield user\n");
+   fprintf(mf, "range %d %d\n", REC_PER_THREAD, numThreads*REC_PER_THREAD);
+   fprintf(mf, "starttime %ld\nendtime %ld\n", (long) startTime,
+           (long) time(0));
+   fclose(mf);
+
+   printf("Checking log file...\n");
+   fflush(stdout);
+   if (! (validate = getenv("DLOGVALIDATE")))
+      validate = access(BUILDVALIDATE, X_OK) == 0 ? BUILDVALIDATE
+                                                   : "dlogvalidate";
+   snprintf(cmd, sizeof(cmd), "%s %s %s", validate, manifest, logName);
+   if (system(cmd) != 0)
+      printf("Log file check failed\n");
    printf("Finished checking log file\n");   
    return 0;    
 }
-